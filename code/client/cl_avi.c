@@ -25,6 +25,9 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #define INDEX_FILE_EXTENSION ".index.dat"
 
+#define Y4M_FRAME_HEADER "FRAME\n"
+#define Y4M_FRAME_HEADER_LEN 6
+
 #define MAX_RIFF_CHUNKS 16
 
 typedef struct audioFormat_s
@@ -57,6 +60,21 @@ typedef struct aviFileData_s
   int           maxRecordSize;
   qboolean      motionJpeg;
 
+  // frame pacing, see CL_VideoFrameMsec and CL_VideoSoundSamples
+  qboolean      offline;
+  double        frameTimeFrac;
+  int           soundRemainder;
+
+  // streaming mode: y4m video and wav audio written to named pipes, each
+  // opened once the encoder opens it, see CL_ConnectAVIPipes
+  qboolean      pipe;
+  char          audioName[ MAX_QPATH ];
+  fileHandle_t  audioF;
+  int           audioSkipped;
+  const byte    *pipePending;
+  int           pipePendingSize;
+  qboolean      pipeStalled;
+
   qboolean      audio;
   audioFormat_t a;
   int           numAudioFrames;
@@ -324,6 +342,126 @@ void CL_WriteAVIHeader( void )
   }
 }
 
+/*
+===============
+CL_OpenAVIPipes
+
+Creates the video and audio pipes. Nothing is written until the encoder
+opens them, which CL_ConnectAVIPipes checks for every frame.
+===============
+*/
+static qboolean CL_OpenAVIPipes( const char *fileName )
+{
+  if( !FS_CreatePipeFile( fileName ) )
+    return qfalse;
+
+  if( afd.audio )
+  {
+    COM_StripExtension( fileName, afd.audioName, sizeof( afd.audioName ) );
+    Q_strcat( afd.audioName, sizeof( afd.audioName ), ".wav" );
+
+    if( !FS_CreatePipeFile( afd.audioName ) )
+      return qfalse;
+  }
+
+  Com_Printf( "Streaming video to %s%s%s, waiting for an encoder\n", fileName,
+      afd.audio ? " and audio to " : "", afd.audio ? afd.audioName : "" );
+
+  return qtrue;
+}
+
+/*
+===============
+CL_WriteAVIPipe
+===============
+*/
+static int CL_WriteAVIPipe( const void *data, int len, fileHandle_t f, qboolean blocking )
+{
+  int written = FS_WritePipe( data, len, f, blocking );
+
+  if( written < 0 )
+    Com_Error( ERR_DROP, "Failed to write to the encoder pipe" );
+
+  return written;
+}
+
+/*
+===============
+CL_AVIPipeBlocking
+
+The encoder reads some video before it opens the audio pipe, so until then
+a full video pipe must not block or both sides wait on each other
+===============
+*/
+static qboolean CL_AVIPipeBlocking( void )
+{
+  return !afd.audio || afd.audioF;
+}
+
+/*
+===============
+CL_ConnectAVIPipes
+
+Picks up the encoder as it opens each pipe and finishes a video frame that
+did not fit in the pipe. Returns qfalse while capture has to hold the demo.
+===============
+*/
+static qboolean CL_ConnectAVIPipes( void )
+{
+  int len;
+
+  if( !afd.f )
+  {
+    if( !( afd.f = FS_FOpenPipeWrite( afd.fileName ) ) )
+      return qfalse;
+
+    Com_sprintf( (char *)buffer, sizeof( buffer ),
+        "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+        afd.width, afd.height, afd.frameRate );
+    CL_WriteAVIPipe( buffer, strlen( (char *)buffer ), afd.f, qtrue );
+  }
+
+  if( afd.audio && !afd.audioF &&
+      ( afd.audioF = FS_FOpenPipeWrite( afd.audioName ) ) )
+  {
+    // RIFF and data sizes are unknown while streaming
+    bufIndex = 0;
+    WRITE_STRING( "RIFF" );
+    WRITE_4BYTES( -1 );
+    WRITE_STRING( "WAVE" );
+    WRITE_STRING( "fmt " );
+    WRITE_4BYTES( 16 );
+    WRITE_2BYTES( afd.a.format );
+    WRITE_2BYTES( afd.a.channels );
+    WRITE_4BYTES( afd.a.rate );
+    WRITE_4BYTES( afd.a.sampleSize * afd.a.rate );
+    WRITE_2BYTES( afd.a.sampleSize );
+    WRITE_2BYTES( afd.a.bits );
+    WRITE_STRING( "data" );
+    WRITE_4BYTES( -1 );
+    CL_WriteAVIPipe( buffer, bufIndex, afd.audioF, qtrue );
+
+    // silence in place of the audio mixed before the encoder got here
+    Com_Memset( buffer, 0, sizeof( buffer ) );
+    while( afd.audioSkipped > 0 )
+    {
+      len = MIN( afd.audioSkipped, (int)sizeof( buffer ) );
+      CL_WriteAVIPipe( buffer, len, afd.audioF, qtrue );
+      afd.audioSkipped -= len;
+    }
+  }
+
+  if( afd.pipePendingSize > 0 )
+  {
+    len = CL_WriteAVIPipe( afd.pipePending, afd.pipePendingSize, afd.f,
+        CL_AVIPipeBlocking( ) );
+    afd.pipePending += len;
+    afd.pipePendingSize -= len;
+  }
+
+  return afd.pipePendingSize == 0;
+}
+
 /*
 ===============
 CL_OpenAVIForWriting
@@ -346,16 +484,6 @@ qboolean CL_OpenAVIForWriting( const char *fileName )
     return qfalse;
   }
 
-  if( ( afd.f = FS_FOpenFileWrite( fileName ) ) <= 0 )
-    return qfalse;
-
-  if( ( afd.idxF = FS_FOpenFileWrite(
-          va( "%s" INDEX_FILE_EXTENSION, fileName ) ) ) <= 0 )
-  {
-    FS_FCloseFile( afd.f );
-    return qfalse;
-  }
-
   Q_strncpyz( afd.fileName, fileName, MAX_QPATH );
 
   afd.frameRate = cl_aviFrameRate->integer;
@@ -363,19 +491,15 @@ qboolean CL_OpenAVIForWriting( const char *fileName )
   afd.width = cls.glconfig.vidWidth;
   afd.height = cls.glconfig.vidHeight;
 
-  if( cl_aviMotionJpeg->integer )
+  afd.offline = cl_aviOffline->integer ? qtrue : qfalse;
+
+  if( cl_aviPipe->integer )
+    afd.pipe = qtrue;
+  else if( cl_aviMotionJpeg->integer )
     afd.motionJpeg = qtrue;
   else
     afd.motionJpeg = qfalse;
 
-  // Buffers only need to store RGB pixels.
-  // Allocate a bit more space for the capture buffer to account for possible
-  // padding at the end of pixel lines, and padding for alignment
-  #define MAX_PACK_LEN 16
-  afd.cBuffer = Z_Malloc((afd.width * 3 + MAX_PACK_LEN - 1) * afd.height + MAX_PACK_LEN - 1);
-  // raw avi files have pixel lines start on 4-byte boundaries
-  afd.eBuffer = Z_Malloc(PAD(afd.width * 3, AVI_LINE_PADDING) * afd.height);
-
   afd.a.rate = dma.speed;
   afd.a.format = WAV_FORMAT_PCM;
   afd.a.channels = dma.channels;
@@ -415,6 +539,46 @@ qboolean CL_OpenAVIForWriting( const char *fileName )
         "with OpenAL. Set s_useOpenAL to 0 for audio capture\n" );
   }
 
+  if( afd.pipe )
+  {
+    if( !CL_OpenAVIPipes( fileName ) )
+      return qfalse;
+  }
+  else
+  {
+    if( ( afd.f = FS_FOpenFileWrite( fileName ) ) <= 0 )
+      return qfalse;
+
+    if( ( afd.idxF = FS_FOpenFileWrite(
+            va( "%s" INDEX_FILE_EXTENSION, fileName ) ) ) <= 0 )
+    {
+      FS_FCloseFile( afd.f );
+      return qfalse;
+    }
+  }
+
+  // Allocate a bit more space for the capture buffer to account for possible
+  // padding at the end of pixel lines, and padding for alignment
+  #define MAX_PACK_LEN 16
+  if( afd.pipe )
+  {
+    // RGBA readback, converted to 12 bit per pixel YUV 4:2:0
+    afd.cBuffer = Z_Malloc((afd.width * 4 + MAX_PACK_LEN - 1) * afd.height + MAX_PACK_LEN - 1);
+    afd.eBuffer = Z_Malloc(Y4M_FRAME_HEADER_LEN + afd.width * afd.height +
+        2 * ( ( afd.width + 1 ) / 2 ) * ( ( afd.height + 1 ) / 2 ));
+
+    // frames are encoded right behind their header and written in one go
+    Com_Memcpy( afd.eBuffer, Y4M_FRAME_HEADER, Y4M_FRAME_HEADER_LEN );
+
+    afd.fileOpen = qtrue;
+    return qtrue;
+  }
+
+  // Buffers only need to store RGB pixels.
+  afd.cBuffer = Z_Malloc((afd.width * 3 + MAX_PACK_LEN - 1) * afd.height + MAX_PACK_LEN - 1);
+  // raw avi files have pixel lines start on 4-byte boundaries
+  afd.eBuffer = Z_Malloc(PAD(afd.width * 3, AVI_LINE_PADDING) * afd.height);
+
   // This doesn't write a real header, but allocates the
   // correct amount of space at the beginning of the file
   CL_WriteAVIHeader( );
@@ -478,6 +642,20 @@ void CL_WriteAVIVideoFrame( const byte *imageBuffer, int size )
   if( !afd.fileOpen )
     return;
 
+  if( afd.pipe )
+  {
+    afd.pipePending = imageBuffer - Y4M_FRAME_HEADER_LEN;
+    afd.pipePendingSize = Y4M_FRAME_HEADER_LEN + size;
+
+    size = CL_WriteAVIPipe( afd.pipePending, afd.pipePendingSize, afd.f,
+        CL_AVIPipeBlocking( ) );
+    afd.pipePending += size;
+    afd.pipePendingSize -= size;
+
+    afd.numVideoFrames++;
+    return;
+  }
+
   // Chunk header + contents + padding
   if( CL_CheckFileSize( 8 + size + 2 ) )
     return;
@@ -526,6 +704,20 @@ void CL_WriteAVIAudioFrame( const byte *pcmBuffer, int size )
   if( !afd.fileOpen )
     return;
 
+  if( afd.pipe )
+  {
+    if( !afd.audioF )
+    {
+      afd.audioSkipped += size;
+      return;
+    }
+
+    CL_WriteAVIPipe( pcmBuffer, size, afd.audioF, qtrue );
+    afd.a.totalBytes += size;
+    afd.numAudioFrames++;
+    return;
+  }
+
   // Chunk header + contents + padding
   if( CL_CheckFileSize( 8 + bytesInBuffer + size + 2 ) )
     return;
@@ -587,8 +779,18 @@ void CL_TakeVideoFrame( void )
   if( !afd.fileOpen )
     return;
 
-  re.TakeVideoFrame( afd.width, afd.height,
-      afd.cBuffer, afd.eBuffer, afd.motionJpeg );
+  if( afd.pipe )
+  {
+    // the demo holds until the encoder is there and has taken the last frame
+    afd.pipeStalled = !CL_ConnectAVIPipes( );
+    if( !afd.pipeStalled )
+      re.TakeVideoFrame( afd.width, afd.height, afd.cBuffer,
+          afd.eBuffer + Y4M_FRAME_HEADER_LEN, VIDEOFRAME_YUV420 );
+  }
+  else
+    re.TakeVideoFrame( afd.width, afd.height,
+        afd.cBuffer, afd.eBuffer,
+        afd.motionJpeg ? VIDEOFRAME_MJPEG : VIDEOFRAME_BGR );
 }
 
 /*
@@ -610,6 +812,23 @@ qboolean CL_CloseAVI( void )
 
   afd.fileOpen = qfalse;
 
+  if( afd.pipe )
+  {
+    if( afd.audioF )
+      FS_FCloseFile( afd.audioF );
+
+    Z_Free( afd.cBuffer );
+    Z_Free( afd.eBuffer );
+
+    if( afd.f )
+      FS_FCloseFile( afd.f );
+
+    Com_Printf( "Streamed %d frames and %d bytes of audio to %s\n",
+        afd.numVideoFrames, afd.a.totalBytes, afd.fileName );
+
+    return qtrue;
+  }
+
   FS_Seek( afd.idxF, 4, FS_SEEK_SET );
   bufIndex = 0;
   WRITE_4BYTES( indexSize );
@@ -674,3 +893,58 @@ qboolean CL_VideoRecording( void )
 {
   return afd.fileOpen;
 }
+
+/*
+===============
+CL_VideoOffline
+===============
+*/
+qboolean CL_VideoOffline( void )
+{
+  return afd.fileOpen && afd.offline;
+}
+
+/*
+===============
+CL_VideoFrameMsec
+
+Demo time to advance after a captured frame. The fractional part of the
+frame period is carried over, so frame n is always rendered at the same
+demo time no matter how long each frame took.
+===============
+*/
+int CL_VideoFrameMsec( void )
+{
+  int msec;
+
+  if( afd.pipeStalled )
+    return 0;
+
+  afd.frameTimeFrac += 1000.0 * com_timescale->value / afd.frameRate;
+  msec = (int)afd.frameTimeFrac;
+  afd.frameTimeFrac -= msec;
+
+  return msec;
+}
+
+/*
+===============
+CL_VideoSoundSamples
+
+Sample frames to mix per captured frame, carrying the remainder so the
+audio stream stays exactly aligned with the video
+===============
+*/
+int CL_VideoSoundSamples( void )
+{
+  int samples;
+
+  if( afd.pipeStalled )
+    return 0;
+
+  samples = afd.a.rate + afd.soundRemainder;
+
+  afd.soundRemainder = samples % afd.frameRate;
+
+  return samples / afd.frameRate;
+}
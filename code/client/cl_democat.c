@@ -0,0 +1,1365 @@
+/*
+===========================================================================
+This file is part of Quake III Arena source code.
+
+Quake III Arena source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Quake III Arena source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Quake III Arena source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// cl_democat.c -- demo catalog, metadata of every demo on disk
+//
+// The catalog is kept in democache.dat in the game directory and updated
+// incrementally: the demos directories are walked a few milliseconds per
+// frame while at the menu, and only demos whose size or modification time
+// changed get their gamestate parsed again.
+
+#include "client.h"
+
+#define DEMOCAT_FILE		"democache.dat"
+#define DEMOCAT_IDENT		(('T'<<24)+('A'<<16)+('C'<<8)+'D')
+#define DEMOCAT_VERSION		1
+
+#define DEMOCAT_CS_PLAYERS	544		// CS_PLAYERS of baseq3 and defrag
+
+#define DEMOCAT_MAX_PRINT	256
+
+typedef struct {
+	int		ident;
+	int		version;
+	int		entrySize;
+	int		numEntries;
+	int		poolSize;
+} demoCatalogHeader_t;
+
+typedef struct {
+	demoCatalogEntry_t	*entries;
+	byte				*seen;			// found by the current scan
+	int					numEntries;
+	int					maxEntries;
+
+	char				*pool;			// all strings, offset 0 is ""
+	int					poolSize;
+	int					maxPool;
+	qboolean			garbage;		// pool holds strings nothing uses
+
+	int					*nameHash;		// entry index + 1 by file name
+	int					nameHashSize;
+	int					*stringHash;	// pool offset by contents
+	int					stringHashSize;
+	int					numStrings;
+
+	char				gamedir[MAX_QPATH];
+	qboolean			ready;			// loaded from disk or fully scanned
+	qboolean			dirty;
+
+	// incremental scan state
+	qboolean			scanning;
+	int					root;			// 0 homepath, 1 basepath
+	void				*dir;
+	char				dirName[MAX_OSPATH];	// relative to demos/
+	char				**pending;
+	int					numPending;
+	int					maxPending;
+	int					scanned;
+	int					parsed;
+	int64_t				scanStart;
+} demoCatalog_t;
+
+static demoCatalog_t	dc;
+
+static cvar_t			*cl_demoIndex;
+
+/*
+==============================================================
+
+STORAGE
+
+==============================================================
+*/
+
+/*
+=================
+DC_Grow
+
+The catalog grows with the number of demos on disk, so it lives on the
+C heap rather than in the fixed size zone
+=================
+*/
+static void *DC_Grow( void *data, int *max, int needed, int size )
+{
+	int		newMax;
+
+	if( needed <= *max )
+		return data;
+
+	newMax = *max ? *max : 256;
+	while( newMax < needed )
+		newMax *= 2;
+
+	data = realloc( data, (size_t)newMax * size );
+	if( !data )
+		Com_Error( ERR_FATAL, "Demo catalog: out of memory" );
+
+	*max = newMax;
+
+	return data;
+}
+
+/*
+=================
+DC_HashString
+=================
+*/
+static unsigned int DC_HashString( const char *s )
+{
+	unsigned int	hash;
+
+	for( hash = 5381; *s; s++ )
+		hash = hash * 33 + (byte)*s;
+
+	return hash;
+}
+
+/*
+=================
+DC_String
+=================
+*/
+static const char *DC_String( int offset )
+{
+	return dc.pool + offset;
+}
+
+/*
+=================
+DC_RehashStrings
+=================
+*/
+static void DC_RehashStrings( int size )
+{
+	int		offset, h;
+
+	free( dc.stringHash );
+	dc.stringHashSize = size;
+	dc.stringHash = calloc( size, sizeof( *dc.stringHash ) );
+	if( !dc.stringHash )
+		Com_Error( ERR_FATAL, "Demo catalog: out of memory" );
+
+	dc.numStrings = 0;
+	for( offset = 1; offset < dc.poolSize; offset += strlen( dc.pool + offset ) + 1 )
+	{
+		h = DC_HashString( dc.pool + offset ) & ( size - 1 );
+		while( dc.stringHash[ h ] )
+			h = ( h + 1 ) & ( size - 1 );
+
+		dc.stringHash[ h ] = offset;
+		dc.numStrings++;
+	}
+}
+
+/*
+=================
+DC_AddString
+
+Returns the pool offset of s, strings are only stored once
+=================
+*/
+static int DC_AddString( const char *s )
+{
+	int		len, h, offset;
+
+	if( !*s )
+		return 0;
+
+	if( ( dc.numStrings + 1 ) * 2 > dc.stringHashSize )
+		DC_RehashStrings( dc.stringHashSize ? dc.stringHashSize * 2 : 1024 );
+
+	h = DC_HashString( s ) & ( dc.stringHashSize - 1 );
+	while( ( offset = dc.stringHash[ h ] ) != 0 )
+	{
+		if( !strcmp( dc.pool + offset, s ) )
+			return offset;
+
+		h = ( h + 1 ) & ( dc.stringHashSize - 1 );
+	}
+
+	len = strlen( s ) + 1;
+	dc.pool = DC_Grow( dc.pool, &dc.maxPool, dc.poolSize + len, 1 );
+
+	offset = dc.poolSize;
+	Com_Memcpy( dc.pool + offset, s, len );
+	dc.poolSize += len;
+
+	dc.stringHash[ h ] = offset;
+	dc.numStrings++;
+
+	return offset;
+}
+
+/*
+=================
+DC_RehashNames
+=================
+*/
+static void DC_RehashNames( int size )
+{
+	int		i, h;
+
+	free( dc.nameHash );
+	dc.nameHashSize = size;
+	dc.nameHash = calloc( size, sizeof( *dc.nameHash ) );
+	if( !dc.nameHash )
+		Com_Error( ERR_FATAL, "Demo catalog: out of memory" );
+
+	for( i = 0; i < dc.numEntries; i++ )
+	{
+		h = DC_HashString( DC_String( dc.entries[ i ].name ) ) & ( size - 1 );
+		while( dc.nameHash[ h ] )
+			h = ( h + 1 ) & ( size - 1 );
+
+		dc.nameHash[ h ] = i + 1;
+	}
+}
+
+/*
+=================
+DC_FindEntry
+=================
+*/
+static int DC_FindEntry( const char *name )
+{
+	int		h, index;
+
+	if( !dc.nameHashSize )
+		return -1;
+
+	h = DC_HashString( name ) & ( dc.nameHashSize - 1 );
+	while( ( index = dc.nameHash[ h ] ) != 0 )
+	{
+		if( !strcmp( DC_String( dc.entries[ index - 1 ].name ), name ) )
+			return index - 1;
+
+		h = ( h + 1 ) & ( dc.nameHashSize - 1 );
+	}
+
+	return -1;
+}
+
+/*
+=================
+DC_NewEntry
+=================
+*/
+static int DC_NewEntry( const char *name )
+{
+	demoCatalogEntry_t	*e;
+	int					maxEntries, h;
+
+	maxEntries = dc.maxEntries;
+	dc.entries = DC_Grow( dc.entries, &dc.maxEntries, dc.numEntries + 1, sizeof( *dc.entries ) );
+	dc.seen = DC_Grow( dc.seen, &maxEntries, dc.numEntries + 1, sizeof( *dc.seen ) );
+
+	e = &dc.entries[ dc.numEntries ];
+	Com_Memset( e, 0, sizeof( *e ) );
+	e->name = DC_AddString( name );
+	dc.seen[ dc.numEntries ] = 0;
+	dc.numEntries++;
+
+	if( dc.numEntries * 2 > dc.nameHashSize )
+		DC_RehashNames( dc.nameHashSize ? dc.nameHashSize * 2 : 1024 );
+	else
+	{
+		h = DC_HashString( name ) & ( dc.nameHashSize - 1 );
+		while( dc.nameHash[ h ] )
+			h = ( h + 1 ) & ( dc.nameHashSize - 1 );
+
+		dc.nameHash[ h ] = dc.numEntries;
+	}
+
+	return dc.numEntries - 1;
+}
+
+/*
+=================
+DC_Compact
+
+Drops the entries the last scan didn't find and the strings
+nothing refers to anymore
+=================
+*/
+static void DC_Compact( qboolean dropUnseen )
+{
+	char	*oldPool;
+	int		i, count;
+
+	oldPool = dc.pool;
+	dc.pool = NULL;
+	dc.poolSize = dc.maxPool = 0;
+	dc.pool = DC_Grow( dc.pool, &dc.maxPool, 1, 1 );
+	dc.pool[ 0 ] = '\0';
+	dc.poolSize = 1;
+	DC_RehashStrings( dc.stringHashSize ? dc.stringHashSize : 1024 );
+
+	for( i = count = 0; i < dc.numEntries; i++ )
+	{
+		demoCatalogEntry_t	*e = &dc.entries[ i ];
+
+		if( dropUnseen && !dc.seen[ i ] )
+			continue;
+
+		e->name = DC_AddString( oldPool + e->name );
+		e->map = DC_AddString( oldPool + e->map );
+		e->player = DC_AddString( oldPool + e->player );
+		e->hostname = DC_AddString( oldPool + e->hostname );
+
+		dc.seen[ count ] = dc.seen[ i ];
+		dc.entries[ count++ ] = *e;
+	}
+
+	free( oldPool );
+
+	dc.numEntries = count;
+	dc.garbage = qfalse;
+	DC_RehashNames( dc.nameHashSize ? dc.nameHashSize : 1024 );
+}
+
+/*
+=================
+DC_Clear
+=================
+*/
+static void DC_Clear( void )
+{
+	int		i;
+
+	if( dc.dir )
+		Sys_CloseDir( dc.dir );
+	for( i = 0; i < dc.numPending; i++ )
+		Z_Free( dc.pending[ i ] );
+
+	free( dc.entries );
+	free( dc.seen );
+	free( dc.pool );
+	free( dc.nameHash );
+	free( dc.stringHash );
+	free( dc.pending );
+
+	Com_Memset( &dc, 0, sizeof( dc ) );
+
+	dc.pool = DC_Grow( dc.pool, &dc.maxPool, 1, 1 );
+	dc.pool[ 0 ] = '\0';
+	dc.poolSize = 1;
+}
+
+/*
+=================
+DC_Load
+=================
+*/
+static void DC_Load( void )
+{
+	demoCatalogHeader_t	*header;
+	demoCatalogEntry_t	*entries;
+	char				*pool;
+	void				*buffer;
+	int					len, i, count, size;
+
+	DC_Clear( );
+	Q_strncpyz( dc.gamedir, FS_GetCurrentGameDir( ), sizeof( dc.gamedir ) );
+
+	len = FS_ReadFile( DEMOCAT_FILE, &buffer );
+	if( len < 0 )
+		return;
+
+	header = buffer;
+	if( len < sizeof( *header ) || header->ident != DEMOCAT_IDENT ||
+		header->version != DEMOCAT_VERSION || header->entrySize != sizeof( *entries ) ||
+		header->numEntries < 0 || header->poolSize < 1 ||
+		len != sizeof( *header ) + header->numEntries * sizeof( *entries ) + header->poolSize )
+	{
+		Com_Printf( "Ignoring outdated or damaged %s\n", DEMOCAT_FILE );
+		FS_FreeFile( buffer );
+		return;
+	}
+
+	entries = (demoCatalogEntry_t *)( header + 1 );
+	pool = (char *)( entries + header->numEntries );
+	if( pool[ 0 ] || pool[ header->poolSize - 1 ] )
+	{
+		Com_Printf( "Ignoring damaged %s\n", DEMOCAT_FILE );
+		FS_FreeFile( buffer );
+		return;
+	}
+
+	for( i = 0; i < header->numEntries; i++ )
+	{
+		demoCatalogEntry_t	*e = &entries[ i ];
+
+		if( e->name <= 0 || e->name >= header->poolSize ||
+			e->map < 0 || e->map >= header->poolSize ||
+			e->player < 0 || e->player >= header->poolSize ||
+			e->hostname < 0 || e->hostname >= header->poolSize )
+		{
+			Com_Printf( "Ignoring damaged %s\n", DEMOCAT_FILE );
+			FS_FreeFile( buffer );
+			return;
+		}
+	}
+
+	dc.entries = DC_Grow( dc.entries, &dc.maxEntries, header->numEntries, sizeof( *dc.entries ) );
+	Com_Memcpy( dc.entries, entries, header->numEntries * sizeof( *entries ) );
+	i = 0;
+	dc.seen = DC_Grow( dc.seen, &i, dc.maxEntries, sizeof( *dc.seen ) );
+	dc.numEntries = header->numEntries;
+
+	dc.pool = DC_Grow( dc.pool, &dc.maxPool, header->poolSize, 1 );
+	Com_Memcpy( dc.pool, pool, header->poolSize );
+	dc.poolSize = header->poolSize;
+
+	FS_FreeFile( buffer );
+
+	for( i = 1, count = 0; i < dc.poolSize; i++ )
+	{
+		if( !dc.pool[ i ] )
+			count++;
+	}
+	for( size = 1024; size < count * 2; size *= 2 );
+	DC_RehashStrings( size );
+
+	for( size = 1024; size < dc.numEntries * 2; size *= 2 );
+	DC_RehashNames( size );
+
+	dc.ready = qtrue;
+}
+
+/*
+=================
+DC_Save
+=================
+*/
+static void DC_Save( void )
+{
+	demoCatalogHeader_t	header;
+	fileHandle_t		f;
+
+	if( !dc.dirty )
+		return;
+
+	if( dc.garbage )
+		DC_Compact( qfalse );
+
+	f = FS_FOpenFileWrite( DEMOCAT_FILE );
+	if( !f )
+	{
+		Com_Printf( "Couldn't write %s\n", DEMOCAT_FILE );
+		return;
+	}
+
+	header.ident = DEMOCAT_IDENT;
+	header.version = DEMOCAT_VERSION;
+	header.entrySize = sizeof( demoCatalogEntry_t );
+	header.numEntries = dc.numEntries;
+	header.poolSize = dc.poolSize;
+
+	FS_Write( &header, sizeof( header ), f );
+	FS_Write( dc.entries, dc.numEntries * sizeof( *dc.entries ), f );
+	FS_Write( dc.pool, dc.poolSize, f );
+	FS_FCloseFile( f );
+
+	dc.dirty = qfalse;
+}
+
+/*
+==============================================================
+
+DEMO PARSING
+
+==============================================================
+*/
+
+/*
+=================
+DC_ParseFilename
+
+Defrag names its records map[mode.physics]mm.ss.mmm(player.country),
+which is the only place the run time is found without playing the demo
+=================
+*/
+static void DC_ParseFilename( const char *name, char *map, char *player, int *runTime, int *physics )
+{
+	const char	*base, *open, *close, *s;
+	char		mode[ MAX_QPATH ];
+	int			min, sec, msec, len;
+
+	base = strrchr( name, '/' );
+	base = base ? base + 1 : name;
+
+	if( !( open = strchr( base, '[' ) ) || !( close = strchr( open, ']' ) ) )
+		return;
+
+	len = open - base;
+	if( len > 0 && len < MAX_QPATH )
+		Q_strncpyz( map, base, len + 1 );
+
+	len = close - open - 1;
+	if( len > 0 && len < sizeof( mode ) )
+	{
+		Q_strncpyz( mode, open + 1, len + 1 );
+		if( Q_stristr( mode, "cpm" ) )
+			*physics = 1;
+		else if( Q_stristr( mode, "vq3" ) )
+			*physics = 0;
+	}
+
+	if( sscanf( close + 1, "%d.%d.%d(", &min, &sec, &msec ) == 3 )
+		*runTime = ( min * 60 + sec ) * 1000 + msec;
+
+	if( ( open = strchr( close, '(' ) ) && ( close = strrchr( open, ')' ) ) )
+	{
+		len = close - open - 1;
+		if( len > 0 && len < MAX_NAME_LENGTH )
+		{
+			Q_strncpyz( player, open + 1, len + 1 );
+
+			// drop the country
+			if( ( s = strrchr( player, '.' ) ) != NULL )
+				player[ s - player ] = '\0';
+		}
+	}
+}
+
+/*
+=================
+DC_ParseGamestate
+
+Like CL_ParseGamestate, but gives up on bad data instead of dropping
+=================
+*/
+static qboolean DC_ParseGamestate( msg_t *msg, gameState_t *gs, int *clientNum )
+{
+	entityState_t	nullstate, es;
+	int				cmd, i, len, newnum;
+	char			*s;
+
+	Com_Memset( gs, 0, sizeof( *gs ) );
+	gs->dataCount = 1;
+
+	MSG_ReadLong( msg );
+
+	while( 1 )
+	{
+		if( msg->readcount > msg->cursize )
+			return qfalse;
+
+		cmd = MSG_ReadByte( msg );
+
+		if( cmd == svc_EOF )
+			break;
+
+		if( cmd == svc_configstring )
+		{
+			i = MSG_ReadShort( msg );
+			if( i < 0 || i >= MAX_CONFIGSTRINGS )
+				return qfalse;
+
+			s = MSG_ReadBigString( msg );
+			len = strlen( s );
+			if( len + 1 + gs->dataCount > MAX_GAMESTATE_CHARS )
+				return qfalse;
+
+			gs->stringOffsets[ i ] = gs->dataCount;
+			Com_Memcpy( gs->stringData + gs->dataCount, s, len + 1 );
+			gs->dataCount += len + 1;
+		}
+		else if( cmd == svc_baseline )
+		{
+			newnum = MSG_ReadBits( msg, GENTITYNUM_BITS );
+			if( newnum < 0 || newnum >= MAX_GENTITIES || !MSG_DeltaEntityIsValid( msg ) )
+				return qfalse;
+
+			Com_Memset( &nullstate, 0, sizeof( nullstate ) );
+			MSG_ReadDeltaEntity( msg, &nullstate, &es, newnum );
+		}
+		else
+			return qfalse;
+	}
+
+	*clientNum = MSG_ReadLong( msg );
+
+	return ( msg->readcount <= msg->cursize );
+}
+
+/*
+=================
+DC_ReadGamestate
+
+The gamestate is the first message of every demo
+=================
+*/
+static qboolean DC_ReadGamestate( FILE *f, gameState_t *gs, int *clientNum )
+{
+	static byte	bufData[ MAX_MSGLEN ];
+	msg_t		msg;
+	int			header[ 2 ], len, cmd;
+
+	if( fread( header, sizeof( header ), 1, f ) != 1 )
+		return qfalse;
+
+	len = LittleLong( header[ 1 ] );
+	if( len <= 0 || len > sizeof( bufData ) || fread( bufData, len, 1, f ) != 1 )
+		return qfalse;
+
+	MSG_Init( &msg, bufData, sizeof( bufData ) );
+	msg.cursize = len;
+	MSG_Bitstream( &msg );
+	MSG_ReadLong( &msg );
+
+	while( msg.readcount <= msg.cursize )
+	{
+		cmd = MSG_ReadByte( &msg );
+
+		if( cmd == svc_gamestate )
+			return DC_ParseGamestate( &msg, gs, clientNum );
+
+		if( cmd != svc_serverCommand )
+			break;
+
+		MSG_ReadLong( &msg );
+		MSG_ReadString( &msg );
+	}
+
+	return qfalse;
+}
+
+/*
+=================
+DC_ParseDemo
+=================
+*/
+static void DC_ParseDemo( const char *ospath, const char *name, demoCatalogEntry_t *e )
+{
+	static gameState_t	gs;
+	char				map[ MAX_QPATH ], player[ MAX_NAME_LENGTH ], hostname[ MAX_NAME_LENGTH ];
+	const char			*info, *s;
+	FILE				*f;
+	int					clientNum, runTime, physics;
+
+	map[ 0 ] = player[ 0 ] = hostname[ 0 ] = '\0';
+	runTime = physics = -1;
+	e->gametype = -1;
+
+	s = strrchr( name, '.' );
+	e->protocol = s ? atoi( s + ARRAY_LEN( DEMOEXT ) ) : 0;
+
+	DC_ParseFilename( name, map, player, &runTime, &physics );
+	e->runTime = runTime;
+	e->physics = physics;
+
+	if( ( f = fopen( ospath, "rb" ) ) != NULL )
+	{
+		if( DC_ReadGamestate( f, &gs, &clientNum ) )
+		{
+			info = gs.stringData + gs.stringOffsets[ CS_SERVERINFO ];
+
+			if( *( s = Info_ValueForKey( info, "mapname" ) ) )
+				Q_strncpyz( map, s, sizeof( map ) );
+
+			Q_strncpyz( hostname, Info_ValueForKey( info, "sv_hostname" ), sizeof( hostname ) );
+			Q_CleanStr( hostname );
+
+			if( *( s = Info_ValueForKey( info, "df_promode" ) ) )
+				e->physics = atoi( s );
+
+			if( *( s = Info_ValueForKey( info, "defrag_gametype" ) ) ||
+				*( s = Info_ValueForKey( info, "g_gametype" ) ) )
+				e->gametype = atoi( s );
+
+			if( clientNum >= 0 && clientNum < MAX_CLIENTS &&
+				DEMOCAT_CS_PLAYERS + clientNum < MAX_CONFIGSTRINGS )
+			{
+				s = gs.stringData + gs.stringOffsets[ DEMOCAT_CS_PLAYERS + clientNum ];
+				if( *( s = Info_ValueForKey( s, "n" ) ) )
+				{
+					Q_strncpyz( player, s, sizeof( player ) );
+					Q_CleanStr( player );
+				}
+			}
+		}
+
+		fclose( f );
+	}
+
+	e->map = DC_AddString( map );
+	e->player = DC_AddString( player );
+	e->hostname = DC_AddString( hostname );
+}
+
+/*
+==============================================================
+
+SCANNING
+
+==============================================================
+*/
+
+/*
+=================
+DC_RootPath
+=================
+*/
+static const char *DC_RootPath( int root )
+{
+	const char	*home, *base;
+
+	home = Cvar_VariableString( "fs_homepath" );
+	base = Cvar_VariableString( "fs_basepath" );
+
+	if( root == 0 )
+		return *home ? home : NULL;
+
+	if( root == 1 )
+		return ( *base && Q_stricmp( base, home ) ) ? base : NULL;
+
+	return NULL;
+}
+
+/*
+=================
+DC_StartScan
+=================
+*/
+static void DC_StartScan( void )
+{
+	if( dc.scanning )
+		return;
+
+	Com_Memset( dc.seen, 0, dc.numEntries * sizeof( *dc.seen ) );
+
+	dc.scanning = qtrue;
+	dc.root = -1;
+	dc.dir = NULL;
+	dc.scanned = dc.parsed = 0;
+	dc.scanStart = Sys_Microseconds( );
+}
+
+/*
+=================
+DC_FinishScan
+=================
+*/
+static void DC_FinishScan( void )
+{
+	int		i, removed;
+
+	for( i = removed = 0; i < dc.numEntries; i++ )
+	{
+		if( !dc.seen[ i ] )
+			removed++;
+	}
+
+	if( removed )
+	{
+		DC_Compact( qtrue );
+		dc.dirty = qtrue;
+	}
+
+	dc.scanning = qfalse;
+	dc.ready = qtrue;
+
+	if( dc.parsed || removed )
+	{
+		Com_DPrintf( "Demo catalog: %d demos, %d parsed, %d removed in %.1f seconds\n",
+			dc.numEntries, dc.parsed, removed, ( Sys_Microseconds( ) - dc.scanStart ) / 1000000.0 );
+	}
+
+	DC_Save( );
+}
+
+/*
+=================
+DC_CheckFile
+=================
+*/
+static void DC_CheckFile( const char *name, const sysDirEntry_t *de )
+{
+	demoCatalogEntry_t	*e;
+	int					index;
+
+	dc.scanned++;
+
+	index = DC_FindEntry( name );
+	if( index >= 0 )
+	{
+		// a basepath demo hidden by one in homepath
+		if( dc.seen[ index ] )
+			return;
+
+		dc.seen[ index ] = 1;
+
+		e = &dc.entries[ index ];
+		if( e->mtime == de->mtime && e->size == de->size )
+			return;
+
+		dc.garbage = qtrue;
+	}
+	else
+	{
+		index = DC_NewEntry( name );
+		dc.seen[ index ] = 1;
+	}
+
+	e = &dc.entries[ index ];
+	DC_ParseDemo( va( "%s/%s", FS_BuildOSPath( DC_RootPath( dc.root ), dc.gamedir, "demos" ), name ), name, e );
+	e->mtime = de->mtime;
+	e->size = de->size;
+
+	dc.parsed++;
+	dc.dirty = qtrue;
+}
+
+/*
+=================
+DC_ScanStep
+
+Handles one directory entry, returns qfalse when the scan is done
+=================
+*/
+static qboolean DC_ScanStep( void )
+{
+	sysDirEntry_t	de;
+	char			name[ MAX_OSPATH ];
+	const char		*root;
+
+	if( !dc.dir )
+	{
+		if( dc.numPending )
+		{
+			dc.numPending--;
+			Q_strncpyz( dc.dirName, dc.pending[ dc.numPending ], sizeof( dc.dirName ) );
+			Z_Free( dc.pending[ dc.numPending ] );
+		}
+		else
+		{
+			// next search path
+			do
+			{
+				if( ++dc.root > 1 )
+					return qfalse;
+			} while( !DC_RootPath( dc.root ) );
+
+			dc.dirName[ 0 ] = '\0';
+		}
+
+		root = FS_BuildOSPath( DC_RootPath( dc.root ), dc.gamedir, "demos" );
+		dc.dir = Sys_OpenDir( dc.dirName[ 0 ] ? va( "%s/%s", root, dc.dirName ) : root );
+
+		return qtrue;
+	}
+
+	if( !Sys_ReadDir( dc.dir, &de ) )
+	{
+		Sys_CloseDir( dc.dir );
+		dc.dir = NULL;
+		return qtrue;
+	}
+
+	if( dc.dirName[ 0 ] )
+		Com_sprintf( name, sizeof( name ), "%s/%s", dc.dirName, de.name );
+	else
+		Q_strncpyz( name, de.name, sizeof( name ) );
+
+	if( de.isDir )
+	{
+		// symlinked directories can loop
+		if( strlen( name ) >= MAX_QPATH * 2 )
+			return qtrue;
+
+		dc.pending = DC_Grow( dc.pending, &dc.maxPending, dc.numPending + 1, sizeof( *dc.pending ) );
+		dc.pending[ dc.numPending++ ] = CopyString( name );
+	}
+	else if( FS_IsDemoExt( name, strlen( name ) ) )
+		DC_CheckFile( name, &de );
+
+	return qtrue;
+}
+
+/*
+=================
+CL_DemoCatalogFrame
+
+Spends up to cl_demoIndex msec on the scan, only while at the menu
+so neither games nor timedemos pay for it
+=================
+*/
+void CL_DemoCatalogFrame( void )
+{
+	int64_t		end;
+
+	if( !dc.pool )
+		return;
+
+	if( Q_stricmp( dc.gamedir, FS_GetCurrentGameDir( ) ) )
+	{
+		DC_Save( );
+		DC_Load( );
+		DC_StartScan( );
+	}
+
+	if( !dc.scanning || cl_demoIndex->integer <= 0 || clc.state != CA_DISCONNECTED )
+		return;
+
+	end = Sys_Microseconds( ) + cl_demoIndex->integer * 1000;
+	do
+	{
+		if( !DC_ScanStep( ) )
+		{
+			DC_FinishScan( );
+			return;
+		}
+	} while( Sys_Microseconds( ) < end );
+}
+
+/*
+=================
+CL_DemoCatalogRescan
+
+Called whenever demos may have been added
+=================
+*/
+void CL_DemoCatalogRescan( void )
+{
+	if( dc.pool )
+		DC_StartScan( );
+}
+
+/*
+==============================================================
+
+QUERIES
+
+==============================================================
+*/
+
+/*
+=================
+CL_DemoCatalogReady
+=================
+*/
+qboolean CL_DemoCatalogReady( void )
+{
+	return dc.ready;
+}
+
+/*
+=================
+CL_DemoCatalogEntry
+=================
+*/
+const demoCatalogEntry_t *CL_DemoCatalogEntry( int index )
+{
+	if( index < 0 || index >= dc.numEntries )
+		return NULL;
+
+	return &dc.entries[ index ];
+}
+
+/*
+=================
+CL_DemoCatalogString
+=================
+*/
+const char *CL_DemoCatalogString( int offset )
+{
+	if( offset < 0 || offset >= dc.poolSize )
+		return "";
+
+	return DC_String( offset );
+}
+
+/*
+=================
+DC_Matches
+=================
+*/
+static qboolean DC_Matches( const demoQuery_t *query, const demoCatalogEntry_t *e )
+{
+	if( query->map && !Com_Filter( query->map, dc.pool + e->map, qfalse ) )
+		return qfalse;
+
+	if( query->player && !Com_Filter( query->player, dc.pool + e->player, qfalse ) )
+		return qfalse;
+
+	if( query->name && !Com_Filter( query->name, dc.pool + e->name, qfalse ) )
+		return qfalse;
+
+	if( query->physics >= 0 && e->physics != query->physics )
+		return qfalse;
+
+	if( query->minTime > 0 || query->maxTime > 0 )
+	{
+		if( e->runTime < 0 || e->runTime < query->minTime )
+			return qfalse;
+
+		if( query->maxTime > 0 && e->runTime > query->maxTime )
+			return qfalse;
+	}
+
+	return qtrue;
+}
+
+/*
+=================
+DC_CompareEntries
+
+Fastest runs first, demos without a run time by name
+=================
+*/
+static int QDECL DC_CompareEntries( const void *a, const void *b )
+{
+	const demoCatalogEntry_t	*ea = &dc.entries[ *(const int *)a ];
+	const demoCatalogEntry_t	*eb = &dc.entries[ *(const int *)b ];
+
+	if( ea->runTime != eb->runTime )
+	{
+		if( ea->runTime < 0 )
+			return 1;
+		if( eb->runTime < 0 )
+			return -1;
+
+		return ea->runTime - eb->runTime;
+	}
+
+	return Q_stricmp( dc.pool + ea->name, dc.pool + eb->name );
+}
+
+/*
+=================
+CL_DemoCatalogFind
+
+Fills results with the indexes of up to maxResults matching demos,
+fastest first, and returns the total number of matches
+=================
+*/
+int CL_DemoCatalogFind( const demoQuery_t *query, int *results, int maxResults )
+{
+	int		*matches;
+	int		i, count;
+
+	if( !dc.numEntries )
+		return 0;
+
+	matches = malloc( dc.numEntries * sizeof( *matches ) );
+	if( !matches )
+		return 0;
+
+	for( i = count = 0; i < dc.numEntries; i++ )
+	{
+		if( DC_Matches( query, &dc.entries[ i ] ) )
+			matches[ count++ ] = i;
+	}
+
+	qsort( matches, count, sizeof( *matches ), DC_CompareEntries );
+	Com_Memcpy( results, matches, MIN( count, maxResults ) * sizeof( *results ) );
+
+	free( matches );
+
+	return count;
+}
+
+/*
+=================
+CL_DemoCatalogParseQuery
+
+Parses "map <pattern> player <pattern> name <pattern> physics <vq3|cpm>
+mintime <sec> maxtime <sec>", every part optional; the patterns point
+into storage
+=================
+*/
+void CL_DemoCatalogParseQuery( const char *text, demoQuery_t *query, char *storage, int storageSize )
+{
+	char	*data, *token, **pattern;
+	char	copy[ MAX_STRING_CHARS ];
+	int		len;
+
+	Com_Memset( query, 0, sizeof( *query ) );
+	query->physics = -1;
+
+	Q_strncpyz( copy, text, sizeof( copy ) );
+	data = copy;
+
+	while( 1 )
+	{
+		token = COM_Parse( &data );
+		if( !token[ 0 ] )
+			break;
+
+		pattern = NULL;
+		if( !Q_stricmp( token, "map" ) )
+			pattern = &query->map;
+		else if( !Q_stricmp( token, "player" ) )
+			pattern = &query->player;
+		else if( !Q_stricmp( token, "name" ) )
+			pattern = &query->name;
+		else if( !Q_stricmp( token, "physics" ) )
+		{
+			token = COM_Parse( &data );
+			query->physics = !Q_stricmp( token, "cpm" ) ? 1 : 0;
+			continue;
+		}
+		else if( !Q_stricmp( token, "mintime" ) )
+		{
+			query->minTime = atof( COM_Parse( &data ) ) * 1000;
+			continue;
+		}
+		else if( !Q_stricmp( token, "maxtime" ) )
+		{
+			query->maxTime = atof( COM_Parse( &data ) ) * 1000;
+			continue;
+		}
+		else
+		{
+			Com_Printf( "demo_find: unknown filter \"%s\"\n", token );
+			continue;
+		}
+
+		token = COM_Parse( &data );
+		len = strlen( token ) + 1;
+		if( len > storageSize )
+			break;
+
+		Com_Memcpy( storage, token, len );
+		*pattern = storage;
+		storage += len;
+		storageSize -= len;
+	}
+}
+
+/*
+=================
+CL_DemoCatalogGetFileList
+
+Answers trap_FS_GetFileList for the UI from the catalog: "demos" lists
+the top level demos like the file system would, "$demofind" takes a
+demo_find query as extension.  Returns -1 if the file system should
+handle the request.
+
+The catalog only indexes loose files, so "demos" also lists whatever the
+file system finds that the catalog doesn't know, demos in pk3s mostly.
+=================
+*/
+int CL_DemoCatalogGetFileList( const char *path, const char *extension, char *listbuf, int bufsize )
+{
+	demoQuery_t	query;
+	char		storage[ MAX_STRING_CHARS ];
+	int			*results;
+	int			i, count, nFiles, nTotal, nLen, extLen;
+	int			fsFiles;
+	char		*fsList;
+	qboolean	listDir;
+	const char	*name;
+
+	if( !dc.ready )
+		return -1;
+
+	listDir = qfalse;
+
+	if( !Q_stricmp( path, "$demofind" ) )
+	{
+		CL_DemoCatalogParseQuery( extension, &query, storage, sizeof( storage ) );
+
+		results = malloc( ( dc.numEntries + 1 ) * sizeof( *results ) );
+		if( !results )
+			return 0;
+
+		count = CL_DemoCatalogFind( &query, results, dc.numEntries );
+	}
+	else if( !Q_stricmp( path, "demos" ) || !Q_stricmp( path, "demos/" ) )
+	{
+		listDir = qtrue;
+		results = malloc( ( dc.numEntries + 1 ) * sizeof( *results ) );
+		if( !results )
+			return 0;
+
+		extLen = strlen( extension );
+		for( i = count = 0; i < dc.numEntries; i++ )
+		{
+			name = dc.pool + dc.entries[ i ].name;
+			nLen = strlen( name );
+
+			if( strchr( name, '/' ) || nLen < extLen || Q_stricmp( name + nLen - extLen, extension ) )
+				continue;
+
+			results[ count++ ] = i;
+		}
+	}
+	else
+		return -1;
+
+	*listbuf = 0;
+	for( i = nFiles = nTotal = 0; i < count; i++ )
+	{
+		name = dc.pool + dc.entries[ results[ i ] ].name;
+		nLen = strlen( name ) + 1;
+		if( nTotal + nLen + 1 >= bufsize )
+			break;
+
+		strcpy( listbuf, name );
+		listbuf += nLen;
+		nTotal += nLen;
+		nFiles++;
+	}
+
+	free( results );
+
+	if( !listDir || i < count )
+		return nFiles;
+
+	fsList = Hunk_AllocateTempMemory( bufsize );
+	fsFiles = FS_GetFileList( path, extension, fsList, bufsize );
+
+	for( i = 0, name = fsList; i < fsFiles; i++, name += nLen )
+	{
+		nLen = strlen( name ) + 1;
+
+		if( DC_FindEntry( name ) >= 0 )
+			continue;
+
+		if( nTotal + nLen + 1 >= bufsize )
+			break;
+
+		strcpy( listbuf, name );
+		listbuf += nLen;
+		nTotal += nLen;
+		nFiles++;
+	}
+
+	Hunk_FreeTempMemory( fsList );
+
+	return nFiles;
+}
+
+/*
+=================
+CL_DemoCatalogCompletion
+
+Passes demo names of the current protocol, without extension
+=================
+*/
+void CL_DemoCatalogCompletion( void (*callback)( const char *s ) )
+{
+	char	ext[ 16 ], name[ MAX_OSPATH ];
+	int		i, len, extLen;
+
+	Com_sprintf( ext, sizeof( ext ), ".%s%d", DEMOEXT, com_protocol->integer );
+	extLen = strlen( ext );
+
+	for( i = 0; i < dc.numEntries; i++ )
+	{
+		Q_strncpyz( name, dc.pool + dc.entries[ i ].name, sizeof( name ) );
+		len = strlen( name );
+
+		if( len > extLen && !Q_stricmp( name + len - extLen, ext ) )
+		{
+			name[ len - extLen ] = '\0';
+			callback( name );
+		}
+	}
+}
+
+/*
+=================
+CL_DemoFind_f
+=================
+*/
+static void CL_DemoFind_f( void )
+{
+	static const char	*physicsNames[] = { "vq3", "cpm" };
+	const demoCatalogEntry_t	*e;
+	demoQuery_t	query;
+	char		storage[ MAX_STRING_CHARS ], runTime[ 16 ];
+	int			results[ DEMOCAT_MAX_PRINT ];
+	int			i, count;
+
+	if( Cmd_Argc( ) < 2 )
+	{
+		Com_Printf( "usage: demo_find [map <pattern>] [player <pattern>] [name <pattern>] "
+			"[physics <vq3|cpm>] [mintime <sec>] [maxtime <sec>]\n" );
+		return;
+	}
+
+	CL_DemoCatalogParseQuery( Cmd_Args( ), &query, storage, sizeof( storage ) );
+
+	count = CL_DemoCatalogFind( &query, results, ARRAY_LEN( results ) );
+
+	for( i = 0; i < count && i < ARRAY_LEN( results ); i++ )
+	{
+		e = &dc.entries[ results[ i ] ];
+
+		if( e->runTime >= 0 )
+		{
+			Com_sprintf( runTime, sizeof( runTime ), "%d:%02d.%03d",
+				e->runTime / 60000, ( e->runTime / 1000 ) % 60, e->runTime % 1000 );
+		}
+		else
+			Q_strncpyz( runTime, "-", sizeof( runTime ) );
+
+		Com_Printf( "%10s %-3s %-16s %-16s %s\n", runTime,
+			( e->physics == 0 || e->physics == 1 ) ? physicsNames[ (int)e->physics ] : "-",
+			dc.pool + e->map, dc.pool + e->player, dc.pool + e->name );
+	}
+
+	if( count > ARRAY_LEN( results ) )
+		Com_Printf( "...%d more\n", count - (int)ARRAY_LEN( results ) );
+
+	Com_Printf( "%d of %d demos match%s\n", count, dc.numEntries,
+		dc.scanning ? ", catalog is being updated" : "" );
+
+	// pick up anything changed since the last scan
+	DC_StartScan( );
+}
+
+/*
+=================
+CL_DemoCatalogInit
+=================
+*/
+void CL_DemoCatalogInit( void )
+{
+	cl_demoIndex = Cvar_Get( "cl_demoIndex", "2", CVAR_ARCHIVE );
+
+	Cmd_AddCommand( "demo_find", CL_DemoFind_f );
+
+	DC_Load( );
+	DC_StartScan( );
+}
+
+/*
+=================
+CL_DemoCatalogShutdown
+=================
+*/
+void CL_DemoCatalogShutdown( void )
+{
+	Cmd_RemoveCommand( "demo_find" );
+
+	if( !dc.pool )
+		return;
+
+	// a partial scan still has valid new entries
+	DC_Save( );
+	DC_Clear( );
+
+	free( dc.pool );
+	Com_Memset( &dc, 0, sizeof( dc ) );
+}
@@ -73,9 +73,12 @@ cvar_t	*cl_shownet;
 cvar_t	*cl_showSend;
 cvar_t	*cl_timedemo;
 cvar_t	*cl_timedemoLog;
+cvar_t	*cl_timedemoProfile;
 cvar_t	*cl_autoRecordDemo;
 cvar_t	*cl_aviFrameRate;
 cvar_t	*cl_aviMotionJpeg;
+cvar_t	*cl_aviPipe;
+cvar_t	*cl_aviOffline;
 cvar_t	*cl_forceavidemo;
 
 cvar_t	*cl_freelook;
@@ -117,6 +120,8 @@ cvar_t	*cl_trn;
 
 cvar_t	*cl_lanForcePackets;
 
+cvar_t	*cl_gamestateCache;
+
 cvar_t	*cl_guidServerUniq;
 
 cvar_t	*cl_consoleKeys;
@@ -660,6 +665,8 @@ void CL_StopRecord_f( void ) {
 	clc.demorecording = qfalse;
 	clc.spDemoRecording = qfalse;
 	Com_Printf ("Stopped demo.\n");
+
+	CL_DemoCatalogRescan();
 }
 
 /* 
@@ -685,6 +692,74 @@ void CL_DemoFilename( int number, char *fileName ) {
 		, a, b, c, d );
 }
 
+/*
+====================
+CL_WriteDemoGamestate
+
+Writes the current gamestate to the demo as a full gamestate message
+====================
+*/
+static void CL_WriteDemoGamestate( int sequence ) {
+	byte		bufData[MAX_MSGLEN];
+	msg_t	buf;
+	int			i;
+	int			len;
+	entityState_t	*ent;
+	entityState_t	nullstate;
+	char		*s;
+
+	MSG_Init (&buf, bufData, sizeof(bufData));
+	MSG_Bitstream(&buf);
+
+	// NOTE, MRE: all server->client messages now acknowledge
+	MSG_WriteLong( &buf, clc.reliableSequence );
+
+	MSG_WriteByte (&buf, svc_gamestate);
+	MSG_WriteLong (&buf, clc.serverCommandSequence );
+
+	// configstrings
+	for ( i = 0 ; i < MAX_CONFIGSTRINGS ; i++ ) {
+		if ( !cl.gameState.stringOffsets[i] ) {
+			continue;
+		}
+		s = cl.gameState.stringData + cl.gameState.stringOffsets[i];
+		MSG_WriteByte (&buf, svc_configstring);
+		MSG_WriteShort (&buf, i);
+		MSG_WriteBigString (&buf, s);
+	}
+
+	// baselines
+	Com_Memset (&nullstate, 0, sizeof(nullstate));
+	for ( i = 0; i < MAX_GENTITIES ; i++ ) {
+		ent = &cl.entityBaselines[i];
+		if ( !ent->number ) {
+			continue;
+		}
+		MSG_WriteByte (&buf, svc_baseline);		
+		MSG_WriteDeltaEntity (&buf, &nullstate, ent, qtrue );
+	}
+
+	MSG_WriteByte( &buf, svc_EOF );
+
+	// finished writing the gamestate stuff
+
+	// write the client num
+	MSG_WriteLong(&buf, clc.clientNum);
+	// write the checksum feed
+	MSG_WriteLong(&buf, clc.checksumFeed);
+
+	// finished writing the client packet
+	MSG_WriteByte( &buf, svc_EOF );
+
+	// write it to the demo file
+	len = LittleLong( sequence );
+	FS_Write (&len, 4, clc.demofile);
+
+	len = LittleLong (buf.cursize);
+	FS_Write (&len, 4, clc.demofile);
+	FS_Write (buf.data, buf.cursize, clc.demofile);
+}
+
 /*
 ====================
 CL_Record_f
@@ -697,12 +772,6 @@ Begins recording a demo from the current position
 static char		demoName[MAX_QPATH];	// compiler bug workaround
 void CL_Record_f( void ) {
 	char		name[MAX_OSPATH];
-	byte		bufData[MAX_MSGLEN];
-	msg_t	buf;
-	int			i;
-	int			len;
-	entityState_t	*ent;
-	entityState_t	nullstate;
 	char		*s;
 
 	if ( Cmd_Argc() > 2 ) {
@@ -775,56 +844,7 @@ void CL_Record_f( void ) {
 	clc.demowaiting = qtrue;
 
 	// write out the gamestate message
-	MSG_Init (&buf, bufData, sizeof(bufData));
-	MSG_Bitstream(&buf);
-
-	// NOTE, MRE: all server->client messages now acknowledge
-	MSG_WriteLong( &buf, clc.reliableSequence );
-
-	MSG_WriteByte (&buf, svc_gamestate);
-	MSG_WriteLong (&buf, clc.serverCommandSequence );
-
-	// configstrings
-	for ( i = 0 ; i < MAX_CONFIGSTRINGS ; i++ ) {
-		if ( !cl.gameState.stringOffsets[i] ) {
-			continue;
-		}
-		s = cl.gameState.stringData + cl.gameState.stringOffsets[i];
-		MSG_WriteByte (&buf, svc_configstring);
-		MSG_WriteShort (&buf, i);
-		MSG_WriteBigString (&buf, s);
-	}
-
-	// baselines
-	Com_Memset (&nullstate, 0, sizeof(nullstate));
-	for ( i = 0; i < MAX_GENTITIES ; i++ ) {
-		ent = &cl.entityBaselines[i];
-		if ( !ent->number ) {
-			continue;
-		}
-		MSG_WriteByte (&buf, svc_baseline);		
-		MSG_WriteDeltaEntity (&buf, &nullstate, ent, qtrue );
-	}
-
-	MSG_WriteByte( &buf, svc_EOF );
-	
-	// finished writing the gamestate stuff
-
-	// write the client num
-	MSG_WriteLong(&buf, clc.clientNum);
-	// write the checksum feed
-	MSG_WriteLong(&buf, clc.checksumFeed);
-
-	// finished writing the client packet
-	MSG_WriteByte( &buf, svc_EOF );
-
-	// write it to the demo file
-	len = LittleLong( clc.serverMessageSequence - 1 );
-	FS_Write (&len, 4, clc.demofile);
-
-	len = LittleLong (buf.cursize);
-	FS_Write (&len, 4, clc.demofile);
-	FS_Write (buf.data, buf.cursize, clc.demofile);
+	CL_WriteDemoGamestate( clc.serverMessageSequence - 1 );
 
 	// the rest of the demo file will be copied from net messages
 }
@@ -837,38 +857,6 @@ CLIENT SIDE DEMO PLAYBACK
 =======================================================================
 */
 
-/*
-=================
-CL_DemoFrameDurationSDev
-=================
-*/
-static float CL_DemoFrameDurationSDev( void )
-{
-	int i;
-	int numFrames;
-	float mean = 0.0f;
-	float variance = 0.0f;
-
-	if( ( clc.timeDemoFrames - 1 ) > MAX_TIMEDEMO_DURATIONS )
-		numFrames = MAX_TIMEDEMO_DURATIONS;
-	else
-		numFrames = clc.timeDemoFrames - 1;
-
-	for( i = 0; i < numFrames; i++ )
-		mean += clc.timeDemoDurations[ i ];
-	mean /= numFrames;
-
-	for( i = 0; i < numFrames; i++ )
-	{
-		float x = clc.timeDemoDurations[ i ];
-
-		variance += ( ( x - mean ) * ( x - mean ) );
-	}
-	variance /= numFrames;
-
-	return sqrt( variance );
-}
-
 /*
 =================
 CL_DemoCompleted
@@ -876,59 +864,8 @@ CL_DemoCompleted
 */
 void CL_DemoCompleted( void )
 {
-	char buffer[ MAX_STRING_CHARS ];
-
 	if( cl_timedemo && cl_timedemo->integer )
-	{
-		int	time;
-		
-		time = Sys_Milliseconds() - clc.timeDemoStart;
-		if( time > 0 )
-		{
-			// Millisecond times are frame durations:
-			// minimum/average/maximum/std deviation
-			Com_sprintf( buffer, sizeof( buffer ),
-					"%i frames %3.1f seconds %3.1f fps %d.0/%.1f/%d.0/%.1f ms\n",
-					clc.timeDemoFrames,
-					time/1000.0,
-					clc.timeDemoFrames*1000.0 / time,
-					clc.timeDemoMinDuration,
-					time / (float)clc.timeDemoFrames,
-					clc.timeDemoMaxDuration,
-					CL_DemoFrameDurationSDev( ) );
-			Com_Printf( "%s", buffer );
-
-			// Write a log of all the frame durations
-			if( cl_timedemoLog && strlen( cl_timedemoLog->string ) > 0 )
-			{
-				int i;
-				int numFrames;
-				fileHandle_t f;
-
-				if( ( clc.timeDemoFrames - 1 ) > MAX_TIMEDEMO_DURATIONS )
-					numFrames = MAX_TIMEDEMO_DURATIONS;
-				else
-					numFrames = clc.timeDemoFrames - 1;
-
-				f = FS_FOpenFileWrite( cl_timedemoLog->string );
-				if( f )
-				{
-					FS_Printf( f, "# %s", buffer );
-
-					for( i = 0; i < numFrames; i++ )
-						FS_Printf( f, "%d\n", clc.timeDemoDurations[ i ] );
-
-					FS_FCloseFile( f );
-					Com_Printf( "%s written\n", cl_timedemoLog->string );
-				}
-				else
-				{
-					Com_Printf( "Couldn't open %s for writing\n",
-							cl_timedemoLog->string );
-				}
-			}
-		}
-	}
+		CL_TimeDemoReport( );
 
 	CL_Disconnect( qtrue );
 	CL_NextDemo();
@@ -1057,7 +994,11 @@ CL_CompleteDemoName
 */
 static void CL_CompleteDemoName( char *args, int argNum )
 {
-	if( argNum == 2 )
+	if( argNum == 2 && CL_DemoCatalogReady() )
+	{
+		Field_CompleteList( CL_DemoCatalogCompletion );
+	}
+	else if( argNum == 2 )
 	{
 		char demoExt[ 16 ];
 
@@ -1437,6 +1378,8 @@ void CL_Disconnect( qboolean showMainMenu ) {
 		clc.demofile = 0;
 	}
 
+	CL_TimeDemoShutdown( );
+
 	if ( uivm && showMainMenu ) {
 		VM_Call( uivm, UI_SET_ACTIVE_MENU, UIMENU_NONE );
 	}
@@ -2370,6 +2313,17 @@ void CL_CheckForResend( void ) {
 			Info_SetValueForKey(info, "protocol", va("%i", com_protocol->integer));
 		Info_SetValueForKey( info, "qport", va("%i", port ) );
 		Info_SetValueForKey( info, "challenge", va("%i", clc.challenge ) );
+
+		// let the server send the gamestate as a delta from the newest cached one
+#ifdef LEGACY_PROTOCOL
+		if ( !clc.compat )
+#endif
+		if ( cl_gamestateCache->integer ) {
+			uint64_t	hash = CL_CachedGamestateHash();
+
+			Info_SetValueForKey( info, "gamestate", va( "%08x%08x",
+				(unsigned)( hash >> 32 ), (unsigned)( hash & 0xffffffffu ) ) );
+		}
 		
 		strcpy(data, "connect ");
     // TTimo adding " " around the userinfo string to avoid truncated userinfo on the server
@@ -2868,8 +2822,13 @@ void CL_PacketEvent( netadr_t from, msg_t *msg ) {
 	// after we have parsed the frame
 	//
 	if ( clc.demorecording && !clc.demowaiting ) {
-		CL_WriteDemoMessage( msg, headerBytes );
+		if ( clc.demoGamestate ) {
+			CL_WriteDemoGamestate( clc.serverMessageSequence );
+		} else {
+			CL_WriteDemoMessage( msg, headerBytes );
+		}
 	}
+	clc.demoGamestate = qfalse;
 }
 
 /*
@@ -2980,16 +2939,14 @@ void CL_Frame ( int msec ) {
 	}
 
 	// if recording an avi, lock to a fixed fps
-	if ( CL_VideoRecording( ) && cl_aviFrameRate->integer && msec) {
+	// offline capture takes a frame every time, however long it took
+	if ( CL_VideoRecording( ) && cl_aviFrameRate->integer && ( msec || CL_VideoOffline( ) ) ) {
 		// save the current screen
 		if ( clc.state == CA_ACTIVE || cl_forceavidemo->integer) {
 			CL_TakeVideoFrame( );
 
-			// fixed time for next frame'
-			msec = (int)ceil( (1000.0f / cl_aviFrameRate->value) * com_timescale->value );
-			if (msec == 0) {
-				msec = 1;
-			}
+			// fixed time for next frame
+			msec = CL_VideoFrameMsec( );
 		}
 	}
 	
@@ -3049,6 +3006,8 @@ void CL_Frame ( int msec ) {
 	}
 	// !drakkar
 
+	CL_DemoCatalogFrame();
+
 	// see if we need to update any userinfo
 	CL_CheckUserinfo();
 
@@ -3069,7 +3028,9 @@ void CL_Frame ( int msec ) {
 	SCR_UpdateScreen();
 
 	// update audio
+	CL_TimeDemoBeginSection( TD_SOUND );
 	S_Update();
+	CL_TimeDemoEndSection( TD_SOUND );
 
 #ifdef USE_VOIP
 	CL_CaptureVoip();
@@ -3351,6 +3312,7 @@ void CL_Video_f( void )
 {
   char  filename[ MAX_OSPATH ];
   int   i, last;
+  const char *ext = cl_aviPipe->integer ? "y4m" : "avi";
 
   if( !clc.demoplaying )
   {
@@ -3361,7 +3323,7 @@ void CL_Video_f( void )
   if( Cmd_Argc( ) == 2 )
   {
     // explicit filename
-    Com_sprintf( filename, MAX_OSPATH, "videos/%s.avi", Cmd_Argv( 1 ) );
+    Com_sprintf( filename, MAX_OSPATH, "videos/%s.%s", Cmd_Argv( 1 ), ext );
   }
   else
   {
@@ -3380,8 +3342,8 @@ void CL_Video_f( void )
       last -= c * 10;
       d = last;
 
-      Com_sprintf( filename, MAX_OSPATH, "videos/video%d%d%d%d.avi",
-          a, b, c, d );
+      Com_sprintf( filename, MAX_OSPATH, "videos/video%d%d%d%d.%s",
+          a, b, c, d, ext );
 
       if( !FS_FileExists( filename ) )
         break; // file doesn't exist
@@ -3489,9 +3451,12 @@ void CL_Init( void ) {
 
 	cl_timedemo = Cvar_Get ("timedemo", "0", 0);
 	cl_timedemoLog = Cvar_Get ("cl_timedemoLog", "", CVAR_ARCHIVE);
+	cl_timedemoProfile = Cvar_Get ("cl_timedemoProfile", "", CVAR_ARCHIVE);
 	cl_autoRecordDemo = Cvar_Get ("cl_autoRecordDemo", "0", CVAR_ARCHIVE);
 	cl_aviFrameRate = Cvar_Get ("cl_aviFrameRate", "25", CVAR_ARCHIVE);
 	cl_aviMotionJpeg = Cvar_Get ("cl_aviMotionJpeg", "1", CVAR_ARCHIVE);
+	cl_aviPipe = Cvar_Get ("cl_aviPipe", "0", CVAR_ARCHIVE);
+	cl_aviOffline = Cvar_Get ("cl_aviOffline", "0", CVAR_ARCHIVE);
 	cl_forceavidemo = Cvar_Get ("cl_forceavidemo", "0", 0);
 
 	rconAddress = Cvar_Get ("rconAddress", "", 0);
@@ -3571,6 +3536,8 @@ void CL_Init( void ) {
 
 	cl_lanForcePackets = Cvar_Get ("cl_lanForcePackets", "1", CVAR_ARCHIVE);
 
+	cl_gamestateCache = Cvar_Get ("cl_gamestateCache", "1", CVAR_ARCHIVE);
+
 	cl_guidServerUniq = Cvar_Get ("cl_guidServerUniq", "1", CVAR_ARCHIVE);
 
 	// ~ and `, as keys and characters
@@ -3665,6 +3632,7 @@ void CL_Init( void ) {
 
 	SCR_Init ();
 	HUD_Init ();
+	CL_DemoCatalogInit ();
 
 //	Cbuf_Execute ();
 
@@ -3738,6 +3706,7 @@ void CL_Shutdown(char *finalmsg, qboolean disconnect, qboolean quit)
 	Con_Shutdown();
 
 	DL_Shutdown();	// Cgg
+	CL_DemoCatalogShutdown();
 	Cvar_Set( "cl_running", "0" );
 
 	recursive = qfalse;
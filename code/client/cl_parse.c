@@ -35,6 +35,7 @@ char *svc_strings[256] = {
 	"svc_snapshot",
 	"svc_EOF",
 	"svc_voip",
+	"svc_gamestateHash",
 };
 
 void SHOWNET( msg_t *msg, char *s) {
@@ -456,6 +457,106 @@ static void CL_ParseServerInfo(void)
 		sizeof(clc.sv_dlURL));
 }
 
+/*
+=========================================================================
+
+GAMESTATE CACHE
+
+The last gamestates received from a server that hashes them are kept,
+so the server can send a later one as a delta against them
+
+=========================================================================
+*/
+
+#define MAX_CACHED_GAMESTATES	2
+
+typedef struct {
+	uint64_t		hash;
+	int				sequence;		// higher is newer
+	gameState_t		gameState;
+	entityState_t	entityBaselines[MAX_GENTITIES];
+} cachedGamestate_t;
+
+static cachedGamestate_t	cachedGamestates[MAX_CACHED_GAMESTATES];
+static int					cachedGamestateSequence;
+
+/*
+==================
+CL_CachedGamestateHash
+
+Returns the hash of the newest cached gamestate, or 0 if there is none
+==================
+*/
+uint64_t CL_CachedGamestateHash( void ) {
+	cachedGamestate_t	*newest;
+	int					i;
+
+	newest = &cachedGamestates[0];
+	for ( i = 1 ; i < MAX_CACHED_GAMESTATES ; i++ ) {
+		if ( cachedGamestates[i].sequence > newest->sequence ) {
+			newest = &cachedGamestates[i];
+		}
+	}
+	return newest->hash;
+}
+
+/*
+==================
+CL_FindCachedGamestate
+==================
+*/
+static cachedGamestate_t *CL_FindCachedGamestate( uint64_t hash ) {
+	int		i;
+
+	for ( i = 0 ; i < MAX_CACHED_GAMESTATES ; i++ ) {
+		if ( cachedGamestates[i].hash == hash ) {
+			return &cachedGamestates[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+==================
+CL_CacheGamestate
+
+Saves the gamestate just parsed.  The one it was a delta against is
+never replaced, as the server may still send another delta from it.
+==================
+*/
+static void CL_CacheGamestate( uint64_t hash, uint64_t baseHash ) {
+	cachedGamestate_t	*cache;
+	int					i;
+
+	cache = CL_FindCachedGamestate( hash );
+	if ( !cache ) {
+		for ( i = 0 ; i < MAX_CACHED_GAMESTATES ; i++ ) {
+			if ( baseHash && cachedGamestates[i].hash == baseHash ) {
+				continue;
+			}
+			if ( !cache || cachedGamestates[i].sequence < cache->sequence ) {
+				cache = &cachedGamestates[i];
+			}
+		}
+		cache->hash = hash;
+		cache->gameState = cl.gameState;
+		Com_Memcpy( cache->entityBaselines, cl.entityBaselines, sizeof( cache->entityBaselines ) );
+	}
+	cache->sequence = ++cachedGamestateSequence;
+}
+
+/*
+==================
+CL_ReadGamestateHash
+==================
+*/
+static uint64_t CL_ReadGamestateHash( msg_t *msg ) {
+	uint64_t	low;
+
+	low = (unsigned)MSG_ReadLong( msg );
+	return ( (uint64_t)(unsigned)MSG_ReadLong( msg ) << 32 ) | low;
+}
+
 /*
 ==================
 CL_ParseGamestate
@@ -469,6 +570,9 @@ void CL_ParseGamestate( msg_t *msg ) {
 	int				cmd;
 	char			*s;
 	char oldGame[MAX_QPATH];
+	uint64_t		hash, baseHash;
+	cachedGamestate_t	*base;
+	byte			received[MAX_CONFIGSTRINGS];
 
 	Con_Close();
 
@@ -480,6 +584,10 @@ void CL_ParseGamestate( msg_t *msg ) {
 	// a gamestate always marks a server command sequence
 	clc.serverCommandSequence = MSG_ReadLong( msg );
 
+	hash = baseHash = 0;
+	base = NULL;
+	Com_Memset( received, 0, sizeof( received ) );
+
 	// parse all the configstrings and baselines
 	cl.gameState.dataCount = 1;	// leave a 0 at the beginning for uninitialized configstrings
 	while ( 1 ) {
@@ -489,7 +597,17 @@ void CL_ParseGamestate( msg_t *msg ) {
 			break;
 		}
 		
-		if ( cmd == svc_configstring ) {
+		if ( cmd == svc_gamestateHash ) {
+			hash = CL_ReadGamestateHash( msg );
+			baseHash = CL_ReadGamestateHash( msg );
+			if ( baseHash ) {
+				base = CL_FindCachedGamestate( baseHash );
+				if ( !base ) {
+					Com_Error( ERR_DROP, "CL_ParseGamestate: delta from an uncached gamestate" );
+				}
+				Com_Memcpy( cl.entityBaselines, base->entityBaselines, sizeof( cl.entityBaselines ) );
+			}
+		} else if ( cmd == svc_configstring ) {
 			int		len;
 
 			i = MSG_ReadShort( msg );
@@ -499,6 +617,12 @@ void CL_ParseGamestate( msg_t *msg ) {
 			s = MSG_ReadBigString( msg );
 			len = strlen( s );
 
+			// an empty string clears the one from the delta base
+			received[i] = qtrue;
+			if ( !len ) {
+				continue;
+			}
+
 			if ( len + 1 + cl.gameState.dataCount > MAX_GAMESTATE_CHARS ) {
 				Com_Error( ERR_DROP, "MAX_GAMESTATE_CHARS exceeded" );
 			}
@@ -515,11 +639,42 @@ void CL_ParseGamestate( msg_t *msg ) {
 			Com_Memset (&nullstate, 0, sizeof(nullstate));
 			es = &cl.entityBaselines[ newnum ];
 			MSG_ReadDeltaEntity( msg, &nullstate, es, newnum );
+			if ( base && es->number == MAX_GENTITIES - 1 ) {
+				// entity removed since the delta base
+				Com_Memset( es, 0, sizeof( *es ) );
+			}
 		} else {
 			Com_Error( ERR_DROP, "CL_ParseGamestate: bad command byte" );
 		}
 	}
 
+	// take the configstrings that didn't change from the delta base
+	if ( base ) {
+		for ( i = 0 ; i < MAX_CONFIGSTRINGS ; i++ ) {
+			int		len;
+
+			if ( received[i] || !base->gameState.stringOffsets[i] ) {
+				continue;
+			}
+			s = base->gameState.stringData + base->gameState.stringOffsets[i];
+			len = strlen( s );
+
+			if ( len + 1 + cl.gameState.dataCount > MAX_GAMESTATE_CHARS ) {
+				Com_Error( ERR_DROP, "MAX_GAMESTATE_CHARS exceeded" );
+			}
+
+			cl.gameState.stringOffsets[ i ] = cl.gameState.dataCount;
+			Com_Memcpy( cl.gameState.stringData + cl.gameState.dataCount, s, len + 1 );
+			cl.gameState.dataCount += len + 1;
+		}
+	}
+
+	// demos get a full gamestate, as the delta base isn't in them
+	clc.demoGamestate = ( hash != 0 );
+	if ( hash ) {
+		CL_CacheGamestate( hash, baseHash );
+	}
+
 	clc.clientNum = MSG_ReadLong(msg);
 	// read the checksum feed
 	clc.checksumFeed = MSG_ReadLong( msg );
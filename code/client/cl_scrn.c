@@ -604,11 +604,13 @@ void SCR_UpdateScreen( void ) {
 			SCR_DrawScreenField( STEREO_CENTER );
 		}
 
+		CL_TimeDemoBeginSection( TD_BACKEND );
 		if ( com_speeds->integer ) {
 			re.EndFrame( &time_frontend, &time_backend );
 		} else {
 			re.EndFrame( NULL, NULL );
 		}
+		CL_TimeDemoEndSection( TD_BACKEND );
 	}
 	
 	recursive = 0;
@@ -0,0 +1,458 @@
+/*
+===========================================================================
+This file is part of Quake III Arena source code.
+
+Quake III Arena source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Quake III Arena source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Quake III Arena source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// cl_timedemo.c -- per frame, per subsystem timedemo profiling
+
+#include "client.h"
+
+typedef struct {
+	int		total;							// usec between two frames
+	int		sections[ TD_NUM_SECTIONS ];	// usec spent in each subsystem
+} timeDemoFrame_t;
+
+static const char *timeDemoSectionNames[ TD_NUM_SECTIONS ] = {
+	"parse",
+	"cgame",
+	"frontend",
+	"backend",
+	"sound"
+};
+
+#define TD_STAT_COLUMNS	( TD_NUM_SECTIONS + 2 )		// total, sections, other
+
+static timeDemoFrame_t	*tdFrames;
+static int				tdNumFrames;
+static int				tdMaxFrames;
+
+static int64_t			tdLastFrameTime;
+static int64_t			tdSectionStart[ TD_NUM_SECTIONS ];
+static int64_t			tdCurrent[ TD_NUM_SECTIONS ];
+
+/*
+=================
+CL_TimeDemoProfiling
+=================
+*/
+qboolean CL_TimeDemoProfiling( void )
+{
+	return clc.demoplaying && cl_timedemo && cl_timedemo->integer && clc.timeDemoStart;
+}
+
+/*
+=================
+CL_TimeDemoClear
+
+Drops all recorded frames, called when a timedemo starts
+=================
+*/
+void CL_TimeDemoClear( void )
+{
+	CL_TimeDemoShutdown( );
+
+	tdLastFrameTime = Sys_Microseconds( );
+}
+
+/*
+=================
+CL_TimeDemoShutdown
+
+Frees the recorded frames and closes any open section, called whenever the
+demo stops
+=================
+*/
+void CL_TimeDemoShutdown( void )
+{
+	free( tdFrames );
+	tdFrames = NULL;
+	tdNumFrames = tdMaxFrames = 0;
+
+	Com_Memset( tdSectionStart, 0, sizeof( tdSectionStart ) );
+	Com_Memset( tdCurrent, 0, sizeof( tdCurrent ) );
+}
+
+/*
+=================
+CL_TimeDemoBeginSection / CL_TimeDemoEndSection
+=================
+*/
+void CL_TimeDemoBeginSection( timeDemoSection_t section )
+{
+	if( CL_TimeDemoProfiling( ) )
+		tdSectionStart[ section ] = Sys_Microseconds( );
+}
+
+void CL_TimeDemoEndSection( timeDemoSection_t section )
+{
+	// the demo may have ended inside the section, close it regardless
+	if( tdSectionStart[ section ] )
+	{
+		tdCurrent[ section ] += Sys_Microseconds( ) - tdSectionStart[ section ];
+		tdSectionStart[ section ] = 0;
+	}
+}
+
+/*
+=================
+CL_TimeDemoFrame
+
+Closes the frame that just ended. The first call only sets the starting
+point, as there is nothing to measure yet.
+=================
+*/
+void CL_TimeDemoFrame( void )
+{
+	int64_t			now = Sys_Microseconds( );
+	timeDemoFrame_t	*frame;
+	int				i;
+
+	if( clc.timeDemoFrames > 0 )
+	{
+		if( tdNumFrames == tdMaxFrames )
+		{
+			tdMaxFrames = tdMaxFrames ? tdMaxFrames * 2 : 4096;
+			tdFrames = realloc( tdFrames, tdMaxFrames * sizeof( *tdFrames ) );
+
+			if( !tdFrames )
+				Com_Error( ERR_FATAL, "CL_TimeDemoFrame: out of memory for %d frames", tdMaxFrames );
+		}
+
+		frame = &tdFrames[ tdNumFrames++ ];
+		frame->total = now - tdLastFrameTime;
+
+		for( i = 0; i < TD_NUM_SECTIONS; i++ )
+			frame->sections[ i ] = tdCurrent[ i ];
+
+		// the renderer front end runs inside the cgame's scene submission
+		frame->sections[ TD_CGAME ] -= frame->sections[ TD_FRONTEND ];
+		if( frame->sections[ TD_CGAME ] < 0 )
+			frame->sections[ TD_CGAME ] = 0;
+	}
+
+	tdLastFrameTime = now;
+	Com_Memset( tdCurrent, 0, sizeof( tdCurrent ) );
+}
+
+/*
+=================
+CL_TimeDemoValue
+=================
+*/
+static int CL_TimeDemoValue( const timeDemoFrame_t *frame, int column )
+{
+	int i, other;
+
+	if( column == 0 )
+		return frame->total;
+
+	if( column <= TD_NUM_SECTIONS )
+		return frame->sections[ column - 1 ];
+
+	other = frame->total;
+	for( i = 0; i < TD_NUM_SECTIONS; i++ )
+		other -= frame->sections[ i ];
+
+	return other > 0 ? other : 0;
+}
+
+static const char *CL_TimeDemoColumnName( int column )
+{
+	if( column == 0 )
+		return "total";
+
+	if( column <= TD_NUM_SECTIONS )
+		return timeDemoSectionNames[ column - 1 ];
+
+	return "other";
+}
+
+static int QDECL CL_TimeDemoCompareInts( const void *a, const void *b )
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+typedef struct {
+	double	mean;
+	double	sdev;
+	int		min;
+	int		p50, p95, p99, p999;
+	int		max;
+} timeDemoStats_t;
+
+/*
+=================
+CL_TimeDemoPercentile
+
+Nearest rank percentile of a sorted array
+=================
+*/
+static int CL_TimeDemoPercentile( const int *sorted, int count, double p )
+{
+	int rank = (int)ceil( p / 100.0 * count );
+
+	if( rank < 1 )
+		rank = 1;
+
+	return sorted[ rank - 1 ];
+}
+
+/*
+=================
+CL_TimeDemoComputeStats
+=================
+*/
+static void CL_TimeDemoComputeStats( timeDemoStats_t *stats, int *scratch )
+{
+	int		column, i;
+	double	variance;
+
+	for( column = 0; column < TD_STAT_COLUMNS; column++ )
+	{
+		timeDemoStats_t *s = &stats[ column ];
+
+		s->mean = 0.0;
+		for( i = 0; i < tdNumFrames; i++ )
+		{
+			scratch[ i ] = CL_TimeDemoValue( &tdFrames[ i ], column );
+			s->mean += scratch[ i ];
+		}
+		s->mean /= tdNumFrames;
+
+		variance = 0.0;
+		for( i = 0; i < tdNumFrames; i++ )
+			variance += ( scratch[ i ] - s->mean ) * ( scratch[ i ] - s->mean );
+		s->sdev = sqrt( variance / tdNumFrames );
+
+		qsort( scratch, tdNumFrames, sizeof( int ), CL_TimeDemoCompareInts );
+
+		s->min = scratch[ 0 ];
+		s->p50 = CL_TimeDemoPercentile( scratch, tdNumFrames, 50.0 );
+		s->p95 = CL_TimeDemoPercentile( scratch, tdNumFrames, 95.0 );
+		s->p99 = CL_TimeDemoPercentile( scratch, tdNumFrames, 99.0 );
+		s->p999 = CL_TimeDemoPercentile( scratch, tdNumFrames, 99.9 );
+		s->max = scratch[ tdNumFrames - 1 ];
+	}
+}
+
+#define TD_HISTOGRAM_BUCKETS	12		// powers of two from 64 usec up
+#define TD_HISTOGRAM_WIDTH		40
+
+/*
+=================
+CL_TimeDemoPrintHistogram
+
+Frame time distribution in power of two buckets
+=================
+*/
+static void CL_TimeDemoPrintHistogram( void )
+{
+	int		counts[ TD_HISTOGRAM_BUCKETS ] = { 0 };
+	int		i, bucket, limit, maxCount = 0;
+	char	bar[ TD_HISTOGRAM_WIDTH + 1 ];
+
+	for( i = 0; i < tdNumFrames; i++ )
+	{
+		for( bucket = 0, limit = 64; bucket < TD_HISTOGRAM_BUCKETS - 1; bucket++, limit <<= 1 )
+		{
+			if( tdFrames[ i ].total < limit )
+				break;
+		}
+
+		counts[ bucket ]++;
+	}
+
+	for( bucket = 0; bucket < TD_HISTOGRAM_BUCKETS; bucket++ )
+	{
+		if( counts[ bucket ] > maxCount )
+			maxCount = counts[ bucket ];
+	}
+
+	Com_Printf( "frame time histogram:\n" );
+
+	for( bucket = 0, limit = 64; bucket < TD_HISTOGRAM_BUCKETS; bucket++, limit <<= 1 )
+	{
+		int len = (int)( (double)counts[ bucket ] * TD_HISTOGRAM_WIDTH / maxCount + 0.5 );
+
+		Com_Memset( bar, '#', len );
+		bar[ len ] = '\0';
+
+		if( bucket < TD_HISTOGRAM_BUCKETS - 1 )
+			Com_Printf( "  < %8.3f ms %8d %s\n", limit / 1000.0, counts[ bucket ], bar );
+		else
+			Com_Printf( " >= %8.3f ms %8d %s\n", ( limit >> 1 ) / 1000.0, counts[ bucket ], bar );
+	}
+}
+
+/*
+=================
+CL_TimeDemoWriteProfile
+
+Dumps every frame to a CSV file, or to JSON along with the statistics if the
+file name ends in .json
+=================
+*/
+static void CL_TimeDemoWriteProfile( const char *fileName, const timeDemoStats_t *stats )
+{
+	fileHandle_t	f;
+	int				i, column;
+
+	f = FS_FOpenFileWrite( fileName );
+	if( !f )
+	{
+		Com_Printf( "Couldn't open %s for writing\n", fileName );
+		return;
+	}
+
+	if( !Q_stricmp( COM_GetExtension( fileName ), "json" ) )
+	{
+		FS_Printf( f, "{\n\t\"demo\": \"%s\",\n\t\"frames\": %d,\n\t\"unit\": \"usec\",\n",
+				clc.demoName, tdNumFrames );
+
+		FS_Printf( f, "\t\"stats\": {\n" );
+		for( column = 0; column < TD_STAT_COLUMNS; column++ )
+		{
+			const timeDemoStats_t *s = &stats[ column ];
+
+			FS_Printf( f, "\t\t\"%s\": { \"mean\": %.1f, \"sdev\": %.1f, \"min\": %d, "
+					"\"p50\": %d, \"p95\": %d, \"p99\": %d, \"p99.9\": %d, \"max\": %d }%s\n",
+					CL_TimeDemoColumnName( column ), s->mean, s->sdev, s->min,
+					s->p50, s->p95, s->p99, s->p999, s->max,
+					column < TD_STAT_COLUMNS - 1 ? "," : "" );
+		}
+		FS_Printf( f, "\t},\n" );
+
+		FS_Printf( f, "\t\"columns\": [" );
+		for( column = 0; column < TD_STAT_COLUMNS; column++ )
+			FS_Printf( f, "%s\"%s\"", column ? ", " : " ", CL_TimeDemoColumnName( column ) );
+		FS_Printf( f, " ],\n\t\"data\": [\n" );
+
+		for( i = 0; i < tdNumFrames; i++ )
+		{
+			FS_Printf( f, "\t\t[" );
+			for( column = 0; column < TD_STAT_COLUMNS; column++ )
+				FS_Printf( f, "%s%d", column ? ", " : " ", CL_TimeDemoValue( &tdFrames[ i ], column ) );
+			FS_Printf( f, " ]%s\n", i < tdNumFrames - 1 ? "," : "" );
+		}
+
+		FS_Printf( f, "\t]\n}\n" );
+	}
+	else
+	{
+		FS_Printf( f, "frame" );
+		for( column = 0; column < TD_STAT_COLUMNS; column++ )
+			FS_Printf( f, ",%s_us", CL_TimeDemoColumnName( column ) );
+		FS_Printf( f, "\n" );
+
+		for( i = 0; i < tdNumFrames; i++ )
+		{
+			FS_Printf( f, "%d", i );
+			for( column = 0; column < TD_STAT_COLUMNS; column++ )
+				FS_Printf( f, ",%d", CL_TimeDemoValue( &tdFrames[ i ], column ) );
+			FS_Printf( f, "\n" );
+		}
+	}
+
+	FS_FCloseFile( f );
+	Com_Printf( "%s written\n", fileName );
+}
+
+/*
+=================
+CL_TimeDemoReport
+
+Prints the summary line, writes cl_timedemoLog and, with cl_timedemoProfile
+set, the per subsystem breakdown
+=================
+*/
+void CL_TimeDemoReport( void )
+{
+	char			buffer[ MAX_STRING_CHARS ];
+	timeDemoStats_t	stats[ TD_STAT_COLUMNS ];
+	int				*scratch;
+	int				time, column, i;
+
+	time = Sys_Milliseconds() - clc.timeDemoStart;
+	if( time <= 0 || !tdNumFrames )
+		return;
+
+	scratch = malloc( tdNumFrames * sizeof( int ) );
+	if( !scratch )
+	{
+		Com_Printf( "CL_TimeDemoReport: out of memory\n" );
+		return;
+	}
+
+	CL_TimeDemoComputeStats( stats, scratch );
+	free( scratch );
+
+	// Millisecond times are frame durations:
+	// minimum/average/maximum/std deviation
+	Com_sprintf( buffer, sizeof( buffer ),
+			"%i frames %3.1f seconds %3.1f fps %.1f/%.1f/%.1f/%.1f ms\n",
+			clc.timeDemoFrames,
+			time/1000.0,
+			clc.timeDemoFrames*1000.0 / time,
+			stats[ 0 ].min / 1000.0,
+			time / (float)clc.timeDemoFrames,
+			stats[ 0 ].max / 1000.0,
+			stats[ 0 ].sdev / 1000.0 );
+	Com_Printf( "%s", buffer );
+
+	// Write a log of all the frame durations
+	if( cl_timedemoLog && strlen( cl_timedemoLog->string ) > 0 )
+	{
+		fileHandle_t f;
+
+		f = FS_FOpenFileWrite( cl_timedemoLog->string );
+		if( f )
+		{
+			FS_Printf( f, "# %s", buffer );
+
+			for( i = 0; i < tdNumFrames; i++ )
+				FS_Printf( f, "%d\n", tdFrames[ i ].total / 1000 );
+
+			FS_FCloseFile( f );
+			Com_Printf( "%s written\n", cl_timedemoLog->string );
+		}
+		else
+		{
+			Com_Printf( "Couldn't open %s for writing\n",
+					cl_timedemoLog->string );
+		}
+	}
+
+	if( !cl_timedemoProfile || !cl_timedemoProfile->string[ 0 ] )
+		return;
+
+	Com_Printf( "%-9s %9s %9s %9s %9s %9s %9s\n",
+			"ms", "mean", "p50", "p95", "p99", "p99.9", "max" );
+	for( column = 0; column < TD_STAT_COLUMNS; column++ )
+	{
+		const timeDemoStats_t *s = &stats[ column ];
+
+		Com_Printf( "%-9s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+				CL_TimeDemoColumnName( column ), s->mean / 1000.0,
+				s->p50 / 1000.0, s->p95 / 1000.0, s->p99 / 1000.0,
+				s->p999 / 1000.0, s->max / 1000.0 );
+	}
+
+	CL_TimeDemoPrintHistogram( );
+
+	if( Q_stricmp( cl_timedemoProfile->string, "1" ) )
+		CL_TimeDemoWriteProfile( cl_timedemoProfile->string, stats );
+}
@@ -792,6 +792,13 @@ intptr_t CL_UISystemCalls( intptr_t *args ) {
 		return 0;
 
 	case UI_FS_GETFILELIST:
+		{
+			int nFiles = CL_DemoCatalogGetFileList( VMA(1), VMA(2), VMA(3), args[4] );
+
+			if ( nFiles >= 0 ) {
+				return nFiles;
+			}
+		}
 		return FS_GetFileList( VMA(1), VMA(2), VMA(3), args[4] );
 
 	case UI_FS_SEEK:
@@ -170,8 +170,6 @@ demo through a file.
 =============================================================================
 */
 
-#define MAX_TIMEDEMO_DURATIONS	4096
-
 typedef struct {
 
 	connstate_t	state;				// connection status
@@ -234,16 +232,13 @@ typedef struct {
 	qboolean	demorecording;
 	qboolean	demoplaying;
 	qboolean	demowaiting;	// don't record until a non-delta message is received
+	qboolean	demoGamestate;	// last gamestate must be recorded in full, not as received
 	qboolean	firstDemoFrameSkipped;
 	fileHandle_t	demofile;
 
 	int			timeDemoFrames;		// counter of rendered frames
 	int			timeDemoStart;		// cls.realtime before first frame
 	int			timeDemoBaseTime;	// each frame will be at this time + frameNum * 50
-	int			timeDemoLastFrame;// time the last frame was rendered
-	int			timeDemoMinDuration;	// minimum frame duration
-	int			timeDemoMaxDuration;	// maximum frame duration
-	unsigned char	timeDemoDurations[ MAX_TIMEDEMO_DURATIONS ];	// log of frame durations
 
 #ifdef USE_VOIP
 	qboolean voipEnabled;
@@ -423,8 +418,12 @@ extern	cvar_t	*j_side_axis;
 extern	cvar_t	*j_up_axis;
 
 extern	cvar_t	*cl_timedemo;
+extern	cvar_t	*cl_timedemoLog;
+extern	cvar_t	*cl_timedemoProfile;
 extern	cvar_t	*cl_aviFrameRate;
 extern	cvar_t	*cl_aviMotionJpeg;
+extern	cvar_t	*cl_aviPipe;
+extern	cvar_t	*cl_aviOffline;
 
 extern	cvar_t	*cl_activeAction;
 
@@ -435,6 +434,7 @@ extern	cvar_t	*cl_mapAutoDownload;  // drakkar
 extern	cvar_t	*cl_inGameVideo;
 
 extern	cvar_t	*cl_lanForcePackets;
+extern	cvar_t	*cl_gamestateCache;
 extern	cvar_t	*cl_autoRecordDemo;
 
 extern	cvar_t	*cl_consoleKeys;
@@ -531,6 +531,7 @@ void CL_Voip_f( void );
 
 void CL_SystemInfoChanged( void );
 void CL_ParseServerMessage( msg_t *msg );
+uint64_t CL_CachedGamestateHash( void );
 
 //====================================================================
 
@@ -650,12 +651,71 @@ void CL_WriteAVIVideoFrame( const byte *imageBuffer, int size );
 void CL_WriteAVIAudioFrame( const byte *pcmBuffer, int size );
 qboolean CL_CloseAVI( void );
 qboolean CL_VideoRecording( void );
+int CL_VideoFrameMsec( void );
+int CL_VideoSoundSamples( void );
 
 //
 // cl_main.c
 //
 void CL_WriteDemoMessage ( msg_t *msg, int headerBytes );
 
+//
+// cl_timedemo.c
+//
+typedef enum {
+	TD_PARSE,		// demo reading and message parsing
+	TD_CGAME,		// cgame frame, not counting the renderer front end
+	TD_FRONTEND,	// scene submission to the renderer
+	TD_BACKEND,		// RE_EndFrame, back end and buffer swap
+	TD_SOUND,		// sound mixing
+	TD_NUM_SECTIONS
+} timeDemoSection_t;
+
+qboolean CL_TimeDemoProfiling( void );
+void CL_TimeDemoClear( void );
+void CL_TimeDemoShutdown( void );
+void CL_TimeDemoBeginSection( timeDemoSection_t section );
+void CL_TimeDemoEndSection( timeDemoSection_t section );
+void CL_TimeDemoFrame( void );
+void CL_TimeDemoReport( void );
+
+//
+// cl_democat.c
+//
+typedef struct {
+	int64_t		mtime;
+	int64_t		size;
+	int			name;		// offsets of strings, see CL_DemoCatalogString
+	int			map;
+	int			player;
+	int			hostname;
+	int			runTime;	// msec from a defrag record name, -1 if unknown
+	short		protocol;
+	signed char	physics;	// df_promode, -1 if unknown
+	signed char	gametype;	// defrag_gametype or g_gametype, -1 if unknown
+} demoCatalogEntry_t;
+
+typedef struct {
+	char		*map;		// Com_Filter patterns, NULL matches anything
+	char		*player;
+	char		*name;
+	int			physics;	// -1 matches anything
+	int			minTime;	// msec, 0 for no limit
+	int			maxTime;
+} demoQuery_t;
+
+void CL_DemoCatalogInit( void );
+void CL_DemoCatalogShutdown( void );
+void CL_DemoCatalogFrame( void );
+void CL_DemoCatalogRescan( void );
+qboolean CL_DemoCatalogReady( void );
+const demoCatalogEntry_t *CL_DemoCatalogEntry( int index );
+const char *CL_DemoCatalogString( int offset );
+void CL_DemoCatalogParseQuery( const char *text, demoQuery_t *query, char *storage, int storageSize );
+int CL_DemoCatalogFind( const demoQuery_t *query, int *results, int maxResults );
+int CL_DemoCatalogGetFileList( const char *path, const char *extension, char *listbuf, int bufsize );
+void CL_DemoCatalogCompletion( void (*callback)( const char *s ) );
+
 //
 // cl_download.c
 //
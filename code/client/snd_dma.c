@@ -1180,7 +1180,7 @@ void S_GetSoundtime(void)
 
 	if( CL_VideoRecording( ) )
 	{
-		s_soundtime += (int)ceil( dma.speed / cl_aviFrameRate->value );
+		s_soundtime += CL_VideoSoundSamples( );
 		return;
 	}
 
@@ -1257,12 +1257,21 @@ void S_Update_(void) {
 		ma = op;
 	}
 
-	// mix ahead of current position
-	endtime = s_soundtime + ma;
+	if( CL_VideoRecording( ) )
+	{
+		// mix exactly the captured frame so the audio doesn't depend on
+		// how long the frame took to render
+		endtime = s_soundtime;
+	}
+	else
+	{
+		// mix ahead of current position
+		endtime = s_soundtime + ma;
 
-	// mix to an even submission block size
-	endtime = (endtime + dma.submission_chunk-1)
-		& ~(dma.submission_chunk-1);
+		// mix to an even submission block size
+		endtime = (endtime + dma.submission_chunk-1)
+			& ~(dma.submission_chunk-1);
+	}
 
 	// never mix more than the complete buffer
 	samps = dma.samples >> (dma.channels-1);
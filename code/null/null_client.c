@@ -80,6 +80,10 @@ void CL_InitKeyCommands( void ) {
 void CL_CDDialog( void ) {
 }
 
+qboolean CL_VideoOffline( void ) {
+	return qfalse;
+}
+
 void CL_FlushMemory(void)
 {
 }
@@ -62,6 +62,7 @@ byte		*cmod_base;
 cvar_t		*cm_noAreas;
 cvar_t		*cm_noCurves;
 cvar_t		*cm_playerCurveClip;
+static cvar_t	*cm_cache;
 #endif
 
 cmodel_t	box_model;
@@ -174,13 +175,16 @@ void CMod_LoadSubmodels( lump_t *l ) {
 =================
 CMod_LoadNodes
 
+The nodes are renumbered depth first from the root, so the subtree a
+trace or point test descends into stays close together in memory
 =================
 */
 void CMod_LoadNodes( lump_t *l ) {
 	dnode_t		*in;
 	int			child;
 	cNode_t		*out;
-	int			i, j, count;
+	int			i, j, count, planeNum;
+	int			*order, *stack, numStack;
 	
 	in = (void *)(cmod_base + l->fileofs);
 	if (l->filelen % sizeof(*in))
@@ -189,21 +193,60 @@ void CMod_LoadNodes( lump_t *l ) {
 
 	if (count < 1)
 		Com_Error (ERR_DROP, "Map has no nodes");
-	cm.nodes = Hunk_Alloc( count * sizeof( *cm.nodes ), h_high );
-	cm.numNodes = count;
 
-	out = cm.nodes;
+	// order[ lump node ] = loaded node, -1 while unreached, -2 while queued
+	order = Z_Malloc( count * sizeof( *order ) );
+	stack = Z_Malloc( count * sizeof( *stack ) );
+	for ( i = 0 ; i < count ; i++ ) {
+		order[i] = -1;
+	}
+
+	cm.numNodes = 0;
+	order[0] = -2;
+	stack[0] = 0;
+	numStack = 1;
+	while ( numStack ) {
+		i = stack[--numStack];
+		order[i] = cm.numNodes++;
+
+		// push the back child first so the front one is numbered next
+		for ( j = 1 ; j >= 0 ; j-- ) {
+			child = LittleLong( in[i].children[j] );
+			if ( child < 0 ) {
+				continue;
+			}
+			if ( child >= count || order[child] != -1 ) {
+				Com_Error( ERR_DROP, "CMod_LoadNodes: bad child %i of node %i", child, i );
+			}
+			order[child] = -2;
+			stack[numStack++] = child;
+		}
+	}
+
+	cm.nodes = Hunk_Alloc( cm.numNodes * sizeof( *cm.nodes ), h_high );
 
-	for (i=0 ; i<count ; i++, out++, in++)
+	for ( i=0 ; i<count ; i++, in++ )
 	{
-		out->plane = cm.planes + LittleLong( in->planeNum );
+		if ( order[i] < 0 ) {
+			continue;	// not part of the world tree
+		}
+		out = &cm.nodes[order[i]];
+
+		planeNum = LittleLong( in->planeNum );
+		if ( planeNum < 0 || planeNum >= cm.numPlanes ) {
+			Com_Error( ERR_DROP, "CMod_LoadNodes: bad planeNum %i", planeNum );
+		}
+		out->plane = cm.planes[planeNum];
+
 		for (j=0 ; j<2 ; j++)
 		{
 			child = LittleLong (in->children[j]);
-			out->children[j] = child;
+			out->children[j] = child < 0 ? child : order[child];
 		}
 	}
 
+	Z_Free( stack );
+	Z_Free( order );
 }
 
 /*
@@ -224,6 +267,51 @@ void CM_BoundBrush( cbrush_t *b ) {
 }
 
 
+/*
+=================
+CMod_BuildBrushSides4
+
+Copies the side planes of every loaded brush into groups of four for
+CM_TraceThroughBrush. The box brush keeps sides4 NULL since its planes
+are rewritten by CM_TempBoxModel.
+=================
+*/
+static void CMod_BuildBrushSides4( void ) {
+#if idx64
+	cbrushsides4_t	*out;
+	cbrush_t		*b;
+	cplane_t		*plane;
+	int				i, j, count;
+
+	count = 0;
+	for ( i = 0, b = cm.brushes ; i < cm.numBrushes ; i++, b++ ) {
+		if ( b->numsides > 0 ) {
+			count += ( b->numsides + 3 ) >> 2;
+		}
+	}
+	if ( !count ) {
+		return;
+	}
+
+	out = Hunk_Alloc( count * sizeof( *out ), h_high );
+
+	for ( i = 0, b = cm.brushes ; i < cm.numBrushes ; i++, b++ ) {
+		if ( b->numsides <= 0 ) {
+			continue;
+		}
+		b->sides4 = out;
+		for ( j = 0 ; j < b->numsides ; j++ ) {
+			plane = b->sides[j].plane;
+			out[j >> 2].normal[0][j & 3] = plane->normal[0];
+			out[j >> 2].normal[1][j & 3] = plane->normal[1];
+			out[j >> 2].normal[2][j & 3] = plane->normal[2];
+			out[j >> 2].dist[j & 3] = plane->dist;
+		}
+		out += ( b->numsides + 3 ) >> 2;
+	}
+#endif
+}
+
 /*
 =================
 CMod_LoadBrushes
@@ -259,6 +347,7 @@ void CMod_LoadBrushes( lump_t *l ) {
 		CM_BoundBrush( out );
 	}
 
+	CMod_BuildBrushSides4();
 }
 
 /*
@@ -475,13 +564,125 @@ void CMod_LoadVisibility( lump_t *l ) {
 //==================================================================
 
 
+/*
+=================
+CMod_ReadPatchCache
+
+The generated patch collision of a map is kept in cmcache/<map>.cmc under
+the game dir in fs_homepath, and reused while the bsp checksum matches.
+Returns the first patch record, or NULL if there is no usable cache.
+=================
+*/
+#define	CM_CACHE_IDENT		(('C'<<24)+('M'<<16)+('C'<<8)+'Q')	// little-endian "QCMC"
+#define	CM_CACHE_VERSION	1
+
+typedef struct {
+	int			ident;
+	int			version;
+	int			checksum;		// of the whole bsp file
+	int			numSurfaces;
+} cmCacheHeader_t;
+
+#ifndef BSPC
+static const byte *CMod_ReadPatchCache( const char *cacheName, int checksum, void **buffer, const byte **end ) {
+	cmCacheHeader_t	*header;
+	fileHandle_t	f;
+	char			path[MAX_OSPATH];
+	long			length;
+
+	*buffer = NULL;
+	*end = NULL;
+	if ( !cm_cache->integer ) {
+		return NULL;
+	}
+
+	// only ever read back what this engine wrote, never a file from the
+	// base path or the search path, so pure servers can use it too
+	Com_sprintf( path, sizeof( path ), "%s/%s", FS_GetCurrentGameDir(), cacheName );
+	if ( !FS_SV_FileExists( path ) ) {
+		return NULL;
+	}
+	length = FS_SV_FOpenFileRead( path, &f );
+	if ( !f ) {
+		return NULL;
+	}
+	if ( length < (long)sizeof( *header ) ) {
+		FS_FCloseFile( f );
+		Com_DPrintf( "%s is out of date\n", cacheName );
+		return NULL;
+	}
+	*buffer = Hunk_AllocateTempMemory( length );
+	if ( FS_Read( *buffer, length, f ) != length ) {
+		FS_FCloseFile( f );
+		Com_DPrintf( "%s is out of date\n", cacheName );
+		return NULL;
+	}
+	FS_FCloseFile( f );
+
+	header = *buffer;
+	if ( header->ident != CM_CACHE_IDENT || header->version != CM_CACHE_VERSION ||
+		header->checksum != checksum || header->numSurfaces != cm.numSurfaces ) {
+		Com_DPrintf( "%s is out of date\n", cacheName );
+		return NULL;
+	}
+
+	*end = (byte *)*buffer + length;
+	return (byte *)( header + 1 );
+}
+
+/*
+=================
+CMod_WritePatchCache
+
+Writes to a temporary file named after the process first, so servers
+sharing the home path never read a cache another one is halfway through
+=================
+*/
+static void CMod_WritePatchCache( const char *cacheName, int checksum ) {
+	cmCacheHeader_t	header;
+	fileHandle_t	f;
+	char			path[MAX_OSPATH];
+	char			tmpPath[MAX_OSPATH];
+	int				i;
+
+	Com_sprintf( path, sizeof( path ), "%s/%s", FS_GetCurrentGameDir(), cacheName );
+	Com_sprintf( tmpPath, sizeof( tmpPath ), "%s.%i.tmp", path, Sys_PID() );
+
+	f = FS_SV_FOpenFileWrite( tmpPath );
+	if ( !f ) {
+		Com_Printf( "Couldn't open %s for writing\n", tmpPath );
+		return;
+	}
+
+	header.ident = CM_CACHE_IDENT;
+	header.version = CM_CACHE_VERSION;
+	header.checksum = checksum;
+	header.numSurfaces = cm.numSurfaces;
+	FS_Write( &header, sizeof( header ), f );
+
+	for ( i = 0 ; i < cm.numSurfaces ; i++ ) {
+		if ( cm.surfaces[i] ) {
+			CM_WritePatchCollide( f, cm.surfaces[i]->pc );
+		}
+	}
+
+	FS_FCloseFile( f );
+
+#ifdef _WIN32
+	// rename doesn't replace existing files on windows
+	FS_HomeRemove( cacheName );
+#endif
+	FS_SV_Rename( tmpPath, path );
+}
+#endif
+
 /*
 =================
 CMod_LoadPatches
 =================
 */
 #define	MAX_PATCH_VERTS		1024
-void CMod_LoadPatches( lump_t *surfs, lump_t *verts ) {
+void CMod_LoadPatches( lump_t *surfs, lump_t *verts, const char *cacheName, int checksum ) {
 	drawVert_t	*dv, *dv_p;
 	dsurface_t	*in;
 	int			count;
@@ -491,6 +692,9 @@ void CMod_LoadPatches( lump_t *surfs, lump_t *verts ) {
 	vec3_t		points[MAX_PATCH_VERTS];
 	int			width, height;
 	int			shaderNum;
+	void		*cacheBuffer;
+	const byte	*cache, *cacheEnd;
+	qboolean	cacheValid, hasPatches;
 
 	in = (void *)(cmod_base + surfs->fileofs);
 	if (surfs->filelen % sizeof(*in))
@@ -502,6 +706,15 @@ void CMod_LoadPatches( lump_t *surfs, lump_t *verts ) {
 	if (verts->filelen % sizeof(*dv))
 		Com_Error (ERR_DROP, "MOD_LoadBmodel: funny lump size");
 
+#ifndef BSPC
+	cache = CMod_ReadPatchCache( cacheName, checksum, &cacheBuffer, &cacheEnd );
+#else
+	cacheBuffer = NULL;
+	cache = cacheEnd = NULL;
+#endif
+	cacheValid = cache != NULL;
+	hasPatches = qfalse;
+
 	// scan through all the surfaces, but only load patches,
 	// not planar faces
 	for ( i = 0 ; i < count ; i++, in++ ) {
@@ -511,6 +724,7 @@ void CMod_LoadPatches( lump_t *surfs, lump_t *verts ) {
 		// FIXME: check for non-colliding patches
 
 		cm.surfaces[ i ] = patch = Hunk_Alloc( sizeof( *patch ), h_high );
+		hasPatches = qtrue;
 
 		// load the full drawverts onto the stack
 		width = LittleLong( in->patchWidth );
@@ -520,6 +734,19 @@ void CMod_LoadPatches( lump_t *surfs, lump_t *verts ) {
 			Com_Error( ERR_DROP, "ParseMesh: MAX_PATCH_VERTS" );
 		}
 
+		shaderNum = LittleLong( in->shaderNum );
+		patch->contents = cm.shaders[shaderNum].contentFlags;
+		patch->surfaceFlags = cm.shaders[shaderNum].surfaceFlags;
+
+		if ( cache ) {
+			patch->pc = CM_ReadPatchCollide( &cache, cacheEnd );
+			if ( patch->pc ) {
+				continue;
+			}
+			cache = NULL;
+			cacheValid = qfalse;
+		}
+
 		dv_p = dv + LittleLong( in->firstVert );
 		for ( j = 0 ; j < c ; j++, dv_p++ ) {
 			points[j][0] = LittleFloat( dv_p->xyz[0] );
@@ -527,13 +754,188 @@ void CMod_LoadPatches( lump_t *surfs, lump_t *verts ) {
 			points[j][2] = LittleFloat( dv_p->xyz[2] );
 		}
 
-		shaderNum = LittleLong( in->shaderNum );
-		patch->contents = cm.shaders[shaderNum].contentFlags;
-		patch->surfaceFlags = cm.shaders[shaderNum].surfaceFlags;
-
 		// create the internal facet structure
 		patch->pc = CM_GeneratePatchCollide( width, height, points );
 	}
+
+	if ( cache != cacheEnd ) {
+		cacheValid = qfalse;
+	}
+
+#ifndef BSPC
+	if ( cacheBuffer ) {
+		Hunk_FreeTempMemory( cacheBuffer );
+	}
+
+	if ( !cacheValid && hasPatches && cm_cache->integer ) {
+		CMod_WritePatchCache( cacheName, checksum );
+	}
+#endif
+}
+
+/*
+=================
+CMod_BuildLeafBVHs
+
+Leaves crowded with detail brushes and patches get a small bounding
+volume hierarchy, so a trace only visits the items its bounds touch
+=================
+*/
+typedef struct {
+	vec3_t		bounds[2];
+	vec3_t		center;		// twice the center, only used for sorting
+	int			item;
+} bvhBuildItem_t;
+
+static int		bvhSortAxis;
+
+static int CMod_CompareBVHItems( const void *a, const void *b ) {
+	const bvhBuildItem_t	*ia = a;
+	const bvhBuildItem_t	*ib = b;
+
+	if ( ia->center[bvhSortAxis] < ib->center[bvhSortAxis] ) {
+		return -1;
+	}
+	if ( ia->center[bvhSortAxis] > ib->center[bvhSortAxis] ) {
+		return 1;
+	}
+	return ia->item - ib->item;
+}
+
+static void CMod_BuildBVHNode( int nodeNum, bvhBuildItem_t *items, int numItems ) {
+	cBVHNode_t	*node;
+	vec3_t		mins, maxs;
+	int			i, axis, child, half;
+
+	node = &cm.bvhNodes[nodeNum];
+
+	ClearBounds( node->bounds[0], node->bounds[1] );
+	ClearBounds( mins, maxs );
+	for ( i = 0 ; i < numItems ; i++ ) {
+		AddPointToBounds( items[i].bounds[0], node->bounds[0], node->bounds[1] );
+		AddPointToBounds( items[i].bounds[1], node->bounds[0], node->bounds[1] );
+		AddPointToBounds( items[i].center, mins, maxs );
+	}
+
+	if ( numItems <= BVH_NODE_ITEMS ) {
+		node->firstItem = cm.numBVHItems;
+		node->numItems = numItems;
+		for ( i = 0 ; i < numItems ; i++ ) {
+			cm.bvhItems[cm.numBVHItems++] = items[i].item;
+		}
+		return;
+	}
+
+	// split at the median along the longest axis of the item centers
+	axis = 0;
+	for ( i = 1 ; i < 3 ; i++ ) {
+		if ( maxs[i] - mins[i] > maxs[axis] - mins[axis] ) {
+			axis = i;
+		}
+	}
+	bvhSortAxis = axis;
+	qsort( items, numItems, sizeof( *items ), CMod_CompareBVHItems );
+
+	child = cm.numBVHNodes;
+	cm.numBVHNodes += 2;
+	node->firstItem = child;
+	node->numItems = 0;
+
+	half = numItems / 2;
+	CMod_BuildBVHNode( child, items, half );
+	CMod_BuildBVHNode( child + 1, items + half, numItems - half );
+}
+
+static void CMod_BuildLeafBVH( cLeaf_t *leaf, bvhBuildItem_t *items ) {
+	int			k, num, numItems;
+	cbrush_t	*b;
+	cPatch_t	*patch;
+
+	numItems = 0;
+
+	for ( k = 0 ; k < leaf->numLeafBrushes ; k++ ) {
+		num = cm.leafbrushes[leaf->firstLeafBrush + k];
+		if ( num < 0 || num >= cm.numBrushes ) {
+			return;
+		}
+		b = &cm.brushes[num];
+		VectorCopy( b->bounds[0], items[numItems].bounds[0] );
+		VectorCopy( b->bounds[1], items[numItems].bounds[1] );
+		items[numItems].item = k;
+		numItems++;
+	}
+
+	for ( k = 0 ; k < leaf->numLeafSurfaces ; k++ ) {
+		num = cm.leafsurfaces[leaf->firstLeafSurface + k];
+		if ( num < 0 || num >= cm.numSurfaces ) {
+			return;
+		}
+		patch = cm.surfaces[num];
+		if ( !patch ) {
+			continue;	// never traced against
+		}
+		CM_PatchCollideBounds( patch->pc, items[numItems].bounds[0], items[numItems].bounds[1] );
+		items[numItems].item = leaf->numLeafBrushes + k;
+		numItems++;
+	}
+
+	if ( numItems < BVH_MIN_ITEMS ) {
+		return;
+	}
+
+	for ( k = 0 ; k < numItems ; k++ ) {
+		VectorAdd( items[k].bounds[0], items[k].bounds[1], items[k].center );
+	}
+
+	leaf->firstBVHNode = cm.numBVHNodes++;
+	CMod_BuildBVHNode( leaf->firstBVHNode, items, numItems );
+	leaf->numBVHNodes = cm.numBVHNodes - leaf->firstBVHNode;
+}
+
+static qboolean CMod_LeafNeedsBVH( const cLeaf_t *leaf ) {
+	int		numItems;
+
+	numItems = leaf->numLeafBrushes + leaf->numLeafSurfaces;
+	return numItems >= BVH_MIN_ITEMS && numItems <= BVH_MAX_ITEMS;
+}
+
+static void CMod_BuildLeafBVHs( void ) {
+	bvhBuildItem_t	*items;
+	int				i, maxItems;
+
+	maxItems = 0;
+	for ( i = 0 ; i < cm.numLeafs ; i++ ) {
+		if ( CMod_LeafNeedsBVH( &cm.leafs[i] ) ) {
+			maxItems += cm.leafs[i].numLeafBrushes + cm.leafs[i].numLeafSurfaces;
+		}
+	}
+	for ( i = 1 ; i < cm.numSubModels ; i++ ) {
+		if ( CMod_LeafNeedsBVH( &cm.cmodels[i].leaf ) ) {
+			maxItems += cm.cmodels[i].leaf.numLeafBrushes + cm.cmodels[i].leaf.numLeafSurfaces;
+		}
+	}
+	if ( !maxItems ) {
+		return;
+	}
+
+	// halving down to BVH_NODE_ITEMS never takes more than two nodes per item
+	cm.bvhNodes = Hunk_Alloc( 2 * maxItems * sizeof( *cm.bvhNodes ), h_high );
+	cm.bvhItems = Hunk_Alloc( maxItems * sizeof( *cm.bvhItems ), h_high );
+
+	items = Z_Malloc( BVH_MAX_ITEMS * sizeof( *items ) );
+
+	for ( i = 0 ; i < cm.numLeafs ; i++ ) {
+		if ( CMod_LeafNeedsBVH( &cm.leafs[i] ) ) {
+			CMod_BuildLeafBVH( &cm.leafs[i], items );
+		}
+	}
+	for ( i = 1 ; i < cm.numSubModels ; i++ ) {
+		if ( CMod_LeafNeedsBVH( &cm.cmodels[i].leaf ) ) {
+			CMod_BuildLeafBVH( &cm.cmodels[i].leaf, items );
+		}
+	}
+
+	Z_Free( items );
 }
 
 //==================================================================
@@ -575,6 +977,8 @@ void CM_LoadMap( const char *name, qboolean clientload, int *checksum ) {
 	dheader_t		header;
 	int				length;
 	static unsigned	last_checksum;
+	char			baseName[MAX_QPATH];
+	char			cacheName[MAX_QPATH];
 
 	if ( !name || !name[0] ) {
 		Com_Error( ERR_DROP, "CM_LoadMap: NULL name" );
@@ -584,6 +988,7 @@ void CM_LoadMap( const char *name, qboolean clientload, int *checksum ) {
 	cm_noAreas = Cvar_Get ("cm_noAreas", "0", CVAR_CHEAT);
 	cm_noCurves = Cvar_Get ("cm_noCurves", "0", CVAR_CHEAT);
 	cm_playerCurveClip = Cvar_Get ("cm_playerCurveClip", "1", CVAR_ARCHIVE|CVAR_CHEAT );
+	cm_cache = Cvar_Get ("cm_cache", "1", CVAR_ARCHIVE );
 #endif
 	Com_DPrintf( "CM_LoadMap( %s, %i )\n", name, clientload );
 
@@ -633,6 +1038,9 @@ void CM_LoadMap( const char *name, qboolean clientload, int *checksum ) {
 
 	cmod_base = (byte *)buf.i;
 
+	COM_StripExtension( COM_SkipPath( (char *)name ), baseName, sizeof( baseName ) );
+	Com_sprintf( cacheName, sizeof( cacheName ), "cmcache/%s.cmc", baseName );
+
 	// load into heap
 	CMod_LoadShaders( &header.lumps[LUMP_SHADERS] );
 	CMod_LoadLeafs (&header.lumps[LUMP_LEAFS]);
@@ -645,7 +1053,8 @@ void CM_LoadMap( const char *name, qboolean clientload, int *checksum ) {
 	CMod_LoadNodes (&header.lumps[LUMP_NODES]);
 	CMod_LoadEntityString (&header.lumps[LUMP_ENTITIES]);
 	CMod_LoadVisibility( &header.lumps[LUMP_VISIBILITY] );
-	CMod_LoadPatches( &header.lumps[LUMP_SURFACES], &header.lumps[LUMP_DRAWVERTS] );
+	CMod_LoadPatches( &header.lumps[LUMP_SURFACES], &header.lumps[LUMP_DRAWVERTS], cacheName, last_checksum );
+	CMod_BuildLeafBVHs();
 
 	// we are NOT freeing the file, because it is cached for the ref
 	FS_FreeFile (buf.v);
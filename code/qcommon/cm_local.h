@@ -29,9 +29,12 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #define CAPSULE_MODEL_HANDLE	254
 
 
+// the plane is copied into the node and the nodes are stored depth first,
+// with the front child right after its parent
 typedef struct {
-	cplane_t	*plane;
+	cplane_t	plane;
 	int			children[2];		// negative numbers are leafs
+	int			pad;				// 32 bytes, two nodes per cache line
 } cNode_t;
 
 typedef struct {
@@ -43,8 +46,24 @@ typedef struct {
 
 	int			firstLeafSurface;
 	int			numLeafSurfaces;
+
+	int			firstBVHNode;	// root of the leaf's BVH in cm.bvhNodes
+	int			numBVHNodes;	// 0 if the brushes and patches are tested one by one
 } cLeaf_t;
 
+// bounding volume hierarchy over the brushes and patches of a crowded leaf,
+// an item is a position in the leaf's brush list or, past numLeafBrushes,
+// in its surface list
+#define	BVH_MIN_ITEMS		16		// leaves with fewer items get no BVH
+#define	BVH_MAX_ITEMS		1024	// leaves with more items get no BVH
+#define	BVH_NODE_ITEMS		4
+
+typedef struct {
+	vec3_t		bounds[2];
+	int			firstItem;		// in cm.bvhItems, or first of the two children
+	int			numItems;		// 0 for an inner node
+} cBVHNode_t;
+
 typedef struct cmodel_s {
 	vec3_t		mins, maxs;
 	cLeaf_t		leaf;			// submodels don't reference the main tree
@@ -56,12 +75,20 @@ typedef struct {
 	int			shaderNum;
 } cbrushside_t;
 
+// brush side planes regrouped four at a time for the SIMD trace kernel,
+// unused lanes of the last group are zero
+typedef struct {
+	float		normal[3][4];
+	float		dist[4];
+} cbrushsides4_t;
+
 typedef struct {
 	int			shaderNum;		// the shader that determined the contents
 	int			contents;
 	vec3_t		bounds[2];
 	int			numsides;
 	cbrushside_t	*sides;
+	cbrushsides4_t	*sides4;	// ( numsides + 3 ) / 4 groups, NULL for scalar tracing
 	int			checkcount;		// to avoid repeated testings
 } cbrush_t;
 
@@ -124,6 +151,12 @@ typedef struct {
 	int			numSurfaces;
 	cPatch_t	**surfaces;			// non-patches will be NULL
 
+	int			numBVHNodes;
+	cBVHNode_t	*bvhNodes;
+
+	int			numBVHItems;
+	short		*bvhItems;
+
 	int			floodvalid;
 	int			checkcount;					// incremented on each trace
 } clipMap_t;
@@ -193,4 +226,7 @@ qboolean CM_BoundsIntersectPoint( const vec3_t mins, const vec3_t maxs, const ve
 struct patchCollide_s	*CM_GeneratePatchCollide( int width, int height, vec3_t *points );
 void CM_TraceThroughPatchCollide( traceWork_t *tw, const struct patchCollide_s *pc );
 qboolean CM_PositionTestInPatchCollide( traceWork_t *tw, const struct patchCollide_s *pc );
+void CM_PatchCollideBounds( const struct patchCollide_s *pc, vec3_t mins, vec3_t maxs );
+void CM_WritePatchCollide( fileHandle_t f, const struct patchCollide_s *pc );
+struct patchCollide_s *CM_ReadPatchCollide( const byte **data, const byte *end );
 void CM_ClearLevelPatches( void );
@@ -31,6 +31,9 @@ void CM_ClearLevelPatches( void );
 struct patchCollide_s	*CM_GeneratePatchCollide( int width, int height, const vec3_t *points );
 void CM_TraceThroughPatchCollide( traceWork_t *tw, const struct patchCollide_s *pc );
 qboolean CM_PositionTestInPatchCollide( traceWork_t *tw, const struct patchCollide_s *pc );
+void CM_PatchCollideBounds( const struct patchCollide_s *pc, vec3_t mins, vec3_t maxs );
+void CM_WritePatchCollide( fileHandle_t f, const struct patchCollide_s *pc );
+struct patchCollide_s *CM_ReadPatchCollide( const byte **data, const byte *end );
 void CM_DrawDebugSurface( void (*drawPoly)(int color, int numPoints, flaot *points) );
 
 
@@ -1214,6 +1217,117 @@ struct patchCollide_s	*CM_GeneratePatchCollide( int width, int height, vec3_t *p
 	return pf;
 }
 
+/*
+===================
+CM_PatchCollideBounds
+===================
+*/
+void CM_PatchCollideBounds( const struct patchCollide_s *pc, vec3_t mins, vec3_t maxs ) {
+	VectorCopy( pc->bounds[0], mins );
+	VectorCopy( pc->bounds[1], maxs );
+}
+
+/*
+================================================================================
+
+COLLISION CACHE
+
+A generated patch is stored as a patchCacheRecord_t followed by its
+planes and facets, exactly as they sit in memory
+
+================================================================================
+*/
+
+typedef struct {
+	vec3_t	bounds[2];
+	int		numPlanes;
+	int		numFacets;
+} patchCacheRecord_t;
+
+#ifndef BSPC
+/*
+===================
+CM_WritePatchCollide
+===================
+*/
+void CM_WritePatchCollide( fileHandle_t f, const struct patchCollide_s *pc ) {
+	patchCacheRecord_t	record;
+
+	VectorCopy( pc->bounds[0], record.bounds[0] );
+	VectorCopy( pc->bounds[1], record.bounds[1] );
+	record.numPlanes = pc->numPlanes;
+	record.numFacets = pc->numFacets;
+
+	FS_Write( &record, sizeof( record ), f );
+	FS_Write( pc->planes, pc->numPlanes * sizeof( *pc->planes ), f );
+	FS_Write( pc->facets, pc->numFacets * sizeof( *pc->facets ), f );
+}
+#endif
+
+/*
+===================
+CM_ReadPatchCollide
+
+Reads a patch written by CM_WritePatchCollide and advances *data past it.
+Returns NULL without allocating anything if the record is damaged.
+===================
+*/
+struct patchCollide_s *CM_ReadPatchCollide( const byte **data, const byte *end ) {
+	patchCacheRecord_t	record;
+	patchCollide_t		*pf;
+	const patchPlane_t	*inPlanes;
+	const facet_t		*inFacets;
+	int					i, j, size;
+
+	if ( end - *data < (int)sizeof( record ) ) {
+		return NULL;
+	}
+	Com_Memcpy( &record, *data, sizeof( record ) );
+
+	if ( record.numPlanes < 0 || record.numPlanes > MAX_PATCH_PLANES ||
+		record.numFacets < 0 || record.numFacets > MAX_FACETS ) {
+		return NULL;
+	}
+	size = sizeof( record ) + record.numPlanes * sizeof( *inPlanes ) + record.numFacets * sizeof( *inFacets );
+	if ( end - *data < size ) {
+		return NULL;
+	}
+
+	inPlanes = (const patchPlane_t *)( *data + sizeof( record ) );
+	inFacets = (const facet_t *)( inPlanes + record.numPlanes );
+
+	// the traces index tw->offsets with signbits and trust every plane number
+	for ( i = 0 ; i < record.numPlanes ; i++ ) {
+		if ( inPlanes[i].signbits < 0 || inPlanes[i].signbits > 7 ) {
+			return NULL;
+		}
+	}
+	for ( i = 0 ; i < record.numFacets ; i++ ) {
+		if ( inFacets[i].surfacePlane < 0 || inFacets[i].surfacePlane >= record.numPlanes ||
+			inFacets[i].numBorders < 0 || inFacets[i].numBorders > ARRAY_LEN( inFacets[i].borderPlanes ) ) {
+			return NULL;
+		}
+		for ( j = 0 ; j < inFacets[i].numBorders ; j++ ) {
+			if ( inFacets[i].borderPlanes[j] < 0 || inFacets[i].borderPlanes[j] >= record.numPlanes ) {
+				return NULL;
+			}
+		}
+	}
+
+	pf = Hunk_Alloc( sizeof( *pf ), h_high );
+	VectorCopy( record.bounds[0], pf->bounds[0] );
+	VectorCopy( record.bounds[1], pf->bounds[1] );
+	pf->numPlanes = record.numPlanes;
+	pf->numFacets = record.numFacets;
+	pf->facets = Hunk_Alloc( pf->numFacets * sizeof( *pf->facets ), h_high );
+	Com_Memcpy( pf->facets, inFacets, pf->numFacets * sizeof( *pf->facets ) );
+	pf->planes = Hunk_Alloc( pf->numPlanes * sizeof( *pf->planes ), h_high );
+	Com_Memcpy( pf->planes, inPlanes, pf->numPlanes * sizeof( *pf->planes ) );
+
+	*data = (const byte *)( inFacets + record.numFacets );
+	return pf;
+}
+
 /*
 ================================================================================
 
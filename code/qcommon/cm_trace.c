@@ -21,6 +21,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 #include "cm_local.h"
 
+#if idx64
+#include <emmintrin.h>
+#endif
+
 // always use bbox vs. bbox collision and never capsule vs. bbox or vice versa
 //#define ALWAYS_BBOX_VS_BBOX
 // always use capsule vs. capsule collision and never capsule vs. bbox or vice versa
@@ -474,6 +478,121 @@ void CM_TraceThroughPatch( traceWork_t *tw, cPatch_t *patch ) {
 	}
 }
 
+#if idx64
+/*
+================
+CM_TraceThroughBrushSides4
+
+Box trace against four brush sides per step. The plane distances are
+computed in the same order as the scalar loop and the enter / leave
+fractions are still taken side by side, so the result is identical.
+Returns qfalse if the trace is completely in front of a side.
+================
+*/
+static qboolean CM_TraceThroughBrushSides4( const traceWork_t *tw, const cbrush_t *brush,
+	float *enterFrac, float *leaveFrac, cbrushside_t **leadside, qboolean *getout, qboolean *startout ) {
+	const cbrushsides4_t	*s4;
+	__m128		zero, eps;
+	__m128		sx, sy, sz, ex, ey, ez;
+	__m128		minx, miny, minz, maxx, maxy, maxz;
+	__m128		nx, ny, nz, ox, oy, oz, dist, d1, d2;
+	float		d1s[4], d2s[4];
+	float		f;
+	int			i, lane, valid, out1, out2, front, cross;
+
+	zero = _mm_setzero_ps();
+	eps = _mm_set1_ps( SURFACE_CLIP_EPSILON );
+	sx = _mm_set1_ps( tw->start[0] );
+	sy = _mm_set1_ps( tw->start[1] );
+	sz = _mm_set1_ps( tw->start[2] );
+	ex = _mm_set1_ps( tw->end[0] );
+	ey = _mm_set1_ps( tw->end[1] );
+	ez = _mm_set1_ps( tw->end[2] );
+	minx = _mm_set1_ps( tw->size[0][0] );
+	miny = _mm_set1_ps( tw->size[0][1] );
+	minz = _mm_set1_ps( tw->size[0][2] );
+	maxx = _mm_set1_ps( tw->size[1][0] );
+	maxy = _mm_set1_ps( tw->size[1][1] );
+	maxz = _mm_set1_ps( tw->size[1][2] );
+
+	s4 = brush->sides4;
+	for ( i = 0; i < brush->numsides; i += 4, s4++ ) {
+		nx = _mm_loadu_ps( s4->normal[0] );
+		ny = _mm_loadu_ps( s4->normal[1] );
+		nz = _mm_loadu_ps( s4->normal[2] );
+
+		// tw->offsets[ plane->signbits ]
+		ox = _mm_cmplt_ps( nx, zero );
+		oy = _mm_cmplt_ps( ny, zero );
+		oz = _mm_cmplt_ps( nz, zero );
+		ox = _mm_or_ps( _mm_and_ps( ox, maxx ), _mm_andnot_ps( ox, minx ) );
+		oy = _mm_or_ps( _mm_and_ps( oy, maxy ), _mm_andnot_ps( oy, miny ) );
+		oz = _mm_or_ps( _mm_and_ps( oz, maxz ), _mm_andnot_ps( oz, minz ) );
+
+		// adjust the plane distance apropriately for mins/maxs
+		dist = _mm_add_ps( _mm_add_ps( _mm_mul_ps( ox, nx ), _mm_mul_ps( oy, ny ) ), _mm_mul_ps( oz, nz ) );
+		dist = _mm_sub_ps( _mm_loadu_ps( s4->dist ), dist );
+
+		d1 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, nx ), _mm_mul_ps( sy, ny ) ), _mm_mul_ps( sz, nz ) );
+		d1 = _mm_sub_ps( d1, dist );
+		d2 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( ex, nx ), _mm_mul_ps( ey, ny ) ), _mm_mul_ps( ez, nz ) );
+		d2 = _mm_sub_ps( d2, dist );
+
+		valid = brush->numsides - i >= 4 ? 15 : ( 1 << ( brush->numsides - i ) ) - 1;
+		out1 = _mm_movemask_ps( _mm_cmpgt_ps( d1, zero ) ) & valid;
+		out2 = _mm_movemask_ps( _mm_cmpgt_ps( d2, zero ) ) & valid;
+
+		// if completely in front of face, no intersection with the entire brush
+		front = _mm_movemask_ps( _mm_or_ps( _mm_cmpge_ps( d2, eps ), _mm_cmpge_ps( d2, d1 ) ) );
+		if ( out1 & front ) {
+			return qfalse;
+		}
+
+		if ( out2 ) {
+			*getout = qtrue;	// endpoint is not in solid
+		}
+		if ( out1 ) {
+			*startout = qtrue;
+		}
+
+		// if it doesn't cross the plane, the plane isn't relevent
+		cross = out1 | out2;
+		if ( !cross ) {
+			continue;
+		}
+
+		_mm_storeu_ps( d1s, d1 );
+		_mm_storeu_ps( d2s, d2 );
+		for ( lane = 0; lane < 4; lane++ ) {
+			if ( !( cross & ( 1 << lane ) ) ) {
+				continue;
+			}
+			// crosses face
+			if ( d1s[lane] > d2s[lane] ) {	// enter
+				f = ( d1s[lane] - SURFACE_CLIP_EPSILON ) / ( d1s[lane] - d2s[lane] );
+				if ( f < 0 ) {
+					f = 0;
+				}
+				if ( f > *enterFrac ) {
+					*enterFrac = f;
+					*leadside = brush->sides + i + lane;
+				}
+			} else {	// leave
+				f = ( d1s[lane] + SURFACE_CLIP_EPSILON ) / ( d1s[lane] - d2s[lane] );
+				if ( f > 1 ) {
+					f = 1;
+				}
+				if ( f < *leaveFrac ) {
+					*leaveFrac = f;
+				}
+			}
+		}
+	}
+
+	return qtrue;
+}
+#endif
+
 /*
 ================
 CM_TraceThroughBrush
@@ -574,6 +693,15 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 				}
 			}
 		}
+#if idx64
+	} else if ( brush->sides4 ) {
+		if ( !CM_TraceThroughBrushSides4( tw, brush, &enterFrac, &leaveFrac, &leadside, &getout, &startout ) ) {
+			return;
+		}
+		if ( leadside ) {
+			clipplane = leadside->plane;
+		}
+#endif
 	} else {
 		//
 		// compare the trace against all planes of the brush
@@ -659,36 +787,150 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush ) {
 
 /*
 ================
-CM_TraceThroughLeaf
+CM_TraceThroughLeafBrush
+
+Returns qtrue once the trace can't get any shorter
 ================
 */
-void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf ) {
-	int			k;
-	int			brushnum;
+static ID_INLINE qboolean CM_TraceThroughLeafBrush( traceWork_t *tw, int brushnum ) {
 	cbrush_t	*b;
+
+	b = &cm.brushes[brushnum];
+	if ( b->checkcount == cm.checkcount ) {
+		return qfalse;	// already checked this brush in another leaf
+	}
+	b->checkcount = cm.checkcount;
+
+	if ( !(b->contents & tw->contents) ) {
+		return qfalse;
+	}
+
+	if ( !CM_BoundsIntersect( tw->bounds[0], tw->bounds[1],
+				b->bounds[0], b->bounds[1] ) ) {
+		return qfalse;
+	}
+
+	CM_TraceThroughBrush( tw, b );
+	return !tw->trace.fraction;
+}
+
+/*
+================
+CM_TraceThroughLeafPatch
+
+Returns qtrue once the trace can't get any shorter
+================
+*/
+static ID_INLINE qboolean CM_TraceThroughLeafPatch( traceWork_t *tw, int surfacenum ) {
 	cPatch_t	*patch;
 
-	// trace line against all brushes in the leaf
-	for ( k = 0 ; k < leaf->numLeafBrushes ; k++ ) {
-		brushnum = cm.leafbrushes[leaf->firstLeafBrush+k];
+	patch = cm.surfaces[ surfacenum ];
+	if ( !patch ) {
+		return qfalse;
+	}
+	if ( patch->checkcount == cm.checkcount ) {
+		return qfalse;	// already checked this patch in another leaf
+	}
+	patch->checkcount = cm.checkcount;
 
-		b = &cm.brushes[brushnum];
-		if ( b->checkcount == cm.checkcount ) {
-			continue;	// already checked this brush in another leaf
-		}
-		b->checkcount = cm.checkcount;
+	if ( !(patch->contents & tw->contents) ) {
+		return qfalse;
+	}
+
+	CM_TraceThroughPatch( tw, patch );
+	return !tw->trace.fraction;
+}
+
+/*
+================
+CM_LeafBVHItems
+
+Sets a bit in items for every brush and patch of the leaf whose BVH
+node bounds the trace touches
+================
+*/
+static void CM_LeafBVHItems( const traceWork_t *tw, const cLeaf_t *leaf, uint64_t *items ) {
+	const cBVHNode_t	*node;
+	int					stack[64];
+	int					i, item, numStack;
+
+	Com_Memset( items, 0, ( ( leaf->numLeafBrushes + leaf->numLeafSurfaces + 63 ) >> 6 ) * sizeof( *items ) );
 
-		if ( !(b->contents & tw->contents) ) {
+	stack[0] = leaf->firstBVHNode;
+	numStack = 1;
+	while ( numStack ) {
+		node = &cm.bvhNodes[ stack[--numStack] ];
+
+		if ( !CM_BoundsIntersect( tw->bounds[0], tw->bounds[1],
+					node->bounds[0], node->bounds[1] ) ) {
 			continue;
 		}
 
-		if ( !CM_BoundsIntersect( tw->bounds[0], tw->bounds[1],
-					b->bounds[0], b->bounds[1] ) ) {
+		if ( !node->numItems ) {
+			stack[numStack++] = node->firstItem;
+			stack[numStack++] = node->firstItem + 1;
 			continue;
 		}
 
-		CM_TraceThroughBrush( tw, b );
-		if ( !tw->trace.fraction ) {
+		for ( i = 0 ; i < node->numItems ; i++ ) {
+			item = cm.bvhItems[ node->firstItem + i ];
+			items[item >> 6] |= (uint64_t)1 << ( item & 63 );
+		}
+	}
+}
+
+static ID_INLINE int CM_LowestBit( uint64_t mask ) {
+#ifdef __GNUC__
+	return __builtin_ctzll( mask );
+#else
+	int		bit;
+
+	for ( bit = 0 ; !( mask & 1 ) ; bit++ ) {
+		mask >>= 1;
+	}
+	return bit;
+#endif
+}
+
+/*
+================
+CM_TraceThroughLeaf
+================
+*/
+void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf ) {
+	int			k, w;
+	uint64_t	items[BVH_MAX_ITEMS / 64], bits;
+
+	if ( leaf->numBVHNodes ) {
+		// visit the items the BVH leaves in, in the same order as below
+		CM_LeafBVHItems( tw, leaf, items );
+
+		for ( w = 0 ; w < ( leaf->numLeafBrushes + leaf->numLeafSurfaces + 63 ) >> 6 ; w++ ) {
+			for ( bits = items[w] ; bits ; bits &= bits - 1 ) {
+				k = ( w << 6 ) + CM_LowestBit( bits );
+				if ( k < leaf->numLeafBrushes ) {
+					if ( CM_TraceThroughLeafBrush( tw, cm.leafbrushes[leaf->firstLeafBrush+k] ) ) {
+						return;
+					}
+					continue;
+				}
+#ifndef BSPC
+				if ( cm_noCurves->integer ) {
+					return;
+				}
+#endif
+				k -= leaf->numLeafBrushes;
+				if ( CM_TraceThroughLeafPatch( tw, cm.leafsurfaces[leaf->firstLeafSurface+k] ) ) {
+					return;
+				}
+			}
+		}
+		return;
+	}
+
+	// trace line against all brushes in the leaf
+	for ( k = 0 ; k < leaf->numLeafBrushes ; k++ ) {
+		if ( CM_TraceThroughLeafBrush( tw, cm.leafbrushes[leaf->firstLeafBrush+k] ) ) {
 			return;
 		}
 	}
@@ -700,21 +942,7 @@ void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf ) {
 	if ( !cm_noCurves->integer ) {
 #endif
 		for ( k = 0 ; k < leaf->numLeafSurfaces ; k++ ) {
-			patch = cm.surfaces[ cm.leafsurfaces[ leaf->firstLeafSurface + k ] ];
-			if ( !patch ) {
-				continue;
-			}
-			if ( patch->checkcount == cm.checkcount ) {
-				continue;	// already checked this patch in another leaf
-			}
-			patch->checkcount = cm.checkcount;
-
-			if ( !(patch->contents & tw->contents) ) {
-				continue;
-			}
-			
-			CM_TraceThroughPatch( tw, patch );
-			if ( !tw->trace.fraction ) {
+			if ( CM_TraceThroughLeafPatch( tw, cm.leafsurfaces[leaf->firstLeafSurface+k] ) ) {
 				return;
 			}
 		}
@@ -1053,7 +1281,7 @@ void CM_TraceThroughTree( traceWork_t *tw, int num, float p1f, float p2f, vec3_t
 	// and the offset for the size of the box
 	//
 	node = cm.nodes + num;
-	plane = node->plane;
+	plane = &node->plane;
 
 	// adjust the plane distance apropriately for mins/maxs
 	if ( plane->type < 3 ) {
@@ -52,6 +52,7 @@ jmp_buf abortframe;		// an ERR_DROP occured, exit the entire frame
 FILE *debuglogfile;
 static fileHandle_t pipefile;
 static fileHandle_t logfile;
+static int			instanceNum = -1;	// com_instances index of this process
 fileHandle_t	com_journalFile;			// events are written here
 fileHandle_t	com_journalDataFile;		// config files are written here
 
@@ -95,6 +96,8 @@ cvar_t	*com_legacyprotocol;
 cvar_t	*com_basegame;
 cvar_t  *com_homepath;
 cvar_t	*com_busyWait;
+cvar_t	*com_busyWaitUsec;
+cvar_t	*com_instances;
 
 #if idx64
 	int (*Q_VMftol)(void);
@@ -110,6 +113,8 @@ int		time_frontend;		// renderer frontend time
 int		time_backend;		// renderer backend time
 
 int			com_frameTime;
+static int64_t	com_frameUsec;			// dedicated: Sys_Microseconds at the start of the frame
+static int		com_frameUsecResidual;	// dedicated: elapsed usec not yet handed to the server
 int			com_frameNumber;
 
 qboolean	com_errorEntered = qfalse;
@@ -195,13 +200,15 @@ void QDECL Com_Printf( const char *fmt, ... ) {
 		if ( !logfile && FS_Initialized() && !opening_qconsole) {
 			struct tm *newtime;
 			time_t aclock;
+			char logName[MAX_QPATH];
 
       opening_qconsole = qtrue;
 
 			time( &aclock );
 			newtime = localtime( &aclock );
 
-			logfile = FS_FOpenFileWrite( "qconsole.log" );
+			Com_InstanceFileName( "qconsole.log", logName, sizeof( logName ) );
+			logfile = FS_FOpenFileWrite( logName );
 			
 			if(logfile)
 			{
@@ -270,6 +277,11 @@ void QDECL Com_Error( int code, const char *fmt, ... ) {
 
 	com_errorEntered = qtrue;
 
+	// an error between NET_BeginSendBatch and NET_FlushSendBatch would
+	// leave the batch open, holding back the shutdown messages and every
+	// packet after them
+	NET_FlushSendBatch();
+
 	Cvar_Set("com_errorCode", va("%i", code));
 
 	// when we are running automated scripts, make sure we
@@ -2174,8 +2186,11 @@ int Com_EventLoop( void ) {
 		// if no more events are available
 		if ( ev.evType == SE_NONE ) {
 			// manually send packet events for the loopback channel
+			// Netchan_Process can point buf at a reassembled message,
+			// so it is set up again for every packet
 			while ( NET_GetLoopPacket( NS_CLIENT, &evFrom, &buf ) ) {
 				CL_PacketEvent( evFrom, &buf );
+				MSG_Init( &buf, bufData, sizeof( bufData ) );
 			}
 
 			while ( NET_GetLoopPacket( NS_SERVER, &evFrom, &buf ) ) {
@@ -2183,6 +2198,7 @@ int Com_EventLoop( void ) {
 				if ( com_sv_running->integer ) {
 					Com_RunAndTimeServerPacket( &evFrom, &buf );
 				}
+				MSG_Init( &buf, bufData, sizeof( bufData ) );
 			}
 
 			return ev.evTime;
@@ -2633,6 +2649,84 @@ static void Com_InitRand(void)
 		srand(time(NULL));
 }
 
+#define MAX_INSTANCES	64
+
+/*
+=================
+Com_InstanceFileName
+
+With com_instances every instance writes its own files, named after the
+shared one with the instance number before the extension
+=================
+*/
+void Com_InstanceFileName( const char *name, char *out, int outSize ) {
+	char		base[MAX_OSPATH];
+	const char	*ext;
+
+	if ( instanceNum < 0 ) {
+		Q_strncpyz( out, name, outSize );
+		return;
+	}
+
+	ext = COM_GetExtension( name );
+	COM_StripExtension( name, base, sizeof( base ) );
+
+	if ( *ext ) {
+		Com_sprintf( out, outSize, "%s%i.%s", base, instanceNum, ext );
+	} else {
+		Com_sprintf( out, outSize, "%s%i", base, instanceNum );
+	}
+}
+
+/*
+=================
+Com_StartInstances
+
+Runs com_instances dedicated servers from a single start. The other
+instances are forked once the filesystem, botlib and virtual machine
+setup is done, so they share that memory until they write to it.
+Instance N listens on net_port + N and net_port6 + N.
+
+Returns the instance number of this process, or -1 with a single server
+=================
+*/
+static int Com_StartInstances( void ) {
+	cvar_t	*port;
+	int		instance;
+
+	com_instances = Cvar_Get( "com_instances", "1", CVAR_INIT );
+	Cvar_CheckRange( com_instances, 1, MAX_INSTANCES, qtrue );
+
+	if ( !com_dedicated->integer || com_instances->integer < 2 ) {
+		return -1;
+	}
+
+	instance = Sys_StartInstances( com_instances->integer );
+	Cvar_Get( "com_instance", va( "%i", instance ), CVAR_ROM );
+	instanceNum = instance;
+
+	// a log opened before the fork is shared, the next print opens this
+	// instance's own
+	if ( logfile ) {
+		FS_FCloseFile( logfile );
+		logfile = 0;
+	}
+
+	if ( instance > 0 ) {
+		// don't share the random sequence with the first instance
+		Com_InitRand();
+
+		port = Cvar_Get( "net_port", va( "%i", PORT_SERVER ), CVAR_LATCH );
+		Cvar_Set2( "net_port", va( "%i", port->integer + instance ), qtrue );
+		port = Cvar_Get( "net_port6", va( "%i", PORT_SERVER ), CVAR_LATCH );
+		Cvar_Set2( "net_port6", va( "%i", port->integer + instance ), qtrue );
+	}
+
+	Com_Printf( "Server instance %i of %i\n", instance, com_instances->integer );
+
+	return instance;
+}
+
 /*
 =================
 Com_Init
@@ -2641,6 +2735,7 @@ Com_Init
 void Com_Init( char *commandLine ) {
 	char	*s;
 	int	qport;
+	int	instance;
 
 	Com_Printf( "%s %s %s\n", Q3_VERSION, PLATFORM_STRING, __DATE__ );
 
@@ -2760,6 +2855,8 @@ void Com_Init( char *commandLine ) {
 	com_maxfpsMinimized = Cvar_Get( "com_maxfpsMinimized", "0", CVAR_ARCHIVE );
 	com_abnormalExit = Cvar_Get( "com_abnormalExit", "0", CVAR_ROM );
 	com_busyWait = Cvar_Get("com_busyWait", "0", CVAR_ARCHIVE);
+	com_busyWaitUsec = Cvar_Get("com_busyWaitUsec", "0", CVAR_ARCHIVE);
+	Cvar_CheckRange(com_busyWaitUsec, 0, 2000, qtrue);
 	Cvar_Get("com_errorMessage", "", CVAR_ROM | CVAR_NORESTART);
 
 	in_numpadbug = Cvar_Get("in_numpadbug", "0", CVAR_ARCHIVE);
@@ -2806,10 +2903,13 @@ void Com_Init( char *commandLine ) {
 	CL_Init();
 #endif
 
+	instance = Com_StartInstances();
+
 	// set com_frameTime so that if a map is started on the
 	// command line it will still be able to count on com_frameTime
 	// being random enough for a serverid
 	com_frameTime = Com_Milliseconds();
+	com_frameUsec = Sys_Microseconds();
 
 	// add + commands from command line
 	if ( !Com_AddStartupCommands() ) {
@@ -2823,6 +2923,18 @@ void Com_Init( char *commandLine ) {
 		}
 	}
 
+	// each instance has its own map and settings on top of the command line,
+	// and saves its archived cvars apart from the shared config
+	if ( instance >= 0 ) {
+		char	configName[MAX_QPATH];
+
+		Com_InstanceFileName( Q3CONFIG_CFG, configName, sizeof( configName ) );
+		if ( FS_FileExists( configName ) ) {
+			Cbuf_AddText( va( "exec %s\n", configName ) );
+		}
+		Cbuf_AddText( va( "exec instance%i.cfg\n", instance ) );
+	}
+
 	// start in full screen ui mode
 	Cvar_Set("r_uiFullScreen", "1");
 
@@ -2848,7 +2960,10 @@ void Com_Init( char *commandLine ) {
 	com_pipefile = Cvar_Get( "com_pipefile", "", CVAR_ARCHIVE|CVAR_LATCH );
 	if( com_pipefile->string[0] )
 	{
-		pipefile = FS_FCreateOpenPipeFile( com_pipefile->string );
+		if( instance > 0 )
+			pipefile = FS_FCreateOpenPipeFile( va( "%s%i", com_pipefile->string, instance ) );
+		else
+			pipefile = FS_FCreateOpenPipeFile( com_pipefile->string );
 	}
 
 	Com_Printf ("--- Common Initialization Complete ---\n");
@@ -2931,6 +3046,7 @@ Writes key bindings and archived cvars to config file if modified
 ===============
 */
 void Com_WriteConfiguration( void ) {
+	char	configName[MAX_QPATH];
 #if !defined(DEDICATED) && !defined(STANDALONE)
 	cvar_t	*fs;
 #endif
@@ -2945,7 +3061,8 @@ void Com_WriteConfiguration( void ) {
 	}
 	cvar_modifiedFlags &= ~CVAR_ARCHIVE;
 
-	Com_WriteConfigToFile( Q3CONFIG_CFG );
+	Com_InstanceFileName( Q3CONFIG_CFG, configName, sizeof( configName ) );
+	Com_WriteConfigToFile( configName );
 
 	// not needed for dedicated or standalone
 #if !defined(DEDICATED) && !defined(STANDALONE)
@@ -3055,6 +3172,66 @@ int Com_TimeVal(int minMsec)
 	return timeVal;
 }
 
+/*
+=================
+Com_ServerFrameWait
+
+Sleeps until the next server frame is due, to the microsecond, sending
+queued packets meanwhile.  The last com_busyWaitUsec microseconds are
+polled for rather than slept, as waking up from a sleep is late by a
+few dozen microseconds.
+=================
+*/
+static void Com_ServerFrameWait(void)
+{
+	int64_t	deadline, wait, timeValSV;
+
+	deadline = com_frameUsec + SV_FrameUsec() - com_frameUsecResidual;
+
+	while(1)
+	{
+		if(com_sv_running->integer)
+			timeValSV = SV_SendQueuedPackets();
+		else
+			timeValSV = INT_MAX;
+
+		wait = deadline - Sys_Microseconds();
+		if(wait <= 0)
+			break;
+
+		if(timeValSV * 1000 < wait)
+			wait = timeValSV * 1000;
+
+		if(com_busyWait->integer || wait <= com_busyWaitUsec->integer)
+			NET_SleepUsec(0);
+		else
+			NET_SleepUsec(wait - com_busyWaitUsec->integer);
+	}
+}
+
+/*
+=================
+Com_ServerFrameMsec
+
+Milliseconds since the last frame, from the microsecond clock so that the
+fractions add up instead of being lost
+=================
+*/
+static int Com_ServerFrameMsec(void)
+{
+	int64_t	now;
+	int		msec;
+
+	now = Sys_Microseconds();
+	com_frameUsecResidual += now - com_frameUsec;
+	com_frameUsec = now;
+
+	msec = com_frameUsecResidual / 1000;
+	com_frameUsecResidual -= msec * 1000;
+
+	return msec;
+}
+
 /*
 =================
 Com_Frame
@@ -3094,59 +3271,66 @@ void Com_Frame( void ) {
 	}
 
 	// Figure out how much time we have
-	if(!com_timedemo->integer)
+	if(CL_VideoOffline())
+		minMsec = 0;
+	else if(com_dedicated->integer)
+		minMsec = 0;		// waits in Com_ServerFrameWait instead
+	else if(!com_timedemo->integer)
 	{
-		if(com_dedicated->integer)
-			minMsec = SV_FrameMsec();
+		if(com_minimized->integer && com_maxfpsMinimized->integer > 0)
+			minMsec = 1000 / com_maxfpsMinimized->integer;
+		else if(com_unfocused->integer && com_maxfpsUnfocused->integer > 0)
+			minMsec = 1000 / com_maxfpsUnfocused->integer;
+		else if(com_maxfps->integer > 0)
+			minMsec = 1000 / com_maxfps->integer;
 		else
-		{
-			if(com_minimized->integer && com_maxfpsMinimized->integer > 0)
-				minMsec = 1000 / com_maxfpsMinimized->integer;
-			else if(com_unfocused->integer && com_maxfpsUnfocused->integer > 0)
-				minMsec = 1000 / com_maxfpsUnfocused->integer;
-			else if(com_maxfps->integer > 0)
-				minMsec = 1000 / com_maxfps->integer;
-			else
-				minMsec = 1;
-			
-			timeVal = com_frameTime - lastTime;
-			bias += timeVal - minMsec;
-			
-			if(bias > minMsec)
-				bias = minMsec;
-			
-			// Adjust minMsec if previous frame took too long to render so
-			// that framerate is stable at the requested value.
-			minMsec -= bias;
-		}
+			minMsec = 1;
+		
+		timeVal = com_frameTime - lastTime;
+		bias += timeVal - minMsec;
+		
+		if(bias > minMsec)
+			bias = minMsec;
+		
+		// Adjust minMsec if previous frame took too long to render so
+		// that framerate is stable at the requested value.
+		minMsec -= bias;
 	}
 	else
 		minMsec = 1;
 
-	do
+	if(com_dedicated->integer)
+		Com_ServerFrameWait();
+	else
 	{
-		if(com_sv_running->integer)
+		do
 		{
-			timeValSV = SV_SendQueuedPackets();
-			
-			timeVal = Com_TimeVal(minMsec);
+			if(com_sv_running->integer)
+			{
+				timeValSV = SV_SendQueuedPackets();
+				
+				timeVal = Com_TimeVal(minMsec);
 
-			if(timeValSV < timeVal)
-				timeVal = timeValSV;
-		}
-		else
-			timeVal = Com_TimeVal(minMsec);
-		
-		if(com_busyWait->integer || timeVal < 1)
-			NET_Sleep(0);
-		else
-			NET_Sleep(timeVal - 1);
-	} while(Com_TimeVal(minMsec));
+				if(timeValSV < timeVal)
+					timeVal = timeValSV;
+			}
+			else
+				timeVal = Com_TimeVal(minMsec);
+			
+			if(com_busyWait->integer || timeVal < 1)
+				NET_Sleep(0);
+			else
+				NET_Sleep(timeVal - 1);
+		} while(Com_TimeVal(minMsec));
+	}
 	
 	lastTime = com_frameTime;
 	com_frameTime = Com_EventLoop();
 	
-	msec = com_frameTime - lastTime;
+	if(com_dedicated->integer)
+		msec = Com_ServerFrameMsec();
+	else
+		msec = com_frameTime - lastTime;
 
 	Cbuf_Execute ();
 
@@ -3446,6 +3630,24 @@ void Field_CompleteFilename( const char *dir,
 		FS_FilenameCompletion( dir, ext, stripExt, PrintMatches, allowNonPureFilesOnDisk );
 }
 
+/*
+===============
+Field_CompleteList
+
+Completes against the names the list function passes to its callback
+===============
+*/
+void Field_CompleteList( void (*list)( void (*callback)( const char *s ) ) )
+{
+	matchCount = 0;
+	shortestMatch[ 0 ] = 0;
+
+	list( FindMatches );
+
+	if( !Field_Complete( ) )
+		list( PrintMatches );
+}
+
 /*
 ===============
 Field_CompleteCommand
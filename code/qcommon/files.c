@@ -962,6 +962,10 @@ fileHandle_t FS_FCreateOpenPipeFile( const char *filename ) {
 
 	FS_CheckFilenameIsNotExecutable( ospath, __func__ );
 
+	if( FS_CreatePath( ospath ) ) {
+		return 0;
+	}
+
 	fifo = Sys_Mkfifo( ospath );
 	if( fifo ) {
 		fsh[f].handleFiles.file.o = fifo;
@@ -969,14 +973,97 @@ fileHandle_t FS_FCreateOpenPipeFile( const char *filename ) {
 	}
 	else
 	{
-		Com_Printf( S_COLOR_YELLOW "WARNING: Could not create new com_pipefile at %s. "
-			"com_pipefile will not be used.\n", ospath );
+		Com_Printf( S_COLOR_YELLOW "WARNING: Could not create new pipe file at %s.\n", ospath );
 		f = 0;
 	}
 
 	return f;
 }
 
+/*
+===========
+FS_CreatePipeFile
+
+Creates a named pipe for streaming output. Nothing is opened until a reader
+shows up, see FS_FOpenPipeWrite.
+===========
+*/
+qboolean FS_CreatePipeFile( const char *filename ) {
+	char	*ospath;
+
+	if ( !fs_searchpaths ) {
+		Com_Error( ERR_FATAL, "Filesystem call made without initialization" );
+	}
+
+	ospath = FS_BuildOSPath( fs_homepath->string, fs_gamedir, filename );
+
+	if ( fs_debug->integer ) {
+		Com_Printf( "FS_CreatePipeFile: %s\n", ospath );
+	}
+
+	FS_CheckFilenameIsNotExecutable( ospath, __func__ );
+
+	if( FS_CreatePath( ospath ) || !Sys_CreateFifo( ospath ) ) {
+		Com_Printf( S_COLOR_YELLOW "WARNING: Could not create new pipe file at %s.\n", ospath );
+		return qfalse;
+	}
+
+	return qtrue;
+}
+
+/*
+===========
+FS_FOpenPipeWrite
+
+Opens the write end of a pipe made by FS_CreatePipeFile. Returns 0 without
+waiting while no reader has the pipe open, so callers poll it once a frame.
+===========
+*/
+fileHandle_t FS_FOpenPipeWrite( const char *filename ) {
+	char			*ospath;
+	FILE			*fifo;
+	fileHandle_t	f;
+
+	if ( !fs_searchpaths ) {
+		Com_Error( ERR_FATAL, "Filesystem call made without initialization" );
+	}
+
+	ospath = FS_BuildOSPath( fs_homepath->string, fs_gamedir, filename );
+
+	fifo = Sys_FifoOpenWrite( ospath );
+	if( !fifo ) {
+		return 0;
+	}
+
+	f = FS_HandleForFile();
+	fsh[f].zipFile = qfalse;
+	fsh[f].handleFiles.file.o = fifo;
+	fsh[f].handleSync = qfalse;
+	Q_strncpyz( fsh[f].name, filename, sizeof( fsh[f].name ) );
+
+	return f;
+}
+
+/*
+===========
+FS_WritePipe
+
+Unbuffered write to a pipe opened by FS_FOpenPipeWrite. Without blocking it
+writes what fits and returns the count; -1 means the reader has gone away.
+===========
+*/
+int FS_WritePipe( const void *buffer, int len, fileHandle_t f, qboolean blocking ) {
+	if ( !fs_searchpaths ) {
+		Com_Error( ERR_FATAL, "Filesystem call made without initialization" );
+	}
+
+	if ( !f || !fsh[f].handleFiles.file.o ) {
+		return -1;
+	}
+
+	return Sys_FifoWrite( fsh[f].handleFiles.file.o, buffer, len, blocking );
+}
+
 /*
 ===========
 FS_FilenameCompare
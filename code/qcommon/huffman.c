@@ -29,14 +29,15 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 static int			bloc = 0;
 
+// the offset versions keep their position in *offset only, so that
+// messages can be written from several threads at once
 void	Huff_putBit( int bit, byte *fout, int *offset) {
-	bloc = *offset;
-	if ((bloc&7) == 0) {
-		fout[(bloc>>3)] = 0;
+	int b = *offset;
+	if ((b&7) == 0) {
+		fout[(b>>3)] = 0;
 	}
-	fout[(bloc>>3)] |= bit << (bloc&7);
-	bloc++;
-	*offset = bloc;
+	fout[(b>>3)] |= bit << (b&7);
+	*offset = b + 1;
 }
 
 int		Huff_getBloc(void)
@@ -50,12 +51,9 @@ void	Huff_setBloc(int _bloc)
 }
 
 int		Huff_getBit( byte *fin, int *offset) {
-	int t;
-	bloc = *offset;
-	t = (fin[(bloc>>3)] >> (bloc&7)) & 0x1;
-	bloc++;
-	*offset = bloc;
-	return t;
+	int b = *offset;
+	*offset = b + 1;
+	return (fin[(b>>3)] >> (b&7)) & 0x1;
 }
 
 /* Add a bit to the output file (buffered) */
@@ -280,9 +278,8 @@ int Huff_Receive (node_t *node, int *ch, byte *fin) {
 
 /* Get a symbol */
 void Huff_offsetReceive (node_t *node, int *ch, byte *fin, int *offset) {
-	bloc = *offset;
 	while (node && node->symbol == INTERNAL_NODE) {
-		if (get_bit(fin)) {
+		if (Huff_getBit(fin, offset)) {
 			node = node->right;
 		} else {
 			node = node->left;
@@ -294,7 +291,6 @@ void Huff_offsetReceive (node_t *node, int *ch, byte *fin, int *offset) {
 //		Com_Error(ERR_DROP, "Illegal tree!");
 	}
 	*ch = node->symbol;
-	*offset = bloc;
 }
 
 /* Send the prefix code for this node */
@@ -325,17 +321,307 @@ void Huff_transmit (huff_t *huff, int ch, byte *fout) {
 	}
 }
 
+static void offsetSend(node_t *node, node_t *child, byte *fout, int *offset) {
+	if (node->parent) {
+		offsetSend(node->parent, node, fout, offset);
+	}
+	if (child) {
+		Huff_putBit(node->right == child, fout, offset);
+	}
+}
+
 void Huff_offsetTransmit (huff_t *huff, int ch, byte *fout, int *offset) {
-	bloc = *offset;
-	send(huff->loc[ch], NULL, fout);
-	*offset = bloc;
+	offsetSend(huff->loc[ch], NULL, fout, offset);
+}
+
+/*
+=============================================================================
+
+Huff_Compress and Huff_Decompress build a new adaptive tree for every
+message.  They run the same algorithm as the huff_t code above, so the
+bitstream is unchanged, on flattened arrays instead: nodes are indexes,
+and the rank list is an array of nodes with their weights next to them,
+so the neighbours of a node are found and moved without pointer chasing.
+
+=============================================================================
+*/
+
+#define FHUFF_NODES		( HMAX * 2 + 1 )
+
+typedef struct {
+	int			numNodes;
+	int			numHeads;
+	int			numFreeHeads;
+	int			tree;
+	short		loc[HMAX+1];
+
+	short		left[FHUFF_NODES];
+	short		right[FHUFF_NODES];
+	short		parent[FHUFF_NODES];
+	short		symbol[FHUFF_NODES];
+	short		rank[FHUFF_NODES];
+	short		head[FHUFF_NODES];		// slot holding the highest ranked node of its weight
+
+	// the rank list, highest rank at 1 and NYT always last, with -1 on
+	// both ends so neighbours never need a bounds check
+	short		order[FHUFF_NODES+2];
+	int			weight[FHUFF_NODES+2];
+
+	short		heads[FHUFF_NODES];
+	short		freeHeads[FHUFF_NODES];
+} fhuff_t;
+
+// only used from the main thread, like bloc
+static byte		fhuffSeq[65536];
+
+static void FHuff_Init( fhuff_t *huff ) {
+	huff->numNodes = 1;
+	huff->numHeads = 0;
+	huff->numFreeHeads = 0;
+	Com_Memset( huff->loc, 0xff, sizeof( huff->loc ) );
+
+	// start with the NYT node only
+	huff->tree = huff->loc[NYT] = 0;
+	huff->left[0] = huff->right[0] = huff->parent[0] = -1;
+	huff->symbol[0] = NYT;
+	huff->rank[0] = 1;
+	huff->head[0] = -1;
+
+	huff->order[0] = -1;
+	huff->order[1] = 0;
+	huff->order[2] = -1;
+	huff->weight[0] = -1;
+	huff->weight[1] = 0;
+	huff->weight[2] = -1;
+}
+
+static ID_INLINE int FHuff_AllocHead( fhuff_t *huff ) {
+	if ( huff->numFreeHeads ) {
+		return huff->freeHeads[--huff->numFreeHeads];
+	}
+	return huff->numHeads++;
+}
+
+/* Swap the location of these two nodes in the tree, see swap */
+static void FHuff_Swap( fhuff_t *huff, int node1, int node2 ) {
+	int		par1, par2;
+
+	par1 = huff->parent[node1];
+	par2 = huff->parent[node2];
+
+	if ( par1 >= 0 ) {
+		if ( huff->left[par1] == node1 ) {
+			huff->left[par1] = node2;
+		} else {
+			huff->right[par1] = node2;
+		}
+	} else {
+		huff->tree = node2;
+	}
+
+	if ( par2 >= 0 ) {
+		if ( huff->left[par2] == node2 ) {
+			huff->left[par2] = node1;
+		} else {
+			huff->right[par2] = node1;
+		}
+	} else {
+		huff->tree = node1;
+	}
+
+	huff->parent[node1] = par2;
+	huff->parent[node2] = par1;
+}
+
+/* Swap these two nodes in the rank list */
+static ID_INLINE void FHuff_SwapList( fhuff_t *huff, int node1, int node2 ) {
+	int		rank1 = huff->rank[node1];
+	int		rank2 = huff->rank[node2];
+	int		weight1 = huff->weight[rank1];
+
+	huff->order[rank1] = node2;
+	huff->order[rank2] = node1;
+	huff->weight[rank1] = huff->weight[rank2];
+	huff->weight[rank2] = weight1;
+	huff->rank[node1] = rank2;
+	huff->rank[node2] = rank1;
+}
+
+/* Do the increments, see increment */
+static void FHuff_Increment( fhuff_t *huff, int node ) {
+	short	chain[FHUFF_NODES];
+	int		depth, r, w, lnode, parent;
+
+	for ( depth = 0 ; node >= 0 ; node = huff->parent[node] ) {
+		r = huff->rank[node];
+		w = huff->weight[r];
+
+		// move to the top of its block first
+		if ( huff->weight[r-1] == w ) {
+			lnode = huff->heads[huff->head[node]];
+			if ( lnode != huff->parent[node] ) {
+				FHuff_Swap( huff, lnode, node );
+			}
+			FHuff_SwapList( huff, lnode, node );
+			r = huff->rank[node];
+		}
+		huff->weight[r] = w + 1;
+		if ( huff->weight[r+1] == w ) {
+			// leave the block to the next one down
+			huff->heads[huff->head[node]] = huff->order[r+1];
+			if ( huff->weight[r-1] == w + 1 ) {
+				huff->head[node] = huff->head[huff->order[r-1]];
+			} else {
+				huff->head[node] = FHuff_AllocHead( huff );
+				huff->heads[huff->head[node]] = node;
+			}
+		} else if ( huff->weight[r-1] == w + 1 ) {
+			// the block is empty now
+			huff->freeHeads[huff->numFreeHeads++] = huff->head[node];
+			huff->head[node] = huff->head[huff->order[r-1]];
+		}
+		// otherwise the node was alone and stays alone, keeping its slot
+
+		chain[depth++] = node;
+	}
+
+	// the recursive version fixed up each rank after incrementing its
+	// parent, so walk back down; the root never had a parent
+	for ( depth -= 2 ; depth >= 0 ; depth-- ) {
+		node = chain[depth];
+		parent = huff->parent[node];
+		if ( huff->order[huff->rank[node] + 1] == parent ) {
+			FHuff_SwapList( huff, node, parent );
+			if ( huff->heads[huff->head[node]] == node ) {
+				huff->heads[huff->head[node]] = parent;
+			}
+		}
+	}
+}
+
+/* See Huff_addRef */
+static void FHuff_AddRef( fhuff_t *huff, byte ch ) {
+	int		nyt, tnode, tnode2, r;
+
+	if ( huff->loc[ch] >= 0 ) {
+		FHuff_Increment( huff, huff->loc[ch] );
+		return;
+	}
+
+	// first transmission of this symbol, the NYT node is replaced by a
+	// new internal node with the NYT and the symbol as its children,
+	// both new nodes are ranked right above the NYT
+	nyt = huff->loc[NYT];
+	r = huff->rank[nyt];
+	tnode = huff->numNodes;
+	tnode2 = huff->numNodes + 1;
+
+	huff->symbol[tnode2] = INTERNAL_NODE;
+	if ( huff->weight[r-1] == 1 ) {
+		huff->head[tnode2] = huff->head[huff->order[r-1]];
+	} else {
+		huff->head[tnode2] = FHuff_AllocHead( huff );
+		huff->heads[huff->head[tnode2]] = tnode2;
+	}
+
+	huff->symbol[tnode] = ch;
+	huff->head[tnode] = huff->head[tnode2];
+	huff->left[tnode] = huff->right[tnode] = -1;
+
+	huff->order[r] = tnode2;
+	huff->order[r+1] = tnode;
+	huff->order[r+2] = nyt;
+	huff->order[r+3] = -1;
+	huff->weight[r] = 1;
+	huff->weight[r+1] = 1;
+	huff->weight[r+2] = 0;
+	huff->weight[r+3] = -1;
+	huff->rank[tnode2] = r;
+	huff->rank[tnode] = r + 1;
+	huff->rank[nyt] = r + 2;
+	huff->numNodes += 2;
+
+	if ( huff->parent[nyt] >= 0 ) {
+		if ( huff->left[huff->parent[nyt]] == nyt ) {
+			huff->left[huff->parent[nyt]] = tnode2;
+		} else {
+			huff->right[huff->parent[nyt]] = tnode2;
+		}
+	} else {
+		huff->tree = tnode2;
+	}
+
+	huff->right[tnode2] = tnode;
+	huff->left[tnode2] = nyt;
+
+	huff->parent[tnode2] = huff->parent[nyt];
+	huff->parent[nyt] = huff->parent[tnode] = tnode2;
+
+	huff->loc[ch] = tnode;
+
+	FHuff_Increment( huff, huff->parent[tnode2] );
+}
+
+/* Send the prefix code for this node, root first */
+static void FHuff_Send( const fhuff_t *huff, int node, byte *fout, int *offset ) {
+	uint64_t	code;
+	byte		*out;
+	int			length, n;
+
+	// collect the code with its first bit lowest
+	code = 0;
+	for ( length = 0 ; huff->parent[node] >= 0 ; node = huff->parent[node] ) {
+		if ( length == 56 ) {
+			// deeper than any tree built from 64k symbols gets
+			Com_Error( ERR_DROP, "FHuff_Send: code too long" );
+		}
+		code = ( code << 1 ) | ( huff->right[huff->parent[node]] == node );
+		length++;
+	}
+
+	// add it to the last byte, which has nothing past the bits in it
+	out = fout + ( *offset >> 3 );
+	n = *offset & 7;
+	code = ( code << n ) | ( n ? out[0] : 0 );
+	*offset += length;
+	for ( length += n ; length > 0 ; length -= 8 ) {
+		*out++ = code;
+		code >>= 8;
+	}
+}
+
+/* Get a symbol */
+static int FHuff_Receive( const fhuff_t *huff, byte *fin, int size, int *offset ) {
+	const byte	*in;
+	unsigned	window;
+	int			node, n;
+
+	node = huff->tree;
+
+	// take the bits 24 at a time while they are inside the message
+	while ( ( *offset >> 3 ) + 4 <= size ) {
+		in = fin + ( *offset >> 3 );
+		window = ( in[0] | ( in[1] << 8 ) | ( in[2] << 16 ) | ( (unsigned)in[3] << 24 ) ) >> ( *offset & 7 );
+		for ( n = 0 ; n < 24 ; n++ ) {
+			if ( huff->symbol[node] != INTERNAL_NODE ) {
+				*offset += n;
+				return huff->symbol[node];
+			}
+			node = ( window >> n ) & 1 ? huff->right[node] : huff->left[node];
+		}
+		*offset += 24;
+	}
+
+	while ( huff->symbol[node] == INTERNAL_NODE ) {
+		node = Huff_getBit( fin, offset ) ? huff->right[node] : huff->left[node];
+	}
+	return huff->symbol[node];
 }
 
 void Huff_Decompress(msg_t *mbuf, int offset) {
-	int			ch, cch, i, j, size;
-	byte		seq[65536];
+	int			ch, cch, i, j, size, bit;
 	byte*		buffer;
-	huff_t		huff;
+	fhuff_t		huff;
 
 	size = mbuf->cursize - offset;
 	buffer = mbuf->data + offset;
@@ -344,84 +630,80 @@ void Huff_Decompress(msg_t *mbuf, int offset) {
 		return;
 	}
 
-	Com_Memset(&huff, 0, sizeof(huff_t));
-	// Initialize the tree & list with the NYT node 
-	huff.tree = huff.lhead = huff.ltail = huff.loc[NYT] = &(huff.nodeList[huff.blocNode++]);
-	huff.tree->symbol = NYT;
-	huff.tree->weight = 0;
-	huff.lhead->next = huff.lhead->prev = NULL;
-	huff.tree->parent = huff.tree->left = huff.tree->right = NULL;
+	FHuff_Init( &huff );
 
 	cch = buffer[0]*256 + buffer[1];
 	// don't overflow with bad messages
 	if ( cch > mbuf->maxsize - offset ) {
 		cch = mbuf->maxsize - offset;
 	}
-	bloc = 16;
+	bit = 16;
 
 	for ( j = 0; j < cch; j++ ) {
-		ch = 0;
 		// don't overflow reading from the messages
-		// FIXME: would it be better to have a overflow check in get_bit ?
-		if ( (bloc >> 3) > size ) {
-			seq[j] = 0;
+		if ( (bit >> 3) > size ) {
+			Com_Memset( fhuffSeq + j, 0, cch - j );
 			break;
 		}
-		Huff_Receive(huff.tree, &ch, buffer);				/* Get a character */
+		ch = FHuff_Receive( &huff, buffer, size, &bit );		/* Get a character */
 		if ( ch == NYT ) {								/* We got a NYT, get the symbol associated with it */
 			ch = 0;
 			for ( i = 0; i < 8; i++ ) {
-				ch = (ch<<1) + get_bit(buffer);
+				ch = (ch<<1) + Huff_getBit( buffer, &bit );
 			}
 		}
     
-		seq[j] = ch;									/* Write symbol */
+		fhuffSeq[j] = ch;								/* Write symbol */
 
-		Huff_addRef(&huff, (byte)ch);								/* Increment node */
+		FHuff_AddRef( &huff, (byte)ch );				/* Increment node */
 	}
+	bloc = bit;
 	mbuf->cursize = cch + offset;
-	Com_Memcpy(mbuf->data + offset, seq, cch);
+	Com_Memcpy(mbuf->data + offset, fhuffSeq, cch);
 }
 
-extern 	int oldsize;
-
 void Huff_Compress(msg_t *mbuf, int offset) {
-	int			i, ch, size;
-	byte		seq[65536];
+	int			i, j, ch, size, bit;
 	byte*		buffer;
-	huff_t		huff;
+	fhuff_t		huff;
 
 	size = mbuf->cursize - offset;
-	buffer = mbuf->data+ + offset;
+	buffer = mbuf->data + offset;
 
 	if (size<=0) {
 		return;
 	}
 
-	Com_Memset(&huff, 0, sizeof(huff_t));
-	// Add the NYT (not yet transmitted) node into the tree/list */
-	huff.tree = huff.lhead = huff.loc[NYT] =  &(huff.nodeList[huff.blocNode++]);
-	huff.tree->symbol = NYT;
-	huff.tree->weight = 0;
-	huff.lhead->next = huff.lhead->prev = NULL;
-	huff.tree->parent = huff.tree->left = huff.tree->right = NULL;
-	huff.loc[NYT] = huff.tree;
+	FHuff_Init( &huff );
 
-	seq[0] = (size>>8);
-	seq[1] = size&0xff;
+	fhuffSeq[0] = (size>>8);
+	fhuffSeq[1] = size&0xff;
 
-	bloc = 16;
+	bit = 16;
 
 	for (i=0; i<size; i++ ) {
 		ch = buffer[i];
-		Huff_transmit(&huff, ch, seq);						/* Transmit symbol */
-		Huff_addRef(&huff, (byte)ch);								/* Do update */
+		if ( huff.loc[ch] < 0 ) {
+			/* not transmitted yet, send a NYT, then the symbol */
+			FHuff_Send( &huff, huff.loc[NYT], fhuffSeq, &bit );
+			for ( j = 7; j >= 0; j-- ) {
+				Huff_putBit( (ch >> j) & 0x1, fhuffSeq, &bit );
+			}
+		} else {
+			FHuff_Send( &huff, huff.loc[ch], fhuffSeq, &bit );
+		}
+		FHuff_AddRef( &huff, (byte)ch );				/* Do update */
+	}
+
+	// the byte after the last bit is sent as well, keep it clear
+	if ( !( bit & 7 ) ) {
+		fhuffSeq[bit>>3] = 0;
 	}
 
-	bloc += 8;												// next byte
+	bloc = bit + 8;											// next byte
 
 	mbuf->cursize = (bloc>>3) + offset;
-	Com_Memcpy(mbuf->data+offset, seq, (bloc>>3));
+	Com_Memcpy(mbuf->data+offset, fhuffSeq, (bloc>>3));
 }
 
 void Huff_Init(huffman_t *huff) {
@@ -22,10 +22,28 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "q_shared.h"
 #include "qcommon.h"
 
+#if idx64
+#include <emmintrin.h>
+#endif
+
 static huffman_t		msgHuff;
 
 static qboolean			msgInit = qfalse;
 
+// msgHuff never changes after MSG_initHuffman, so its codes are compiled
+// into tables that write or read a whole symbol at once.  Codes are kept
+// in the order their bits are sent, the first one in the lowest bit.
+#define HUFF_LOOKUP_BITS	11
+#define HUFF_LOOKUP_MASK	( ( 1 << HUFF_LOOKUP_BITS ) - 1 )
+
+static unsigned int		msgHuffCode[256];
+static byte				msgHuffLength[256];
+
+// symbol | length << 9 for codes of up to HUFF_LOOKUP_BITS bits, or 0 for
+// longer ones, which are read on from the node in msgHuffLongNode
+static unsigned short	msgHuffLookup[1 << HUFF_LOOKUP_BITS];
+static node_t			*msgHuffLongNode[1 << HUFF_LOOKUP_BITS];
+
 int pcount[256];
 
 /*
@@ -37,8 +55,6 @@ Handles byte ordering and avoids alignment errors
 ==============================================================================
 */
 
-int oldsize = 0;
-
 void MSG_initHuffman( void );
 
 void MSG_Init( msg_t *buf, byte *data, int length ) {
@@ -101,15 +117,27 @@ bit functions
 =============================================================================
 */
 
-int	overflows;
+/*
+============
+MSG_DeferError
+
+Messages written off the main thread must not call Com_Error. Their first
+error is kept for the owner to raise, and nothing more is written.
+============
+*/
+static void MSG_DeferError( msg_t *msg, const char *error ) {
+	if ( !msg->error ) {
+		msg->error = error;
+	}
+	msg->overflowed = qtrue;
+	msg->cursize = msg->maxsize;
+}
 
 // negative bit values include signs
 void MSG_WriteBits( msg_t *msg, int value, int bits ) {
 	int	i;
 //	FILE*	fp;
 
-	oldsize += bits;
-
 	// this isn't an exact overflow check, but close enough
 	if ( msg->maxsize - msg->cursize < 4 ) {
 		msg->overflowed = qtrue;
@@ -117,25 +145,13 @@ void MSG_WriteBits( msg_t *msg, int value, int bits ) {
 	}
 
 	if ( bits == 0 || bits < -31 || bits > 32 ) {
+		if ( msg->deferErrors ) {
+			MSG_DeferError( msg, "MSG_WriteBits: bad bits" );
+			return;
+		}
 		Com_Error( ERR_DROP, "MSG_WriteBits: bad bits %i", bits );
 	}
 
-	// check for overflows
-	if ( bits != 32 ) {
-		if ( bits > 0 ) {
-			if ( value > ( ( 1 << bits ) - 1 ) || value < 0 ) {
-				overflows++;
-			}
-		} else {
-			int	r;
-
-			r = 1 << (bits-1);
-
-			if ( value >  r - 1 || value < -r ) {
-				overflows++;
-			}
-		}
-	}
 	if ( bits < 0 ) {
 		bits = -bits;
 	}
@@ -160,38 +176,135 @@ void MSG_WriteBits( msg_t *msg, int value, int bits ) {
 			msg->cursize += 4;
 			msg->bit += 32;
 		}
+		else if ( msg->deferErrors )
+			MSG_DeferError( msg, "MSG_WriteBits: can't write OOB bits" );
 		else 
 			Com_Error(ERR_DROP, "can't write %d bits", bits);
 	} else {
-//		fp = fopen("c:\\netchan.bin", "a");
+		uint64_t	acc;
+		byte		*out;
+		int			n, sent;
+
 		value &= (0xffffffff>>(32-bits));
+
+		// collect the bits in acc, on top of the ones already in the
+		// last byte, and store all of them at once
+		out = msg->data + ( msg->bit >> 3 );
+		n = msg->bit & 7;
+		acc = n ? out[0] : 0;
+		sent = 0;
+
+		// the odd bits are sent as they are, whole bytes huffman coded
 		if (bits&7) {
 			int nbits;
 			nbits = bits&7;
-			for(i=0;i<nbits;i++) {
-				Huff_putBit((value&1), msg->data, &msg->bit);
-				value = (value>>1);
-			}
+			acc |= (uint64_t)( value & ( ( 1 << nbits ) - 1 ) ) << n;
+			n += nbits;
+			sent += nbits;
+			value = (value>>nbits);
 			bits = bits - nbits;
 		}
-		if (bits) {
-			for(i=0;i<bits;i+=8) {
-//				fwrite(bp, 1, 1, fp);
-				Huff_offsetTransmit (&msgHuff.compressor, (value&0xff), msg->data, &msg->bit);
-				value = (value>>8);
+		for ( i = 0 ; i < bits ; i += 8 ) {
+			acc |= (uint64_t)msgHuffCode[value & 0xff] << n;
+			n += msgHuffLength[value & 0xff];
+			sent += msgHuffLength[value & 0xff];
+			value = (value>>8);
+			if ( n >= 32 ) {
+				out[0] = acc;
+				out[1] = acc >> 8;
+				out[2] = acc >> 16;
+				out[3] = acc >> 24;
+				out += 4;
+				acc >>= 32;
+				n -= 32;
 			}
 		}
+		// the bits past the end of the message are left clear
+		for ( ; n > 0 ; n -= 8 ) {
+			*out++ = acc;
+			acc >>= 8;
+		}
+
+		msg->bit += sent;
 		msg->cursize = (msg->bit>>3)+1;
-//		fclose(fp);
 	}
 }
 
+/*
+============
+MSG_WriteEncoded
+
+Huffman codes are not affected by what was written before them, so the
+bits of a message that was written from bit 0 on can be copied to the
+end of another one, giving the same result as writing its contents there.
+Both messages must be bitstreams.
+============
+*/
+void MSG_WriteEncoded( msg_t *msg, const msg_t *src ) {
+	byte	*out;
+	int		bytes, shift, carry;
+	int		i;
+
+	bytes = ( src->bit + 7 ) >> 3;
+
+	if ( src->overflowed || msg->maxsize - msg->cursize < bytes + 4 ) {
+		msg->overflowed = qtrue;
+		return;
+	}
+
+	if ( !src->bit ) {
+		return;
+	}
+
+	out = msg->data + ( msg->bit >> 3 );
+	shift = msg->bit & 7;
+
+	if ( !shift ) {
+		Com_Memcpy( out, src->data, bytes );
+	} else {
+		// the bits past the end of a message are always clear
+		carry = out[0] & ( ( 1 << shift ) - 1 );
+		for ( i = 0 ; i < bytes ; i++ ) {
+			out[i] = carry | ( src->data[i] << shift );
+			carry = src->data[i] >> ( 8 - shift );
+		}
+		out[bytes] = carry;
+	}
+
+	msg->bit += src->bit;
+	msg->cursize = ( msg->bit >> 3 ) + 1;
+}
+
+/*
+============
+MSG_CanPeek
+
+True if the three bytes MSG_PeekBits reads are inside the buffer
+============
+*/
+static ID_INLINE qboolean MSG_CanPeek( const msg_t *msg ) {
+	return ( msg->bit >> 3 ) + 2 < msg->maxsize;
+}
+
+/*
+============
+MSG_PeekBits
+
+Returns at least the next 17 bits without consuming them
+============
+*/
+static ID_INLINE unsigned int MSG_PeekBits( const msg_t *msg ) {
+	const byte	*in;
+
+	in = msg->data + ( msg->bit >> 3 );
+	return ( in[0] | ( in[1] << 8 ) | ( in[2] << 16 ) ) >> ( msg->bit & 7 );
+}
+
 int MSG_ReadBits( msg_t *msg, int bits ) {
 	int			value;
 	int			get;
 	qboolean	sgn;
 	int			i, nbits;
-//	FILE*	fp;
 
 	value = 0;
 
@@ -230,19 +343,34 @@ int MSG_ReadBits( msg_t *msg, int bits ) {
 		nbits = 0;
 		if (bits&7) {
 			nbits = bits&7;
-			for(i=0;i<nbits;i++) {
-				value |= (Huff_getBit(msg->data, &msg->bit)<<i);
+			if ( MSG_CanPeek( msg ) ) {
+				value = MSG_PeekBits( msg ) & ( ( 1 << nbits ) - 1 );
+				msg->bit += nbits;
+			} else {
+				for(i=0;i<nbits;i++) {
+					value |= (Huff_getBit(msg->data, &msg->bit)<<i);
+				}
 			}
 			bits = bits - nbits;
 		}
-		if (bits) {
-//			fp = fopen("c:\\netchan.bin", "a");
-			for(i=0;i<bits;i+=8) {
+		for(i=0;i<bits;i+=8) {
+			if ( MSG_CanPeek( msg ) ) {
+				int		code, entry;
+
+				code = MSG_PeekBits( msg ) & HUFF_LOOKUP_MASK;
+				entry = msgHuffLookup[code];
+				if ( entry ) {
+					get = entry & 511;
+					msg->bit += entry >> 9;
+				} else {
+					msg->bit += HUFF_LOOKUP_BITS;
+					Huff_offsetReceive (msgHuffLongNode[code], &get, msg->data, &msg->bit);
+				}
+			} else {
+				// too close to the end of the buffer to look ahead
 				Huff_offsetReceive (msgHuff.decompressor.tree, &get, msg->data, &msg->bit);
-//				fwrite(&get, 1, 1, fp);
-				value |= (get<<(i+nbits));
 			}
-//			fclose(fp);
+			value |= (get<<(i+nbits));
 		}
 		msg->readcount = (msg->bit>>3)+1;
 	}
@@ -316,7 +444,9 @@ void MSG_WriteString( msg_t *sb, const char *s ) {
 
 		l = strlen( s );
 		if ( l >= MAX_STRING_CHARS ) {
-			Com_Printf( "MSG_WriteString: MAX_STRING_CHARS" );
+			if ( !sb->deferErrors ) {
+				Com_Printf( "MSG_WriteString: MAX_STRING_CHARS" );
+			}
 			MSG_WriteData (sb, "", 1);
 			return;
 		}
@@ -342,7 +472,9 @@ void MSG_WriteBigString( msg_t *sb, const char *s ) {
 
 		l = strlen( s );
 		if ( l >= BIG_INFO_STRING ) {
-			Com_Printf( "MSG_WriteString: BIG_INFO_STRING" );
+			if ( !sb->deferErrors ) {
+				Com_Printf( "MSG_WriteString: BIG_INFO_STRING" );
+			}
 			MSG_WriteData (sb, "", 1);
 			return;
 		}
@@ -749,7 +881,6 @@ void MSG_WriteDeltaUsercmdKey( msg_t *msg, int key, usercmd_t *from, usercmd_t *
 		from->buttons == to->buttons &&
 		from->weapon == to->weapon) {
 			MSG_WriteBits( msg, 0, 1 );				// no change
-			oldsize += 7;
 			return;
 	}
 	key ^= to->serverTime;
@@ -898,6 +1029,144 @@ netField_t	entityStateFields[] =
 #define	FLOAT_INT_BITS	13
 #define	FLOAT_INT_BIAS	(1<<(FLOAT_INT_BITS-1))
 
+/*
+=============================================================================
+
+delta change masks
+
+The delta writers start from a mask of the 32 bit words that differ
+between the two states, so only the fields that changed are looked at.
+The flag bits in between are collected and written in pieces of less
+than a byte, which are sent as they are, so the result is the same as
+writing them one at a time.
+
+=============================================================================
+*/
+
+#define ES_WORDS	( sizeof( entityState_t ) / 4 )
+#define PS_WORDS	( sizeof( playerState_t ) / 4 )
+#define PS_MASKS	( ( PS_WORDS + 63 ) / 64 )
+
+// field number + 1 of each word, 0 for words that aren't in the field list
+static byte		entityFieldOfWord[ES_WORDS];
+static byte		playerFieldOfWord[PS_WORDS];
+
+
+/*
+==================
+MSG_ChangedWords
+
+Sets a bit in mask for each 32 bit word that differs
+==================
+*/
+static void MSG_ChangedWords( const int *from, const int *to, int words, uint64_t *mask ) {
+	int		i;
+
+	Com_Memset( mask, 0, ( ( words + 63 ) >> 6 ) * sizeof( *mask ) );
+
+	i = 0;
+#if idx64
+	for ( ; i + 4 <= words ; i += 4 ) {
+		__m128i	a = _mm_loadu_si128( (const __m128i *)( from + i ) );
+		__m128i	b = _mm_loadu_si128( (const __m128i *)( to + i ) );
+		int		same = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32( a, b ) ) );
+
+		mask[i >> 6] |= (uint64_t)( same ^ 15 ) << ( i & 63 );
+	}
+#endif
+	for ( ; i < words ; i++ ) {
+		if ( from[i] != to[i] ) {
+			mask[i >> 6] |= (uint64_t)1 << ( i & 63 );
+		}
+	}
+}
+
+/*
+==================
+MSG_MaskBits
+
+Returns count <= 32 bits of a word mask from start on
+==================
+*/
+static int MSG_MaskBits( const uint64_t *mask, int start, int count ) {
+	uint64_t	bits;
+
+	bits = mask[start >> 6] >> ( start & 63 );
+	if ( ( start & 63 ) + count > 64 ) {
+		bits |= mask[( start >> 6 ) + 1] << ( 64 - ( start & 63 ) );
+	}
+	return (int)( bits & ( ( (uint64_t)1 << count ) - 1 ) );
+}
+
+static ID_INLINE int MSG_LowestBit( uint64_t mask ) {
+#ifdef __GNUC__
+	return __builtin_ctzll( mask );
+#else
+	int		i;
+
+	for ( i = 0 ; !( mask & 1 ) ; i++ ) {
+		mask >>= 1;
+	}
+	return i;
+#endif
+}
+
+// the number of fields up to and including the last changed one
+static ID_INLINE int MSG_LastField( uint64_t fields ) {
+#ifdef __GNUC__
+	return fields ? 64 - __builtin_clzll( fields ) : 0;
+#else
+	int		i;
+
+	for ( i = 0 ; fields ; i++ ) {
+		fields >>= 1;
+	}
+	return i;
+#endif
+}
+
+/*
+==================
+MSG_ChangedFields
+
+Turns a word mask into a mask of field numbers
+==================
+*/
+static uint64_t MSG_ChangedFields( const uint64_t *mask, int numMasks, const byte *fieldOfWord ) {
+	uint64_t	words, fields;
+	int			i, w;
+
+	fields = 0;
+	for ( i = 0 ; i < numMasks ; i++ ) {
+		for ( words = mask[i] ; words ; words &= words - 1 ) {
+			w = fieldOfWord[i * 64 + MSG_LowestBit( words )];
+			if ( w ) {
+				fields |= (uint64_t)1 << ( w - 1 );
+			}
+		}
+	}
+	return fields;
+}
+
+/*
+==================
+MSG_WriteFlags
+
+Writes the collected flag bits, first one lowest
+==================
+*/
+static void MSG_WriteFlags( msg_t *msg, uint64_t *flags, int *numFlags ) {
+	int		bits;
+
+	while ( *numFlags > 0 ) {
+		bits = *numFlags < 7 ? *numFlags : 7;
+		MSG_WriteBits( msg, (int)( *flags & ( ( 1 << bits ) - 1 ) ), bits );
+		*flags >>= bits;
+		*numFlags -= bits;
+	}
+	*flags = 0;
+}
+
 /*
 ==================
 MSG_WriteDeltaEntity
@@ -911,20 +1180,19 @@ identical, under the assumption that the in-order delta code will catch it.
 */
 void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entityState_s *to, 
 						   qboolean force ) {
-	int			i, lc;
-	int			numFields;
+	int			i, lc, next;
 	netField_t	*field;
 	int			trunc;
 	float		fullFloat;
-	int			*fromF, *toF;
-
-	numFields = ARRAY_LEN( entityStateFields );
+	int			*toF;
+	uint64_t	words, fields, flags;
+	int			numFlags;
 
 	// all fields should be 32 bits to avoid any compiler packing issues
 	// the "number" field is not part of the field list
 	// if this assert fails, someone added a field to the entityState_t
 	// struct without updating the message fields
-	assert( numFields + 1 == sizeof( *from )/4 );
+	assert( ARRAY_LEN( entityStateFields ) + 1 == sizeof( *from )/4 );
 
 	// a NULL to is a delta remove message
 	if ( to == NULL ) {
@@ -937,20 +1205,17 @@ void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entity
 	}
 
 	if ( to->number < 0 || to->number >= MAX_GENTITIES ) {
+		if ( msg->deferErrors ) {
+			MSG_DeferError( msg, "MSG_WriteDeltaEntity: Bad entity number" );
+			return;
+		}
 		Com_Error (ERR_FATAL, "MSG_WriteDeltaEntity: Bad entity number: %i", to->number );
 	}
 
-	lc = 0;
-	// build the change vector as bytes so it is endien independent
-	for ( i = 0, field = entityStateFields ; i < numFields ; i++, field++ ) {
-		fromF = (int *)( (byte *)from + field->offset );
-		toF = (int *)( (byte *)to + field->offset );
-		if ( *fromF != *toF ) {
-			lc = i+1;
-		}
-	}
+	MSG_ChangedWords( (int *)from, (int *)to, ES_WORDS, &words );
+	fields = MSG_ChangedFields( &words, 1, entityFieldOfWord );
 
-	if ( lc == 0 ) {
+	if ( !fields ) {
 		// nothing at all changed
 		if ( !force ) {
 			return;		// nothing at all
@@ -962,24 +1227,28 @@ void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entity
 		return;
 	}
 
+	lc = MSG_LastField( fields );
+
 	MSG_WriteBits( msg, to->number, GENTITYNUM_BITS );
 	MSG_WriteBits( msg, 0, 1 );			// not removed
 	MSG_WriteBits( msg, 1, 1 );			// we have a delta
 
 	MSG_WriteByte( msg, lc );	// # of changes
 
-	oldsize += numFields;
-
-	for ( i = 0, field = entityStateFields ; i < lc ; i++, field++ ) {
-		fromF = (int *)( (byte *)from + field->offset );
+	flags = 0;
+	numFlags = 0;
+	for ( next = 0 ; fields ; fields &= fields - 1 ) {
+		i = MSG_LowestBit( fields );
+		field = &entityStateFields[i];
 		toF = (int *)( (byte *)to + field->offset );
 
-		if ( *fromF == *toF ) {
-			MSG_WriteBits( msg, 0, 1 );	// no change
-			continue;
+		numFlags += i - next;	// no change for the ones in between
+		next = i + 1;
+		if ( numFlags > 56 ) {
+			MSG_WriteFlags( msg, &flags, &numFlags );
 		}
 
-		MSG_WriteBits( msg, 1, 1 );	// changed
+		flags |= (uint64_t)1 << numFlags++;	// changed
 
 		if ( field->bits == 0 ) {
 			// float
@@ -987,31 +1256,59 @@ void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entity
 			trunc = (int)fullFloat;
 
 			if (fullFloat == 0.0f) {
-					MSG_WriteBits( msg, 0, 1 );
-					oldsize += FLOAT_INT_BITS;
+					numFlags++;
 			} else {
-				MSG_WriteBits( msg, 1, 1 );
+				flags |= (uint64_t)1 << numFlags++;
 				if ( trunc == fullFloat && trunc + FLOAT_INT_BIAS >= 0 && 
 					trunc + FLOAT_INT_BIAS < ( 1 << FLOAT_INT_BITS ) ) {
 					// send as small integer
-					MSG_WriteBits( msg, 0, 1 );
+					numFlags++;
+					MSG_WriteFlags( msg, &flags, &numFlags );
 					MSG_WriteBits( msg, trunc + FLOAT_INT_BIAS, FLOAT_INT_BITS );
 				} else {
 					// send as full floating point value
-					MSG_WriteBits( msg, 1, 1 );
+					flags |= (uint64_t)1 << numFlags++;
+					MSG_WriteFlags( msg, &flags, &numFlags );
 					MSG_WriteBits( msg, *toF, 32 );
 				}
 			}
 		} else {
 			if (*toF == 0) {
-				MSG_WriteBits( msg, 0, 1 );
+				numFlags++;
 			} else {
-				MSG_WriteBits( msg, 1, 1 );
+				flags |= (uint64_t)1 << numFlags++;
+				MSG_WriteFlags( msg, &flags, &numFlags );
 				// integer
 				MSG_WriteBits( msg, *toF, field->bits );
 			}
 		}
 	}
+	MSG_WriteFlags( msg, &flags, &numFlags );
+}
+
+/*
+==================
+MSG_DeltaEntityIsValid
+
+Looks at the header of a delta entity without consuming it, so code
+reading untrusted files can give up instead of MSG_ReadDeltaEntity
+dropping to the console
+==================
+*/
+qboolean MSG_DeltaEntityIsValid( msg_t *msg ) {
+	msg_t	peek;
+	int		lc;
+
+	peek = *msg;
+
+	// removes and unchanged entities carry no field count
+	if ( MSG_ReadBits( &peek, 1 ) == 1 || MSG_ReadBits( &peek, 1 ) == 0 ) {
+		return qtrue;
+	}
+
+	lc = MSG_ReadByte( &peek );
+
+	return ( lc >= 0 && lc <= ARRAY_LEN( entityStateFields ) );
 }
 
 /*
@@ -1206,6 +1503,31 @@ netField_t	playerStateFields[] =
 { PSF(loopSound), 16 }
 };
 
+// the changed fields are kept in a 64 bit mask, which also keeps the
+// field numbers in the byte wide field-of-word tables, and the entity
+// words in a single one, so the lists can't grow past that
+#define MSG_STATIC_ASSERT( name, cond )	typedef char msgAssert_##name[ ( cond ) ? 1 : -1 ]
+
+MSG_STATIC_ASSERT( entityFields, ARRAY_LEN( entityStateFields ) <= 64 );
+MSG_STATIC_ASSERT( playerFields, ARRAY_LEN( playerStateFields ) <= 64 );
+MSG_STATIC_ASSERT( entityWords, ES_WORDS <= 64 );
+
+/*
+=============
+MSG_InitDeltaTables
+=============
+*/
+static void MSG_InitDeltaTables( void ) {
+	int		i;
+
+	for ( i = 0 ; i < ARRAY_LEN( entityStateFields ) ; i++ ) {
+		entityFieldOfWord[entityStateFields[i].offset / 4] = i + 1;
+	}
+	for ( i = 0 ; i < ARRAY_LEN( playerStateFields ) ; i++ ) {
+		playerFieldOfWord[playerStateFields[i].offset / 4] = i + 1;
+	}
+}
+
 /*
 =============
 MSG_WriteDeltaPlayerstate
@@ -1219,43 +1541,39 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct p
 	int				persistantbits;
 	int				ammobits;
 	int				powerupbits;
-	int				numFields;
 	netField_t		*field;
-	int				*fromF, *toF;
+	int				*toF;
 	float			fullFloat;
-	int				trunc, lc;
+	int				trunc, lc, next;
+	uint64_t		words[PS_MASKS], fields, flags;
+	int				numFlags;
 
 	if (!from) {
 		from = &dummy;
 		Com_Memset (&dummy, 0, sizeof(dummy));
 	}
 
-	numFields = ARRAY_LEN( playerStateFields );
+	MSG_ChangedWords( (int *)from, (int *)to, PS_WORDS, words );
+	fields = MSG_ChangedFields( words, PS_MASKS, playerFieldOfWord );
 
-	lc = 0;
-	for ( i = 0, field = playerStateFields ; i < numFields ; i++, field++ ) {
-		fromF = (int *)( (byte *)from + field->offset );
-		toF = (int *)( (byte *)to + field->offset );
-		if ( *fromF != *toF ) {
-			lc = i+1;
-		}
-	}
+	lc = MSG_LastField( fields );
 
 	MSG_WriteByte( msg, lc );	// # of changes
 
-	oldsize += numFields - lc;
-
-	for ( i = 0, field = playerStateFields ; i < lc ; i++, field++ ) {
-		fromF = (int *)( (byte *)from + field->offset );
+	flags = 0;
+	numFlags = 0;
+	for ( next = 0 ; fields ; fields &= fields - 1 ) {
+		i = MSG_LowestBit( fields );
+		field = &playerStateFields[i];
 		toF = (int *)( (byte *)to + field->offset );
 
-		if ( *fromF == *toF ) {
-			MSG_WriteBits( msg, 0, 1 );	// no change
-			continue;
+		numFlags += i - next;	// no change for the ones in between
+		next = i + 1;
+		if ( numFlags > 56 ) {
+			MSG_WriteFlags( msg, &flags, &numFlags );
 		}
 
-		MSG_WriteBits( msg, 1, 1 );	// changed
-//		pcount[i]++;
+		flags |= (uint64_t)1 << numFlags++;	// changed
 
 		if ( field->bits == 0 ) {
 			// float
@@ -1265,51 +1583,34 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct p
 			if ( trunc == fullFloat && trunc + FLOAT_INT_BIAS >= 0 && 
 				trunc + FLOAT_INT_BIAS < ( 1 << FLOAT_INT_BITS ) ) {
 				// send as small integer
-				MSG_WriteBits( msg, 0, 1 );
+				numFlags++;
+				MSG_WriteFlags( msg, &flags, &numFlags );
 				MSG_WriteBits( msg, trunc + FLOAT_INT_BIAS, FLOAT_INT_BITS );
 			} else {
 				// send as full floating point value
-				MSG_WriteBits( msg, 1, 1 );
+				flags |= (uint64_t)1 << numFlags++;
+				MSG_WriteFlags( msg, &flags, &numFlags );
 				MSG_WriteBits( msg, *toF, 32 );
 			}
 		} else {
 			// integer
+			MSG_WriteFlags( msg, &flags, &numFlags );
 			MSG_WriteBits( msg, *toF, field->bits );
 		}
 	}
+	MSG_WriteFlags( msg, &flags, &numFlags );
 
 
 	//
 	// send the arrays
 	//
-	statsbits = 0;
-	for (i=0 ; i<MAX_STATS ; i++) {
-		if (to->stats[i] != from->stats[i]) {
-			statsbits |= 1<<i;
-		}
-	}
-	persistantbits = 0;
-	for (i=0 ; i<MAX_PERSISTANT ; i++) {
-		if (to->persistant[i] != from->persistant[i]) {
-			persistantbits |= 1<<i;
-		}
-	}
-	ammobits = 0;
-	for (i=0 ; i<MAX_WEAPONS ; i++) {
-		if (to->ammo[i] != from->ammo[i]) {
-			ammobits |= 1<<i;
-		}
-	}
-	powerupbits = 0;
-	for (i=0 ; i<MAX_POWERUPS ; i++) {
-		if (to->powerups[i] != from->powerups[i]) {
-			powerupbits |= 1<<i;
-		}
-	}
+	statsbits = MSG_MaskBits( words, to->stats - (int *)to, MAX_STATS );
+	persistantbits = MSG_MaskBits( words, to->persistant - (int *)to, MAX_PERSISTANT );
+	ammobits = MSG_MaskBits( words, to->ammo - (int *)to, MAX_WEAPONS );
+	powerupbits = MSG_MaskBits( words, to->powerups - (int *)to, MAX_POWERUPS );
 
 	if (!statsbits && !persistantbits && !ammobits && !powerupbits) {
 		MSG_WriteBits( msg, 0, 1 );	// no change
-		oldsize += 4;
 		return;
 	}
 	MSG_WriteBits( msg, 1, 1 );	// changed
@@ -1762,6 +2063,48 @@ int msg_hData[256] = {
 13504,			// 255
 };
 
+/*
+============
+MSG_BuildHuffTables
+============
+*/
+static void MSG_BuildHuffTables( void ) {
+	node_t	*node;
+	int		i, length;
+
+	for ( i = 0 ; i < 256 ; i++ ) {
+		msgHuffCode[i] = 0;
+		msgHuffLength[i] = 0;
+		for ( node = msgHuff.compressor.loc[i] ; node && node->parent ; node = node->parent ) {
+			msgHuffCode[i] = ( msgHuffCode[i] << 1 ) | ( node->parent->right == node );
+			msgHuffLength[i]++;
+		}
+		if ( msgHuffLength[i] > 32 ) {
+			Com_Error( ERR_FATAL, "MSG_BuildHuffTables: code for %i too long", i );
+		}
+	}
+
+	for ( i = 0 ; i < ( 1 << HUFF_LOOKUP_BITS ) ; i++ ) {
+		node = msgHuff.decompressor.tree;
+		for ( length = 0 ; length < HUFF_LOOKUP_BITS ; ) {
+			if ( !node || node->symbol != INTERNAL_NODE ) {
+				break;
+			}
+			node = ( i >> length ) & 1 ? node->right : node->left;
+			length++;
+		}
+		if ( !node ) {
+			// same as Huff_offsetReceive on a broken tree
+			msgHuffLookup[i] = length << 9;
+		} else if ( node->symbol != INTERNAL_NODE ) {
+			msgHuffLookup[i] = node->symbol | ( length << 9 );
+		} else {
+			msgHuffLookup[i] = 0;
+			msgHuffLongNode[i] = node;
+		}
+	}
+}
+
 void MSG_initHuffman( void ) {
 	int i,j;
 
@@ -1773,6 +2116,8 @@ void MSG_initHuffman( void ) {
 			Huff_addRef(&msgHuff.decompressor,	(byte)i);			// Do update
 		}
 	}
+	MSG_BuildHuffTables();
+	MSG_InitDeltaTables();
 }
 
 /*
@@ -144,6 +144,7 @@ void Netchan_TransmitNextFragment( netchan_t *chan ) {
 	// Store send time and size of this packet for rate control
 	chan->lastSentTime = Sys_Milliseconds();
 	chan->lastSentSize = send.cursize;
+	chan->lastSentPackets = 1;
 
 	if ( showpackets->integer ) {
 		Com_Printf ("%s send %4i : s=%i fragment=%i,%i\n"
@@ -165,6 +166,37 @@ void Netchan_TransmitNextFragment( netchan_t *chan ) {
 	}
 }
 
+/*
+=================
+Netchan_TransmitFragments
+
+Called right after a fragment went out, sends the following ones as
+long as the whole burst stays within maxBytes.  lastSentSize and
+lastSentPackets cover the whole burst, so rate control charges for all
+of it.
+=================
+*/
+void Netchan_TransmitFragments( netchan_t *chan, int maxBytes ) {
+	int			sent, packets, next;
+
+	sent = chan->lastSentSize;
+	packets = chan->lastSentPackets;
+	while ( chan->unsentFragments ) {
+		next = chan->unsentLength - chan->unsentFragmentStart;
+		if ( next > FRAGMENT_SIZE ) {
+			next = FRAGMENT_SIZE;
+		}
+		if ( sent + next > maxBytes ) {
+			break;
+		}
+		Netchan_TransmitNextFragment( chan );
+		sent += chan->lastSentSize;
+		packets++;
+	}
+	chan->lastSentSize = sent;
+	chan->lastSentPackets = packets;
+}
+
 
 /*
 ===============
@@ -219,6 +251,7 @@ void Netchan_Transmit( netchan_t *chan, int length, const byte *data ) {
 	// Store send time and size of this packet for rate control
 	chan->lastSentTime = Sys_Milliseconds();
 	chan->lastSentSize = send.cursize;
+	chan->lastSentPackets = 1;
 
 	if ( showpackets->integer ) {
 		Com_Printf( "%s send %4i : s=%i ack=%i\n"
@@ -236,9 +269,9 @@ Netchan_Process
 Returns qfalse if the message should not be processed due to being
 out of order or a fragment.
 
-Msg must be large enough to hold MAX_MSGLEN, because if this is the
-final fragment of a multi-part message, the entire thing will be
-copied out.
+If this is the final fragment of a multi-part message, msg is pointed
+at the channel's assembly buffer instead of copying the whole message
+back, so msg has to be set up again before it takes the next packet.
 =================
 */
 qboolean Netchan_Process( netchan_t *chan, msg_t *msg ) {
@@ -356,7 +389,7 @@ qboolean Netchan_Process( netchan_t *chan, msg_t *msg ) {
 
 		// copy the fragment to the fragment buffer
 		if ( fragmentLength < 0 || msg->readcount + fragmentLength > msg->cursize ||
-			chan->fragmentLength + fragmentLength > sizeof( chan->fragmentBuffer ) ) {
+			chan->fragmentLength + fragmentLength > MAX_MSGLEN ) {
 			if ( showdrop->integer || showpackets->integer ) {
 				Com_Printf ("%s:illegal fragment length\n"
 				, NET_AdrToString (chan->remoteAddress ) );
@@ -364,7 +397,7 @@ qboolean Netchan_Process( netchan_t *chan, msg_t *msg ) {
 			return qfalse;
 		}
 
-		Com_Memcpy( chan->fragmentBuffer + chan->fragmentLength, 
+		Com_Memcpy( chan->fragmentBuffer + 4 + chan->fragmentLength, 
 			msg->data + msg->readcount, fragmentLength );
 
 		chan->fragmentLength += fragmentLength;
@@ -381,12 +414,13 @@ qboolean Netchan_Process( netchan_t *chan, msg_t *msg ) {
 			return qfalse;
 		}
 
-		// copy the full message over the partial fragment
+		// read the full message straight from the fragment buffer
 
 		// make sure the sequence number is still there
-		*(int *)msg->data = LittleLong( sequence );
+		*(int *)chan->fragmentBuffer = LittleLong( sequence );
 
-		Com_Memcpy( msg->data + 4, chan->fragmentBuffer, chan->fragmentLength );
+		msg->data = chan->fragmentBuffer;
+		msg->maxsize = sizeof( chan->fragmentBuffer );
 		msg->cursize = chan->fragmentLength + 4;
 		chan->fragmentLength = 0;
 		msg->readcount = 4;	// past the sequence number
@@ -20,6 +20,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 ===========================================================================
 */
 
+#ifdef __linux__
+#	define _GNU_SOURCE		// recvmmsg, sendmmsg
+#endif
+
 #include "../qcommon/q_shared.h"
 #include "../qcommon/qcommon.h"
 
@@ -81,6 +85,12 @@ static qboolean	winsockInitialized = qfalse;
 #		include <sys/filio.h>
 #	endif
 
+#	ifdef __linux__
+#		include <sys/epoll.h>
+#		include <sys/timerfd.h>
+#		define USE_NET_BATCH	// recvmmsg/sendmmsg and epoll
+#	endif
+
 typedef int SOCKET;
 #	define INVALID_SOCKET		-1
 #	define SOCKET_ERROR			-1
@@ -111,6 +121,8 @@ static cvar_t	*net_mcast6iface;
 
 static cvar_t	*net_dropsim;
 
+static cvar_t	*net_batch;
+
 static struct sockaddr	socksRelayAddr;
 
 static SOCKET	ip_socket = INVALID_SOCKET;
@@ -145,6 +157,31 @@ typedef struct
 static nip_localaddr_t localIP[MAX_IPS];
 static int numIP;
 
+#ifdef USE_NET_BATCH
+// packets moved per recvmmsg/sendmmsg call
+#define NET_BATCH_PACKETS	32
+#define NET_BATCH_BYTES		0x10000
+
+static int epoll_fd = -1;
+static int timer_fd = -1;		// wakes NET_SleepUsec between milliseconds
+
+static byte						recvData[NET_BATCH_PACKETS][MAX_MSGLEN + 1];
+static struct mmsghdr			recvHdr[NET_BATCH_PACKETS];
+static struct iovec				recvIov[NET_BATCH_PACKETS];
+static struct sockaddr_storage	recvFrom[NET_BATCH_PACKETS];
+
+// outgoing packets held between NET_BeginSendBatch and NET_FlushSendBatch
+static qboolean					sendBatchOpen;
+static qboolean					sendBatching;		// open and net_batch set
+static int						numSendQueued;
+static int						sendQueuedBytes;
+static byte						sendData[NET_BATCH_BYTES];
+static struct mmsghdr			sendHdr[NET_BATCH_PACKETS];
+static struct iovec				sendIov[NET_BATCH_PACKETS];
+static struct sockaddr_storage	sendTo[NET_BATCH_PACKETS];
+static SOCKET					sendSocket[NET_BATCH_PACKETS];
+#endif
+
 
 //=============================================================================
 
@@ -633,6 +670,116 @@ qboolean NET_GetPacket(netadr_t *net_from, msg_t *net_message, fd_set *fdr)
 
 //=============================================================================
 
+#ifdef USE_NET_BATCH
+/*
+==================
+NET_SendQueued
+
+Hands the queued packets to the kernel, one sendmmsg per run of
+packets on the same socket so they still go out in order
+==================
+*/
+static void NET_SendQueued( void ) {
+	int		start, end, sent;
+
+	start = 0;
+	while( start < numSendQueued ) {
+		for( end = start + 1; end < numSendQueued && sendSocket[end] == sendSocket[start]; end++ );
+
+		sent = sendmmsg( sendSocket[start], &sendHdr[start], end - start, 0 );
+		if( sent > 0 ) {
+			start += sent;
+			continue;
+		}
+
+		// sendmmsg stops at the first packet that failed, drop it like
+		// Sys_SendPacket would and carry on with the rest
+		if( socketError != EAGAIN ) {
+			Com_Printf( "NET_SendPacket: %s\n", NET_ErrorString() );
+		}
+		start++;
+	}
+
+	numSendQueued = 0;
+	sendQueuedBytes = 0;
+}
+
+/*
+==================
+NET_QueuePacket
+==================
+*/
+static void NET_QueuePacket( SOCKET sock, int length, const void *data, struct sockaddr_storage *addr ) {
+	int		i;
+
+	if( length > NET_BATCH_BYTES ) {
+		return;
+	}
+
+	if( numSendQueued == NET_BATCH_PACKETS || sendQueuedBytes + length > NET_BATCH_BYTES ) {
+		NET_SendQueued();
+	}
+
+	i = numSendQueued++;
+
+	memcpy( &sendData[sendQueuedBytes], data, length );
+	memcpy( &sendTo[i], addr, sizeof( sendTo[i] ) );
+	sendSocket[i] = sock;
+
+	sendIov[i].iov_base = &sendData[sendQueuedBytes];
+	sendIov[i].iov_len = length;
+
+	memset( &sendHdr[i], 0, sizeof( sendHdr[i] ) );
+	sendHdr[i].msg_hdr.msg_name = &sendTo[i];
+	sendHdr[i].msg_hdr.msg_namelen = addr->ss_family == AF_INET ?
+		sizeof( struct sockaddr_in ) : sizeof( struct sockaddr_in6 );
+	sendHdr[i].msg_hdr.msg_iov = &sendIov[i];
+	sendHdr[i].msg_hdr.msg_iovlen = 1;
+
+	sendQueuedBytes += length;
+}
+#endif
+
+/*
+==================
+NET_BeginSendBatch
+
+Holds back outgoing IP packets until NET_FlushSendBatch so they can be
+sent with a single system call.  Returns qfalse if a batch is already
+open, the caller then leaves flushing it to whoever opened it.
+==================
+*/
+qboolean NET_BeginSendBatch( void ) {
+#ifdef USE_NET_BATCH
+	if( sendBatchOpen ) {
+		return qfalse;
+	}
+	sendBatchOpen = qtrue;
+	sendBatching = net_batch && net_batch->integer;
+	return qtrue;
+#else
+	return qfalse;
+#endif
+}
+
+/*
+==================
+NET_FlushSendBatch
+
+Sends the held back packets and closes the batch, does nothing if
+there is none
+==================
+*/
+void NET_FlushSendBatch( void ) {
+#ifdef USE_NET_BATCH
+	if( numSendQueued ) {
+		NET_SendQueued();
+	}
+	sendBatchOpen = qfalse;
+	sendBatching = qfalse;
+#endif
+}
+
 static char socksBuf[4096];
 
 /*
@@ -661,6 +808,13 @@ void Sys_SendPacket( int length, const void *data, netadr_t to ) {
 	memset(&addr, 0, sizeof(addr));
 	NetadrToSockadr( &to, (struct sockaddr *) &addr );
 
+#ifdef USE_NET_BATCH
+	if( sendBatching && !usingSocks && ( to.type == NA_IP || to.type == NA_IP6 ) ) {
+		NET_QueuePacket( to.type == NA_IP ? ip_socket : ip6_socket, length, data, &addr );
+		return;
+	}
+#endif
+
 	if( usingSocks && to.type == NA_IP ) {
 		socksBuf[0] = 0;	// reserved
 		socksBuf[1] = 0;
@@ -989,6 +1143,32 @@ void NET_SetMulticast6(void)
 		curgroup.ipv6mr_interface = 0;
 }
 
+#ifdef USE_NET_BATCH
+/*
+====================
+NET_EpollWatch
+
+Adds or removes a socket opened after NET_OpenEpoll, such as a separate
+multicast socket
+====================
+*/
+static void NET_EpollWatch( SOCKET sock, qboolean watch ) {
+	struct epoll_event	ev;
+
+	if( epoll_fd == -1 || sock == INVALID_SOCKET ) {
+		return;
+	}
+
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = EPOLLIN;
+	ev.data.fd = sock;
+
+	if( epoll_ctl( epoll_fd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, sock, &ev ) == -1 ) {
+		Com_Printf( "WARNING: epoll_ctl: %s\n", NET_ErrorString() );
+	}
+}
+#endif
+
 /*
 ====================
 NET_JoinMulticast
@@ -1043,6 +1223,11 @@ void NET_JoinMulticast6(void)
 			return;
 		}
 	}
+
+#ifdef USE_NET_BATCH
+	if(multicast6_socket != ip6_socket)
+		NET_EpollWatch(multicast6_socket, qtrue);
+#endif
 }
 
 void NET_LeaveMulticast6()
@@ -1050,7 +1235,12 @@ void NET_LeaveMulticast6()
 	if(multicast6_socket != INVALID_SOCKET)
 	{
 		if(multicast6_socket != ip6_socket)
+		{
+#ifdef USE_NET_BATCH
+			NET_EpollWatch(multicast6_socket, qfalse);
+#endif
 			closesocket(multicast6_socket);
+		}
 		else
 			setsockopt(multicast6_socket, IPPROTO_IPV6, IPV6_LEAVE_GROUP, (char *) &curgroup, sizeof(curgroup));
 
@@ -1341,6 +1531,64 @@ static void NET_GetLocalAddress( void ) {
 }
 #endif
 
+#ifdef USE_NET_BATCH
+/*
+====================
+NET_OpenEpoll
+
+NET_Sleep waits on this instead of calling select
+====================
+*/
+static void NET_OpenEpoll( void ) {
+	struct epoll_event	ev;
+	SOCKET				socks[3];
+	int					i;
+
+	epoll_fd = epoll_create( 3 );
+	if( epoll_fd == -1 ) {
+		Com_Printf( "WARNING: epoll_create: %s\n", NET_ErrorString() );
+		return;
+	}
+
+	socks[0] = ip_socket;
+	socks[1] = ip6_socket;
+	socks[2] = multicast6_socket != ip6_socket ? multicast6_socket : INVALID_SOCKET;
+
+	for( i = 0; i < 3; i++ ) {
+		if( socks[i] == INVALID_SOCKET ) {
+			continue;
+		}
+
+		memset( &ev, 0, sizeof( ev ) );
+		ev.events = EPOLLIN;
+		ev.data.fd = socks[i];
+
+		if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, socks[i], &ev ) == -1 ) {
+			Com_Printf( "WARNING: epoll_ctl: %s\n", NET_ErrorString() );
+			close( epoll_fd );
+			epoll_fd = -1;
+			return;
+		}
+	}
+
+	// epoll_wait only takes milliseconds, finer sleeps are timed by a
+	// timerfd in the same set (epoll_pwait2 would need a recent libc)
+	timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK );
+	if( timer_fd == -1 ) {
+		return;
+	}
+
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = EPOLLIN;
+	ev.data.fd = timer_fd;
+
+	if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev ) == -1 ) {
+		close( timer_fd );
+		timer_fd = -1;
+	}
+}
+#endif
+
 /*
 ====================
 NET_OpenIP
@@ -1403,6 +1651,10 @@ void NET_OpenIP( void ) {
 		if(ip_socket == INVALID_SOCKET)
 			Com_Printf( "WARNING: Couldn't bind to a v4 ip address.\n");
 	}
+
+#ifdef USE_NET_BATCH
+	NET_OpenEpoll();
+#endif
 }
 
 
@@ -1479,6 +1731,8 @@ static qboolean NET_GetCvars( void ) {
 
 	net_dropsim = Cvar_Get("net_dropsim", "", CVAR_TEMP);
 
+	net_batch = Cvar_Get( "net_batch", "1", CVAR_ARCHIVE );
+
 	return modified ? qtrue : qfalse;
 }
 
@@ -1528,6 +1782,19 @@ void NET_Config( qboolean enableNetworking ) {
 	}
 
 	if( stop ) {
+#ifdef USE_NET_BATCH
+		NET_FlushSendBatch();
+
+		if ( epoll_fd != -1 ) {
+			close( epoll_fd );
+			epoll_fd = -1;
+		}
+		if ( timer_fd != -1 ) {
+			close( timer_fd );
+			timer_fd = -1;
+		}
+#endif
+
 		if ( ip_socket != INVALID_SOCKET ) {
 			closesocket( ip_socket );
 			ip_socket = INVALID_SOCKET;
@@ -1615,11 +1882,101 @@ Called from NET_Sleep which uses select() to determine which sockets have seen a
 ====================
 */
 
+#ifdef USE_NET_BATCH
+/*
+====================
+NET_ReceiveBatch
+
+Reads all pending packets from a socket, up to NET_BATCH_PACKETS per
+system call.  The socket is passed by reference since a packet handler
+may restart networking.
+====================
+*/
+static void NET_ReceiveBatch(SOCKET *sock)
+{
+	netadr_t from;
+	msg_t netmsg;
+	int count, i, err;
+
+	do
+	{
+		if(*sock == INVALID_SOCKET)
+			return;
+
+		for(i = 0; i < NET_BATCH_PACKETS; i++)
+		{
+			recvIov[i].iov_base = recvData[i];
+			recvIov[i].iov_len = sizeof(recvData[i]);
+
+			memset(&recvHdr[i], 0, sizeof(recvHdr[i]));
+			recvHdr[i].msg_hdr.msg_name = &recvFrom[i];
+			recvHdr[i].msg_hdr.msg_namelen = sizeof(recvFrom[i]);
+			recvHdr[i].msg_hdr.msg_iov = &recvIov[i];
+			recvHdr[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		count = recvmmsg(*sock, recvHdr, NET_BATCH_PACKETS, MSG_DONTWAIT, NULL);
+
+		if(count == SOCKET_ERROR)
+		{
+			err = socketError;
+
+			if(err != EAGAIN && err != ECONNRESET && err != EINTR)
+				Com_Printf("NET_GetPacket: %s\n", NET_ErrorString());
+
+			return;
+		}
+
+		for(i = 0; i < count; i++)
+		{
+			SockadrToNetadr((struct sockaddr *) &recvFrom[i], &from);
+
+			if(recvHdr[i].msg_len >= sizeof(recvData[i]))
+			{
+				Com_Printf("Oversize packet from %s\n", NET_AdrToString(from));
+				continue;
+			}
+
+			if(net_dropsim->value > 0.0f && net_dropsim->value <= 100.0f)
+			{
+				if(rand() < (int) (((double) RAND_MAX) / 100.0 * (double) net_dropsim->value))
+					continue;
+			}
+
+			MSG_Init(&netmsg, recvData[i], sizeof(recvData[i]));
+			netmsg.cursize = recvHdr[i].msg_len;
+
+			if(com_sv_running->integer)
+				Com_RunAndTimeServerPacket(&from, &netmsg);
+			else
+				CL_PacketEvent(from, &netmsg);
+		}
+	} while(count == NET_BATCH_PACKETS);
+}
+#endif
+
 void NET_Event(fd_set *fdr)
 {
 	byte bufData[MAX_MSGLEN + 1];
 	netadr_t from;
 	msg_t netmsg;
+
+#ifdef USE_NET_BATCH
+	// socks needs the relay header stripped, leave it to NET_GetPacket
+	if(net_batch->integer && !usingSocks)
+	{
+		if(ip_socket != INVALID_SOCKET && FD_ISSET(ip_socket, fdr))
+			NET_ReceiveBatch(&ip_socket);
+
+		if(ip6_socket != INVALID_SOCKET && FD_ISSET(ip6_socket, fdr))
+			NET_ReceiveBatch(&ip6_socket);
+
+		if(multicast6_socket != INVALID_SOCKET && multicast6_socket != ip6_socket && FD_ISSET(multicast6_socket, fdr))
+			NET_ReceiveBatch(&multicast6_socket);
+
+		return;
+	}
+#endif
 	
 	while(1)
 	{
@@ -1646,22 +2003,77 @@ void NET_Event(fd_set *fdr)
 
 /*
 ====================
-NET_Sleep
+NET_SleepUsec
 
-Sleeps msec or until something happens on the network
+Sleeps usec microseconds or until a packet is received on one of the sockets
 ====================
 */
-void NET_Sleep(int msec)
+void NET_SleepUsec(int64_t usec)
 {
 	struct timeval timeout;
 	fd_set fdr;
 	int highestfd = -1, retval;
 
-	if(msec < 0)
-		msec = 0;
+	if(usec < 0)
+		usec = 0;
 
 	FD_ZERO(&fdr);
 
+#ifdef USE_NET_BATCH
+	if(net_batch->integer && epoll_fd != -1)
+	{
+		struct epoll_event events[4];
+		struct itimerspec its;
+		uint64_t expirations;
+		int msec, i;
+
+		if(!usec)
+			msec = 0;
+		else if(timer_fd != -1)
+		{
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = usec / 1000000;
+			its.it_value.tv_nsec = (usec % 1000000) * 1000;
+			timerfd_settime(timer_fd, 0, &its, NULL);
+			msec = -1;
+		}
+		else
+			msec = (usec + 999) / 1000;
+
+		retval = epoll_wait(epoll_fd, events, ARRAY_LEN(events), msec);
+
+		if(retval < 0)
+		{
+			if(socketError != EINTR)
+				Com_Printf("Warning: epoll_wait() syscall failed: %s\n", NET_ErrorString());
+		}
+		else if(retval > 0)
+		{
+			for(i = 0; i < retval; i++)
+			{
+				if(events[i].data.fd == timer_fd)
+				{
+					if(read(timer_fd, &expirations, sizeof(expirations)) < 0)
+						continue;
+				}
+				else
+					FD_SET(events[i].data.fd, &fdr);
+			}
+
+			NET_Event(&fdr);
+		}
+
+		if(timer_fd != -1 && msec == -1)
+		{
+			// a packet came in first
+			memset(&its, 0, sizeof(its));
+			timerfd_settime(timer_fd, 0, &its, NULL);
+		}
+
+		return;
+	}
+#endif
+
 	if(ip_socket != INVALID_SOCKET)
 	{
 		FD_SET(ip_socket, &fdr);
@@ -1675,15 +2087,22 @@ void NET_Sleep(int msec)
 		if(ip6_socket > highestfd)
 			highestfd = ip6_socket;
 	}
+	if(multicast6_socket != INVALID_SOCKET && multicast6_socket != ip6_socket)
+	{
+		FD_SET(multicast6_socket, &fdr);
 
-	timeout.tv_sec = msec/1000;
-	timeout.tv_usec = (msec%1000)*1000;
+		if(multicast6_socket > highestfd)
+			highestfd = multicast6_socket;
+	}
+
+	timeout.tv_sec = usec/1000000;
+	timeout.tv_usec = usec%1000000;
 	
 #ifdef _WIN32
 	if(highestfd < 0)
 	{
 		// windows ain't happy when select is called without valid FDs
-		SleepEx(msec, 0);
+		SleepEx((usec + 999) / 1000, 0);
 		return;
 	}
 #endif
@@ -1696,6 +2115,18 @@ void NET_Sleep(int msec)
 		NET_Event(&fdr);
 }
 
+/*
+====================
+NET_Sleep
+
+Sleeps msec or until something happens on the network
+====================
+*/
+void NET_Sleep(int msec)
+{
+	NET_SleepUsec((int64_t)msec * 1000);
+}
+
 /*
 ====================
 NET_Restart_f
@@ -48,6 +48,8 @@ typedef struct {
 	int		cursize;
 	int		readcount;
 	int		bit;				// for bitwise reads and writes
+	qboolean	deferErrors;	// write errors go to error instead of Com_Error
+	const char	*error;			// first deferred error, raised by the owner
 } msg_t;
 
 void MSG_Init (msg_t *buf, byte *data, int length);
@@ -67,6 +69,8 @@ struct entityState_s;
 struct playerState_s;
 
 void MSG_WriteBits( msg_t *msg, int value, int bits );
+// appends the already encoded bits of a message that was written from bit 0
+void MSG_WriteEncoded( msg_t *msg, const msg_t *src );
 
 void MSG_WriteChar (msg_t *sb, int c);
 void MSG_WriteByte (msg_t *sb, int c);
@@ -103,6 +107,7 @@ void MSG_ReadDeltaUsercmdKey( msg_t *msg, int key, usercmd_t *from, usercmd_t *t
 
 void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entityState_s *to
 						   , qboolean force );
+qboolean MSG_DeltaEntityIsValid( msg_t *msg );
 void MSG_ReadDeltaEntity( msg_t *msg, entityState_t *from, entityState_t *to, 
 						 int number );
 
@@ -187,6 +192,9 @@ qboolean	NET_GetLoopPacket (netsrc_t sock, netadr_t *net_from, msg_t *net_messag
 void		NET_JoinMulticast6(void);
 void		NET_LeaveMulticast6(void);
 void		NET_Sleep(int msec);
+void		NET_SleepUsec(int64_t usec);
+qboolean	NET_BeginSendBatch(void);
+void		NET_FlushSendBatch(void);
 
 
 #define	MAX_MSGLEN				16384		// max length of a message, which may
@@ -214,10 +222,11 @@ typedef struct {
 	int			incomingSequence;
 	int			outgoingSequence;
 
-	// incoming fragment assembly buffer
+	// incoming fragment assembly buffer, the message is handed out from
+	// here with its sequence number in the first four bytes
 	int			fragmentSequence;
 	int			fragmentLength;	
-	byte		fragmentBuffer[MAX_MSGLEN];
+	byte		fragmentBuffer[4 + MAX_MSGLEN];
 
 	// outgoing fragment buffer
 	// we need to space out the sending of large fragmented messages
@@ -229,6 +238,7 @@ typedef struct {
 	int			challenge;
 	int		lastSentTime;
 	int		lastSentSize;
+	int		lastSentPackets;	// datagrams lastSentSize was sent in
 
 #ifdef LEGACY_PROTOCOL
 	qboolean	compat;
@@ -240,6 +250,7 @@ void Netchan_Setup(netsrc_t sock, netchan_t *chan, netadr_t adr, int qport, int
 
 void Netchan_Transmit( netchan_t *chan, int length, const byte *data );
 void Netchan_TransmitNextFragment( netchan_t *chan );
+void Netchan_TransmitFragments( netchan_t *chan, int maxBytes );
 
 qboolean Netchan_Process( netchan_t *chan, msg_t *msg );
 
@@ -302,6 +313,7 @@ enum svc_ops_e {
 
 // new commands, supported only by ioquake3 protocol but not legacy
 	svc_voip,     // not wrapped in USE_VOIP, so this value is reserved.
+	svc_gamestateHash,			// [2 longs] hash [2 longs] base hash, low word first, only in gamestate messages
 };
 
 
@@ -639,11 +651,15 @@ int		FS_GetModList(  char *listbuf, int bufsize );
 fileHandle_t	FS_FOpenFileWrite( const char *qpath );
 fileHandle_t	FS_FOpenFileAppend( const char *filename );
 fileHandle_t	FS_FCreateOpenPipeFile( const char *filename );
+qboolean	FS_CreatePipeFile( const char *filename );
+fileHandle_t	FS_FOpenPipeWrite( const char *filename );
+int		FS_WritePipe( const void *buffer, int len, fileHandle_t f, qboolean blocking );
 // will properly create any needed paths and deal with seperater character issues
 
 fileHandle_t FS_SV_FOpenFileWrite( const char *filename );
 long		FS_SV_FOpenFileRead( const char *filename, fileHandle_t *fp );
 void	FS_SV_Rename( const char *from, const char *to );
+qboolean	FS_SV_FileExists( const char *file );
 long		FS_FOpenFileRead( const char *qpath, fileHandle_t *file, qboolean uniqueFILE );
 // if uniqueFILE is true, then a new FILE will be fopened even if the file
 // is found in an already open pak file.  If uniqueFILE is false, you must call
@@ -699,6 +715,7 @@ int		FS_Seek( fileHandle_t f, long offset, int origin );
 // seek on a file (doesn't work for zip files!!!!!!!!)
 
 qboolean FS_FilenameCompare( const char *s1, const char *s2 );
+qboolean FS_IsDemoExt( const char *filename, int namelen );
 
 const char *FS_GamePureChecksum( void );
 // Returns the checksum of the pk3 from which the server loaded the qagame.qvm
@@ -762,6 +779,7 @@ void Field_AutoComplete( field_t *edit );
 void Field_CompleteKeyname( void );
 void Field_CompleteFilename( const char *dir,
 		const char *ext, qboolean stripExt, qboolean allowNonPureFilesOnDisk );
+void Field_CompleteList( void (*list)( void (*callback)( const char *s ) ) );
 void Field_CompleteCommand( char *cmd,
 		qboolean doCommands, qboolean doCvars );
 
@@ -835,6 +853,7 @@ int			Com_FilterPath(char *filter, char *name, int casesensitive);
 int			Com_RealTime(qtime_t *qtime);
 qboolean	Com_SafeMode( void );
 void		Com_RunAndTimeServerPacket(netadr_t *evFrom, msg_t *buf);
+void		Com_InstanceFileName( const char *name, char *out, int outSize );
 
 qboolean	Com_IsVoipTarget(uint8_t *voipTargets, int voipTargetsSize, int clientNum);
 
@@ -1006,6 +1025,9 @@ void	CL_ForwardCommandToServer( const char *string );
 void CL_CDDialog( void );
 // bring up the "need a cd to play" dialog
 
+qboolean CL_VideoOffline( void );
+// video capture that runs frames back to back, ignoring the wall clock
+
 void CL_FlushMemory( void );
 // dump all memory on an error
 
@@ -1035,6 +1057,13 @@ void SCR_DebugGraph (float value);	// FIXME: move logging to common?
 // AVI files have the start of pixel lines 4 byte-aligned
 #define AVI_LINE_PADDING 4
 
+// pixel layouts the renderer can hand back for video capture
+typedef enum {
+	VIDEOFRAME_BGR,		// bottom-up BGR with AVI line padding
+	VIDEOFRAME_MJPEG,	// one JPEG image per frame
+	VIDEOFRAME_YUV420	// top-down planar YUV 4:2:0, BT.601 limited range
+} videoFrameFormat_t;
+
 //
 // server interface
 //
@@ -1042,7 +1071,7 @@ void SV_Init( void );
 void SV_Shutdown( char *finalmsg );
 void SV_Frame( int msec );
 void SV_PacketEvent( netadr_t from, msg_t *msg );
-int SV_FrameMsec(void);
+int SV_FrameUsec(void);
 qboolean SV_GameCommand( void );
 int SV_SendQueuedPackets(void);
 
@@ -1094,6 +1123,11 @@ void	Sys_Print( const char *msg );
 // any game related timing information should come from event timestamps
 int		Sys_Milliseconds (void);
 
+// monotonic, for measuring intervals below a millisecond
+int64_t	Sys_Microseconds (void);
+
+int		Sys_PID( void );
+
 void	Sys_SnapVector( float *v );
 
 qboolean Sys_RandomBytes( byte *string, int len );
@@ -1115,6 +1149,9 @@ void		Sys_ShowIP(void);
 
 qboolean Sys_Mkdir( const char *path );
 FILE	*Sys_Mkfifo( const char *ospath );
+qboolean	Sys_CreateFifo( const char *ospath );
+FILE	*Sys_FifoOpenWrite( const char *ospath );
+int		Sys_FifoWrite( FILE *fifo, const void *buffer, int len, qboolean blocking );
 char	*Sys_Cwd( void );
 void	Sys_SetDefaultInstallPath(const char *path);
 char	*Sys_DefaultInstallPath(void);
@@ -1132,6 +1169,26 @@ char *Sys_ConsoleInput(void);
 
 char **Sys_ListFiles( const char *directory, const char *extension, char *filter, int *numfiles, qboolean wantsubs );
 void	Sys_FreeFileList( char **list );
+
+// walks one directory without the MAX_FOUND_FILES limit of Sys_ListFiles
+typedef struct {
+	char		name[MAX_OSPATH];
+	qboolean	isDir;
+	int64_t		mtime;		// seconds since the epoch
+	int64_t		size;
+} sysDirEntry_t;
+
+void		*Sys_OpenDir( const char *directory );
+qboolean	Sys_ReadDir( void *dir, sysDirEntry_t *entry );
+void		Sys_CloseDir( void *dir );
+
+// calls func( data, index ) for each index below count, spread over up to
+// numThreads threads (the caller being one of them), and returns once all
+// calls are done; only to be used from the main thread
+#define	MAX_PARALLEL_THREADS	16
+
+void	Sys_ParallelFor( int numThreads, int count, void (*func)( void *data, int index ), void *data );
+
 void	Sys_Sleep(int msec);
 
 qboolean Sys_LowPhysicalMemory( void );
@@ -1159,6 +1216,9 @@ dialogResult_t Sys_Dialog( dialogType_t type, const char *message, const char *t
 
 qboolean Sys_WritePIDFile( void );
 
+// returns the instance number of the calling process, 0 for the original one
+int Sys_StartInstances( int count );
+
 /* This is based on the Adaptive Huffman algorithm described in Sayood's Data
  * Compression book.  The ranks are not actually stored, but implicitly defined
  * by the location of a node within a doubly-linked list */
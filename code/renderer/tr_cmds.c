@@ -554,7 +554,7 @@ RE_TakeVideoFrame
 =============
 */
 void RE_TakeVideoFrame( int width, int height,
-		byte *captureBuffer, byte *encodeBuffer, qboolean motionJpeg )
+		byte *captureBuffer, byte *encodeBuffer, videoFrameFormat_t format )
 {
 	videoFrameCommand_t	*cmd;
 
@@ -573,5 +573,5 @@ void RE_TakeVideoFrame( int width, int height,
 	cmd->height = height;
 	cmd->captureBuffer = captureBuffer;
 	cmd->encodeBuffer = encodeBuffer;
-	cmd->motionJpeg = motionJpeg;
+	cmd->format = format;
 }
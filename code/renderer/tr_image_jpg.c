@@ -42,6 +42,14 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #  endif
 #endif
 
+#ifdef USE_LOCAL_HEADERS
+#	include "SDL_thread.h"
+#else
+#	include <SDL_thread.h>
+#endif
+
+#include <setjmp.h>
+
 static void R_JPGErrorExit(j_common_ptr cinfo)
 {
   char buffer[JMSG_LENGTH_MAX];
@@ -65,6 +73,31 @@ static void R_JPGOutputMessage(j_common_ptr cinfo)
   ri.Printf(PRINT_ALL, "%s\n", buffer);
 }
 
+/*
+ * Compression may run on a worker thread, where ri.Error must never be
+ * called. Its errors jump back into R_CompressJPG instead, which hands the
+ * message to the thread that started the encode.
+ */
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmpBuffer;
+  char message[JMSG_LENGTH_MAX];
+} jpegCompressError_t;
+
+static void R_JPGCompressErrorExit(j_common_ptr cinfo)
+{
+  jpegCompressError_t *err = (jpegCompressError_t *) cinfo->err;
+
+  (*cinfo->err->format_message) (cinfo, err->message);
+
+  longjmp(err->setjmpBuffer, 1);
+}
+
+static void R_JPGCompressOutputMessage(j_common_ptr cinfo)
+{
+  // warnings are not worth a round trip to the main thread
+}
+
 void R_LoadJPG(const char *filename, unsigned char **pic, int *width, int *height)
 {
   /* This struct contains the JPEG decompression parameters and pointers to
@@ -294,12 +327,12 @@ static boolean
 empty_output_buffer (j_compress_ptr cinfo)
 {
   my_dest_ptr dest = (my_dest_ptr) cinfo->dest;
+  jpegCompressError_t *err = (jpegCompressError_t *) cinfo->err;
   
-  jpeg_destroy_compress(cinfo);
-  
-  // Make crash fatal or we would probably leak memory.
-  ri.Error(ERR_FATAL, "Output buffer for encoded JPEG image has insufficient size of %d bytes",
-           dest->size);
+  Com_sprintf(err->message, sizeof(err->message),
+      "Output buffer for encoded JPEG image has insufficient size of %d bytes", dest->size);
+
+  longjmp(err->setjmpBuffer, 1);
 
   return FALSE;
 }
@@ -351,26 +384,33 @@ jpegDest (j_compress_ptr cinfo, byte* outfile, int size)
 
 /*
 =================
-SaveJPGToBuffer
+R_CompressJPG
 
-Encodes JPEG from image in image_buffer and writes to buffer.
-Expects RGB input data
+Encodes a bottom-up RGB image with the given row stride in bytes. Safe to
+call from any thread: on failure it returns 0 and copies the libjpeg message
+to error, which must hold JMSG_LENGTH_MAX bytes.
 =================
 */
-size_t RE_SaveJPGToBuffer(byte *buffer, size_t bufSize, int quality,
-    int image_width, int image_height, byte *image_buffer, int padding)
+static size_t R_CompressJPG(byte *buffer, size_t bufSize, int quality,
+    int image_width, int image_height, byte *image_buffer, int row_stride, char *error)
 {
   struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
+  jpegCompressError_t jerr;
   JSAMPROW row_pointer[1];	/* pointer to JSAMPLE row[s] */
   my_dest_ptr dest;
-  int row_stride;		/* physical row width in image buffer */
   size_t outcount;
 
   /* Step 1: allocate and initialize JPEG compression object */
-  cinfo.err = jpeg_std_error(&jerr);
-  cinfo.err->error_exit = R_JPGErrorExit;
-  cinfo.err->output_message = R_JPGOutputMessage;
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  cinfo.err->error_exit = R_JPGCompressErrorExit;
+  cinfo.err->output_message = R_JPGCompressOutputMessage;
+  jerr.message[0] = '\0';
+
+  if (setjmp(jerr.setjmpBuffer)) {
+    jpeg_destroy_compress(&cinfo);
+    Q_strncpyz(error, jerr.message, JMSG_LENGTH_MAX);
+    return 0;
+  }
 
   /* Now we can initialize the JPEG compression object. */
   jpeg_create_compress(&cinfo);
@@ -398,8 +438,6 @@ size_t RE_SaveJPGToBuffer(byte *buffer, size_t bufSize, int quality,
 
   /* Step 5: while (scan lines remain to be written) */
   /*           jpeg_write_scanlines(...); */
-  row_stride = image_width * cinfo.input_components + padding; /* JSAMPLEs per row in image_buffer */
-  
   while (cinfo.next_scanline < cinfo.image_height) {
     /* jpeg_write_scanlines expects an array of pointers to scanlines.
      * Here the array is only one element long, but you could pass
@@ -422,6 +460,371 @@ size_t RE_SaveJPGToBuffer(byte *buffer, size_t bufSize, int quality,
   return outcount;
 }
 
+/*
+=================
+R_CompressJPGOrFail
+
+Single threaded R_CompressJPG that raises its errors
+=================
+*/
+static size_t R_CompressJPGOrFail(byte *buffer, size_t bufSize, int quality,
+    int image_width, int image_height, byte *image_buffer, int row_stride)
+{
+  char error[JMSG_LENGTH_MAX];
+  size_t outcount;
+
+  outcount = R_CompressJPG(buffer, bufSize, quality, image_width, image_height,
+      image_buffer, row_stride, error);
+
+  if (!outcount)
+    ri.Error(ERR_FATAL, "%s", error);
+
+  return outcount;
+}
+
+/*
+ * Slice-parallel encoding.
+ *
+ * The image is cut into horizontal strips whose height is a multiple of the
+ * MCU height. Every strip is encoded as a standalone JPEG with the same
+ * parameters and standard Huffman tables, which makes its entropy coded data
+ * identical to one restart interval of the full image: DC prediction starts
+ * from zero and the bit buffer is padded to a byte boundary at the end.
+ * The strips are then stitched behind the headers of the first one, with the
+ * frame height patched, a DRI segment added and RSTn markers in between.
+ */
+
+#define MAX_JPEG_THREADS	16
+#define MAX_JPEG_SLICES		64
+#define JPEG_HEADER_MARGIN	1024	// room for the headers of every slice
+#define JPEG_MIN_SLICE_ROWS	64		// not worth a thread below this
+
+typedef struct {
+  byte		*image;		// bottom-up RGB rows of this slice
+  int		width, height;
+  int		rowStride;
+  int		quality;
+
+  byte		*out;
+  size_t	outSize;
+  size_t	outCount;
+  char		error[JMSG_LENGTH_MAX];	// set instead of outCount on failure
+} jpegSlice_t;
+
+static struct {
+  SDL_Thread	*threads[MAX_JPEG_THREADS];
+  int			numThreads;
+  SDL_mutex		*mutex;
+  SDL_cond		*jobsReady;
+  SDL_cond		*jobsDone;
+  qboolean		shutdown;
+
+  jpegSlice_t	*slices;
+  int			numSlices;
+  int			nextSlice;
+  int			slicesDone;
+} jpgWorkers;
+
+/*
+=================
+R_JPGRunSlices
+
+Encodes slices until none are left to claim. Called with the mutex held,
+returns with it held.
+=================
+*/
+static void R_JPGRunSlices(void)
+{
+  while (jpgWorkers.nextSlice < jpgWorkers.numSlices) {
+    jpegSlice_t *slice = &jpgWorkers.slices[jpgWorkers.nextSlice++];
+
+    SDL_mutexV(jpgWorkers.mutex);
+    slice->outCount = R_CompressJPG(slice->out, slice->outSize, slice->quality,
+        slice->width, slice->height, slice->image, slice->rowStride, slice->error);
+    SDL_mutexP(jpgWorkers.mutex);
+
+    // failed slices count as done too, the caller raises their error
+    if (++jpgWorkers.slicesDone == jpgWorkers.numSlices)
+      SDL_CondSignal(jpgWorkers.jobsDone);
+  }
+}
+
+static int R_JPGWorkerThread(void *arg)
+{
+  SDL_mutexP(jpgWorkers.mutex);
+
+  while (!jpgWorkers.shutdown) {
+    R_JPGRunSlices();
+    SDL_CondWait(jpgWorkers.jobsReady, jpgWorkers.mutex);
+  }
+
+  SDL_mutexV(jpgWorkers.mutex);
+
+  return 0;
+}
+
+/*
+=================
+R_ShutdownJPGWorkers
+=================
+*/
+void R_ShutdownJPGWorkers(void)
+{
+  int i;
+
+  if (!jpgWorkers.mutex)
+    return;
+
+  SDL_mutexP(jpgWorkers.mutex);
+  jpgWorkers.shutdown = qtrue;
+  SDL_CondBroadcast(jpgWorkers.jobsReady);
+  SDL_mutexV(jpgWorkers.mutex);
+
+  for (i = 0; i < jpgWorkers.numThreads; i++)
+    SDL_WaitThread(jpgWorkers.threads[i], NULL);
+
+  SDL_DestroyCond(jpgWorkers.jobsDone);
+  SDL_DestroyCond(jpgWorkers.jobsReady);
+  SDL_DestroyMutex(jpgWorkers.mutex);
+
+  Com_Memset(&jpgWorkers, 0, sizeof(jpgWorkers));
+}
+
+/*
+=================
+R_InitJPGWorkers
+
+(Re)starts the pool if r_jpegThreads changed, returns the number of threads
+=================
+*/
+static int R_InitJPGWorkers(void)
+{
+  int numThreads = r_jpegThreads->integer;
+
+  if (numThreads < 0)
+    numThreads = 0;
+  else if (numThreads > MAX_JPEG_THREADS)
+    numThreads = MAX_JPEG_THREADS;
+
+  if (jpgWorkers.mutex && jpgWorkers.numThreads == numThreads)
+    return numThreads;
+
+  R_ShutdownJPGWorkers();
+
+  if (!numThreads)
+    return 0;
+
+  jpgWorkers.mutex = SDL_CreateMutex();
+  jpgWorkers.jobsReady = SDL_CreateCond();
+  jpgWorkers.jobsDone = SDL_CreateCond();
+
+  if (!jpgWorkers.mutex || !jpgWorkers.jobsReady || !jpgWorkers.jobsDone) {
+    ri.Printf(PRINT_WARNING, "R_InitJPGWorkers: %s\n", SDL_GetError());
+    R_ShutdownJPGWorkers();
+    return 0;
+  }
+
+  while (jpgWorkers.numThreads < numThreads) {
+    SDL_Thread *thread = SDL_CreateThread(R_JPGWorkerThread, NULL);
+
+    if (!thread) {
+      ri.Printf(PRINT_WARNING, "R_InitJPGWorkers: %s\n", SDL_GetError());
+      break;
+    }
+
+    jpgWorkers.threads[jpgWorkers.numThreads++] = thread;
+  }
+
+  return jpgWorkers.numThreads;
+}
+
+/*
+=================
+R_JPGScanOffset
+
+Returns the offset of the entropy coded data following the SOS segment and
+stores the offsets of the SOS marker and the SOF frame height
+=================
+*/
+static size_t R_JPGScanOffset(const byte *jpg, size_t len, size_t *sosOfs, size_t *heightOfs)
+{
+  size_t pos = 2; // SOI
+
+  while (pos + 4 <= len && jpg[pos] == 0xFF) {
+    int marker = jpg[pos + 1];
+    size_t segLen = (jpg[pos + 2] << 8) | jpg[pos + 3];
+
+    if (marker == 0xC0 || marker == 0xC1)
+      *heightOfs = pos + 5;
+    else if (marker == 0xDA) {
+      *sosOfs = pos;
+      return pos + 2 + segLen;
+    }
+
+    pos += 2 + segLen;
+  }
+
+  ri.Error(ERR_DROP, "R_JPGScanOffset: malformed JPEG slice");
+  return 0;
+}
+
+/*
+=================
+R_StitchJPGSlices
+=================
+*/
+static size_t R_StitchJPGSlices(byte *buffer, size_t bufSize, const jpegSlice_t *slices,
+    int numSlices, int image_height, int restartInterval)
+{
+  size_t sosOfs = 0, heightOfs = 0, scanOfs, outcount, len;
+  byte *out = buffer;
+  int i;
+
+  scanOfs = R_JPGScanOffset(slices[0].out, slices[0].outCount, &sosOfs, &heightOfs);
+
+  // headers plus DRI segment, the slices, RST markers and EOI
+  outcount = scanOfs + 6 + 2;
+  for (i = 0; i < numSlices; i++)
+    outcount += slices[i].outCount + 2;
+
+  if (outcount > bufSize)
+    ri.Error(ERR_FATAL, "Output buffer for encoded JPEG image has insufficient size of %d bytes",
+             (int) bufSize);
+
+  Com_Memcpy(out, slices[0].out, sosOfs);
+  out[heightOfs] = (image_height >> 8) & 0xFF;
+  out[heightOfs + 1] = image_height & 0xFF;
+  out += sosOfs;
+
+  *out++ = 0xFF;
+  *out++ = 0xDD;
+  *out++ = 0;
+  *out++ = 4;
+  *out++ = (restartInterval >> 8) & 0xFF;
+  *out++ = restartInterval & 0xFF;
+
+  Com_Memcpy(out, slices[0].out + sosOfs, scanOfs - sosOfs);
+  out += scanOfs - sosOfs;
+
+  for (i = 0; i < numSlices; i++) {
+    const jpegSlice_t *slice = &slices[i];
+
+    if (i > 0) {
+      *out++ = 0xFF;
+      *out++ = 0xD0 + ((i - 1) & 7);
+      scanOfs = R_JPGScanOffset(slice->out, slice->outCount, &sosOfs, &heightOfs);
+    }
+
+    // everything up to the slice's EOI
+    len = slice->outCount - 2 - scanOfs;
+    Com_Memcpy(out, slice->out + scanOfs, len);
+    out += len;
+  }
+
+  *out++ = 0xFF;
+  *out++ = 0xD9;
+
+  return out - buffer;
+}
+
+/*
+=================
+SaveJPGToBuffer
+
+Encodes JPEG from image in image_buffer and writes to buffer.
+Expects RGB input data
+=================
+*/
+size_t RE_SaveJPGToBuffer(byte *buffer, size_t bufSize, int quality,
+    int image_width, int image_height, byte *image_buffer, int padding)
+{
+  jpegSlice_t slices[MAX_JPEG_SLICES];
+  char error[JMSG_LENGTH_MAX];
+  int row_stride;		/* physical row width in image buffer */
+  int numThreads, numSlices, mcuSize, mcusPerRow, mcuRows, sliceRows;
+  size_t sliceBufSize, outcount;
+  byte *sliceBuf;
+  int i, y;
+
+  row_stride = image_width * 3 + padding; /* JSAMPLEs per row in image_buffer */
+
+  numThreads = R_InitJPGWorkers();
+
+  // MCUs are 8x8 without chroma subsampling, 16x16 with it
+  mcuSize = (quality >= 85) ? 8 : 16;
+  mcusPerRow = (image_width + mcuSize - 1) / mcuSize;
+  mcuRows = (image_height + mcuSize - 1) / mcuSize;
+
+  numSlices = numThreads + 1;
+  if (numSlices > image_height / JPEG_MIN_SLICE_ROWS)
+    numSlices = image_height / JPEG_MIN_SLICE_ROWS;
+
+  if (numSlices < 2)
+    return R_CompressJPGOrFail(buffer, bufSize, quality, image_width, image_height, image_buffer, row_stride);
+
+  // the restart interval is a 16 bit MCU count
+  sliceRows = (mcuRows + numSlices - 1) / numSlices;
+  if (sliceRows * mcusPerRow > 65535)
+    sliceRows = 65535 / mcusPerRow;
+  numSlices = (mcuRows + sliceRows - 1) / sliceRows;
+
+  if (sliceRows < 1 || numSlices > MAX_JPEG_SLICES)
+    return R_CompressJPGOrFail(buffer, bufSize, quality, image_width, image_height, image_buffer, row_stride);
+
+  sliceRows *= mcuSize;
+  sliceBufSize = image_width * sliceRows * 3 + JPEG_HEADER_MARGIN;
+  sliceBuf = ri.Hunk_AllocateTempMemory(sliceBufSize * numSlices);
+
+  for (i = 0, y = 0; i < numSlices; i++, y += sliceRows) {
+    jpegSlice_t *slice = &slices[i];
+    int height = (y + sliceRows > image_height) ? image_height - y : sliceRows;
+
+    // image rows are stored bottom-up
+    slice->image = image_buffer + (image_height - y - height) * row_stride;
+    slice->width = image_width;
+    slice->height = height;
+    slice->rowStride = row_stride;
+    slice->quality = quality;
+    slice->out = sliceBuf + i * sliceBufSize;
+    slice->outSize = sliceBufSize;
+    slice->outCount = 0;
+    slice->error[0] = '\0';
+  }
+
+  SDL_mutexP(jpgWorkers.mutex);
+  jpgWorkers.slices = slices;
+  jpgWorkers.numSlices = numSlices;
+  jpgWorkers.nextSlice = 0;
+  jpgWorkers.slicesDone = 0;
+  SDL_CondBroadcast(jpgWorkers.jobsReady);
+
+  // lend a hand, then wait for the stragglers
+  R_JPGRunSlices();
+  while (jpgWorkers.slicesDone < numSlices)
+    SDL_CondWait(jpgWorkers.jobsDone, jpgWorkers.mutex);
+
+  jpgWorkers.slices = NULL;
+  jpgWorkers.numSlices = 0;
+  jpgWorkers.nextSlice = 0;
+  SDL_mutexV(jpgWorkers.mutex);
+
+  // every worker is idle again, errors can be raised safely now
+  for (i = 0; i < numSlices; i++) {
+    if (!slices[i].outCount) {
+      Q_strncpyz(error, slices[i].error, sizeof(error));
+      ri.Hunk_FreeTempMemory(sliceBuf);
+      ri.Error(ERR_FATAL, "%s", error);
+    }
+  }
+
+  outcount = R_StitchJPGSlices(buffer, bufSize, slices, numSlices, image_height,
+      (sliceRows / mcuSize) * mcusPerRow);
+
+  ri.Hunk_FreeTempMemory(sliceBuf);
+
+  return outcount;
+}
+
 void RE_SaveJPG(char * filename, int quality, int image_width, int image_height, byte *image_buffer, int padding)
 {
   byte *out;
@@ -23,6 +23,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "tr_local.h"
 
+#if idx64
+#include <emmintrin.h>
+#endif
+
 glconfig_t  glConfig;
 qboolean    textureFilterAnisotropic = qfalse;
 int         maxAnisotropy = 0;
@@ -162,6 +166,7 @@ cvar_t	*r_marksOnTriangleMeshes;
 
 cvar_t	*r_aviMotionJpegQuality;
 cvar_t	*r_screenshotJpegQuality;
+cvar_t	*r_jpegThreads;
 
 cvar_t	*r_maxpolys;
 int		max_polys;
@@ -769,6 +774,159 @@ void R_ScreenShotJPEG_f (void) {
 
 //============================================================================
 
+/*
+==================
+R_LumaFromRGB / R_ChromaFromRGB
+
+BT.601 limited range, 8 bit fixed point
+==================
+*/
+#define R_LumaFromRGB( r, g, b )	( ( ( 66 * (r) + 129 * (g) + 25 * (b) + 128 ) >> 8 ) + 16 )
+#define R_CbFromRGB( r, g, b )		( ( ( -38 * (r) - 74 * (g) + 112 * (b) + 128 ) >> 8 ) + 128 )
+#define R_CrFromRGB( r, g, b )		( ( ( 112 * (r) - 94 * (g) - 18 * (b) + 128 ) >> 8 ) + 128 )
+
+#if idx64
+/*
+==================
+R_AverageQuadsSSE2
+
+Returns the 2x2 box average of 8 RGBA pixels from two rows as 4 RGBA pixels,
+rounding the same way as the scalar path (vertical first, then horizontal)
+==================
+*/
+static ID_INLINE __m128i R_AverageQuadsSSE2( const byte *row0, const byte *row1 )
+{
+	__m128i	v0, v1;
+
+	v0 = _mm_avg_epu8( _mm_loadu_si128( (const __m128i *)row0 ),
+		_mm_loadu_si128( (const __m128i *)row1 ) );
+	v1 = _mm_avg_epu8( _mm_loadu_si128( (const __m128i *)( row0 + 16 ) ),
+		_mm_loadu_si128( (const __m128i *)( row1 + 16 ) ) );
+
+	// neighbouring pixels end up in lanes 0 and 2
+	v0 = _mm_avg_epu8( v0, _mm_shuffle_epi32( v0, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	v1 = _mm_avg_epu8( v1, _mm_shuffle_epi32( v1, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+
+	return _mm_unpacklo_epi64( _mm_shuffle_epi32( v0, _MM_SHUFFLE( 3, 1, 2, 0 ) ),
+		_mm_shuffle_epi32( v1, _MM_SHUFFLE( 3, 1, 2, 0 ) ) );
+}
+#endif
+
+/*
+==================
+R_ConvertRGBAToYUV420
+
+Converts a bottom-up RGBA image as returned by glReadPixels into top-down
+planar YUV 4:2:0. Odd dimensions replicate the last column/row for the chroma
+planes. Returns the number of bytes written.
+==================
+*/
+static size_t R_ConvertRGBAToYUV420( byte *out, const byte *in, int width, int height, int stride )
+{
+	int		x, y;
+	int		chromaWidth = ( width + 1 ) / 2;
+	int		chromaHeight = ( height + 1 ) / 2;
+	byte	*yPlane = out;
+	byte	*uPlane = yPlane + width * height;
+	byte	*vPlane = uPlane + chromaWidth * chromaHeight;
+#if idx64
+	const __m128i	lowByte = _mm_set1_epi32( 0xff );
+#endif
+
+	for( y = 0; y < height; y++ )
+	{
+		const byte	*src = in + ( height - 1 - y ) * stride;
+		byte		*dst = yPlane + y * width;
+
+		x = 0;
+#if idx64
+		for( ; x + 8 <= width; x += 8 )
+		{
+			__m128i	p0 = _mm_loadu_si128( (const __m128i *)( src + x * 4 ) );
+			__m128i	p1 = _mm_loadu_si128( (const __m128i *)( src + x * 4 + 16 ) );
+			__m128i	r, g, b, l;
+
+			r = _mm_packs_epi32( _mm_and_si128( p0, lowByte ), _mm_and_si128( p1, lowByte ) );
+			g = _mm_packs_epi32( _mm_and_si128( _mm_srli_epi32( p0, 8 ), lowByte ),
+				_mm_and_si128( _mm_srli_epi32( p1, 8 ), lowByte ) );
+			b = _mm_packs_epi32( _mm_and_si128( _mm_srli_epi32( p0, 16 ), lowByte ),
+				_mm_and_si128( _mm_srli_epi32( p1, 16 ), lowByte ) );
+
+			// the weighted sum stays below 65536, so unsigned 16 bit is enough
+			l = _mm_add_epi16( _mm_mullo_epi16( r, _mm_set1_epi16( 66 ) ),
+				_mm_mullo_epi16( g, _mm_set1_epi16( 129 ) ) );
+			l = _mm_add_epi16( l, _mm_mullo_epi16( b, _mm_set1_epi16( 25 ) ) );
+			l = _mm_srli_epi16( _mm_add_epi16( l, _mm_set1_epi16( 128 ) ), 8 );
+			l = _mm_add_epi16( l, _mm_set1_epi16( 16 ) );
+
+			_mm_storel_epi64( (__m128i *)( dst + x ), _mm_packus_epi16( l, l ) );
+		}
+#endif
+		for( ; x < width; x++ )
+		{
+			const byte *p = src + x * 4;
+
+			dst[x] = R_LumaFromRGB( p[0], p[1], p[2] );
+		}
+	}
+
+	for( y = 0; y < chromaHeight; y++ )
+	{
+		const byte	*row0 = in + ( height - 1 - 2 * y ) * stride;
+		const byte	*row1 = ( 2 * y + 1 < height ) ? row0 - stride : row0;
+		byte		*u = uPlane + y * chromaWidth;
+		byte		*v = vPlane + y * chromaWidth;
+
+		x = 0;
+#if idx64
+		for( ; 2 * x + 16 <= width; x += 8 )
+		{
+			__m128i	q0 = R_AverageQuadsSSE2( row0 + x * 8, row1 + x * 8 );
+			__m128i	q1 = R_AverageQuadsSSE2( row0 + x * 8 + 32, row1 + x * 8 + 32 );
+			__m128i	r, g, b, cb, cr, bias;
+
+			r = _mm_packs_epi32( _mm_and_si128( q0, lowByte ), _mm_and_si128( q1, lowByte ) );
+			g = _mm_packs_epi32( _mm_and_si128( _mm_srli_epi32( q0, 8 ), lowByte ),
+				_mm_and_si128( _mm_srli_epi32( q1, 8 ), lowByte ) );
+			b = _mm_packs_epi32( _mm_and_si128( _mm_srli_epi32( q0, 16 ), lowByte ),
+				_mm_and_si128( _mm_srli_epi32( q1, 16 ), lowByte ) );
+			bias = _mm_set1_epi16( 128 );
+
+			// signed sums stay within +-28688
+			cb = _mm_add_epi16( _mm_mullo_epi16( r, _mm_set1_epi16( -38 ) ),
+				_mm_mullo_epi16( g, _mm_set1_epi16( -74 ) ) );
+			cb = _mm_add_epi16( cb, _mm_mullo_epi16( b, _mm_set1_epi16( 112 ) ) );
+			cb = _mm_add_epi16( _mm_srai_epi16( _mm_add_epi16( cb, bias ), 8 ), bias );
+
+			cr = _mm_add_epi16( _mm_mullo_epi16( r, _mm_set1_epi16( 112 ) ),
+				_mm_mullo_epi16( g, _mm_set1_epi16( -94 ) ) );
+			cr = _mm_add_epi16( cr, _mm_mullo_epi16( b, _mm_set1_epi16( -18 ) ) );
+			cr = _mm_add_epi16( _mm_srai_epi16( _mm_add_epi16( cr, bias ), 8 ), bias );
+
+			cb = _mm_packus_epi16( cb, cr );
+			_mm_storel_epi64( (__m128i *)( u + x ), cb );
+			_mm_storel_epi64( (__m128i *)( v + x ), _mm_srli_si128( cb, 8 ) );
+		}
+#endif
+		for( ; x < chromaWidth; x++ )
+		{
+			int			x0 = 2 * x;
+			int			x1 = ( x0 + 1 < width ) ? x0 + 1 : x0;
+			const byte	*a0 = row0 + x0 * 4, *a1 = row0 + x1 * 4;
+			const byte	*b0 = row1 + x0 * 4, *b1 = row1 + x1 * 4;
+			int			c[3], i;
+
+			for( i = 0; i < 3; i++ )
+				c[i] = ( ( ( a0[i] + b0[i] + 1 ) >> 1 ) + ( ( a1[i] + b1[i] + 1 ) >> 1 ) + 1 ) >> 1;
+
+			u[x] = R_CbFromRGB( c[0], c[1], c[2] );
+			v[x] = R_CrFromRGB( c[0], c[1], c[2] );
+		}
+	}
+
+	return width * height + 2 * chromaWidth * chromaHeight;
+}
+
 /*
 ==================
 RB_TakeVideoFrameCmd
@@ -786,6 +944,25 @@ const void *RB_TakeVideoFrameCmd( const void *data )
 	
 	qglGetIntegerv(GL_PACK_ALIGNMENT, &packAlign);
 
+	if(cmd->format == VIDEOFRAME_YUV420)
+	{
+		// read back RGBA so every pixel is a 32 bit word for the converter
+		padwidth = PAD(cmd->width * 4, packAlign);
+		cBuf = PADP(cmd->captureBuffer, packAlign);
+
+		qglReadPixels(0, 0, cmd->width, cmd->height, GL_RGBA,
+			GL_UNSIGNED_BYTE, cBuf);
+
+		if(glConfig.deviceSupportsGamma)
+			R_GammaCorrect(cBuf, padwidth * cmd->height);
+
+		memcount = R_ConvertRGBAToYUV420(cmd->encodeBuffer, cBuf,
+			cmd->width, cmd->height, padwidth);
+		ri.CL_WriteAVIVideoFrame(cmd->encodeBuffer, memcount);
+
+		return (const void *)(cmd + 1);
+	}
+
 	linelen = cmd->width * 3;
 
 	// Alignment stuff for glReadPixels
@@ -806,7 +983,7 @@ const void *RB_TakeVideoFrameCmd( const void *data )
 	if(glConfig.deviceSupportsGamma)
 		R_GammaCorrect(cBuf, memcount);
 
-	if(cmd->motionJpeg)
+	if(cmd->format == VIDEOFRAME_MJPEG)
 	{
 		memcount = RE_SaveJPGToBuffer(cmd->encodeBuffer, linelen * cmd->height,
 			r_aviMotionJpegQuality->integer,
@@ -1134,6 +1311,7 @@ void R_Register( void )
 
 	r_aviMotionJpegQuality = ri.Cvar_Get("r_aviMotionJpegQuality", "90", CVAR_ARCHIVE);
 	r_screenshotJpegQuality = ri.Cvar_Get("r_screenshotJpegQuality", "90", CVAR_ARCHIVE);
+	r_jpegThreads = ri.Cvar_Get("r_jpegThreads", "3", CVAR_ARCHIVE);
 
 	r_maxpolys = ri.Cvar_Get( "r_maxpolys", va("%d", MAX_POLYS), 0);
 	r_maxpolyverts = ri.Cvar_Get( "r_maxpolyverts", va("%d", MAX_POLYVERTS), 0);
@@ -1282,6 +1460,8 @@ void RE_Shutdown( qboolean destroyWindow ) {
 
 	R_DoneFreeType();
 
+	R_ShutdownJPGWorkers();
+
 	// shut down platform specific OpenGL stuff
 	if ( destroyWindow ) {
 		GLimp_Shutdown();
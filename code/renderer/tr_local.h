@@ -1147,6 +1147,8 @@ extern	cvar_t	*r_saveFontData;
 
 extern cvar_t	*r_marksOnTriangleMeshes;
 
+extern cvar_t	*r_jpegThreads;					// worker threads for slice-parallel JPEG encoding
+
 //====================================================================
 
 float R_NoiseGet4f( float x, float y, float z, float t );
@@ -1662,7 +1664,7 @@ typedef struct {
 	int						height;
 	byte					*captureBuffer;
 	byte					*encodeBuffer;
-	qboolean			motionJpeg;
+	videoFrameFormat_t		format;
 } videoFrameCommand_t;
 
 typedef struct
@@ -1739,8 +1741,9 @@ void RE_SaveJPG(char * filename, int quality, int image_width, int image_height,
                 unsigned char *image_buffer, int padding);
 size_t RE_SaveJPGToBuffer(byte *buffer, size_t bufSize, int quality,
 		          int image_width, int image_height, byte *image_buffer, int padding);
+void R_ShutdownJPGWorkers(void);
 void RE_TakeVideoFrame( int width, int height,
-		byte *captureBuffer, byte *encodeBuffer, qboolean motionJpeg );
+		byte *captureBuffer, byte *encodeBuffer, videoFrameFormat_t format );
 
 // font stuff
 void R_InitFreeType( void );
@@ -100,7 +100,7 @@ typedef struct {
 	qboolean (*GetEntityToken)( char *buffer, int size );
 	qboolean (*inPVS)( const vec3_t p1, const vec3_t p2 );
 
-	void (*TakeVideoFrame)( int h, int w, byte* captureBuffer, byte *encodeBuffer, qboolean motionJpeg );
+	void (*TakeVideoFrame)( int h, int w, byte* captureBuffer, byte *encodeBuffer, videoFrameFormat_t format );
 } refexport_t;
 
 //
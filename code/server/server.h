@@ -57,7 +57,6 @@ typedef struct svEntity_s {
 	int			clusternums[MAX_ENT_CLUSTERS];
 	int			lastCluster;		// if all the clusters don't fit in clusternums
 	int			areanum, areanum2;
-	int			snapshotCounter;	// used to prevent double adding from portal views
 } svEntity_t;
 
 typedef enum {
@@ -75,11 +74,12 @@ typedef struct {
 	// https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=475
 	// the serverId associated with the current checksumFeed (always <= serverId)
 	int       checksumFeedServerId;	
-	int				snapshotCounter;	// incremented for each snapshot built
 	int				timeResidual;		// <= 1000 / sv_frame->value
+	int				frameFraction;		// usec a sv_fps that doesn't divide 1000 owes the game time
 	int				nextFrameTime;		// when time > nextFrameTime, process world
 	struct cmodel_s	*models[MAX_MODELS];
 	char			*configstrings[MAX_CONFIGSTRINGS];
+	uint64_t		gamestateHash;		// of configstrings and baselines, 0 after a change
 	svEntity_t		svEntities[MAX_GENTITIES];
 
 	char			*entityParsePoint;	// used during game VM init
@@ -142,6 +142,9 @@ typedef struct client_s {
 	int				messageAcknowledge;
 
 	int				gamestateMessageNum;	// netchan->outgoingSequence of gamestate
+	qboolean		gamestateDelta;		// client caches gamestates to delta against
+	uint64_t		gamestateBase;		// hash of a gamestate the client is known to have
+	uint64_t		gamestateSent;		// hash of the last gamestate sent
 	int				challenge;
 
 	usercmd_t		lastUsercmd;
@@ -170,6 +173,9 @@ typedef struct client_s {
 	int				lastConnectTime;	// svs.time when connection started
 	int				lastSnapshotTime;	// svs.time of last sent snapshot
 	qboolean		rateDelayed;		// true if nextSnapshotTime was set based on rate instead of snapshotMsec
+	uint64_t		metricsBytesSent;	// sv_metrics counters since the client connected
+	int				metricsSnapshots;
+	int				metricsSnapshotsDelayed;
 	int				timeoutCount;		// must timeout a few frames in a row so debugging doesn't break
 	clientSnapshot_t	frames[PACKET_BACKUP];	// updates can be delta'd from here
 	int				ping;
@@ -290,6 +296,9 @@ extern	cvar_t	*sv_gametype;
 extern	cvar_t	*sv_pure;
 extern	cvar_t	*sv_floodProtect;
 extern	cvar_t	*sv_lanForceRate;
+extern	cvar_t	*sv_snapshotThreads;
+extern	cvar_t	*sv_fragmentBurst;
+extern	cvar_t	*sv_traceCache;
 #ifndef STANDALONE
 extern	cvar_t	*sv_strictAuth;
 #endif
@@ -317,7 +326,9 @@ void SV_RemoveOperatorCommands (void);
 
 
 void SV_MasterShutdown (void);
+int SV_ClientRate(client_t *client);
 int SV_RateMsec(client_t *client);
+void SV_ClearQueryCache( void );
 
 
 
@@ -351,6 +362,7 @@ void SV_ExecuteClientMessage( client_t *cl, msg_t *msg );
 void SV_UserinfoChanged( client_t *cl );
 
 void SV_ClientEnterWorld( client_t *client, usercmd_t *cmd );
+void SV_FreeGamestates( void );
 void SV_FreeClient(client_t *client);
 void SV_DropClient( client_t *drop, const char *reason );
 
@@ -459,9 +471,37 @@ void SV_Trace( trace_t *results, const vec3_t start, vec3_t mins, vec3_t maxs, c
 // passEntityNum is explicitly excluded from clipping checks (normally ENTITYNUM_NONE)
 
 
+void SV_ClearTraceCache( void );
+// forgets the SV_Trace results cached with sv_traceCache, done at every
+// game frame and whenever an entity is linked or unlinked
+
+void SV_TraceCacheCounters( uint64_t *lookups, uint64_t *hits );
+
 void SV_ClipToEntity( trace_t *trace, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int entityNum, int contentmask, int capsule );
 // clip to a specific entity
 
+//
+// sv_metrics.c
+//
+typedef enum {
+	SVM_PACKETS,	// SV_PacketEvent, including client commands and usercmds
+	SVM_BOTS,		// SV_BotFrame
+	SVM_GAME,		// GAME_RUN_FRAME
+	SVM_SNAPSHOT,	// visibility, entity collection and copies
+	SVM_ENCODE,		// delta encoding and compression
+	SVM_SEND,		// transmitting the messages
+	SVM_TOTAL,		// SV_Frame and the packets since the previous one
+	SVM_NUM_SECTIONS
+} svMetricsSection_t;
+
+void SV_MetricsInit( void );
+void SV_MetricsBeginSection( svMetricsSection_t section );
+void SV_MetricsEndSection( svMetricsSection_t section );
+void SV_MetricsMessageSent( client_t *client, int bytes );
+void SV_MetricsSnapshotSent( client_t *client );
+void SV_MetricsSnapshotDelayed( client_t *client );
+void SV_MetricsFrame( void );
+
 //
 // sv_net_chan.c
 //
@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "server.h"
 
 static void SV_CloseDownload( client_t *cl );
+static uint64_t SV_ParseGamestateHash( const char *s );
 
 /*
 =================
@@ -318,6 +319,7 @@ void SV_DirectConnect( netadr_t from ) {
 	int			qport;
 	int			challenge;
 	char		*password;
+	char		*gamestateHash;
 	int			startIndex;
 	intptr_t		denied;
 	int			count;
@@ -532,6 +534,14 @@ gotnewcl:
 	// save the challenge
 	newcl->challenge = challenge;
 
+	// a client that caches gamestates sends the hash of the last one it got
+	gamestateHash = Info_ValueForKey( userinfo, "gamestate" );
+	if ( *gamestateHash ) {
+		newcl->gamestateDelta = qtrue;
+		newcl->gamestateBase = SV_ParseGamestateHash( gamestateHash );
+		Info_RemoveKey( userinfo, "gamestate" );
+	}
+
 	// save the address
 #ifdef LEGACY_PROTOCOL
 	newcl->compat = compat;
@@ -686,6 +696,186 @@ void SV_DropClient( client_t *drop, const char *reason ) {
 	}
 }
 
+/*
+=============================================================================
+
+GAMESTATE DELTAS
+
+Clients that set the "gamestate" connect key keep their last gamestates
+around, so after a map change or a reconnect only the configstrings and
+baselines that differ from one of those have to be sent.
+
+=============================================================================
+*/
+
+#define MAX_GAMESTATES	4
+
+typedef struct {
+	uint64_t		hash;
+	char			*configstrings[MAX_CONFIGSTRINGS];
+	entityState_t	baselines[MAX_GENTITIES];
+} storedGamestate_t;
+
+static storedGamestate_t	*storedGamestates[MAX_GAMESTATES];
+static int					nextStoredGamestate;
+
+/*
+================
+SV_FreeGamestates
+================
+*/
+void SV_FreeGamestates( void ) {
+	storedGamestate_t	*gs;
+	int					i, j;
+
+	for ( i = 0 ; i < MAX_GAMESTATES ; i++ ) {
+		gs = storedGamestates[i];
+		if ( !gs ) {
+			continue;
+		}
+		for ( j = 0 ; j < MAX_CONFIGSTRINGS ; j++ ) {
+			Z_Free( gs->configstrings[j] );
+		}
+		Z_Free( gs );
+		storedGamestates[i] = NULL;
+	}
+	nextStoredGamestate = 0;
+}
+
+/*
+================
+SV_GamestateBaseline
+
+Entities without a number never get a baseline sent
+================
+*/
+static const entityState_t *SV_GamestateBaseline( const entityState_t *base ) {
+	static const entityState_t	nullstate;
+
+	return base->number ? base : &nullstate;
+}
+
+/*
+================
+SV_HashGamestate
+
+64 bit FNV-1a, as a collision would have the client rebuild the new
+gamestate from the wrong base
+================
+*/
+static uint64_t SV_HashGamestate( void ) {
+	const byte	*p;
+	uint64_t	hash;
+	int			i, len;
+
+	hash = 14695981039346656037ULL;
+	for ( i = 0 ; i < MAX_CONFIGSTRINGS ; i++ ) {
+		p = (const byte *)sv.configstrings[i];
+		len = strlen( sv.configstrings[i] ) + 1;
+		while ( len-- ) {
+			hash = ( hash ^ *p++ ) * 1099511628211ULL;
+		}
+	}
+	for ( i = 0 ; i < MAX_GENTITIES ; i++ ) {
+		p = (const byte *)SV_GamestateBaseline( &sv.svEntities[i].baseline );
+		len = sizeof( entityState_t );
+		while ( len-- ) {
+			hash = ( hash ^ *p++ ) * 1099511628211ULL;
+		}
+	}
+
+	// zero tells the client the gamestate is not a delta
+	return hash ? hash : 1;
+}
+
+/*
+================
+SV_FindGamestate
+================
+*/
+static storedGamestate_t *SV_FindGamestate( uint64_t hash ) {
+	int		i;
+
+	if ( !hash ) {
+		return NULL;
+	}
+	for ( i = 0 ; i < MAX_GAMESTATES ; i++ ) {
+		if ( storedGamestates[i] && storedGamestates[i]->hash == hash ) {
+			return storedGamestates[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+================
+SV_ParseGamestateHash
+
+The client sends the hash as 16 hex digits in its connect userinfo
+================
+*/
+static uint64_t SV_ParseGamestateHash( const char *s ) {
+	unsigned	high, low;
+
+	if ( strlen( s ) != 16 || sscanf( s, "%8x%8x", &high, &low ) != 2 ) {
+		return 0;
+	}
+	return ( (uint64_t)high << 32 ) | low;
+}
+
+/*
+================
+SV_WriteGamestateHash
+================
+*/
+static void SV_WriteGamestateHash( msg_t *msg, uint64_t hash ) {
+	MSG_WriteLong( msg, (int)( hash & 0xffffffffu ) );
+	MSG_WriteLong( msg, (int)( hash >> 32 ) );
+}
+
+/*
+================
+SV_CurrentGamestate
+
+Hashes the current configstrings and baselines and keeps a copy of
+them so later gamestates can be sent as a delta, replacing the oldest
+stored one
+================
+*/
+static storedGamestate_t *SV_CurrentGamestate( void ) {
+	storedGamestate_t	*gs;
+	int					i;
+
+	if ( !sv.gamestateHash ) {
+		sv.gamestateHash = SV_HashGamestate();
+	}
+
+	gs = SV_FindGamestate( sv.gamestateHash );
+	if ( gs ) {
+		return gs;
+	}
+
+	gs = storedGamestates[nextStoredGamestate];
+	if ( !gs ) {
+		gs = Z_Malloc( sizeof( *gs ) );
+		storedGamestates[nextStoredGamestate] = gs;
+	}
+	nextStoredGamestate = ( nextStoredGamestate + 1 ) % MAX_GAMESTATES;
+
+	gs->hash = sv.gamestateHash;
+	for ( i = 0 ; i < MAX_CONFIGSTRINGS ; i++ ) {
+		if ( gs->configstrings[i] ) {
+			Z_Free( gs->configstrings[i] );
+		}
+		gs->configstrings[i] = CopyString( sv.configstrings[i] );
+	}
+	for ( i = 0 ; i < MAX_GENTITIES ; i++ ) {
+		gs->baselines[i] = *SV_GamestateBaseline( &sv.svEntities[i].baseline );
+	}
+
+	return gs;
+}
+
 /*
 ================
 SV_SendClientGameState
@@ -699,7 +889,10 @@ the wrong gamestate.
 */
 static void SV_SendClientGameState( client_t *client ) {
 	int			start;
-	entityState_t	*base, nullstate;
+	const entityState_t	*base, *oldBase;
+	entityState_t	nullstate;
+	storedGamestate_t	*current, *old;
+	const char	*oldString;
 	msg_t		msg;
 	byte		msgBuffer[MAX_MSGLEN];
 
@@ -714,6 +907,18 @@ static void SV_SendClientGameState( client_t *client ) {
 	// gamestate message was not just sent, forcing a retransmit
 	client->gamestateMessageNum = client->netchan.outgoingSequence;
 
+	current = old = NULL;
+	if ( client->gamestateDelta ) {
+		current = SV_CurrentGamestate();
+		old = SV_FindGamestate( client->gamestateBase );
+		if ( !old ) {
+			// the client may drop whatever it had while it receives a
+			// full gamestate, so don't delta against it until it acks
+			client->gamestateBase = 0;
+		}
+		client->gamestateSent = current->hash;
+	}
+
 	MSG_Init( &msg, msgBuffer, sizeof( msgBuffer ) );
 
 	// NOTE, MRE: all server->client messages now acknowledge
@@ -730,24 +935,38 @@ static void SV_SendClientGameState( client_t *client ) {
 	MSG_WriteByte( &msg, svc_gamestate );
 	MSG_WriteLong( &msg, client->reliableSequence );
 
-	// write the configstrings
+	if ( current ) {
+		MSG_WriteByte( &msg, svc_gamestateHash );
+		SV_WriteGamestateHash( &msg, current->hash );
+		SV_WriteGamestateHash( &msg, old ? old->hash : 0 );
+	}
+
+	// write the configstrings, an empty one clears a string of the old gamestate
 	for ( start = 0 ; start < MAX_CONFIGSTRINGS ; start++ ) {
-		if (sv.configstrings[start][0]) {
+		oldString = old ? old->configstrings[start] : "";
+		if ( strcmp( sv.configstrings[start], oldString ) ) {
 			MSG_WriteByte( &msg, svc_configstring );
 			MSG_WriteShort( &msg, start );
 			MSG_WriteBigString( &msg, sv.configstrings[start] );
 		}
 	}
 
-	// write the baselines
+	// write the baselines, a removed entity clears a baseline of the old gamestate
 	Com_Memset( &nullstate, 0, sizeof( nullstate ) );
 	for ( start = 0 ; start < MAX_GENTITIES; start++ ) {
-		base = &sv.svEntities[start].baseline;
-		if ( !base->number ) {
+		base = SV_GamestateBaseline( &sv.svEntities[start].baseline );
+		oldBase = old ? &old->baselines[start] : &nullstate;
+		if ( !memcmp( base, oldBase, sizeof( *base ) ) ) {
 			continue;
 		}
 		MSG_WriteByte( &msg, svc_baseline );
-		MSG_WriteDeltaEntity( &msg, &nullstate, base, qtrue );
+		if ( base->number ) {
+			MSG_WriteDeltaEntity( &msg, &nullstate, (entityState_t *)base, qtrue );
+		} else {
+			nullstate.number = start;
+			MSG_WriteDeltaEntity( &msg, &nullstate, NULL, qtrue );
+			nullstate.number = 0;
+		}
 	}
 
 	MSG_WriteByte( &msg, svc_EOF );
@@ -1383,6 +1602,9 @@ void SV_UserinfoChanged( client_t *cl ) {
 	// name for C code
 	Q_strncpyz( cl->name, Info_ValueForKey (cl->userinfo, "name"), sizeof(cl->name) );
 
+	// the gamestate cache key is only for the engine, keep it from the game
+	Info_RemoveKey( cl->userinfo, "gamestate" );
+
 	// rate command
 
 	// if the client is on the same subnet as the server and we aren't running an
@@ -1718,6 +1940,8 @@ static void SV_UserMove( client_t *cl, msg_t *msg, qboolean delta ) {
 	// if this is the first usercmd we have received
 	// this gamestate, put the client into the world
 	if ( cl->state == CS_PRIMED ) {
+		// the client has the gamestate now, so the next one can be a delta
+		cl->gamestateBase = cl->gamestateSent;
 		SV_ClientEnterWorld( cl, &cmds[0] );
 		// the moves can be processed normaly
 	}
@@ -123,6 +123,11 @@ void SV_SetConfigstring (int index, const char *val) {
 	// change the string in sv
 	Z_Free( sv.configstrings[index] );
 	sv.configstrings[index] = CopyString( val );
+	sv.gamestateHash = 0;
+
+	if ( index == CS_SERVERINFO || index == CS_SYSTEMINFO ) {
+		SV_ClearQueryCache();
+	}
 
 	// send it to all the clients if we aren't
 	// spawning a new server
@@ -230,6 +235,8 @@ static void SV_CreateBaseline( void ) {
 		//
 		sv.svEntities[entnum].baseline = svent->s;
 	}
+
+	sv.gamestateHash = 0;
 }
 
 
@@ -688,6 +695,12 @@ void SV_Init (void)
 	sv_killserver = Cvar_Get ("sv_killserver", "0", 0);
 	sv_mapChecksum = Cvar_Get ("sv_mapChecksum", "", CVAR_ROM);
 	sv_lanForceRate = Cvar_Get ("sv_lanForceRate", "1", CVAR_ARCHIVE );
+	sv_snapshotThreads = Cvar_Get ("sv_snapshotThreads", "1", CVAR_ARCHIVE );
+	Cvar_CheckRange( sv_snapshotThreads, 1, MAX_PARALLEL_THREADS, qtrue );
+	sv_fragmentBurst = Cvar_Get ("sv_fragmentBurst", "32768", CVAR_ARCHIVE );
+	Cvar_CheckRange( sv_fragmentBurst, 0, 65536, qtrue );
+	sv_traceCache = Cvar_Get ("sv_traceCache", "0", CVAR_ARCHIVE );
+	Cvar_CheckRange( sv_traceCache, 0, 1, qtrue );
 #ifndef STANDALONE
 	sv_strictAuth = Cvar_Get ("sv_strictAuth", "1", CVAR_ARCHIVE );
 #endif
@@ -697,6 +710,8 @@ void SV_Init (void)
 	// initialize bot cvars so they are listed and can be set before loading the botlib
 	SV_BotInitCvars();
 
+	SV_MetricsInit();
+
 	// init the botlib here because we need the pre-compiler in the UI
 	SV_BotInitBotLib();
 	
@@ -764,6 +779,7 @@ void SV_Shutdown( char *finalmsg ) {
 
 	// free current level
 	SV_ClearServer();
+	SV_FreeGamestates();
 
 	// free server static data
 	if(svs.clients)
@@ -57,6 +57,9 @@ cvar_t	*sv_gametype;
 cvar_t	*sv_pure;
 cvar_t	*sv_floodProtect;
 cvar_t	*sv_lanForceRate; // dedicated 1 (LAN) server forces local client rates to 99999 (bug #491)
+cvar_t	*sv_snapshotThreads;		// threads building client snapshots
+cvar_t	*sv_fragmentBurst;			// bytes of a fragmented message sent at once
+cvar_t	*sv_traceCache;				// reuse identical SV_Trace results within a game frame
 #ifndef STANDALONE
 cvar_t	*sv_strictAuth;
 #endif
@@ -357,135 +360,101 @@ CONNECTIONLESS COMMANDS
 typedef struct leakyBucket_s leakyBucket_t;
 struct leakyBucket_s {
 	netadrtype_t	type;
+	byte			prefix[8];		// the whole IPv4 address or the IPv6 /64
 
-	union {
-		byte	_4[4];
-		byte	_6[16];
-	} ipv;
-
-	int						lastTime;
+	int				lastTime;
 	signed char		burst;
-
-	long					hash;
-
-	leakyBucket_t *prev, *next;
 };
 
-// This is deliberately quite large to make it more of an effort to DoS
+// This is deliberately quite large to make it more of an effort to DoS.
+// The table is open addressed, an address can only end up in one of the
+// MAX_BUCKET_PROBES slots following its hash, so finding or replacing a
+// bucket never takes longer than looking at those.
 #define MAX_BUCKETS			16384
-#define MAX_HASHES			1024
+#define MAX_BUCKET_PROBES	8
 
 static leakyBucket_t buckets[ MAX_BUCKETS ];
-static leakyBucket_t *bucketHashes[ MAX_HASHES ];
+static unsigned int bucketSalt;
 
 /*
 ================
-SVC_HashForAddress
+SVC_HashForPrefix
+
+Salted, so spoofed addresses can't be picked to push a
+particular address out of the table
 ================
 */
-static long SVC_HashForAddress( netadr_t address ) {
-	byte 		*ip = NULL;
-	size_t	size = 0;
-	int			i;
-	long		hash = 0;
+static unsigned int SVC_HashForPrefix( netadrtype_t type, const byte *prefix ) {
+	unsigned int	hash;
+	int				i;
 
-	switch ( address.type ) {
-		case NA_IP:  ip = address.ip;  size = 4; break;
-		case NA_IP6: ip = address.ip6; size = 16; break;
-		default: break;
+	if ( !bucketSalt ) {
+		Com_RandomBytes( (byte *)&bucketSalt, sizeof( bucketSalt ) );
+		bucketSalt |= 1;
 	}
 
-	for ( i = 0; i < size; i++ ) {
-		hash += (long)( ip[ i ] ) * ( i + 119 );
+	hash = bucketSalt ^ type;
+	for ( i = 0; i < 8; i++ ) {
+		hash = ( hash ^ prefix[ i ] ) * 16777619;
 	}
 
-	hash = ( hash ^ ( hash >> 10 ) ^ ( hash >> 20 ) );
-	hash &= ( MAX_HASHES - 1 );
-
-	return hash;
+	return hash ^ ( hash >> 15 );
 }
 
 /*
 ================
 SVC_BucketForAddress
 
-Find or allocate a bucket for an address
+Find or allocate a bucket for an address. IPv6 addresses are limited
+per /64, as that is what a single host usually gets to pick from.
 ================
 */
 static leakyBucket_t *SVC_BucketForAddress( netadr_t address, int burst, int period ) {
-	leakyBucket_t	*bucket = NULL;
-	int						i;
-	long					hash = SVC_HashForAddress( address );
-	int						now = Sys_Milliseconds();
-
-	for ( bucket = bucketHashes[ hash ]; bucket; bucket = bucket->next ) {
-		switch ( bucket->type ) {
-			case NA_IP:
-				if ( memcmp( bucket->ipv._4, address.ip, 4 ) == 0 ) {
-					return bucket;
-				}
-				break;
-
-			case NA_IP6:
-				if ( memcmp( bucket->ipv._6, address.ip6, 16 ) == 0 ) {
-					return bucket;
-				}
-				break;
+	leakyBucket_t	*bucket, *unused, *oldest;
+	byte			prefix[8];
+	unsigned int	hash;
+	int				i, interval;
+	int				now = Sys_Milliseconds();
 
-			default:
-				break;
-		}
+	Com_Memset( prefix, 0, sizeof( prefix ) );
+	switch ( address.type ) {
+		case NA_IP:  Com_Memcpy( prefix, address.ip, 4 );  break;
+		case NA_IP6: Com_Memcpy( prefix, address.ip6, 8 ); break;
+		default: break;
 	}
 
-	for ( i = 0; i < MAX_BUCKETS; i++ ) {
-		int interval;
-
-		bucket = &buckets[ i ];
-		interval = now - bucket->lastTime;
+	hash = SVC_HashForPrefix( address.type, prefix );
+	unused = oldest = NULL;
 
-		// Reclaim expired buckets
-		if ( bucket->lastTime > 0 && ( interval > ( burst * period ) ||
-					interval < 0 ) ) {
-			if ( bucket->prev != NULL ) {
-				bucket->prev->next = bucket->next;
-			} else {
-				bucketHashes[ bucket->hash ] = bucket->next;
-			}
-			
-			if ( bucket->next != NULL ) {
-				bucket->next->prev = bucket->prev;
-			}
+	for ( i = 0; i < MAX_BUCKET_PROBES; i++ ) {
+		bucket = &buckets[ ( hash + i ) & ( MAX_BUCKETS - 1 ) ];
 
-			Com_Memset( bucket, 0, sizeof( leakyBucket_t ) );
+		if ( bucket->type == address.type && !memcmp( bucket->prefix, prefix, sizeof( prefix ) ) ) {
+			return bucket;
 		}
 
-		if ( bucket->type == NA_BAD ) {
-			bucket->type = address.type;
-			switch ( address.type ) {
-				case NA_IP:  Com_Memcpy( bucket->ipv._4, address.ip, 4 );   break;
-				case NA_IP6: Com_Memcpy( bucket->ipv._6, address.ip6, 16 ); break;
-				default: break;
-			}
-
-			bucket->lastTime = now;
-			bucket->burst = 0;
-			bucket->hash = hash;
+		interval = now - bucket->lastTime;
 
-			// Add to the head of the relevant hash chain
-			bucket->next = bucketHashes[ hash ];
-			if ( bucketHashes[ hash ] != NULL ) {
-				bucketHashes[ hash ]->prev = bucket;
+		// expired buckets can be reclaimed
+		if ( bucket->type == NA_BAD || interval > burst * period || interval < 0 ) {
+			if ( !unused ) {
+				unused = bucket;
 			}
-
-			bucket->prev = NULL;
-			bucketHashes[ hash ] = bucket;
-
-			return bucket;
+		} else if ( !oldest || bucket->lastTime - oldest->lastTime < 0 ) {
+			oldest = bucket;
 		}
 	}
 
-	// Couldn't allocate a bucket for this address
-	return NULL;
+	// with every slot in use, the address that was quiet the longest
+	// loses its bucket
+	bucket = unused ? unused : oldest;
+
+	bucket->type = address.type;
+	Com_Memcpy( bucket->prefix, prefix, sizeof( prefix ) );
+	bucket->lastTime = now;
+	bucket->burst = 0;
+
+	return bucket;
 }
 
 /*
@@ -531,24 +500,219 @@ static qboolean SVC_RateLimitAddress( netadr_t from, int burst, int period ) {
 	return SVC_RateLimit( bucket, burst, period );
 }
 
+/*
+==============================================================================
+
+Cached getstatus and getinfo responses. Server browsers and master list
+storms ask for these far more often than anything in them changes, so the
+responses are only rebuilt when the serverinfo or systeminfo configstrings
+change, a client connects or leaves, or a score, ping or name changes.
+The challenge each request echoes back is the only part added per request.
+
+==============================================================================
+*/
+
+typedef struct {
+	qboolean	connected;
+	int			score;
+	int			ping;
+	char		name[MAX_NAME_LENGTH];
+} statusPlayer_t;
+
+static struct {
+	qboolean		valid;
+	int				maxclients;
+	statusPlayer_t	players[MAX_CLIENTS];
+
+	// the serverinfo string and a line per player
+	char			response[MAX_MSGLEN];
+	int				responseLength;
+	int				infoLength;
+} statusCache;
+
+static struct {
+	qboolean		valid;
+	int				count, humans;
+
+	char			response[MAX_INFO_STRING];
+	int				responseLength;
+} infoCache;
+
+/*
+================
+SV_ClearQueryCache
+
+Called whenever the serverinfo or systeminfo configstring changes
+================
+*/
+void SV_ClearQueryCache( void ) {
+	statusCache.valid = qfalse;
+	infoCache.valid = qfalse;
+}
+
 /*
 ================
-SVC_Status
+SVC_QueryCacheStale
 
-Responds with all the info that qplug or qspy can see about the server
-and all connected players.  Used for getting detailed information after
-the simple info query.
+Cvars can change between two server frames, before the configstrings
+are updated
 ================
 */
-static void SVC_Status( netadr_t from ) {
+static qboolean SVC_QueryCacheStale( void ) {
+	return ( cvar_modifiedFlags & ( CVAR_SERVERINFO | CVAR_SYSTEMINFO ) ) != 0;
+}
+
+/*
+================
+SVC_ChallengeInfo
+
+The challenge echoed back in the infostring of a response, if it fits
+================
+*/
+static int SVC_ChallengeInfo( char *challenge, int infoLength ) {
+	int		length;
+
+	challenge[0] = '\0';
+	Info_SetValueForKey( challenge, "challenge", Cmd_Argv(1) );
+
+	length = strlen( challenge );
+	if ( length + infoLength >= MAX_INFO_STRING ) {
+		Com_Printf( "Info string length exceeded\n" );
+		challenge[0] = '\0';
+		return 0;
+	}
+
+	return length;
+}
+
+/*
+================
+SVC_SendResponse
+
+Sends command, then the given parts, as one out of band packet
+================
+*/
+static void SVC_SendResponse( netadr_t from, const char *command, const char **parts, const int *lengths, int numParts ) {
+	char	packet[MAX_MSGLEN];
+	int		length, partLength;
+	int		i;
+
+	packet[0] = packet[1] = packet[2] = packet[3] = -1;
+	length = 4;
+
+	partLength = strlen( command );
+	Com_Memcpy( packet + length, command, partLength );
+	length += partLength;
+
+	// truncated like NET_OutOfBandPrint would
+	for ( i = 0; i < numParts; i++ ) {
+		partLength = lengths[i];
+		if ( length + partLength > sizeof( packet ) - 1 ) {
+			partLength = sizeof( packet ) - 1 - length;
+		}
+
+		Com_Memcpy( packet + length, parts[i], partLength );
+		length += partLength;
+	}
+
+	NET_SendPacket( NS_SERVER, length, packet, from );
+}
+
+/*
+================
+SVC_UpdateStatusPlayers
+
+Returns qtrue if anything shown in the player lines of a status
+response changed since the last call
+================
+*/
+static qboolean SVC_UpdateStatusPlayers( void ) {
+	statusPlayer_t	*player;
+	client_t		*cl;
+	qboolean		changed;
+	int				i, score;
+
+	changed = ( statusCache.maxclients != sv_maxclients->integer );
+	statusCache.maxclients = sv_maxclients->integer;
+
+	for ( i = 0 ; i < sv_maxclients->integer ; i++ ) {
+		cl = &svs.clients[i];
+		player = &statusCache.players[i];
+
+		if ( cl->state < CS_CONNECTED ) {
+			if ( player->connected ) {
+				player->connected = qfalse;
+				changed = qtrue;
+			}
+			continue;
+		}
+
+		score = SV_GameClientNum( i )->persistant[PERS_SCORE];
+
+		if ( !player->connected || player->score != score || player->ping != cl->ping ||
+			strcmp( player->name, cl->name ) ) {
+			player->connected = qtrue;
+			player->score = score;
+			player->ping = cl->ping;
+			Q_strncpyz( player->name, cl->name, sizeof( player->name ) );
+			changed = qtrue;
+		}
+	}
+
+	return changed;
+}
+
+/*
+================
+SVC_BuildStatusResponse
+================
+*/
+static void SVC_BuildStatusResponse( void ) {
 	char	player[1024];
-	char	status[MAX_MSGLEN];
+	char	*status;
 	int		i;
-	client_t	*cl;
-	playerState_t	*ps;
 	int		statusLength;
 	int		playerLength;
 	char	infostring[MAX_INFO_STRING];
+
+	Q_strncpyz( infostring, Cvar_InfoString( CVAR_SERVERINFO ), sizeof( infostring ) );
+	Info_RemoveKey( infostring, "challenge" );
+
+	statusCache.infoLength = Com_sprintf( statusCache.response, sizeof( statusCache.response ),
+		"%s\n", infostring ) - 1;
+	status = statusCache.response + statusCache.infoLength + 1;
+	statusLength = 0;
+
+	for (i=0 ; i < sv_maxclients->integer ; i++) {
+		if ( statusCache.players[i].connected ) {
+			Com_sprintf (player, sizeof(player), "%i %i \"%s\"\n", 
+				statusCache.players[i].score, statusCache.players[i].ping, statusCache.players[i].name);
+			playerLength = strlen(player);
+			if (status + statusLength + playerLength >= statusCache.response + sizeof( statusCache.response ) ) {
+				break;		// can't hold any more
+			}
+			strcpy (status + statusLength, player);
+			statusLength += playerLength;
+		}
+	}
+
+	statusCache.responseLength = status + statusLength - statusCache.response;
+	statusCache.valid = qtrue;
+}
+
+/*
+================
+SVC_Status
+
+Responds with all the info that qplug or qspy can see about the server
+and all connected players.  Used for getting detailed information after
+the simple info query.
+================
+*/
+static void SVC_Status( netadr_t from ) {
+	char		challenge[MAX_INFO_STRING];
+	const char	*parts[2];
+	int			lengths[2];
 	static leakyBucket_t bucket;
 
 	// ignore if we are in single player
@@ -570,31 +734,69 @@ static void SVC_Status( netadr_t from ) {
 		return;
 	}
 
-	strcpy( infostring, Cvar_InfoString( CVAR_SERVERINFO ) );
+	if ( SVC_UpdateStatusPlayers() || !statusCache.valid || SVC_QueryCacheStale() ) {
+		SVC_BuildStatusResponse();
+	}
 
 	// echo back the parameter to status. so master servers can use it as a challenge
 	// to prevent timed spoofed reply packets that add ghost servers
-	Info_SetValueForKey( infostring, "challenge", Cmd_Argv(1) );
+	parts[0] = challenge;
+	lengths[0] = SVC_ChallengeInfo( challenge, statusCache.infoLength );
+	parts[1] = statusCache.response;
+	lengths[1] = statusCache.responseLength;
 
-	status[0] = 0;
-	statusLength = 0;
+	SVC_SendResponse( from, "statusResponse\n", parts, lengths, 2 );
+}
 
-	for (i=0 ; i < sv_maxclients->integer ; i++) {
-		cl = &svs.clients[i];
-		if ( cl->state >= CS_CONNECTED ) {
-			ps = SV_GameClientNum( i );
-			Com_sprintf (player, sizeof(player), "%i %i \"%s\"\n", 
-				ps->persistant[PERS_SCORE], cl->ping, cl->name);
-			playerLength = strlen(player);
-			if (statusLength + playerLength >= sizeof(status) ) {
-				break;		// can't hold any more
-			}
-			strcpy (status + statusLength, player);
-			statusLength += playerLength;
-		}
+/*
+================
+SVC_BuildInfoResponse
+================
+*/
+static void SVC_BuildInfoResponse( void ) {
+	char	*gamedir;
+	char	*infostring = infoCache.response;
+
+	infostring[0] = 0;
+
+	Info_SetValueForKey( infostring, "gamename", com_gamename->string );
+
+#ifdef LEGACY_PROTOCOL
+	if(com_legacyprotocol->integer > 0)
+		Info_SetValueForKey(infostring, "protocol", va("%i", com_legacyprotocol->integer));
+	else
+#endif
+		Info_SetValueForKey(infostring, "protocol", va("%i", com_protocol->integer));
+
+	Info_SetValueForKey( infostring, "hostname", sv_hostname->string );
+	Info_SetValueForKey( infostring, "mapname", sv_mapname->string );
+	Info_SetValueForKey( infostring, "clients", va("%i", infoCache.count) );
+	Info_SetValueForKey(infostring, "g_humanplayers", va("%i", infoCache.humans));
+	Info_SetValueForKey( infostring, "sv_maxclients", 
+		va("%i", sv_maxclients->integer - sv_privateClients->integer ) );
+	Info_SetValueForKey( infostring, "gametype", va("%i", sv_gametype->integer ) );
+	Info_SetValueForKey( infostring, "pure", va("%i", sv_pure->integer ) );
+	Info_SetValueForKey(infostring, "g_needpass", va("%d", Cvar_VariableIntegerValue("g_needpass")));
+
+#ifdef USE_VOIP
+	if (sv_voip->integer) {
+		Info_SetValueForKey( infostring, "voip", va("%i", sv_voip->integer ) );
 	}
+#endif
 
-	NET_OutOfBandPrint( NS_SERVER, from, "statusResponse\n%s\n%s", infostring, status );
+	if( sv_minPing->integer ) {
+		Info_SetValueForKey( infostring, "minPing", va("%i", sv_minPing->integer) );
+	}
+	if( sv_maxPing->integer ) {
+		Info_SetValueForKey( infostring, "maxPing", va("%i", sv_maxPing->integer) );
+	}
+	gamedir = Cvar_VariableString( "fs_game" );
+	if( *gamedir ) {
+		Info_SetValueForKey( infostring, "game", gamedir );
+	}
+
+	infoCache.responseLength = strlen( infostring );
+	infoCache.valid = qtrue;
 }
 
 /*
@@ -607,8 +809,10 @@ if a user is interested in a server to do a full status
 */
 void SVC_Info( netadr_t from ) {
 	int		i, count, humans;
-	char	*gamedir;
-	char	infostring[MAX_INFO_STRING];
+	char	challenge[MAX_INFO_STRING];
+	const char	*parts[2];
+	int		lengths[2];
+	static leakyBucket_t bucket;
 
 	// ignore if we are in single player
 	if ( Cvar_VariableValue( "g_gametype" ) == GT_SINGLE_PLAYER || Cvar_VariableValue("ui_singlePlayerActive")) {
@@ -624,6 +828,19 @@ void SVC_Info( netadr_t from ) {
 	if(strlen(Cmd_Argv(1)) > 128)
 		return;
 
+	// Prevent using getinfo as an amplifier
+	if ( SVC_RateLimitAddress( from, 10, 1000 ) ) {
+		Com_DPrintf( "SVC_Info: rate limit from %s exceeded, dropping request\n",
+			NET_AdrToString( from ) );
+		return;
+	}
+
+	// Keep a flood of getinfo requests from eating the server frame
+	if ( SVC_RateLimit( &bucket, 20, 50 ) ) {
+		Com_DPrintf( "SVC_Info: rate limit exceeded, dropping request\n" );
+		return;
+	}
+
 	// don't count privateclients
 	count = humans = 0;
 	for ( i = sv_privateClients->integer ; i < sv_maxclients->integer ; i++ ) {
@@ -635,49 +852,21 @@ void SVC_Info( netadr_t from ) {
 		}
 	}
 
-	infostring[0] = 0;
+	if ( !infoCache.valid || infoCache.count != count || infoCache.humans != humans ||
+		SVC_QueryCacheStale() ) {
+		infoCache.count = count;
+		infoCache.humans = humans;
+		SVC_BuildInfoResponse();
+	}
 
 	// echo back the parameter to status. so servers can use it as a challenge
 	// to prevent timed spoofed reply packets that add ghost servers
-	Info_SetValueForKey( infostring, "challenge", Cmd_Argv(1) );
-
-	Info_SetValueForKey( infostring, "gamename", com_gamename->string );
-
-#ifdef LEGACY_PROTOCOL
-	if(com_legacyprotocol->integer > 0)
-		Info_SetValueForKey(infostring, "protocol", va("%i", com_legacyprotocol->integer));
-	else
-#endif
-		Info_SetValueForKey(infostring, "protocol", va("%i", com_protocol->integer));
+	parts[0] = infoCache.response;
+	lengths[0] = infoCache.responseLength;
+	parts[1] = challenge;
+	lengths[1] = SVC_ChallengeInfo( challenge, infoCache.responseLength );
 
-	Info_SetValueForKey( infostring, "hostname", sv_hostname->string );
-	Info_SetValueForKey( infostring, "mapname", sv_mapname->string );
-	Info_SetValueForKey( infostring, "clients", va("%i", count) );
-	Info_SetValueForKey(infostring, "g_humanplayers", va("%i", humans));
-	Info_SetValueForKey( infostring, "sv_maxclients", 
-		va("%i", sv_maxclients->integer - sv_privateClients->integer ) );
-	Info_SetValueForKey( infostring, "gametype", va("%i", sv_gametype->integer ) );
-	Info_SetValueForKey( infostring, "pure", va("%i", sv_pure->integer ) );
-	Info_SetValueForKey(infostring, "g_needpass", va("%d", Cvar_VariableIntegerValue("g_needpass")));
-
-#ifdef USE_VOIP
-	if (sv_voip->integer) {
-		Info_SetValueForKey( infostring, "voip", va("%i", sv_voip->integer ) );
-	}
-#endif
-
-	if( sv_minPing->integer ) {
-		Info_SetValueForKey( infostring, "minPing", va("%i", sv_minPing->integer) );
-	}
-	if( sv_maxPing->integer ) {
-		Info_SetValueForKey( infostring, "maxPing", va("%i", sv_maxPing->integer) );
-	}
-	gamedir = Cvar_VariableString( "fs_game" );
-	if( *gamedir ) {
-		Info_SetValueForKey( infostring, "game", gamedir );
-	}
-
-	NET_OutOfBandPrint( NS_SERVER, from, "infoResponse\n%s", infostring );
+	SVC_SendResponse( from, "infoResponse\n", parts, lengths, 2 );
 }
 
 /*
@@ -820,10 +1009,10 @@ static void SV_ConnectionlessPacket( netadr_t from, msg_t *msg ) {
 
 /*
 =================
-SV_PacketEvent
+SV_ProcessPacket
 =================
 */
-void SV_PacketEvent( netadr_t from, msg_t *msg ) {
+static void SV_ProcessPacket( netadr_t from, msg_t *msg ) {
 	int			i;
 	client_t	*cl;
 	int			qport;
@@ -876,6 +1065,17 @@ void SV_PacketEvent( netadr_t from, msg_t *msg ) {
 	}
 }
 
+/*
+=================
+SV_PacketEvent
+=================
+*/
+void SV_PacketEvent( netadr_t from, msg_t *msg ) {
+	SV_MetricsBeginSection( SVM_PACKETS );
+	SV_ProcessPacket( from, msg );
+	SV_MetricsEndSection( SVM_PACKETS );
+}
+
 
 /*
 ===================
@@ -1016,25 +1216,54 @@ static qboolean SV_CheckPaused( void ) {
 
 /*
 ==================
-SV_FrameMsec
-Return time in millseconds until processing of the next server frame.
+SV_FrameLength
+
+Length in usec of a server frame at the current sv_fps
 ==================
 */
-int SV_FrameMsec()
+static int SV_FrameLength( void )
 {
-	if(sv_fps)
-	{
-		int frameMsec;
-		
-		frameMsec = 1000.0f / sv_fps->value;
-		
-		if(frameMsec < sv.timeResidual)
-			return 0;
-		else
-			return frameMsec - sv.timeResidual;
-	}
+	// don't let it scale below 1ms
+	if(sv_fps->integer > 1000)
+		return 1000;
+
+	return 1000000 / sv_fps->integer;
+}
+
+/*
+==================
+SV_NextFrameMsec
+
+Game time only advances in whole milliseconds, so with an sv_fps that
+doesn't divide 1000 the frames are a millisecond longer every now and then,
+keeping the average rate at sv_fps.
+==================
+*/
+static int SV_NextFrameMsec( void )
+{
+	return (sv.frameFraction + SV_FrameLength()) / 1000;
+}
+
+/*
+==================
+SV_FrameUsec
+
+Return time in microseconds until processing of the next server frame.
+==================
+*/
+int SV_FrameUsec(void)
+{
+	int frameMsec;
+
+	if(!sv_fps || sv_fps->integer < 1)
+		return 1000;
+
+	frameMsec = SV_NextFrameMsec();
+
+	if(frameMsec < sv.timeResidual)
+		return 0;
 	else
-		return 1;
+		return (frameMsec - sv.timeResidual) * 1000;
 }
 
 /*
@@ -1049,6 +1278,9 @@ void SV_Frame( int msec ) {
 	int		frameMsec;
 	int		startTime;
 
+	// no send batch is held across frames, close one an error left open
+	NET_FlushSendBatch();
+
 	// the menu kills the server with this cvar
 	if ( sv_killserver->integer ) {
 		SV_Shutdown ("Server was killed");
@@ -1077,16 +1309,16 @@ void SV_Frame( int msec ) {
 		Cvar_Set( "sv_fps", "10" );
 	}
 
-	frameMsec = 1000 / sv_fps->integer ;
-	// don't let it scale below 1ms
-	if(frameMsec < 1)
-	{
-		frameMsec = 1;
-	}
+	SV_MetricsBeginSection( SVM_TOTAL );
 
 	sv.timeResidual += msec;
 
-	if (!com_dedicated->integer) SV_BotFrame (sv.time + sv.timeResidual);
+	if (!com_dedicated->integer) {
+		SV_MetricsBeginSection( SVM_BOTS );
+		SV_ClearTraceCache();
+		SV_BotFrame (sv.time + sv.timeResidual);
+		SV_MetricsEndSection( SVM_BOTS );
+	}
 
 	// if time is about to hit the 32nd bit, kick all clients
 	// and clear sv.time, rather
@@ -1129,17 +1361,26 @@ void SV_Frame( int msec ) {
 	// update ping based on the all received frames
 	SV_CalcPings();
 
-	if (com_dedicated->integer) SV_BotFrame (sv.time);
+	if (com_dedicated->integer) {
+		SV_MetricsBeginSection( SVM_BOTS );
+		SV_ClearTraceCache();
+		SV_BotFrame (sv.time);
+		SV_MetricsEndSection( SVM_BOTS );
+	}
 
 	// run the game simulation in chunks
-	while ( sv.timeResidual >= frameMsec ) {
+	SV_MetricsBeginSection( SVM_GAME );
+	while ( sv.timeResidual >= ( frameMsec = SV_NextFrameMsec() ) ) {
+		sv.frameFraction = ( sv.frameFraction + SV_FrameLength() ) % 1000;
 		sv.timeResidual -= frameMsec;
 		svs.time += frameMsec;
 		sv.time += frameMsec;
 
 		// let everything in the world think and move
+		SV_ClearTraceCache();
 		VM_Call (gvm, GAME_RUN_FRAME, sv.time);
 	}
+	SV_MetricsEndSection( SVM_GAME );
 
 	if ( com_speeds->integer ) {
 		time_game = Sys_Milliseconds () - startTime;
@@ -1153,26 +1394,23 @@ void SV_Frame( int msec ) {
 
 	// send a heartbeat to the master if needed
 	SV_MasterHeartbeat(HEARTBEAT_FOR_MASTER);
+
+	SV_MetricsEndSection( SVM_TOTAL );
+	SV_MetricsFrame();
 }
 
 /*
 ====================
-SV_RateMsec
+SV_ClientRate
 
-Return the number of msec until another message can be sent to
-a client based on its rate settings
+Return the rate in bytes per second a client is sent data at,
+within sv_minRate and sv_maxRate
 ====================
 */
-
-#define UDPIP_HEADER_SIZE 28
-#define UDPIP6_HEADER_SIZE 48
-
-int SV_RateMsec(client_t *client)
+int SV_ClientRate(client_t *client)
 {
-	int rate, rateMsec;
-	int messageSize;
-	
-	messageSize = client->netchan.lastSentSize;
+	int rate;
+
 	rate = client->rate;
 
 	if(sv_maxRate->integer)
@@ -1191,10 +1429,34 @@ int SV_RateMsec(client_t *client)
 			rate = sv_minRate->integer;
 	}
 
+	return rate;
+}
+
+/*
+====================
+SV_RateMsec
+
+Return the number of msec until another message can be sent to
+a client based on its rate settings
+====================
+*/
+
+#define UDPIP_HEADER_SIZE 28
+#define UDPIP6_HEADER_SIZE 48
+
+int SV_RateMsec(client_t *client)
+{
+	int rate, rateMsec;
+	int messageSize;
+	
+	messageSize = client->netchan.lastSentSize;
+	rate = SV_ClientRate(client);
+
+	// every fragment of a burst went out with its own header
 	if(client->netchan.remoteAddress.type == NA_IP6)
-		messageSize += UDPIP6_HEADER_SIZE;
+		messageSize += UDPIP6_HEADER_SIZE * client->netchan.lastSentPackets;
 	else
-		messageSize += UDPIP_HEADER_SIZE;
+		messageSize += UDPIP_HEADER_SIZE * client->netchan.lastSentPackets;
 		
 	rateMsec = messageSize * 1000 / ((int) (rate * com_timescale->value));
 	rate = Sys_Milliseconds() - client->netchan.lastSentTime;
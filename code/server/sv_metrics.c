@@ -0,0 +1,357 @@
+/*
+===========================================================================
+This file is part of Quake III Arena source code.
+
+Quake III Arena source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Quake III Arena source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Quake III Arena source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// sv_metrics.c -- per frame server timings and traffic counters in the
+// Prometheus text format
+
+#include "server.h"
+
+static cvar_t	*sv_metrics;
+static cvar_t	*sv_metricsFile;
+static cvar_t	*sv_metricsInterval;
+
+static const char *svMetricsSectionNames[ SVM_NUM_SECTIONS ] = {
+	"packets",
+	"bots",
+	"game",
+	"snapshot",
+	"encode",
+	"send",
+	"total"
+};
+
+// upper bounds in usec, the last bucket is +Inf
+static const int svMetricsBuckets[] = {
+	50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000
+};
+
+#define SVM_NUM_BUCKETS		( ARRAY_LEN( svMetricsBuckets ) + 1 )
+
+typedef struct {
+	uint64_t	counts[ SVM_NUM_BUCKETS ];
+	uint64_t	count;
+	int64_t		sum;			// usec
+} svMetricsHistogram_t;
+
+static svMetricsHistogram_t	svmHistograms[ SVM_NUM_SECTIONS ];
+static int64_t				svmSectionStart[ SVM_NUM_SECTIONS ];
+static int64_t				svmCurrent[ SVM_NUM_SECTIONS ];
+
+// totals over all clients, including the ones that left
+static uint64_t				svmBytesSent;
+static uint64_t				svmSnapshots;
+static uint64_t				svmSnapshotsDelayed;
+
+static int					svmLastWrite;
+
+/*
+=================
+SV_MetricsBeginSection / SV_MetricsEndSection
+=================
+*/
+void SV_MetricsBeginSection( svMetricsSection_t section ) {
+	if ( sv_metrics->integer ) {
+		svmSectionStart[ section ] = Sys_Microseconds();
+	}
+}
+
+void SV_MetricsEndSection( svMetricsSection_t section ) {
+	if ( sv_metrics->integer && svmSectionStart[ section ] ) {
+		svmCurrent[ section ] += Sys_Microseconds() - svmSectionStart[ section ];
+		svmSectionStart[ section ] = 0;
+	}
+}
+
+/*
+=================
+SV_MetricsMessageSent
+=================
+*/
+void SV_MetricsMessageSent( client_t *client, int bytes ) {
+	client->metricsBytesSent += bytes;
+	svmBytesSent += bytes;
+}
+
+/*
+=================
+SV_MetricsSnapshotSent
+=================
+*/
+void SV_MetricsSnapshotSent( client_t *client ) {
+	client->metricsSnapshots++;
+	svmSnapshots++;
+}
+
+/*
+=================
+SV_MetricsSnapshotDelayed
+
+A snapshot was due but held back by the client's rate or a full
+fragment queue
+=================
+*/
+void SV_MetricsSnapshotDelayed( client_t *client ) {
+	client->metricsSnapshotsDelayed++;
+	svmSnapshotsDelayed++;
+}
+
+/*
+=================
+SV_MetricsAddSample
+=================
+*/
+static void SV_MetricsAddSample( svMetricsHistogram_t *h, int64_t usec ) {
+	int bucket;
+
+	for ( bucket = 0; bucket < SVM_NUM_BUCKETS - 1; bucket++ ) {
+		if ( usec <= svMetricsBuckets[ bucket ] ) {
+			break;
+		}
+	}
+
+	h->counts[ bucket ]++;
+	h->count++;
+	h->sum += usec;
+}
+
+static void QDECL SV_MetricsPrintf( fileHandle_t f, const char *fmt, ... ) __attribute__ ((format (printf, 2, 3)));
+
+/*
+=================
+SV_MetricsPrintf
+
+Writes to f, or to the console without one
+=================
+*/
+static void QDECL SV_MetricsPrintf( fileHandle_t f, const char *fmt, ... ) {
+	va_list	argptr;
+	char	msg[MAXPRINTMSG];
+
+	va_start( argptr, fmt );
+	Q_vsnprintf( msg, sizeof( msg ), fmt, argptr );
+	va_end( argptr );
+
+	if ( f ) {
+		FS_Write( msg, strlen( msg ), f );
+	} else {
+		Com_Printf( "%s", msg );
+	}
+}
+
+/*
+=================
+SV_MetricsWrite
+=================
+*/
+static void SV_MetricsWrite( fileHandle_t f ) {
+	const svMetricsHistogram_t	*h;
+	client_t					*cl;
+	uint64_t					cumulative;
+	uint64_t					traceLookups, traceHits;
+	int							i, bucket, clients;
+
+	SV_MetricsPrintf( f, "# HELP ioq3_server_frame_seconds Time spent per server frame in each section.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_server_frame_seconds histogram\n" );
+
+	for ( i = 0; i < SVM_NUM_SECTIONS; i++ ) {
+		h = &svmHistograms[ i ];
+
+		cumulative = 0;
+		for ( bucket = 0; bucket < SVM_NUM_BUCKETS - 1; bucket++ ) {
+			cumulative += h->counts[ bucket ];
+			SV_MetricsPrintf( f, "ioq3_server_frame_seconds_bucket{section=\"%s\",le=\"%g\"} %llu\n",
+					svMetricsSectionNames[ i ], svMetricsBuckets[ bucket ] / 1000000.0,
+					(unsigned long long)cumulative );
+		}
+
+		SV_MetricsPrintf( f, "ioq3_server_frame_seconds_bucket{section=\"%s\",le=\"+Inf\"} %llu\n",
+				svMetricsSectionNames[ i ], (unsigned long long)h->count );
+		SV_MetricsPrintf( f, "ioq3_server_frame_seconds_sum{section=\"%s\"} %.6f\n",
+				svMetricsSectionNames[ i ], h->sum / 1000000.0 );
+		SV_MetricsPrintf( f, "ioq3_server_frame_seconds_count{section=\"%s\"} %llu\n",
+				svMetricsSectionNames[ i ], (unsigned long long)h->count );
+	}
+
+	clients = 0;
+	if ( svs.clients ) {
+		for ( i = 0, cl = svs.clients; i < sv_maxclients->integer; i++, cl++ ) {
+			if ( cl->state >= CS_CONNECTED ) {
+				clients++;
+			}
+		}
+	}
+
+	SV_MetricsPrintf( f, "# HELP ioq3_server_clients Connected clients.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_server_clients gauge\n" );
+	SV_MetricsPrintf( f, "ioq3_server_clients %d\n", clients );
+
+	SV_MetricsPrintf( f, "# HELP ioq3_server_bytes_sent_total Bytes of client messages sent.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_server_bytes_sent_total counter\n" );
+	SV_MetricsPrintf( f, "ioq3_server_bytes_sent_total %llu\n", (unsigned long long)svmBytesSent );
+
+	SV_MetricsPrintf( f, "# HELP ioq3_server_snapshots_total Snapshots sent.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_server_snapshots_total counter\n" );
+	SV_MetricsPrintf( f, "ioq3_server_snapshots_total %llu\n", (unsigned long long)svmSnapshots );
+
+	SV_MetricsPrintf( f, "# HELP ioq3_server_snapshots_delayed_total Frames a due snapshot was held back by rate or fragment queue.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_server_snapshots_delayed_total counter\n" );
+	SV_MetricsPrintf( f, "ioq3_server_snapshots_delayed_total %llu\n", (unsigned long long)svmSnapshotsDelayed );
+
+	SV_TraceCacheCounters( &traceLookups, &traceHits );
+
+	SV_MetricsPrintf( f, "# HELP ioq3_server_trace_cache_lookups_total Traces looked up in the sv_traceCache table.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_server_trace_cache_lookups_total counter\n" );
+	SV_MetricsPrintf( f, "ioq3_server_trace_cache_lookups_total %llu\n", (unsigned long long)traceLookups );
+
+	SV_MetricsPrintf( f, "# HELP ioq3_server_trace_cache_hits_total Traces answered from the sv_traceCache table.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_server_trace_cache_hits_total counter\n" );
+	SV_MetricsPrintf( f, "ioq3_server_trace_cache_hits_total %llu\n", (unsigned long long)traceHits );
+
+	if ( !clients ) {
+		return;
+	}
+
+	// per client counters start over whenever a new client takes the slot
+	SV_MetricsPrintf( f, "# HELP ioq3_client_bytes_sent_total Bytes sent to the client since it connected.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_client_bytes_sent_total counter\n" );
+	for ( i = 0, cl = svs.clients; i < sv_maxclients->integer; i++, cl++ ) {
+		if ( cl->state >= CS_CONNECTED ) {
+			SV_MetricsPrintf( f, "ioq3_client_bytes_sent_total{client=\"%d\"} %llu\n",
+					i, (unsigned long long)cl->metricsBytesSent );
+		}
+	}
+
+	SV_MetricsPrintf( f, "# HELP ioq3_client_snapshots_total Snapshots sent to the client since it connected.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_client_snapshots_total counter\n" );
+	for ( i = 0, cl = svs.clients; i < sv_maxclients->integer; i++, cl++ ) {
+		if ( cl->state >= CS_CONNECTED ) {
+			SV_MetricsPrintf( f, "ioq3_client_snapshots_total{client=\"%d\"} %d\n",
+					i, cl->metricsSnapshots );
+		}
+	}
+
+	SV_MetricsPrintf( f, "# HELP ioq3_client_snapshots_delayed_total Snapshots held back for the client since it connected.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_client_snapshots_delayed_total counter\n" );
+	for ( i = 0, cl = svs.clients; i < sv_maxclients->integer; i++, cl++ ) {
+		if ( cl->state >= CS_CONNECTED ) {
+			SV_MetricsPrintf( f, "ioq3_client_snapshots_delayed_total{client=\"%d\"} %d\n",
+					i, cl->metricsSnapshotsDelayed );
+		}
+	}
+
+	SV_MetricsPrintf( f, "# HELP ioq3_client_ping_milliseconds Client ping.\n" );
+	SV_MetricsPrintf( f, "# TYPE ioq3_client_ping_milliseconds gauge\n" );
+	for ( i = 0, cl = svs.clients; i < sv_maxclients->integer; i++, cl++ ) {
+		if ( cl->state >= CS_CONNECTED ) {
+			SV_MetricsPrintf( f, "ioq3_client_ping_milliseconds{client=\"%d\"} %d\n",
+					i, cl->ping );
+		}
+	}
+}
+
+/*
+=================
+SV_MetricsWriteFile
+
+Writes to a temporary file first, so whatever scrapes sv_metricsFile never
+sees it half written
+=================
+*/
+static void SV_MetricsWriteFile( void ) {
+	char			fileName[MAX_QPATH];
+	char			tmpName[MAX_QPATH];
+	fileHandle_t	f;
+
+	Com_InstanceFileName( sv_metricsFile->string, fileName, sizeof( fileName ) );
+	Com_sprintf( tmpName, sizeof( tmpName ), "%s.tmp", fileName );
+
+	f = FS_FOpenFileWrite( tmpName );
+	if ( !f ) {
+		Com_Printf( "Couldn't open %s for writing\n", tmpName );
+		Cvar_Set( "sv_metricsFile", "" );
+		return;
+	}
+
+	SV_MetricsWrite( f );
+	FS_FCloseFile( f );
+
+#ifdef _WIN32
+	// rename doesn't replace existing files on windows
+	FS_HomeRemove( fileName );
+#endif
+	FS_Rename( tmpName, fileName );
+}
+
+/*
+=================
+SV_MetricsFrame
+
+Called at the end of every server frame. The packets processed since the
+previous frame count towards this one.
+=================
+*/
+void SV_MetricsFrame( void ) {
+	int		i, now;
+
+	if ( sv_metrics->integer ) {
+		svmCurrent[ SVM_TOTAL ] += svmCurrent[ SVM_PACKETS ];
+
+		for ( i = 0; i < SVM_NUM_SECTIONS; i++ ) {
+			SV_MetricsAddSample( &svmHistograms[ i ], svmCurrent[ i ] );
+			svmCurrent[ i ] = 0;
+		}
+	}
+
+	if ( !sv_metricsFile->string[0] ) {
+		return;
+	}
+
+	now = Sys_Milliseconds();
+	if ( now - svmLastWrite >= sv_metricsInterval->integer * 1000 ) {
+		svmLastWrite = now;
+		SV_MetricsWriteFile();
+	}
+}
+
+/*
+=================
+SV_Metrics_f
+=================
+*/
+static void SV_Metrics_f( void ) {
+	if ( !sv_metrics->integer ) {
+		Com_Printf( "Frame timings are only recorded with sv_metrics 1\n" );
+	}
+
+	SV_MetricsWrite( 0 );
+}
+
+/*
+=================
+SV_MetricsInit
+=================
+*/
+void SV_MetricsInit( void ) {
+	sv_metrics = Cvar_Get( "sv_metrics", "0", CVAR_ARCHIVE );
+	sv_metricsFile = Cvar_Get( "sv_metricsFile", "", CVAR_ARCHIVE );
+	sv_metricsInterval = Cvar_Get( "sv_metricsInterval", "10", CVAR_ARCHIVE );
+	Cvar_CheckRange( sv_metricsInterval, 1, 3600, qtrue );
+
+	Cmd_AddCommand( "metrics", SV_Metrics_f );
+}
@@ -152,6 +152,28 @@ void SV_Netchan_FreeQueue(client_t *client)
 	client->netchan_end_queue = &client->netchan_start_queue;
 }
 
+/*
+=================
+SV_Netchan_SendFragments
+
+Sends the rest of a fragmented message right after its first fragment,
+as far as sv_fragmentBurst and the client's rate allow
+=================
+*/
+static void SV_Netchan_SendFragments(client_t *client)
+{
+	int maxBytes;
+
+	if(!client->netchan.unsentFragments)
+		return;
+
+	maxBytes = SV_ClientRate(client);
+	if(maxBytes > sv_fragmentBurst->integer)
+		maxBytes = sv_fragmentBurst->integer;
+
+	Netchan_TransmitFragments(&client->netchan, maxBytes);
+}
+
 /*
 =================
 SV_Netchan_TransmitNextInQueue
@@ -160,6 +182,7 @@ SV_Netchan_TransmitNextInQueue
 void SV_Netchan_TransmitNextInQueue(client_t *client)
 {
 	netchan_buffer_t *netbuf;
+	qboolean batch;
 		
 	Com_DPrintf("#462 Netchan_TransmitNextFragment: popping a queued message for transmit\n");
 	netbuf = client->netchan_start_queue;
@@ -169,7 +192,11 @@ void SV_Netchan_TransmitNextInQueue(client_t *client)
 		SV_Netchan_Encode(client, &netbuf->msg, netbuf->clientCommandString);
 #endif
 
+	batch = NET_BeginSendBatch();
 	Netchan_Transmit(&client->netchan, netbuf->msg.cursize, netbuf->msg.data);
+	SV_Netchan_SendFragments(client);
+	if(batch)
+		NET_FlushSendBatch();
 
 	// pop from queue
 	client->netchan_start_queue = netbuf->next;
@@ -187,7 +214,7 @@ void SV_Netchan_TransmitNextInQueue(client_t *client)
 /*
 =================
 SV_Netchan_TransmitNextFragment
-Transmit the next fragment and the next queued packet
+Transmit the next fragments or the next queued packet
 Return number of ms until next message can be sent based on throughput given by client rate,
 -1 if no packet was sent.
 =================
@@ -197,7 +224,13 @@ int SV_Netchan_TransmitNextFragment(client_t *client)
 {
 	if(client->netchan.unsentFragments)
 	{
+		qboolean batch;
+
+		batch = NET_BeginSendBatch();
 		Netchan_TransmitNextFragment(&client->netchan);
+		SV_Netchan_SendFragments(client);
+		if(batch)
+			NET_FlushSendBatch();
 		return SV_RateMsec(client);
 	}
 	else if(client->netchan_start_queue)
@@ -246,11 +279,18 @@ void SV_Netchan_Transmit( client_t *client, msg_t *msg)
 	}
 	else
 	{
+		qboolean batch;
+
 #ifdef LEGACY_PROTOCOL
 		if(client->compat)
 			SV_Netchan_Encode(client, msg, client->lastClientCommandString);
 #endif
+		// when sent with the snapshots, the batch is flushed after them
+		batch = NET_BeginSendBatch();
 		Netchan_Transmit( &client->netchan, msg->cursize, msg->data );
+		SV_Netchan_SendFragments(client);
+		if(batch)
+			NET_FlushSendBatch();
 	}
 }
 
@@ -116,40 +116,54 @@ static void SV_EmitPacketEntities( clientSnapshot_t *from, clientSnapshot_t *to,
 
 /*
 ==================
-SV_WriteSnapshotToClient
+SV_SnapshotDeltaFrame
+
+Returns the previous frame to delta compress the client's new snapshot
+from, or NULL if a full snapshot has to be sent
 ==================
 */
-static void SV_WriteSnapshotToClient( client_t *client, msg_t *msg ) {
-	clientSnapshot_t	*frame, *oldframe;
-	int					lastframe;
-	int					i;
-	int					snapFlags;
-
-	// this is the snapshot we are creating
-	frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
+static clientSnapshot_t *SV_SnapshotDeltaFrame( client_t *client ) {
+	clientSnapshot_t	*oldframe;
 
-	// try to use a previous frame as the source for delta compressing the snapshot
 	if ( client->deltaMessage <= 0 || client->state != CS_ACTIVE ) {
 		// client is asking for a retransmit
-		oldframe = NULL;
-		lastframe = 0;
-	} else if ( client->netchan.outgoingSequence - client->deltaMessage 
+		return NULL;
+	}
+
+	if ( client->netchan.outgoingSequence - client->deltaMessage 
 		>= (PACKET_BACKUP - 3) ) {
 		// client hasn't gotten a good message through in a long time
 		Com_DPrintf ("%s: Delta request from out of date packet.\n", client->name);
-		oldframe = NULL;
-		lastframe = 0;
-	} else {
-		// we have a valid snapshot to delta from
-		oldframe = &client->frames[ client->deltaMessage & PACKET_MASK ];
-		lastframe = client->netchan.outgoingSequence - client->deltaMessage;
+		return NULL;
+	}
 
-		// the snapshot's entities may still have rolled off the buffer, though
-		if ( oldframe->first_entity <= svs.nextSnapshotEntities - svs.numSnapshotEntities ) {
-			Com_DPrintf ("%s: Delta request from out of date entities.\n", client->name);
-			oldframe = NULL;
-			lastframe = 0;
-		}
+	// we have a valid snapshot to delta from
+	oldframe = &client->frames[ client->deltaMessage & PACKET_MASK ];
+
+	// the snapshot's entities may still have rolled off the buffer, though
+	if ( oldframe->first_entity <= svs.nextSnapshotEntities - svs.numSnapshotEntities ) {
+		Com_DPrintf ("%s: Delta request from out of date entities.\n", client->name);
+		return NULL;
+	}
+
+	return oldframe;
+}
+
+/*
+==================
+SV_WriteSnapshotHeader
+
+The part of the snapshot that is particular to the client
+==================
+*/
+static void SV_WriteSnapshotHeader( client_t *client, clientSnapshot_t *oldframe, msg_t *msg ) {
+	int					lastframe;
+	int					snapFlags;
+
+	if ( oldframe ) {
+		lastframe = client->netchan.outgoingSequence - client->deltaMessage;
+	} else {
+		lastframe = 0;
 	}
 
 	MSG_WriteByte (msg, svc_snapshot);
@@ -184,6 +198,18 @@ static void SV_WriteSnapshotToClient( client_t *client, msg_t *msg ) {
 	}
 
 	MSG_WriteByte (msg, snapFlags);
+}
+
+/*
+==================
+SV_WriteSnapshotBody
+
+The part of the snapshot that only depends on the frames, which is the same
+for all clients with matching frames
+==================
+*/
+static void SV_WriteSnapshotBody( clientSnapshot_t *frame, clientSnapshot_t *oldframe, msg_t *msg ) {
+	int		i;
 
 	// send over the areabits
 	MSG_WriteByte (msg, frame->areabytes);
@@ -239,6 +265,8 @@ Build a client snapshot structure
 typedef struct {
 	int		numSnapshotEntities;
 	int		snapshotEntities[MAX_SNAPSHOT_ENTITIES];	
+	byte	added[MAX_GENTITIES/8];		// prevents double adding from portal views
+	const char	*error;					// raised once back on the main thread
 } snapshotEntityNumbers_t;
 
 /*
@@ -252,10 +280,6 @@ static int QDECL SV_QsortEntityNumbers( const void *a, const void *b ) {
 	ea = (int *)a;
 	eb = (int *)b;
 
-	if ( *ea == *eb ) {
-		Com_Error( ERR_DROP, "SV_QsortEntityStates: duplicated entity" );
-	}
-
 	if ( *ea < *eb ) {
 		return -1;
 	}
@@ -269,12 +293,14 @@ static int QDECL SV_QsortEntityNumbers( const void *a, const void *b ) {
 SV_AddEntToSnapshot
 ===============
 */
-static void SV_AddEntToSnapshot( svEntity_t *svEnt, sharedEntity_t *gEnt, snapshotEntityNumbers_t *eNums ) {
+static void SV_AddEntToSnapshot( sharedEntity_t *gEnt, snapshotEntityNumbers_t *eNums ) {
+	int		num = gEnt->s.number;
+
 	// if we have already added this entity to this snapshot, don't add again
-	if ( svEnt->snapshotCounter == sv.snapshotCounter ) {
+	if ( eNums->added[num >> 3] & (1 << (num & 7)) ) {
 		return;
 	}
-	svEnt->snapshotCounter = sv.snapshotCounter;
+	eNums->added[num >> 3] |= 1 << (num & 7);
 
 	// if we are full, silently discard entities
 	if ( eNums->numSnapshotEntities == MAX_SNAPSHOT_ENTITIES ) {
@@ -285,21 +311,52 @@ static void SV_AddEntToSnapshot( svEntity_t *svEnt, sharedEntity_t *gEnt, snapsh
 	eNums->numSnapshotEntities++;
 }
 
+/*
+=============================================================================
+
+Per-frame visibility cache
+
+Whether an entity passes the area and PVS checks only depends on the area
+and cluster the viewpoint is in, so that is worked out once per frame for
+each pair in use, as a bitset over all entities, and shared by every
+client (and portal view) looking from there.  The sets are combined a
+machine word at a time.
+
+=============================================================================
+*/
+
+#define	VIS_WORDS			(MAX_GENTITIES/64)
+#define	MAX_SNAPSHOT_VIS	128
+
+typedef struct {
+	int			area;
+	int			cluster;
+	uint64_t	ents[VIS_WORDS];
+} snapshotVis_t;
+
+static struct {
+	qboolean		active;				// inside SV_SendClientMessages
+	qboolean		readOnly;			// worker threads are reading the cache
+	uint64_t		sendable[VIS_WORDS];	// linked and not SVF_NOCLIENT
+	uint64_t		broadcast[VIS_WORDS];	// sendable and SVF_BROADCAST
+	int				numVis;
+	snapshotVis_t	vis[MAX_SNAPSHOT_VIS];
+} snapshotVis;
+
 /*
 ===============
-SV_AddEntitiesVisibleFromPoint
+SV_ClearSnapshotVis
+
+Empties the cache and sorts out the entities that may be sent at all
 ===============
 */
-static void SV_AddEntitiesVisibleFromPoint( vec3_t origin, clientSnapshot_t *frame, 
-									snapshotEntityNumbers_t *eNums, qboolean portal ) {
-	int		e, i;
-	sharedEntity_t *ent;
-	svEntity_t	*svEnt;
-	int		l;
-	int		clientarea, clientcluster;
-	int		leafnum;
-	byte	*clientpvs;
-	byte	*bitvector;
+static void SV_ClearSnapshotVis( void ) {
+	sharedEntity_t	*ent;
+	int				e;
+
+	snapshotVis.numVis = 0;
+	Com_Memset( snapshotVis.sendable, 0, sizeof( snapshotVis.sendable ) );
+	Com_Memset( snapshotVis.broadcast, 0, sizeof( snapshotVis.broadcast ) );
 
 	// during an error shutdown message we may need to transmit
 	// the shutdown message after the server has shutdown, so
@@ -308,15 +365,6 @@ static void SV_AddEntitiesVisibleFromPoint( vec3_t origin, clientSnapshot_t *fra
 		return;
 	}
 
-	leafnum = CM_PointLeafnum (origin);
-	clientarea = CM_LeafArea (leafnum);
-	clientcluster = CM_LeafCluster (leafnum);
-
-	// calculate the visible areas
-	frame->areabytes = CM_WriteAreaBits( frame->areabits, clientarea );
-
-	clientpvs = CM_ClusterPVS (clientcluster);
-
 	for ( e = 0 ; e < sv.num_entities ; e++ ) {
 		ent = SV_GentityNum(e);
 
@@ -335,101 +383,205 @@ static void SV_AddEntitiesVisibleFromPoint( vec3_t origin, clientSnapshot_t *fra
 			continue;
 		}
 
-		// entities can be flagged to be sent to only one client
-		if ( ent->r.svFlags & SVF_SINGLECLIENT ) {
-			if ( ent->r.singleClient != frame->ps.clientNum ) {
-				continue;
-			}
-		}
-		// entities can be flagged to be sent to everyone but one client
-		if ( ent->r.svFlags & SVF_NOTSINGLECLIENT ) {
-			if ( ent->r.singleClient == frame->ps.clientNum ) {
-				continue;
-			}
-		}
-		// entities can be flagged to be sent to a given mask of clients
-		if ( ent->r.svFlags & SVF_CLIENTMASK ) {
-			if (frame->ps.clientNum >= 32)
-				Com_Error( ERR_DROP, "SVF_CLIENTMASK: clientNum >= 32" );
-			if (~ent->r.singleClient & (1 << frame->ps.clientNum))
-				continue;
+		snapshotVis.sendable[e >> 6] |= (uint64_t)1 << (e & 63);
+
+		// broadcast entities are always sent
+		if ( ent->r.svFlags & SVF_BROADCAST ) {
+			snapshotVis.broadcast[e >> 6] |= (uint64_t)1 << (e & 63);
 		}
+	}
+}
 
-		svEnt = SV_SvEntityForGentity( ent );
+/*
+===============
+SV_EntityVisibleFromCluster
+===============
+*/
+static qboolean SV_EntityVisibleFromCluster( svEntity_t *svEnt, int clientarea, byte *clientpvs ) {
+	int		i, l;
+	byte	*bitvector;
 
-		// don't double add an entity through portals
-		if ( svEnt->snapshotCounter == sv.snapshotCounter ) {
-			continue;
+	// ignore if not touching a PV leaf
+	// check area
+	if ( !CM_AreasConnected( clientarea, svEnt->areanum ) ) {
+		// doors can legally straddle two areas, so
+		// we may need to check another one
+		if ( !CM_AreasConnected( clientarea, svEnt->areanum2 ) ) {
+			return qfalse;		// blocked by a door
 		}
+	}
 
-		// broadcast entities are always sent
-		if ( ent->r.svFlags & SVF_BROADCAST ) {
-			SV_AddEntToSnapshot( svEnt, ent, eNums );
-			continue;
+	bitvector = clientpvs;
+
+	// check individual leafs
+	if ( !svEnt->numClusters ) {
+		return qfalse;
+	}
+	l = 0;
+	for ( i=0 ; i < svEnt->numClusters ; i++ ) {
+		l = svEnt->clusternums[i];
+		if ( bitvector[l >> 3] & (1 << (l&7) ) ) {
+			return qtrue;
 		}
+	}
 
-		// ignore if not touching a PV leaf
-		// check area
-		if ( !CM_AreasConnected( clientarea, svEnt->areanum ) ) {
-			// doors can legally straddle two areas, so
-			// we may need to check another one
-			if ( !CM_AreasConnected( clientarea, svEnt->areanum2 ) ) {
-				continue;		// blocked by a door
+	// if we haven't found it to be visible,
+	// check overflow clusters that coudln't be stored
+	if ( svEnt->lastCluster ) {
+		for ( ; l <= svEnt->lastCluster ; l++ ) {
+			if ( bitvector[l >> 3] & (1 << (l&7) ) ) {
+				break;
 			}
 		}
+		if ( l == svEnt->lastCluster ) {
+			return qfalse;	// not visible
+		}
+		return qtrue;
+	}
+
+	return qfalse;
+}
 
-		bitvector = clientpvs;
+/*
+===============
+SV_SnapshotVis
 
-		// check individual leafs
-		if ( !svEnt->numClusters ) {
-			continue;
+Returns the non broadcast entities that pass the area and PVS checks from
+the given area and cluster.  Misses are worked out into scratch when the
+cache can't be written to.
+===============
+*/
+static const uint64_t *SV_SnapshotVis( int area, int cluster, uint64_t *scratch ) {
+	snapshotVis_t	*vis;
+	uint64_t		*ents, bits;
+	byte			*clientpvs;
+	int				i, w, e;
+
+	for ( i = 0, vis = snapshotVis.vis ; i < snapshotVis.numVis ; i++, vis++ ) {
+		if ( vis->area == area && vis->cluster == cluster ) {
+			return vis->ents;
 		}
-		l = 0;
-		for ( i=0 ; i < svEnt->numClusters ; i++ ) {
-			l = svEnt->clusternums[i];
-			if ( bitvector[l >> 3] & (1 << (l&7) ) ) {
-				break;
+	}
+
+	if ( snapshotVis.readOnly || snapshotVis.numVis == MAX_SNAPSHOT_VIS ) {
+		ents = scratch;
+	} else {
+		vis = &snapshotVis.vis[snapshotVis.numVis++];
+		vis->area = area;
+		vis->cluster = cluster;
+		ents = vis->ents;
+	}
+
+	clientpvs = CM_ClusterPVS( cluster );
+
+	for ( w = 0 ; w < VIS_WORDS ; w++ ) {
+		ents[w] = 0;
+		bits = snapshotVis.sendable[w] & ~snapshotVis.broadcast[w];
+		for ( e = w << 6 ; bits ; e++, bits >>= 1 ) {
+			if ( ( bits & 1 ) && SV_EntityVisibleFromCluster( &sv.svEntities[e], area, clientpvs ) ) {
+				ents[w] |= (uint64_t)1 << (e & 63);
 			}
 		}
+	}
 
-		// if we haven't found it to be visible,
-		// check overflow clusters that coudln't be stored
-		if ( i == svEnt->numClusters ) {
-			if ( svEnt->lastCluster ) {
-				for ( ; l <= svEnt->lastCluster ; l++ ) {
-					if ( bitvector[l >> 3] & (1 << (l&7) ) ) {
-						break;
-					}
-				}
-				if ( l == svEnt->lastCluster ) {
-					continue;	// not visible
-				}
-			} else {
+	return ents;
+}
+
+/*
+===============
+SV_AddEntitiesVisibleFromPoint
+===============
+*/
+static void SV_AddEntitiesVisibleFromPoint( vec3_t origin, clientSnapshot_t *frame, 
+									snapshotEntityNumbers_t *eNums, qboolean portal ) {
+	int		e, w;
+	sharedEntity_t *ent;
+	int		clientarea, clientcluster;
+	int		leafnum;
+	const uint64_t	*vis;
+	uint64_t	scratch[VIS_WORDS];
+	uint64_t	bits, visible;
+
+	// during an error shutdown message we may need to transmit
+	// the shutdown message after the server has shutdown, so
+	// specfically check for it
+	if ( !sv.state ) {
+		return;
+	}
+
+	leafnum = CM_PointLeafnum (origin);
+	clientarea = CM_LeafArea (leafnum);
+	clientcluster = CM_LeafCluster (leafnum);
+
+	// calculate the visible areas
+	frame->areabytes = CM_WriteAreaBits( frame->areabits, clientarea );
+
+	vis = SV_SnapshotVis( clientarea, clientcluster, scratch );
+
+	for ( w = 0 ; w < VIS_WORDS ; w++ ) {
+		visible = vis[w];
+		bits = visible | snapshotVis.broadcast[w];
+
+		for ( e = w << 6 ; bits ; e++, bits >>= 1 ) {
+			if ( !( bits & 1 ) ) {
+				continue;
+			}
+
+			// don't double add an entity through portals
+			if ( eNums->added[e >> 3] & (1 << (e & 7)) ) {
 				continue;
 			}
-		}
 
-		// add it
-		SV_AddEntToSnapshot( svEnt, ent, eNums );
+			ent = SV_GentityNum(e);
 
-		// if it's a portal entity, add everything visible from its camera position
-		if ( ent->r.svFlags & SVF_PORTAL ) {
-			if ( ent->s.generic1 ) {
-				vec3_t dir;
-				VectorSubtract(ent->s.origin, origin, dir);
-				if ( VectorLengthSquared(dir) > (float) ent->s.generic1 * ent->s.generic1 ) {
+			// entities can be flagged to be sent to only one client
+			if ( ent->r.svFlags & SVF_SINGLECLIENT ) {
+				if ( ent->r.singleClient != frame->ps.clientNum ) {
 					continue;
 				}
 			}
-			SV_AddEntitiesVisibleFromPoint( ent->s.origin2, frame, eNums, qtrue );
-		}
+			// entities can be flagged to be sent to everyone but one client
+			if ( ent->r.svFlags & SVF_NOTSINGLECLIENT ) {
+				if ( ent->r.singleClient == frame->ps.clientNum ) {
+					continue;
+				}
+			}
+			// entities can be flagged to be sent to a given mask of clients
+			if ( ent->r.svFlags & SVF_CLIENTMASK ) {
+				if (frame->ps.clientNum >= 32) {
+					eNums->error = "SVF_CLIENTMASK: clientNum >= 32";
+					continue;
+				}
+				if (~ent->r.singleClient & (1 << frame->ps.clientNum))
+					continue;
+			}
 
+			// add it
+			SV_AddEntToSnapshot( ent, eNums );
+
+			// broadcast entities don't open a view through portals
+			if ( !( visible & ( (uint64_t)1 << (e & 63) ) ) ) {
+				continue;
+			}
+
+			// if it's a portal entity, add everything visible from its camera position
+			if ( ent->r.svFlags & SVF_PORTAL ) {
+				if ( ent->s.generic1 ) {
+					vec3_t dir;
+					VectorSubtract(ent->s.origin, origin, dir);
+					if ( VectorLengthSquared(dir) > (float) ent->s.generic1 * ent->s.generic1 ) {
+						continue;
+					}
+				}
+				SV_AddEntitiesVisibleFromPoint( ent->s.origin2, frame, eNums, qtrue );
+			}
+		}
 	}
 }
 
 /*
 =============
-SV_BuildClientSnapshot
+SV_CollectSnapshotEntities
 
 Decides which entities are going to be visible to the client, and
 copies off the playerstate and areabits.
@@ -438,28 +590,28 @@ This properly handles multiple recursive portals, but the render
 currently doesn't.
 
 For viewing through other player's eyes, clent can be something other than client->gentity
+
+Only reads shared server and game state, so several clients can be
+collected at once.  Errors are left in eNums->error for the caller.  The
+collision map lookups only ever get leafs and areas it handed out itself,
+so their range checks can't fire on a worker.
 =============
 */
-static void SV_BuildClientSnapshot( client_t *client ) {
+static void SV_CollectSnapshotEntities( client_t *client, snapshotEntityNumbers_t *eNums ) {
 	vec3_t						org;
 	clientSnapshot_t			*frame;
-	snapshotEntityNumbers_t		entityNumbers;
 	int							i;
-	sharedEntity_t				*ent;
-	entityState_t				*state;
-	svEntity_t					*svEnt;
 	sharedEntity_t				*clent;
 	int							clientNum;
 	playerState_t				*ps;
 
-	// bump the counter used to prevent double adding
-	sv.snapshotCounter++;
-
 	// this is the frame we are creating
 	frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
 
 	// clear everything in this snapshot
-	entityNumbers.numSnapshotEntities = 0;
+	eNums->numSnapshotEntities = 0;
+	eNums->error = NULL;
+	Com_Memset( eNums->added, 0, sizeof( eNums->added ) );
 	Com_Memset( frame->areabits, 0, sizeof( frame->areabits ) );
 
   // https://zerowing.idsoftware.com/bugzilla/show_bug.cgi?id=62
@@ -478,11 +630,10 @@ static void SV_BuildClientSnapshot( client_t *client ) {
 	// be regenerated from the playerstate
 	clientNum = frame->ps.clientNum;
 	if ( clientNum < 0 || clientNum >= MAX_GENTITIES ) {
-		Com_Error( ERR_DROP, "SV_SvEntityForGentity: bad gEnt" );
+		eNums->error = "SV_SvEntityForGentity: bad gEnt";
+		return;
 	}
-	svEnt = &sv.svEntities[ clientNum ];
-
-	svEnt->snapshotCounter = sv.snapshotCounter;
+	eNums->added[clientNum >> 3] |= 1 << (clientNum & 7);
 
 	// find the client's viewpoint
 	VectorCopy( ps->origin, org );
@@ -490,37 +641,89 @@ static void SV_BuildClientSnapshot( client_t *client ) {
 
 	// add all the entities directly visible to the eye, which
 	// may include portal entities that merge other viewpoints
-	SV_AddEntitiesVisibleFromPoint( org, frame, &entityNumbers, qfalse );
+	SV_AddEntitiesVisibleFromPoint( org, frame, eNums, qfalse );
 
 	// if there were portals visible, there may be out of order entities
 	// in the list which will need to be resorted for the delta compression
-	// to work correctly.  This also catches the error condition
-	// of an entity being included twice.
-	qsort( entityNumbers.snapshotEntities, entityNumbers.numSnapshotEntities, 
-		sizeof( entityNumbers.snapshotEntities[0] ), SV_QsortEntityNumbers );
+	// to work correctly.  The added bits keep entities from being
+	// included twice.
+	qsort( eNums->snapshotEntities, eNums->numSnapshotEntities, 
+		sizeof( eNums->snapshotEntities[0] ), SV_QsortEntityNumbers );
 
 	// now that all viewpoint's areabits have been OR'd together, invert
 	// all of them to make it a mask vector, which is what the renderer wants
 	for ( i = 0 ; i < MAX_MAP_AREA_BYTES/4 ; i++ ) {
 		((int *)frame->areabits)[i] = ((int *)frame->areabits)[i] ^ -1;
 	}
+}
+
+/*
+=============
+SV_ReserveSnapshotEntities
+
+Claims the client's range of svs.snapshotEntities, must be called in client order
+=============
+*/
+static void SV_ReserveSnapshotEntities( client_t *client, int numEntities ) {
+	clientSnapshot_t	*frame;
+
+	frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
 
-	// copy the entity states out
-	frame->num_entities = 0;
 	frame->first_entity = svs.nextSnapshotEntities;
-	for ( i = 0 ; i < entityNumbers.numSnapshotEntities ; i++ ) {
-		ent = SV_GentityNum(entityNumbers.snapshotEntities[i]);
-		state = &svs.snapshotEntities[svs.nextSnapshotEntities % svs.numSnapshotEntities];
+	frame->num_entities = numEntities;
+	svs.nextSnapshotEntities += numEntities;
+
+	// this should never hit, map should always be restarted first in SV_Frame
+	if ( svs.nextSnapshotEntities >= 0x7FFFFFFE ) {
+		Com_Error(ERR_FATAL, "svs.nextSnapshotEntities wrapped");
+	}
+}
+
+/*
+=============
+SV_CopySnapshotEntities
+
+Copies the entity states out into the range claimed by SV_ReserveSnapshotEntities
+=============
+*/
+static void SV_CopySnapshotEntities( client_t *client, const snapshotEntityNumbers_t *eNums ) {
+	clientSnapshot_t	*frame;
+	sharedEntity_t		*ent;
+	entityState_t		*state;
+	int					i;
+
+	frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
+
+	for ( i = 0 ; i < frame->num_entities ; i++ ) {
+		ent = SV_GentityNum(eNums->snapshotEntities[i]);
+		state = &svs.snapshotEntities[(frame->first_entity + i) % svs.numSnapshotEntities];
 		*state = ent->s;
-		svs.nextSnapshotEntities++;
-		// this should never hit, map should always be restarted first in SV_Frame
-		if ( svs.nextSnapshotEntities >= 0x7FFFFFFE ) {
-			Com_Error(ERR_FATAL, "svs.nextSnapshotEntities wrapped");
-		}
-		frame->num_entities++;
 	}
 }
 
+/*
+=============
+SV_BuildClientSnapshot
+=============
+*/
+static void SV_BuildClientSnapshot( client_t *client ) {
+	snapshotEntityNumbers_t		entityNumbers;
+
+	// outside of SV_SendClientMessages the world may have changed since
+	// the cache was filled
+	if ( !snapshotVis.active ) {
+		SV_ClearSnapshotVis();
+	}
+
+	SV_CollectSnapshotEntities( client, &entityNumbers );
+	if ( entityNumbers.error ) {
+		Com_Error( ERR_DROP, "%s", entityNumbers.error );
+	}
+
+	SV_ReserveSnapshotEntities( client, entityNumbers.numSnapshotEntities );
+	SV_CopySnapshotEntities( client, &entityNumbers );
+}
+
 #ifdef USE_VOIP
 /*
 ==================
@@ -582,11 +785,60 @@ void SV_SendMessageToClient(msg_t *msg, client_t *client)
 	client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageSent = svs.time;
 	client->frames[client->netchan.outgoingSequence & PACKET_MASK].messageAcked = -1;
 
+	SV_MetricsMessageSent( client, msg->cursize );
+
 	// send the datagram
 	SV_Netchan_Transmit(client, msg);
 }
 
 
+/*
+=======================
+SV_WriteSnapshotMessage
+
+Everything but the VoIP data, which can be written from a worker thread.
+If body is given it has to be the snapshot body of an identical frame.
+=======================
+*/
+static void SV_WriteSnapshotMessage( client_t *client, clientSnapshot_t *oldframe, const msg_t *body, msg_t *msg ) {
+	// NOTE, MRE: all server->client messages now acknowledge
+	// let the client know which reliable clientCommands we have received
+	MSG_WriteLong( msg, client->lastClientCommand );
+
+	// (re)send any reliable server commands
+	SV_UpdateServerCommandsToClient( client, msg );
+
+	// send over all the relevant entityState_t
+	// and the playerState_t
+	SV_WriteSnapshotHeader( client, oldframe, msg );
+
+	if ( body ) {
+		MSG_WriteEncoded( msg, body );
+	} else {
+		SV_WriteSnapshotBody( &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ], oldframe, msg );
+	}
+}
+
+/*
+=======================
+SV_TransmitSnapshotMessage
+=======================
+*/
+static void SV_TransmitSnapshotMessage( client_t *client, msg_t *msg ) {
+#ifdef USE_VOIP
+	SV_WriteVoipToClient( client, msg );
+#endif
+
+	// check for overflow
+	if ( msg->overflowed ) {
+		Com_Printf ("WARNING: msg overflowed for %s\n", client->name);
+		MSG_Clear (msg);
+	}
+
+	SV_SendMessageToClient( msg, client );
+	SV_MetricsSnapshotSent( client );
+}
+
 /*
 =======================
 SV_SendClientSnapshot
@@ -611,28 +863,300 @@ void SV_SendClientSnapshot( client_t *client ) {
 	MSG_Init (&msg, msg_buf, sizeof(msg_buf));
 	msg.allowoverflow = qtrue;
 
-	// NOTE, MRE: all server->client messages now acknowledge
-	// let the client know which reliable clientCommands we have received
-	MSG_WriteLong( &msg, client->lastClientCommand );
+	SV_WriteSnapshotMessage( client, SV_SnapshotDeltaFrame( client ), NULL, &msg );
+	SV_TransmitSnapshotMessage( client, &msg );
+}
 
-	// (re)send any reliable server commands
-	SV_UpdateServerCommandsToClient( client, &msg );
+/*
+=============================================================================
 
-	// send over all the relevant entityState_t
-	// and the playerState_t
-	SV_WriteSnapshotToClient( client, &msg );
+Snapshot jobs
 
-#ifdef USE_VOIP
-	SV_WriteVoipToClient( client, &msg );
-#endif
+The snapshots of all clients due this frame are built and encoded in a few
+passes, spread over sv_snapshotThreads threads, each client into its own
+message.  Everything that changes shared state (the snapshot entity ring,
+console output, VoIP queues and the netchan) is done on the main thread
+between the passes.
 
-	// check for overflow
-	if ( msg.overflowed ) {
-		Com_Printf ("WARNING: msg overflowed for %s\n", client->name);
-		MSG_Clear (&msg);
+Clients that see the same entities share their range of the snapshot
+entity ring.  Clients whose snapshots also match in playerstate, areabits
+and delta source, typically spectators following the same player, share
+the encoded snapshot body: it is encoded once and its bits copied behind
+each client's own header.
+
+=============================================================================
+*/
+
+typedef struct {
+	client_t				*client;
+	qboolean				bot;
+	clientSnapshot_t		*frame;
+	clientSnapshot_t		*oldframe;
+	snapshotEntityNumbers_t	entityNumbers;
+	int						entityHash;
+	qboolean				copyEntities;	// owns its range of the snapshot entity ring
+	int						leader;			// job whose body is reused, or -1
+	qboolean				shared;			// other jobs reuse this one's body
+	msg_t					body;
+	byte					bodyBuffer[MAX_MSGLEN];
+	msg_t					msg;
+	byte					msgBuffer[MAX_MSGLEN];
+} snapshotJob_t;
+
+static snapshotJob_t	snapshotJobs[MAX_CLIENTS];
+
+/*
+=======================
+SV_CollectSnapshotJob
+=======================
+*/
+static void SV_CollectSnapshotJob( void *data, int index ) {
+	snapshotJob_t	*job = &snapshotJobs[index];
+	int				i;
+
+	SV_CollectSnapshotEntities( job->client, &job->entityNumbers );
+
+	job->entityHash = job->entityNumbers.numSnapshotEntities;
+	for ( i = 0 ; i < job->entityNumbers.numSnapshotEntities ; i++ ) {
+		job->entityHash = job->entityHash * 31 + job->entityNumbers.snapshotEntities[i];
+	}
+}
+
+/*
+=======================
+SV_CopySnapshotJob
+=======================
+*/
+static void SV_CopySnapshotJob( void *data, int index ) {
+	snapshotJob_t	*job = &snapshotJobs[index];
+
+	if ( job->copyEntities ) {
+		SV_CopySnapshotEntities( job->client, &job->entityNumbers );
+	}
+
+	if ( job->shared ) {
+		MSG_Init( &job->body, job->bodyBuffer, sizeof( job->bodyBuffer ) );
+		job->body.allowoverflow = qtrue;
+		job->body.deferErrors = qtrue;
+	}
+}
+
+/*
+=======================
+SV_EncodeBodyJob
+=======================
+*/
+static void SV_EncodeBodyJob( void *data, int index ) {
+	snapshotJob_t	*job = &snapshotJobs[index];
+
+	if ( job->shared ) {
+		SV_WriteSnapshotBody( job->frame, job->oldframe, &job->body );
+	}
+}
+
+/*
+=======================
+SV_EncodeSnapshotJob
+=======================
+*/
+static void SV_EncodeSnapshotJob( void *data, int index ) {
+	snapshotJob_t	*job = &snapshotJobs[index];
+	const msg_t		*body;
+
+	if ( job->bot ) {
+		return;
+	}
+
+	if ( job->shared ) {
+		body = &job->body;
+	} else if ( job->leader >= 0 ) {
+		body = &snapshotJobs[job->leader].body;
+	} else {
+		body = NULL;
+	}
+
+	MSG_Init( &job->msg, job->msgBuffer, sizeof( job->msgBuffer ) );
+	job->msg.allowoverflow = qtrue;
+	job->msg.deferErrors = qtrue;
+
+	SV_WriteSnapshotMessage( job->client, job->oldframe, body, &job->msg );
+}
+
+/*
+=======================
+SV_ShareSnapshotEntities
+
+Points the job's frame at the ring range of an earlier job that has the
+same entities, returns qfalse if there is none
+=======================
+*/
+static qboolean SV_ShareSnapshotEntities( snapshotJob_t *job ) {
+	snapshotJob_t	*other;
+	int				num;
+
+	num = job->entityNumbers.numSnapshotEntities;
+
+	for ( other = snapshotJobs ; other < job ; other++ ) {
+		if ( other->entityHash != job->entityHash
+			|| other->entityNumbers.numSnapshotEntities != num ) {
+			continue;
+		}
+		if ( memcmp( other->entityNumbers.snapshotEntities, job->entityNumbers.snapshotEntities,
+			num * sizeof( job->entityNumbers.snapshotEntities[0] ) ) ) {
+			continue;
+		}
+
+		job->frame->first_entity = other->frame->first_entity;
+		job->frame->num_entities = num;
+		return qtrue;
+	}
+
+	return qfalse;
+}
+
+/*
+=======================
+SV_SnapshotBodiesMatch
+=======================
+*/
+static qboolean SV_SnapshotBodiesMatch( const snapshotJob_t *a, const snapshotJob_t *b ) {
+	const clientSnapshot_t	*fa = a->frame, *fb = b->frame;
+
+	if ( fa->first_entity != fb->first_entity || fa->num_entities != fb->num_entities ) {
+		return qfalse;
+	}
+	if ( fa->areabytes != fb->areabytes || memcmp( fa->areabits, fb->areabits, fa->areabytes ) ) {
+		return qfalse;
+	}
+	if ( memcmp( &fa->ps, &fb->ps, sizeof( fa->ps ) ) ) {
+		return qfalse;
+	}
+
+	fa = a->oldframe;
+	fb = b->oldframe;
+	if ( !fa || !fb ) {
+		return ( fa == fb );
+	}
+
+	// shared ring ranges of the frames they were built in
+	if ( fa->first_entity != fb->first_entity || fa->num_entities != fb->num_entities ) {
+		return qfalse;
 	}
+	return !memcmp( &fa->ps, &fb->ps, sizeof( fa->ps ) );
+}
+
+/*
+=======================
+SV_CheckSnapshotJobErrors
 
-	SV_SendMessageToClient( &msg, client );
+Raises the first error the encode workers left in their messages
+=======================
+*/
+static void SV_CheckSnapshotJobErrors( int numJobs, qboolean bodies ) {
+	snapshotJob_t	*job;
+	int				i;
+
+	for ( i = 0, job = snapshotJobs ; i < numJobs ; i++, job++ ) {
+		if ( bodies ) {
+			if ( job->shared && job->body.error ) {
+				Com_Error( ERR_DROP, "%s", job->body.error );
+			}
+		} else if ( !job->bot && job->msg.error ) {
+			Com_Error( ERR_DROP, "%s", job->msg.error );
+		}
+	}
+}
+
+/*
+=======================
+SV_SendSnapshotJobs
+=======================
+*/
+static void SV_SendSnapshotJobs( int numJobs ) {
+	snapshotJob_t	*job, *other;
+	playerState_t	*ps;
+	vec3_t			org;
+	int				leafnum;
+	uint64_t		scratch[VIS_WORDS];
+	int				numShared;
+	int				i;
+
+	SV_MetricsBeginSection( SVM_SNAPSHOT );
+
+	// fill the visibility cache for every client's own viewpoint, the
+	// workers only read it
+	for ( i = 0, job = snapshotJobs ; sv.state && i < numJobs ; i++, job++ ) {
+		if ( !job->client->gentity || job->client->state == CS_ZOMBIE ) {
+			continue;
+		}
+		ps = SV_GameClientNum( job->client - svs.clients );
+		VectorCopy( ps->origin, org );
+		org[2] += ps->viewheight;
+		leafnum = CM_PointLeafnum( org );
+		SV_SnapshotVis( CM_LeafArea( leafnum ), CM_LeafCluster( leafnum ), scratch );
+	}
+
+	snapshotVis.readOnly = qtrue;
+	Sys_ParallelFor( sv_snapshotThreads->integer, numJobs, SV_CollectSnapshotJob, NULL );
+	snapshotVis.readOnly = qfalse;
+
+	// entity ranges are handed out in client order, as SV_SendClientSnapshot would
+	for ( i = 0, job = snapshotJobs ; i < numJobs ; i++, job++ ) {
+		if ( job->entityNumbers.error ) {
+			Com_Error( ERR_DROP, "%s", job->entityNumbers.error );
+		}
+
+		job->frame = &job->client->frames[ job->client->netchan.outgoingSequence & PACKET_MASK ];
+		job->copyEntities = !SV_ShareSnapshotEntities( job );
+		if ( job->copyEntities ) {
+			SV_ReserveSnapshotEntities( job->client, job->entityNumbers.numSnapshotEntities );
+		}
+	}
+
+	// delta sources are checked once all new ranges are claimed, so none of
+	// them can be overwritten while the workers read it
+	numShared = 0;
+	for ( i = 0, job = snapshotJobs ; i < numJobs ; i++, job++ ) {
+		job->bot = ( job->client->gentity && job->client->gentity->r.svFlags & SVF_BOT );
+		job->oldframe = job->bot ? NULL : SV_SnapshotDeltaFrame( job->client );
+		job->leader = -1;
+		job->shared = qfalse;
+
+		if ( job->bot ) {
+			continue;
+		}
+
+		for ( other = snapshotJobs ; other < job ; other++ ) {
+			if ( !other->bot && other->leader < 0 && SV_SnapshotBodiesMatch( job, other ) ) {
+				job->leader = other - snapshotJobs;
+				if ( !other->shared ) {
+					other->shared = qtrue;
+					numShared++;
+				}
+				break;
+			}
+		}
+	}
+
+	Sys_ParallelFor( sv_snapshotThreads->integer, numJobs, SV_CopySnapshotJob, NULL );
+	SV_MetricsEndSection( SVM_SNAPSHOT );
+
+	SV_MetricsBeginSection( SVM_ENCODE );
+	if ( numShared ) {
+		Sys_ParallelFor( sv_snapshotThreads->integer, numJobs, SV_EncodeBodyJob, NULL );
+		SV_CheckSnapshotJobErrors( numJobs, qtrue );
+	}
+	Sys_ParallelFor( sv_snapshotThreads->integer, numJobs, SV_EncodeSnapshotJob, NULL );
+	SV_CheckSnapshotJobErrors( numJobs, qfalse );
+	SV_MetricsEndSection( SVM_ENCODE );
+
+	SV_MetricsBeginSection( SVM_SEND );
+	for ( i = 0, job = snapshotJobs ; i < numJobs ; i++, job++ ) {
+		if ( !job->bot ) {
+			SV_TransmitSnapshotMessage( job->client, &job->msg );
+		}
+	}
+	SV_MetricsEndSection( SVM_SEND );
 }
 
 
@@ -644,9 +1168,14 @@ SV_SendClientMessages
 void SV_SendClientMessages(void)
 {
 	int		i;
+	int		numJobs;
 	client_t	*c;
 
-	// send a message to each connected client
+	// snapshots of all clients go out together at the end
+	NET_BeginSendBatch();
+
+	// find the clients that get a new message
+	numJobs = 0;
 	for(i=0; i < sv_maxclients->integer; i++)
 	{
 		c = &svs.clients[i];
@@ -660,6 +1189,7 @@ void SV_SendClientMessages(void)
 		if(c->netchan.unsentFragments || c->netchan_start_queue)
 		{
 			c->rateDelayed = qtrue;
+			SV_MetricsSnapshotDelayed(c);
 			continue;		// Drop this snapshot if the packet queue is still full or delta compression will break
 		}
 
@@ -675,13 +1205,30 @@ void SV_SendClientMessages(void)
 			{
 				// Not enough time since last packet passed through the line
 				c->rateDelayed = qtrue;
+				SV_MetricsSnapshotDelayed(c);
 				continue;
 			}
 		}
 
-		// generate and send a new message
-		SV_SendClientSnapshot(c);
+		snapshotJobs[numJobs++].client = c;
+	}
+
+	// generate and send the new messages
+	SV_ClearSnapshotVis();
+	snapshotVis.active = qtrue;
+
+	SV_SendSnapshotJobs(numJobs);
+
+	snapshotVis.active = qfalse;
+
+	for(i=0; i < numJobs; i++)
+	{
+		c = snapshotJobs[i].client;
 		c->lastSnapshotTime = svs.time;
 		c->rateDelayed = qfalse;
 	}
+
+	SV_MetricsBeginSection( SVM_SEND );
+	NET_FlushSendBatch();
+	SV_MetricsEndSection( SVM_SEND );
 }
@@ -151,6 +151,8 @@ void SV_ClearWorld( void ) {
 	Com_Memset( sv_worldSectors, 0, sizeof(sv_worldSectors) );
 	sv_numworldSectors = 0;
 
+	SV_ClearTraceCache();
+
 	// get world map bounds
 	h = CM_InlineModel( 0 );
 	CM_ModelBounds( h, mins, maxs );
@@ -173,6 +175,8 @@ void SV_UnlinkEntity( sharedEntity_t *gEnt ) {
 
 	gEnt->r.linked = qfalse;
 
+	SV_ClearTraceCache();
+
 	ws = ent->worldSector;
 	if ( !ws ) {
 		return;		// not linked in anywhere
@@ -215,6 +219,8 @@ void SV_LinkEntity( sharedEntity_t *gEnt ) {
 
 	ent = SV_SvEntityForGentity( gEnt );
 
+	SV_ClearTraceCache();
+
 	if ( ent->worldSector ) {
 		SV_UnlinkEntity( gEnt );	// unlink from old position
 	}
@@ -586,25 +592,102 @@ static void SV_ClipMoveToEntities( moveclip_t *clip ) {
 }
 
 
+/*
+===============================================================================
+
+TRACE CACHE
+
+Pmove and the bots repeat many traces with the same arguments before
+anything in the world moves. With sv_traceCache set the results are kept
+in a small direct mapped table until the next game frame or until an
+entity is linked or unlinked.
+
+===============================================================================
+*/
+
+#define	TRACE_CACHE_SIZE	256		// power of two
+
+typedef struct {
+	vec3_t		start;
+	vec3_t		end;
+	vec3_t		mins;
+	vec3_t		maxs;
+	int			passEntityNum;
+	int			contentmask;
+	int			capsule;
+} traceKey_t;
+
+typedef struct {
+	traceKey_t	key;
+	unsigned	generation;
+	trace_t		trace;
+} traceCacheEntry_t;
+
+static traceCacheEntry_t	sv_traceCacheEntries[TRACE_CACHE_SIZE];
+static unsigned				sv_traceCacheGeneration = 1;	// entries of older generations are stale
+
+static uint64_t				sv_traceCacheLookups;
+static uint64_t				sv_traceCacheHits;
+
+/*
+===============
+SV_ClearTraceCache
+===============
+*/
+void SV_ClearTraceCache( void ) {
+	sv_traceCacheGeneration++;
+	if ( !sv_traceCacheGeneration ) {
+		// wrapped, old entries could look current again
+		Com_Memset( sv_traceCacheEntries, 0, sizeof( sv_traceCacheEntries ) );
+		sv_traceCacheGeneration = 1;
+	}
+}
+
+/*
+===============
+SV_TraceCacheCounters
+===============
+*/
+void SV_TraceCacheCounters( uint64_t *lookups, uint64_t *hits ) {
+	*lookups = sv_traceCacheLookups;
+	*hits = sv_traceCacheHits;
+}
+
+/*
+===============
+SV_TraceCacheEntry
+
+Returns the slot for key, which holds its result if the generation
+is current and the key matches
+===============
+*/
+static traceCacheEntry_t *SV_TraceCacheEntry( const traceKey_t *key ) {
+	const unsigned	*words;
+	unsigned		hash;
+	int				i;
+
+	// FNV-1a over the raw bits, -0 and 0 just hash apart
+	words = (const unsigned *)key;
+	hash = 2166136261u;
+	for ( i = 0; i < (int)( sizeof( *key ) / sizeof( *words ) ); i++ ) {
+		hash = ( hash ^ words[i] ) * 16777619u;
+	}
+	hash ^= hash >> 16;
+
+	return &sv_traceCacheEntries[ hash & ( TRACE_CACHE_SIZE - 1 ) ];
+}
+
 /*
 ==================
-SV_Trace
+SV_ClipMove
 
 Moves the given mins/maxs volume through the world from start to end.
-passEntityNum and entities owned by passEntityNum are explicitly not checked.
 ==================
 */
-void SV_Trace( trace_t *results, const vec3_t start, vec3_t mins, vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask, int capsule ) {
+static void SV_ClipMove( trace_t *results, const vec3_t start, vec3_t mins, vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask, int capsule ) {
 	moveclip_t	clip;
 	int			i;
 
-	if ( !mins ) {
-		mins = vec3_origin;
-	}
-	if ( !maxs ) {
-		maxs = vec3_origin;
-	}
-
 	Com_Memset ( &clip, 0, sizeof ( moveclip_t ) );
 
 	// clip to world
@@ -644,6 +727,55 @@ void SV_Trace( trace_t *results, const vec3_t start, vec3_t mins, vec3_t maxs, c
 	*results = clip.trace;
 }
 
+/*
+==================
+SV_Trace
+
+Moves the given mins/maxs volume through the world from start to end.
+passEntityNum and entities owned by passEntityNum are explicitly not checked.
+==================
+*/
+void SV_Trace( trace_t *results, const vec3_t start, vec3_t mins, vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask, int capsule ) {
+	traceKey_t			key;
+	traceCacheEntry_t	*entry;
+
+	if ( !mins ) {
+		mins = vec3_origin;
+	}
+	if ( !maxs ) {
+		maxs = vec3_origin;
+	}
+
+	if ( !sv_traceCache->integer ) {
+		SV_ClipMove( results, start, mins, maxs, end, passEntityNum, contentmask, capsule );
+		return;
+	}
+
+	// results may overlap the arguments of a game trace, so copy them first
+	VectorCopy( start, key.start );
+	VectorCopy( end, key.end );
+	VectorCopy( mins, key.mins );
+	VectorCopy( maxs, key.maxs );
+	key.passEntityNum = passEntityNum;
+	key.contentmask = contentmask;
+	key.capsule = capsule;
+
+	sv_traceCacheLookups++;
+
+	entry = SV_TraceCacheEntry( &key );
+	if ( entry->generation == sv_traceCacheGeneration && !memcmp( &entry->key, &key, sizeof( key ) ) ) {
+		sv_traceCacheHits++;
+		*results = entry->trace;
+		return;
+	}
+
+	SV_ClipMove( &entry->trace, key.start, key.mins, key.maxs, key.end, passEntityNum, contentmask, capsule );
+	entry->key = key;
+	entry->generation = sv_traceCacheGeneration;
+
+	*results = entry->trace;
+}
+
 
 
 /*
@@ -56,5 +56,4 @@ void Sys_SigHandler( int signal ) __attribute__ ((noreturn));
 void Sys_ErrorDialog( const char *error );
 void Sys_AnsiColorPrint( const char *msg );
 
-int Sys_PID( void );
 qboolean Sys_PIDIsRunning( int pid );
@@ -133,6 +133,8 @@ char *Sys_ConsoleInput(void)
 #	define PID_FILENAME PRODUCT_NAME ".pid"
 #endif
 
+static int pidFileOwner;
+
 /*
 =================
 Sys_PIDFileName
@@ -177,7 +179,8 @@ qboolean Sys_WritePIDFile( void )
 
 	if( ( f = fopen( pidFile, "w" ) ) != NULL )
 	{
-		fprintf( f, "%d", Sys_PID( ) );
+		pidFileOwner = Sys_PID( );
+		fprintf( f, "%d", pidFileOwner );
 		fclose( f );
 	}
 	else
@@ -201,7 +204,8 @@ static __attribute__ ((noreturn)) void Sys_Exit( int exitCode )
 	SDL_Quit( );
 #endif
 
-	if( exitCode < 2 )
+	// forked server instances leave it to the first one
+	if( exitCode < 2 && Sys_PID( ) == pidFileOwner )
 	{
 		// Normal exit
 		remove( Sys_PIDFileName( ) );
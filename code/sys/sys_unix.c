@@ -33,11 +33,17 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <pwd.h>
 #include <libgen.h>
 #include <fcntl.h>
 #include <fenv.h>
 #include <sys/wait.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 qboolean stdinIsATTY;
 
@@ -127,6 +133,28 @@ int Sys_Milliseconds (void)
 	return curtime;
 }
 
+/*
+================
+Sys_Microseconds
+================
+*/
+int64_t Sys_Microseconds (void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tp;
+
+	gettimeofday(&tp, NULL);
+
+	return (int64_t)tp.tv_sec * 1000000 + tp.tv_usec;
+#endif
+}
+
 /*
 ==================
 Sys_RandomBytes
@@ -226,22 +254,35 @@ qboolean Sys_Mkdir( const char *path )
 
 /*
 ==================
-Sys_Mkfifo
+Sys_CreateFifo
+
+Creates a named pipe, replacing a stale one left by an earlier run
 ==================
 */
-FILE *Sys_Mkfifo( const char *ospath )
+qboolean Sys_CreateFifo( const char *ospath )
 {
-	FILE	*fifo;
-	int	result;
-	int	fn;
 	struct	stat buf;
 
 	// if file already exists AND is a pipefile, remove it
 	if( !stat( ospath, &buf ) && S_ISFIFO( buf.st_mode ) )
 		FS_Remove( ospath );
 
-	result = mkfifo( ospath, 0600 );
-	if( result != 0 )
+	return mkfifo( ospath, 0600 ) == 0;
+}
+
+/*
+==================
+Sys_Mkfifo
+
+Command input pipe, opened read/write so it never sees EOF
+==================
+*/
+FILE *Sys_Mkfifo( const char *ospath )
+{
+	FILE	*fifo;
+	int	fn;
+
+	if( !Sys_CreateFifo( ospath ) )
 		return NULL;
 
 	fifo = fopen( ospath, "w+" );
@@ -254,6 +295,70 @@ FILE *Sys_Mkfifo( const char *ospath )
 	return fifo;
 }
 
+/*
+==================
+Sys_FifoOpenWrite
+
+Streaming output pipe, opened write-only so a reader that goes away shows up
+as a failed write. Never waits: returns NULL until a reader has the other
+end open, and the caller tries again on a later frame.
+==================
+*/
+FILE *Sys_FifoOpenWrite( const char *ospath )
+{
+	FILE	*fifo;
+	int	fn;
+
+	// fails with ENXIO until the other end is opened
+	fn = open( ospath, O_WRONLY | O_NONBLOCK );
+	if( fn < 0 )
+		return NULL;
+
+	fifo = fdopen( fn, "w" );
+	if( !fifo )
+		close( fn );
+
+	return fifo;
+}
+
+/*
+==================
+Sys_FifoWrite
+
+Writes straight to the pipe, bypassing stdio buffering. A blocking write
+returns once everything is written; a non-blocking one stops when the pipe
+is full. Returns the number of bytes written, or -1 if the reader is gone.
+==================
+*/
+int Sys_FifoWrite( FILE *fifo, const void *buffer, int len, qboolean blocking )
+{
+	int	fn = fileno( fifo );
+	int	flags = fcntl( fn, F_GETFL );
+	int	written = 0;
+	int	result;
+
+	fcntl( fn, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK );
+
+	while( written < len )
+	{
+		result = write( fn, (const byte *)buffer + written, len - written );
+		if( result < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+
+			if( errno == EAGAIN && !blocking )
+				break;
+
+			return -1;
+		}
+
+		written += result;
+	}
+
+	return written;
+}
+
 /*
 ==================
 Sys_Cwd
@@ -459,6 +564,196 @@ void Sys_FreeFileList( char **list )
 	Z_Free( list );
 }
 
+typedef struct {
+	DIR		*handle;
+	char	path[MAX_OSPATH];
+} sysDir_t;
+
+/*
+==================
+Sys_OpenDir
+==================
+*/
+void *Sys_OpenDir( const char *directory )
+{
+	sysDir_t	*dir;
+	DIR			*handle;
+
+	if( ( handle = opendir( directory ) ) == NULL )
+		return NULL;
+
+	dir = Z_Malloc( sizeof( *dir ) );
+	dir->handle = handle;
+	Q_strncpyz( dir->path, directory, sizeof( dir->path ) );
+
+	return dir;
+}
+
+/*
+==================
+Sys_ReadDir
+
+Returns qfalse once all entries have been read, "." and ".." are skipped
+==================
+*/
+qboolean Sys_ReadDir( void *dir, sysDirEntry_t *entry )
+{
+	sysDir_t		*d = dir;
+	struct dirent	*de;
+	struct stat		st;
+	char			path[MAX_OSPATH];
+
+	while( ( de = readdir( d->handle ) ) != NULL )
+	{
+		if( !strcmp( de->d_name, "." ) || !strcmp( de->d_name, ".." ) )
+			continue;
+
+		Com_sprintf( path, sizeof( path ), "%s/%s", d->path, de->d_name );
+		if( stat( path, &st ) == -1 )
+			continue;
+
+		Q_strncpyz( entry->name, de->d_name, sizeof( entry->name ) );
+		entry->isDir = S_ISDIR( st.st_mode ) ? qtrue : qfalse;
+		entry->mtime = st.st_mtime;
+		entry->size = st.st_size;
+		return qtrue;
+	}
+
+	return qfalse;
+}
+
+/*
+==================
+Sys_CloseDir
+==================
+*/
+void Sys_CloseDir( void *dir )
+{
+	sysDir_t	*d = dir;
+
+	closedir( d->handle );
+	Z_Free( d );
+}
+
+typedef struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;			// signalled when a new batch of work is posted
+	pthread_cond_t	done;			// signalled when the last worker has finished
+	pthread_t		threads[MAX_PARALLEL_THREADS - 1];
+	int				numThreads;
+	int				generation;		// bumped for every batch
+	int				wanted;			// workers taking part in the current batch
+	int				busy;			// workers still running the current batch
+	void			(*func)( void *data, int index );
+	void			*data;
+	int				count;
+	volatile int	next;			// next index to hand out
+} sysParallel_t;
+
+static sysParallel_t sysParallel = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+/*
+==================
+Sys_ParallelRun
+
+Hands out indexes of the current batch until there are none left
+==================
+*/
+static void Sys_ParallelRun( void )
+{
+	int		i;
+
+	while( ( i = __sync_fetch_and_add( &sysParallel.next, 1 ) ) < sysParallel.count )
+		sysParallel.func( sysParallel.data, i );
+}
+
+/*
+==================
+Sys_ParallelWorker
+==================
+*/
+static void *Sys_ParallelWorker( void *arg )
+{
+	int		self = (intptr_t)arg;
+	int		generation = 0;
+
+	pthread_mutex_lock( &sysParallel.lock );
+	while( 1 )
+	{
+		while( sysParallel.generation == generation )
+			pthread_cond_wait( &sysParallel.wake, &sysParallel.lock );
+		generation = sysParallel.generation;
+
+		if( self >= sysParallel.wanted )
+			continue;
+
+		pthread_mutex_unlock( &sysParallel.lock );
+		Sys_ParallelRun( );
+		pthread_mutex_lock( &sysParallel.lock );
+
+		if( --sysParallel.busy == 0 )
+			pthread_cond_signal( &sysParallel.done );
+	}
+
+	return NULL;
+}
+
+/*
+==================
+Sys_ParallelFor
+==================
+*/
+void Sys_ParallelFor( int numThreads, int count, void (*func)( void *data, int index ), void *data )
+{
+	int		workers;
+
+	workers = MIN( numThreads, MAX_PARALLEL_THREADS ) - 1;
+	if( workers > count - 1 )
+		workers = count - 1;
+
+	// start the worker threads the first time they are needed
+	while( sysParallel.numThreads < workers )
+	{
+		if( pthread_create( &sysParallel.threads[sysParallel.numThreads], NULL,
+			Sys_ParallelWorker, (void *)(intptr_t)sysParallel.numThreads ) != 0 )
+		{
+			Com_Printf( "WARNING: couldn't start worker thread: %s\n", strerror( errno ) );
+			break;
+		}
+		sysParallel.numThreads++;
+	}
+
+	if( workers > sysParallel.numThreads )
+		workers = sysParallel.numThreads;
+
+	sysParallel.func = func;
+	sysParallel.data = data;
+	sysParallel.count = count;
+	sysParallel.next = 0;
+
+	if( workers > 0 )
+	{
+		pthread_mutex_lock( &sysParallel.lock );
+		sysParallel.wanted = workers;
+		sysParallel.busy = workers;
+		sysParallel.generation++;
+		pthread_cond_broadcast( &sysParallel.wake );
+		pthread_mutex_unlock( &sysParallel.lock );
+	}
+
+	Sys_ParallelRun( );
+
+	if( workers > 0 )
+	{
+		pthread_mutex_lock( &sysParallel.lock );
+		while( sysParallel.busy > 0 )
+			pthread_cond_wait( &sysParallel.done, &sysParallel.lock );
+		pthread_mutex_unlock( &sysParallel.lock );
+	}
+}
+
 /*
 ==================
 Sys_Sleep
@@ -831,6 +1126,9 @@ void Sys_PlatformInit( void )
 	signal( SIGIOT, Sys_SigHandler );
 	signal( SIGBUS, Sys_SigHandler );
 
+	// a pipe reader going away must fail the write, not kill the process
+	signal( SIGPIPE, SIG_IGN );
+
 	stdinIsATTY = isatty( STDIN_FILENO ) &&
 		!( term && ( !strcmp( term, "raw" ) || !strcmp( term, "dumb" ) ) );
 }
@@ -872,6 +1170,57 @@ int Sys_PID( void )
 	return getpid( );
 }
 
+/*
+==============
+Sys_StartInstances
+
+Forks count - 1 copies of the process
+==============
+*/
+int Sys_StartInstances( int count )
+{
+	pid_t	pid;
+	int		i, fd;
+
+	// anything still buffered would be written once by every instance
+	fflush( NULL );
+
+	for( i = 1; i < count; i++ )
+	{
+		pid = fork( );
+
+		if( pid < 0 )
+		{
+			Com_Printf( "Couldn't start server instance %d: %s\n", i, strerror( errno ) );
+			break;
+		}
+
+		if( pid == 0 )
+		{
+#ifdef __linux__
+			// don't outlive the first instance
+			prctl( PR_SET_PDEATHSIG, SIGTERM );
+#endif
+
+			// only the first instance reads the console
+			fd = open( "/dev/null", O_RDONLY );
+			if( fd >= 0 )
+			{
+				dup2( fd, STDIN_FILENO );
+				close( fd );
+			}
+			stdinIsATTY = qfalse;
+
+			return i;
+		}
+	}
+
+	// the other instances are never waited for
+	signal( SIGCHLD, SIG_IGN );
+
+	return 0;
+}
+
 /*
 ==============
 Sys_PIDIsRunning
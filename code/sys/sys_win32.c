@@ -165,6 +165,25 @@ int Sys_Milliseconds (void)
 	return sys_curtime;
 }
 
+/*
+================
+Sys_Microseconds
+================
+*/
+int64_t Sys_Microseconds (void)
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+
+	QueryPerformanceCounter(&counter);
+
+	return (counter.QuadPart / frequency.QuadPart) * 1000000 +
+		(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
 /*
 ================
 Sys_RandomBytes
@@ -328,6 +347,36 @@ FILE *Sys_Mkfifo( const char *ospath )
 	return NULL;
 }
 
+/*
+==================
+Sys_CreateFifo
+==================
+*/
+qboolean Sys_CreateFifo( const char *ospath )
+{
+	return qfalse;
+}
+
+/*
+==================
+Sys_FifoOpenWrite
+==================
+*/
+FILE *Sys_FifoOpenWrite( const char *ospath )
+{
+	return NULL;
+}
+
+/*
+==================
+Sys_FifoWrite
+==================
+*/
+int Sys_FifoWrite( FILE *fifo, const void *buffer, int len, qboolean blocking )
+{
+	return -1;
+}
+
 /*
 ==============
 Sys_Cwd
@@ -553,6 +602,177 @@ void Sys_FreeFileList( char **list )
 	Z_Free( list );
 }
 
+typedef struct {
+	intptr_t				handle;
+	struct __finddata64_t	info;
+	qboolean				pending;	// info holds an entry not returned yet
+} sysDir_t;
+
+/*
+==============
+Sys_OpenDir
+==============
+*/
+void *Sys_OpenDir( const char *directory )
+{
+	sysDir_t	*dir;
+	char		search[MAX_OSPATH];
+
+	dir = Z_Malloc( sizeof( *dir ) );
+
+	Com_sprintf( search, sizeof( search ), "%s\\*", directory );
+	dir->handle = _findfirst64( search, &dir->info );
+	if( dir->handle == -1 )
+	{
+		Z_Free( dir );
+		return NULL;
+	}
+	dir->pending = qtrue;
+
+	return dir;
+}
+
+/*
+==============
+Sys_ReadDir
+
+Returns qfalse once all entries have been read, "." and ".." are skipped
+==============
+*/
+qboolean Sys_ReadDir( void *dir, sysDirEntry_t *entry )
+{
+	sysDir_t	*d = dir;
+
+	while( d->pending || _findnext64( d->handle, &d->info ) != -1 )
+	{
+		d->pending = qfalse;
+
+		if( !strcmp( d->info.name, "." ) || !strcmp( d->info.name, ".." ) )
+			continue;
+
+		Q_strncpyz( entry->name, d->info.name, sizeof( entry->name ) );
+		entry->isDir = ( d->info.attrib & _A_SUBDIR ) ? qtrue : qfalse;
+		entry->mtime = d->info.time_write;
+		entry->size = d->info.size;
+		return qtrue;
+	}
+
+	return qfalse;
+}
+
+/*
+==============
+Sys_CloseDir
+==============
+*/
+void Sys_CloseDir( void *dir )
+{
+	sysDir_t	*d = dir;
+
+	_findclose( d->handle );
+	Z_Free( d );
+}
+
+
+typedef struct {
+	HANDLE			threads[MAX_PARALLEL_THREADS - 1];
+	HANDLE			wake[MAX_PARALLEL_THREADS - 1];	// one auto-reset event per worker
+	HANDLE			done;			// set when the last worker has finished
+	int				numThreads;
+	void			(*func)( void *data, int index );
+	void			*data;
+	int				count;
+	volatile LONG	next;			// next index to hand out
+	volatile LONG	busy;			// workers still running the current batch
+} sysParallel_t;
+
+static sysParallel_t sysParallel;
+
+/*
+==============
+Sys_ParallelRun
+
+Hands out indexes of the current batch until there are none left
+==============
+*/
+static void Sys_ParallelRun( void )
+{
+	int		i;
+
+	while( ( i = InterlockedIncrement( &sysParallel.next ) - 1 ) < sysParallel.count )
+		sysParallel.func( sysParallel.data, i );
+}
+
+/*
+==============
+Sys_ParallelWorker
+==============
+*/
+static DWORD WINAPI Sys_ParallelWorker( LPVOID arg )
+{
+	HANDLE	wake = sysParallel.wake[(INT_PTR)arg];
+
+	while( 1 )
+	{
+		WaitForSingleObject( wake, INFINITE );
+		Sys_ParallelRun( );
+
+		if( InterlockedDecrement( &sysParallel.busy ) == 0 )
+			SetEvent( sysParallel.done );
+	}
+
+	return 0;
+}
+
+/*
+==============
+Sys_ParallelFor
+==============
+*/
+void Sys_ParallelFor( int numThreads, int count, void (*func)( void *data, int index ), void *data )
+{
+	int		workers;
+	int		i;
+
+	workers = MIN( numThreads, MAX_PARALLEL_THREADS ) - 1;
+	if( workers > count - 1 )
+		workers = count - 1;
+
+	if( !sysParallel.done && workers > 0 )
+		sysParallel.done = CreateEvent( NULL, FALSE, FALSE, NULL );
+
+	// start the worker threads the first time they are needed
+	while( sysParallel.numThreads < workers )
+	{
+		i = sysParallel.numThreads;
+		sysParallel.wake[i] = CreateEvent( NULL, FALSE, FALSE, NULL );
+		sysParallel.threads[i] = CreateThread( NULL, 0, Sys_ParallelWorker, (LPVOID)(INT_PTR)i, 0, NULL );
+		if( !sysParallel.threads[i] )
+		{
+			Com_Printf( "WARNING: couldn't start worker thread: error %lu\n", GetLastError( ) );
+			CloseHandle( sysParallel.wake[i] );
+			break;
+		}
+		sysParallel.numThreads++;
+	}
+
+	if( workers > sysParallel.numThreads )
+		workers = sysParallel.numThreads;
+
+	sysParallel.func = func;
+	sysParallel.data = data;
+	sysParallel.count = count;
+	sysParallel.next = 0;
+	sysParallel.busy = workers;
+
+	for( i = 0; i < workers; i++ )
+		SetEvent( sysParallel.wake[i] );
+
+	Sys_ParallelRun( );
+
+	if( workers > 0 )
+		WaitForSingleObject( sysParallel.done, INFINITE );
+}
 
 /*
 ==============
@@ -788,6 +1008,20 @@ int Sys_PID( void )
 	return GetCurrentProcessId( );
 }
 
+/*
+==============
+Sys_StartInstances
+
+There is no fork on windows, every server needs its own process
+==============
+*/
+int Sys_StartInstances( int count )
+{
+	Com_Printf( "com_instances isn't supported on this platform, starting a single server\n" );
+
+	return 0;
+}
+
 /*
 ==============
 Sys_PIDIsRunning
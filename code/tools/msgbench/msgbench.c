@@ -0,0 +1,1387 @@
+/*
+===========================================================================
+Copyright (C) 1999-2005 Id Software, Inc.
+
+This file is part of Quake III Arena source code.
+
+Quake III Arena source code is free software; you can redistribute it
+and/or modify it under the terms of the GNU General Public License as
+published by the Free Software Foundation; either version 2 of the License,
+or (at your option) any later version.
+
+Quake III Arena source code is distributed in the hope that it will be
+useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Quake III Arena source code; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+===========================================================================
+*/
+// msgbench.c -- message coding benchmark
+//
+// Pulls the snapshot stream out of one or more demos (or makes one up when
+// no demos are given) and runs it through the same delta, huffman and
+// netchan code the engine uses.  Every stage is read back and compared
+// with what went in, and all the bytes that were produced are summed into
+// a checksum, so an optimised encoder can be checked for bit exactness
+// with -expect.
+//
+// -fuzz skips the benchmarks and instead runs the messages, and as many
+// random buffers as asked for, through both Huff_Compress/Huff_Decompress
+// and the original huff_t coder built on Huff_addRef, which must produce
+// the same bytes.
+//
+// 'make msgbench' builds it as tools/q3msgbench in the release build dir.
+//
+// usage: q3msgbench [-loops <count>] [-expect <checksum>] [-fuzz <count>] [demo ...]
+
+#include "../../qcommon/q_shared.h"
+#include "../../qcommon/qcommon.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define	MB_LOOPS			20
+#define	MB_HUFF_LOOPS_DIVISOR	10
+#define	MB_SYNTH_FRAMES		4000
+#define	MB_SYNTH_ENTITIES	128
+#define	MB_FUZZ_BUFFER		0x10000
+
+typedef struct {
+	playerState_t	ps;
+	int				firstEntity;
+	int				numEntities;
+	int				stream;			// snapshots only delta from the same stream
+} mbSnapshot_t;
+
+typedef struct {
+	int				offset;
+	int				length;
+} mbMessage_t;
+
+typedef struct {
+	byte			*data;
+	int				size, maxSize;
+	mbMessage_t		*messages;
+	int				numMessages, maxMessages;
+} mbStore_t;
+
+typedef struct {
+	const char		*name;
+	int64_t			ops;
+	int64_t			bytes;
+	double			seconds;
+} mbResult_t;
+
+static mbSnapshot_t		*mbSnapshots;
+static int				mbNumSnapshots, mbMaxSnapshots;
+
+static entityState_t	*mbEntities;
+static int				mbNumEntities, mbMaxEntities;
+
+static entityState_t	*mbBaselines;		// MAX_GENTITIES for each stream
+static int				mbNumStreams, mbMaxBaselines;
+
+static mbStore_t		mbPlayerStore, mbEntityStore, mbSnapshotStore;
+
+static unsigned			mbChecksum = 2166136261u;
+static int				mbErrors;
+
+// what the netchan stub does with the packets it is given
+static netchan_t		mbReceiver;
+static qboolean			mbVerifyPackets;
+static int				mbWireBytes;
+static const byte		*mbExpected;
+static int				mbExpectedLength;
+static int				mbReceived;
+
+cvar_t	*cl_shownet;
+cvar_t	*cl_packetdelay;
+cvar_t	*sv_packetdelay;
+cvar_t	*com_timescale;
+
+/*
+==============================================================================
+
+ENGINE STUBS
+
+==============================================================================
+*/
+
+void QDECL Com_Printf( const char *fmt, ... ) {
+	va_list		argptr;
+
+	va_start( argptr, fmt );
+	vprintf( fmt, argptr );
+	va_end( argptr );
+}
+
+void QDECL Com_Error( int code, const char *fmt, ... ) {
+	va_list		argptr;
+
+	printf( "ERROR: " );
+	va_start( argptr, fmt );
+	vprintf( fmt, argptr );
+	va_end( argptr );
+	printf( "\n" );
+	exit( 1 );
+}
+
+cvar_t *Cvar_Get( const char *var_name, const char *var_value, int flags ) {
+	cvar_t	*var;
+
+	var = calloc( 1, sizeof( *var ) );
+	var->name = (char *)var_name;
+	var->string = (char *)var_value;
+	var->value = atof( var_value );
+	var->integer = atoi( var_value );
+	var->flags = flags;
+	return var;
+}
+
+int Sys_Milliseconds( void ) {
+	return 0;
+}
+
+qboolean Sys_StringToAdr( const char *s, netadr_t *a, netadrtype_t family ) {
+	return qfalse;
+}
+
+const char *NET_AdrToString( netadr_t a ) {
+	return "msgbench";
+}
+
+#ifdef ZONE_DEBUG
+void *S_MallocDebug( int size, char *label, char *file, int line ) {
+	return calloc( 1, size );
+}
+#else
+void *S_Malloc( int size ) {
+	return malloc( size );
+}
+#endif
+
+void Z_Free( void *ptr ) {
+	free( ptr );
+}
+
+/*
+================
+MB_Checksum
+================
+*/
+static void MB_Checksum( const byte *data, int length ) {
+	int		i;
+
+	for ( i = 0 ; i < length ; i++ ) {
+		mbChecksum = ( mbChecksum ^ data[i] ) * 16777619u;
+	}
+}
+
+/*
+================
+Sys_SendPacket
+
+Counts the wire bytes, and while verifying hands every packet to a
+receiving netchan to check the message comes out the other end whole
+================
+*/
+void Sys_SendPacket( int length, const void *data, netadr_t to ) {
+	static byte	bufData[MAX_MSGLEN];
+	msg_t		msg;
+
+	mbWireBytes += length;
+
+	if ( !mbVerifyPackets ) {
+		return;
+	}
+
+	MB_Checksum( data, length );
+
+	MSG_Init( &msg, bufData, sizeof( bufData ) );
+	Com_Memcpy( bufData, data, length );
+	msg.cursize = length;
+
+	if ( !Netchan_Process( &mbReceiver, &msg ) ) {
+		return;
+	}
+
+	if ( msg.cursize - msg.readcount != mbExpectedLength ||
+		memcmp( msg.data + msg.readcount, mbExpected, mbExpectedLength ) ) {
+		Com_Printf( "netchan: message %i came through changed\n", mbReceived );
+		mbErrors++;
+	}
+	mbReceived++;
+}
+
+/*
+==============================================================================
+
+HELPERS
+
+==============================================================================
+*/
+
+/*
+================
+MB_Seconds
+================
+*/
+static double MB_Seconds( void ) {
+#ifdef _WIN32
+	LARGE_INTEGER	count, frequency;
+
+	QueryPerformanceCounter( &count );
+	QueryPerformanceFrequency( &frequency );
+	return (double)count.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec	ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/*
+================
+MB_Grow
+
+Makes room for count more elements in a growing array
+================
+*/
+static void *MB_Grow( void *base, int *max, int used, int count, int size ) {
+	if ( used + count <= *max ) {
+		return base;
+	}
+	while ( used + count > *max ) {
+		*max = *max ? *max * 2 : 1024;
+	}
+	base = realloc( base, (size_t)*max * size );
+	if ( !base ) {
+		Com_Error( ERR_FATAL, "out of memory" );
+	}
+	return base;
+}
+
+/*
+================
+MB_Store
+================
+*/
+static void MB_Store( mbStore_t *store, const byte *data, int length ) {
+	mbMessage_t	*m;
+
+	store->data = MB_Grow( store->data, &store->maxSize, store->size, length, 1 );
+	store->messages = MB_Grow( store->messages, &store->maxMessages,
+		store->numMessages, 1, sizeof( mbMessage_t ) );
+
+	m = &store->messages[store->numMessages++];
+	m->offset = store->size;
+	m->length = length;
+	Com_Memcpy( store->data + store->size, data, length );
+	store->size += length;
+
+	MB_Checksum( data, length );
+}
+
+/*
+================
+MB_NewStream
+================
+*/
+static entityState_t *MB_NewStream( void ) {
+	entityState_t	*baselines;
+
+	mbBaselines = MB_Grow( mbBaselines, &mbMaxBaselines, mbNumStreams * MAX_GENTITIES,
+		MAX_GENTITIES, sizeof( entityState_t ) );
+	baselines = &mbBaselines[mbNumStreams * MAX_GENTITIES];
+	Com_Memset( baselines, 0, MAX_GENTITIES * sizeof( *baselines ) );
+	mbNumStreams++;
+
+	return baselines;
+}
+
+/*
+================
+MB_NewSnapshot
+
+Makes room for a full snapshot worth of entities after it
+================
+*/
+static mbSnapshot_t *MB_NewSnapshot( void ) {
+	mbSnapshot_t	*snap;
+
+	mbSnapshots = MB_Grow( mbSnapshots, &mbMaxSnapshots, mbNumSnapshots, 1, sizeof( mbSnapshot_t ) );
+	mbEntities = MB_Grow( mbEntities, &mbMaxEntities, mbNumEntities, MAX_GENTITIES, sizeof( entityState_t ) );
+
+	snap = &mbSnapshots[mbNumSnapshots];
+	Com_Memset( snap, 0, sizeof( *snap ) );
+	snap->firstEntity = mbNumEntities;
+	snap->stream = mbNumStreams - 1;
+
+	return snap;
+}
+
+/*
+==============================================================================
+
+DEMO LOADING
+
+==============================================================================
+*/
+
+/*
+================
+MB_ParseGamestate
+
+Only the baselines are kept
+================
+*/
+static qboolean MB_ParseGamestate( msg_t *msg ) {
+	entityState_t	nullstate, *baselines;
+	int				cmd, newnum;
+
+	MSG_ReadLong( msg );		// command sequence
+
+	baselines = MB_NewStream();
+	Com_Memset( &nullstate, 0, sizeof( nullstate ) );
+
+	while ( 1 ) {
+		if ( msg->readcount > msg->cursize ) {
+			return qfalse;
+		}
+
+		cmd = MSG_ReadByte( msg );
+
+		if ( cmd == svc_EOF ) {
+			break;
+		}
+
+		if ( cmd == svc_configstring ) {
+			MSG_ReadShort( msg );
+			MSG_ReadBigString( msg );
+		} else if ( cmd == svc_baseline ) {
+			newnum = MSG_ReadBits( msg, GENTITYNUM_BITS );
+			if ( newnum < 0 || newnum >= MAX_GENTITIES ) {
+				return qfalse;
+			}
+			MSG_ReadDeltaEntity( msg, &nullstate, &baselines[newnum], newnum );
+		} else {
+			return qfalse;
+		}
+	}
+
+	MSG_ReadLong( msg );		// client num
+	MSG_ReadLong( msg );		// checksum feed
+
+	return qtrue;
+}
+
+/*
+================
+MB_ParseSnapshot
+
+The same as CL_ParseSnapshot and CL_ParsePacketEntities, without the
+client state.  ring holds the snapshot number of the last PACKET_BACKUP
+server messages, or -1.
+================
+*/
+static qboolean MB_ParseSnapshot( msg_t *msg, int messageNum, int *ring ) {
+	mbSnapshot_t	*snap, *old;
+	entityState_t	*baselines, *oldstate, *state;
+	int				deltaNum, len, oldindex, oldnum, newnum;
+	byte			areamask[MAX_MAP_AREA_BYTES];
+
+	if ( !mbNumStreams ) {
+		return qfalse;
+	}
+
+	snap = MB_NewSnapshot();
+	baselines = &mbBaselines[snap->stream * MAX_GENTITIES];
+
+	MSG_ReadLong( msg );		// server time
+
+	deltaNum = MSG_ReadByte( msg );
+	old = NULL;
+	if ( deltaNum ) {
+		if ( deltaNum >= PACKET_BACKUP || ring[( messageNum - deltaNum ) & PACKET_MASK] < 0 ) {
+			return qfalse;
+		}
+		old = &mbSnapshots[ring[( messageNum - deltaNum ) & PACKET_MASK]];
+		if ( old->stream != snap->stream ) {
+			return qfalse;
+		}
+	}
+	MSG_ReadByte( msg );		// snap flags
+
+	len = MSG_ReadByte( msg );
+	if ( len > sizeof( areamask ) ) {
+		return qfalse;
+	}
+	MSG_ReadData( msg, areamask, len );
+
+	MSG_ReadDeltaPlayerstate( msg, old ? &old->ps : NULL, &snap->ps );
+
+	oldindex = 0;
+	oldstate = NULL;
+	oldnum = 99999;
+	if ( old && old->numEntities ) {
+		oldstate = &mbEntities[old->firstEntity];
+		oldnum = oldstate->number;
+	}
+
+	while ( 1 ) {
+		newnum = MSG_ReadBits( msg, GENTITYNUM_BITS );
+		if ( newnum == MAX_GENTITIES - 1 ) {
+			break;
+		}
+		if ( msg->readcount > msg->cursize ) {
+			mbNumEntities = snap->firstEntity;
+			return qfalse;
+		}
+
+		// one or more entities from the old packet are unchanged
+		while ( oldnum < newnum ) {
+			mbEntities[mbNumEntities++] = *oldstate;
+			if ( ++oldindex >= old->numEntities ) {
+				oldnum = 99999;
+			} else {
+				oldstate++;
+				oldnum = oldstate->number;
+			}
+		}
+
+		state = &mbEntities[mbNumEntities];
+		if ( oldnum == newnum ) {
+			// delta from previous state
+			MSG_ReadDeltaEntity( msg, oldstate, state, newnum );
+			if ( ++oldindex >= old->numEntities ) {
+				oldnum = 99999;
+			} else {
+				oldstate++;
+				oldnum = oldstate->number;
+			}
+		} else {
+			// delta from baseline
+			MSG_ReadDeltaEntity( msg, &baselines[newnum], state, newnum );
+		}
+
+		if ( state->number != MAX_GENTITIES - 1 ) {
+			mbNumEntities++;
+		}
+	}
+
+	// any remaining entities in the old frame are copied over
+	while ( oldnum != 99999 ) {
+		mbEntities[mbNumEntities++] = *oldstate;
+		if ( ++oldindex >= old->numEntities ) {
+			oldnum = 99999;
+		} else {
+			oldstate++;
+			oldnum = oldstate->number;
+		}
+	}
+
+	if ( msg->readcount > msg->cursize ) {
+		mbNumEntities = snap->firstEntity;
+		return qfalse;
+	}
+
+	snap->numEntities = mbNumEntities - snap->firstEntity;
+	ring[messageNum & PACKET_MASK] = mbNumSnapshots++;
+	return qtrue;
+}
+
+/*
+================
+MB_LoadDemo
+================
+*/
+static void MB_LoadDemo( const char *name ) {
+	static byte	bufData[MAX_MSGLEN];
+	msg_t		msg;
+	FILE		*f;
+	int			header[2], messageNum, len, cmd, i, first;
+	int			ring[PACKET_BACKUP];
+	qboolean	ok;
+
+	f = fopen( name, "rb" );
+	if ( !f ) {
+		Com_Printf( "couldn't open %s\n", name );
+		mbErrors++;
+		return;
+	}
+
+	for ( i = 0 ; i < PACKET_BACKUP ; i++ ) {
+		ring[i] = -1;
+	}
+	first = mbNumSnapshots;
+
+	while ( fread( header, sizeof( header ), 1, f ) == 1 ) {
+		messageNum = LittleLong( header[0] );
+		len = LittleLong( header[1] );
+		if ( len < 0 || len > sizeof( bufData ) || fread( bufData, len, 1, f ) != 1 ) {
+			break;
+		}
+
+		MSG_Init( &msg, bufData, sizeof( bufData ) );
+		msg.cursize = len;
+		MSG_Bitstream( &msg );
+		MSG_ReadLong( &msg );		// reliable acknowledge
+
+		ok = qtrue;
+		while ( ok && msg.readcount <= msg.cursize ) {
+			cmd = MSG_ReadByte( &msg );
+			if ( cmd == svc_EOF ) {
+				break;
+			}
+
+			switch ( cmd ) {
+			case svc_nop:
+				break;
+			case svc_serverCommand:
+				MSG_ReadLong( &msg );
+				MSG_ReadString( &msg );
+				break;
+			case svc_gamestate:
+				for ( i = 0 ; i < PACKET_BACKUP ; i++ ) {
+					ring[i] = -1;
+				}
+				ok = MB_ParseGamestate( &msg );
+				break;
+			case svc_snapshot:
+				ok = MB_ParseSnapshot( &msg, messageNum, ring );
+				break;
+			default:
+				// downloads and voip don't end up in demos
+				ok = qfalse;
+				break;
+			}
+		}
+	}
+
+	fclose( f );
+
+	Com_Printf( "%s: %i snapshots\n", name, mbNumSnapshots - first );
+}
+
+/*
+================
+MB_Synthesize
+
+A made up stream for when there are no demos around: a player running
+around among entities that move, fire events and come and go
+================
+*/
+static void MB_Synthesize( int frames ) {
+	mbSnapshot_t	*snap;
+	entityState_t	*es;
+	playerState_t	*ps;
+	unsigned		seed;
+	int				f, i, n;
+
+	MB_NewStream();
+	seed = 1;
+
+	for ( f = 0 ; f < frames ; f++ ) {
+		snap = MB_NewSnapshot();
+		ps = &snap->ps;
+		if ( f ) {
+			*ps = mbSnapshots[f - 1].ps;
+		}
+
+		seed = seed * 1103515245 + 12345;
+		ps->commandTime = f * 50;
+		ps->origin[0] = 512.0f * sin( f * 0.013 );
+		ps->origin[1] = 512.0f * cos( f * 0.011 );
+		ps->origin[2] = ( f % 60 < 20 ) ? 24.0f + ( f % 20 ) * 1.5f : 24.0f;
+		ps->velocity[0] = (int)( 320.0f * cos( f * 0.013 ) );
+		ps->velocity[1] = (int)( -320.0f * sin( f * 0.011 ) );
+		ps->weaponTime = ( f % 8 ) * 100;
+		ps->bobCycle = ( f * 7 ) & 255;
+		ps->delta_angles[YAW] = ( seed >> 16 ) & 0xffff;
+		ps->viewangles[YAW] = ( f * 3 ) % 360;
+		ps->viewangles[PITCH] = ( ( seed >> 8 ) % 90 ) - 45.0f;
+		ps->viewheight = 26;
+		if ( !( f % 25 ) ) {
+			ps->stats[0] = 100 - ( f / 25 ) % 100;		// health
+			ps->persistant[0] = f / 100;				// score
+			ps->ammo[2 + ( f / 25 ) % 6]++;
+		}
+		if ( !( f % 40 ) ) {
+			ps->externalEvent = f & 255;
+			ps->eventSequence++;
+		}
+
+		for ( i = 0 ; i < MB_SYNTH_ENTITIES ; i++ ) {
+			if ( ( i * 7 + f / 30 ) % 5 == 0 ) {
+				continue;		// not in this snapshot
+			}
+
+			es = &mbEntities[mbNumEntities++];
+			Com_Memset( es, 0, sizeof( *es ) );
+			n = f + i * 13;
+
+			es->number = i + 1;
+			es->eType = i % 6;
+			es->modelindex = i % 12;
+			es->pos.trType = ( i & 3 ) ? TR_LINEAR : TR_STATIONARY;
+			es->pos.trTime = ( n / 10 ) * 500;
+			es->pos.trBase[0] = (int)( 1000.0f * sin( n * 0.01 ) );
+			es->pos.trBase[1] = (int)( 1000.0f * cos( n * 0.01 ) );
+			es->pos.trBase[2] = i * 4;
+			es->pos.trDelta[0] = ( i & 3 ) ? 300.0f * cos( n * 0.01 ) : 0.0f;
+			es->pos.trDelta[1] = ( i & 3 ) ? 300.0f * sin( n * 0.01 ) : 0.0f;
+			es->apos.trBase[YAW] = ( n * 5 ) % 360;
+			es->event = ( n % 50 < 2 ) ? 23 : 0;
+			es->eventParm = es->event ? ( n & 255 ) : 0;
+			es->weapon = i % 9;
+			es->legsAnim = ( n / 20 ) & 63;
+			es->torsoAnim = ( n / 15 ) & 63;
+			es->clientNum = i % MAX_CLIENTS;
+		}
+
+		snap->numEntities = mbNumEntities - snap->firstEntity;
+		mbNumSnapshots++;
+	}
+}
+
+/*
+==============================================================================
+
+ENCODING
+
+==============================================================================
+*/
+
+/*
+================
+MB_DeltaSnapshot
+
+The snapshot to delta the given one from, as a server would with no
+packet loss
+================
+*/
+static mbSnapshot_t *MB_DeltaSnapshot( int i ) {
+	if ( i && mbSnapshots[i - 1].stream == mbSnapshots[i].stream ) {
+		return &mbSnapshots[i - 1];
+	}
+	return NULL;
+}
+
+/*
+================
+MB_WritePacketEntities
+
+The same as SV_EmitPacketEntities, returns the number of deltas written
+================
+*/
+static int MB_WritePacketEntities( msg_t *msg, mbSnapshot_t *from, mbSnapshot_t *to ) {
+	entityState_t	*oldent, *newent, *baselines;
+	int				oldindex, newindex, oldnum, newnum, fromNum, deltas;
+
+	baselines = &mbBaselines[to->stream * MAX_GENTITIES];
+	fromNum = from ? from->numEntities : 0;
+	oldent = newent = NULL;
+	oldindex = newindex = 0;
+	deltas = 0;
+
+	while ( newindex < to->numEntities || oldindex < fromNum ) {
+		if ( newindex >= to->numEntities ) {
+			newnum = 9999;
+		} else {
+			newent = &mbEntities[to->firstEntity + newindex];
+			newnum = newent->number;
+		}
+
+		if ( oldindex >= fromNum ) {
+			oldnum = 9999;
+		} else {
+			oldent = &mbEntities[from->firstEntity + oldindex];
+			oldnum = oldent->number;
+		}
+
+		deltas++;
+		if ( newnum == oldnum ) {
+			MSG_WriteDeltaEntity( msg, oldent, newent, qfalse );
+			oldindex++;
+			newindex++;
+		} else if ( newnum < oldnum ) {
+			MSG_WriteDeltaEntity( msg, &baselines[newnum], newent, qtrue );
+			newindex++;
+		} else {
+			MSG_WriteDeltaEntity( msg, oldent, NULL, qtrue );
+			oldindex++;
+		}
+	}
+
+	MSG_WriteBits( msg, MAX_GENTITIES - 1, GENTITYNUM_BITS );
+
+	return deltas;
+}
+
+/*
+================
+MB_ReadPacketEntities
+
+Reads back what MB_WritePacketEntities wrote and checks it against the
+snapshot, returns the number of deltas read
+================
+*/
+static int MB_ReadPacketEntities( msg_t *msg, mbSnapshot_t *from, mbSnapshot_t *to, qboolean verify ) {
+	entityState_t	*oldent, *baselines, state;
+	int				oldindex, newnum, newindex, fromNum, deltas;
+
+	baselines = &mbBaselines[to->stream * MAX_GENTITIES];
+	fromNum = from ? from->numEntities : 0;
+	oldindex = newindex = 0;
+	deltas = 0;
+
+	while ( 1 ) {
+		newnum = MSG_ReadBits( msg, GENTITYNUM_BITS );
+		if ( newnum == MAX_GENTITIES - 1 ) {
+			break;
+		}
+
+		// skip over the old entities that didn't change
+		while ( oldindex < fromNum && mbEntities[from->firstEntity + oldindex].number < newnum ) {
+			oldindex++;
+			newindex++;
+		}
+
+		if ( oldindex < fromNum && mbEntities[from->firstEntity + oldindex].number == newnum ) {
+			oldent = &mbEntities[from->firstEntity + oldindex++];
+		} else {
+			oldent = &baselines[newnum];
+		}
+
+		MSG_ReadDeltaEntity( msg, oldent, &state, newnum );
+		deltas++;
+
+		if ( state.number == MAX_GENTITIES - 1 ) {
+			continue;		// removed
+		}
+		if ( verify && ( newindex >= to->numEntities ||
+			memcmp( &state, &mbEntities[to->firstEntity + newindex], sizeof( state ) ) ) ) {
+			Com_Printf( "entity %i read back wrong\n", newnum );
+			mbErrors++;
+		}
+		newindex++;
+	}
+
+	return deltas;
+}
+
+/*
+================
+MB_Encode
+
+Writes the stream once the way a server would and keeps the messages
+for the later stages
+================
+*/
+static void MB_Encode( void ) {
+	static byte	bufData[MAX_MSGLEN];
+	msg_t		msg;
+	int			i;
+
+	for ( i = 0 ; i < mbNumSnapshots ; i++ ) {
+		MSG_Init( &msg, bufData, sizeof( bufData ) );
+		MSG_WriteDeltaPlayerstate( &msg, MB_DeltaSnapshot( i ) ? &MB_DeltaSnapshot( i )->ps : NULL,
+			&mbSnapshots[i].ps );
+		MB_Store( &mbPlayerStore, msg.data, msg.cursize );
+
+		MSG_Init( &msg, bufData, sizeof( bufData ) );
+		MB_WritePacketEntities( &msg, MB_DeltaSnapshot( i ), &mbSnapshots[i] );
+		MB_Store( &mbEntityStore, msg.data, msg.cursize );
+
+		// a whole snapshot message, as the netchan would get it
+		MSG_Init( &msg, bufData, sizeof( bufData ) );
+		MSG_WriteLong( &msg, 0 );
+		MSG_WriteByte( &msg, svc_snapshot );
+		MSG_WriteLong( &msg, mbSnapshots[i].ps.commandTime );
+		MSG_WriteByte( &msg, MB_DeltaSnapshot( i ) ? 1 : 0 );
+		MSG_WriteByte( &msg, 0 );
+		MSG_WriteByte( &msg, 0 );
+		MSG_WriteDeltaPlayerstate( &msg, MB_DeltaSnapshot( i ) ? &MB_DeltaSnapshot( i )->ps : NULL,
+			&mbSnapshots[i].ps );
+		MB_WritePacketEntities( &msg, MB_DeltaSnapshot( i ), &mbSnapshots[i] );
+		MSG_WriteByte( &msg, svc_EOF );
+		MB_Store( &mbSnapshotStore, msg.data, msg.cursize );
+	}
+}
+
+/*
+==============================================================================
+
+BENCHMARKS
+
+==============================================================================
+*/
+
+/*
+================
+MB_WritePlayerstates
+================
+*/
+static void MB_WritePlayerstates( mbResult_t *r, int loops ) {
+	static byte	bufData[MAX_MSGLEN];
+	msg_t		msg;
+	mbSnapshot_t	*from;
+	double		start;
+	int			i, l;
+
+	start = MB_Seconds();
+	for ( l = 0 ; l < loops ; l++ ) {
+		for ( i = 0 ; i < mbNumSnapshots ; i++ ) {
+			from = MB_DeltaSnapshot( i );
+			MSG_Init( &msg, bufData, sizeof( bufData ) );
+			MSG_WriteDeltaPlayerstate( &msg, from ? &from->ps : NULL, &mbSnapshots[i].ps );
+		}
+	}
+	r->seconds = MB_Seconds() - start;
+	r->ops = (int64_t)mbNumSnapshots * loops;
+	r->bytes = (int64_t)mbPlayerStore.size * loops;
+}
+
+/*
+================
+MB_ReadPlayerstates
+================
+*/
+static void MB_ReadPlayerstates( mbResult_t *r, int loops ) {
+	msg_t		msg;
+	mbSnapshot_t	*from;
+	playerState_t	ps;
+	double		start;
+	int			i, l;
+
+	start = MB_Seconds();
+	for ( l = 0 ; l < loops ; l++ ) {
+		for ( i = 0 ; i < mbNumSnapshots ; i++ ) {
+			from = MB_DeltaSnapshot( i );
+			MSG_Init( &msg, mbPlayerStore.data + mbPlayerStore.messages[i].offset,
+				mbPlayerStore.messages[i].length );
+			msg.cursize = mbPlayerStore.messages[i].length;
+			MSG_ReadDeltaPlayerstate( &msg, from ? &from->ps : NULL, &ps );
+
+			if ( !l && memcmp( &ps, &mbSnapshots[i].ps, sizeof( ps ) ) ) {
+				Com_Printf( "playerstate %i read back wrong\n", i );
+				mbErrors++;
+			}
+		}
+	}
+	r->seconds = MB_Seconds() - start;
+	r->ops = (int64_t)mbNumSnapshots * loops;
+	r->bytes = (int64_t)mbPlayerStore.size * loops;
+}
+
+/*
+================
+MB_WriteEntities
+================
+*/
+static void MB_WriteEntities( mbResult_t *r, int loops ) {
+	static byte	bufData[MAX_MSGLEN];
+	msg_t		msg;
+	double		start;
+	int			i, l;
+
+	r->ops = 0;
+	start = MB_Seconds();
+	for ( l = 0 ; l < loops ; l++ ) {
+		for ( i = 0 ; i < mbNumSnapshots ; i++ ) {
+			MSG_Init( &msg, bufData, sizeof( bufData ) );
+			r->ops += MB_WritePacketEntities( &msg, MB_DeltaSnapshot( i ), &mbSnapshots[i] );
+		}
+	}
+	r->seconds = MB_Seconds() - start;
+	r->bytes = (int64_t)mbEntityStore.size * loops;
+}
+
+/*
+================
+MB_ReadEntities
+================
+*/
+static void MB_ReadEntities( mbResult_t *r, int loops ) {
+	msg_t		msg;
+	double		start;
+	int			i, l;
+
+	r->ops = 0;
+	start = MB_Seconds();
+	for ( l = 0 ; l < loops ; l++ ) {
+		for ( i = 0 ; i < mbNumSnapshots ; i++ ) {
+			MSG_Init( &msg, mbEntityStore.data + mbEntityStore.messages[i].offset,
+				mbEntityStore.messages[i].length );
+			msg.cursize = mbEntityStore.messages[i].length;
+			r->ops += MB_ReadPacketEntities( &msg, MB_DeltaSnapshot( i ), &mbSnapshots[i], !l );
+		}
+	}
+	r->seconds = MB_Seconds() - start;
+	r->bytes = (int64_t)mbEntityStore.size * loops;
+}
+
+/*
+================
+MB_Huffman
+
+Huff_Compress and Huff_Decompress on the snapshot messages, the copies
+into the work buffer are timed along with them.  The delta writers can
+only write bitstream messages, so these are already huffman coded once.
+================
+*/
+static void MB_Huffman( mbResult_t *compress, mbResult_t *decompress, int loops ) {
+	static byte	bufData[0x10000];
+	static byte	packed[0x10000];
+	msg_t		msg;
+	mbMessage_t	*m;
+	double		start;
+	int			i, l, packedSize;
+
+	compress->seconds = decompress->seconds = 0;
+	compress->bytes = 0;
+
+	// the adaptive coder is a lot slower than the rest, so it gets
+	// fewer rounds
+	loops = ( loops + MB_HUFF_LOOPS_DIVISOR - 1 ) / MB_HUFF_LOOPS_DIVISOR;
+
+	for ( l = 0 ; l < loops ; l++ ) {
+		for ( i = 0 ; i < mbSnapshotStore.numMessages ; i++ ) {
+			m = &mbSnapshotStore.messages[i];
+
+			start = MB_Seconds();
+			MSG_InitOOB( &msg, bufData, sizeof( bufData ) );
+			Com_Memcpy( bufData, mbSnapshotStore.data + m->offset, m->length );
+			msg.cursize = m->length;
+			Huff_Compress( &msg, 0 );
+			compress->seconds += MB_Seconds() - start;
+
+			packedSize = msg.cursize;
+			compress->bytes += packedSize;
+			Com_Memcpy( packed, bufData, packedSize );
+			if ( !l ) {
+				MB_Checksum( packed, packedSize );
+			}
+
+			start = MB_Seconds();
+			MSG_InitOOB( &msg, bufData, sizeof( bufData ) );
+			Com_Memcpy( bufData, packed, packedSize );
+			msg.cursize = packedSize;
+			Huff_Decompress( &msg, 0 );
+			decompress->seconds += MB_Seconds() - start;
+
+			if ( !l && ( msg.cursize != m->length ||
+				memcmp( bufData, mbSnapshotStore.data + m->offset, m->length ) ) ) {
+				Com_Printf( "huffman: message %i came back changed\n", i );
+				mbErrors++;
+			}
+		}
+	}
+
+	compress->ops = decompress->ops = (int64_t)mbSnapshotStore.numMessages * loops;
+	decompress->bytes = compress->bytes;
+}
+
+/*
+================
+MB_Netchan
+
+Netchan_Transmit and the fragments after it for every snapshot
+message.  An untimed first pass hands each packet to Netchan_Process
+to check the messages come out whole.
+================
+*/
+static void MB_Netchan( mbResult_t *r, int loops ) {
+	netchan_t	chan;
+	netadr_t	adr;
+	mbMessage_t	*m;
+	double		start;
+	int			i, l;
+
+	Com_Memset( &adr, 0, sizeof( adr ) );
+	adr.type = NA_IP;
+
+	r->seconds = 0;
+
+	for ( l = -1 ; l < loops ; l++ ) {
+		Netchan_Setup( NS_SERVER, &chan, adr, 0, 0x1234, qfalse );
+		Netchan_Setup( NS_CLIENT, &mbReceiver, adr, 0, 0x1234, qfalse );
+		mbVerifyPackets = ( l < 0 );
+		mbReceived = 0;
+		mbWireBytes = 0;
+
+		start = MB_Seconds();
+		for ( i = 0 ; i < mbSnapshotStore.numMessages ; i++ ) {
+			m = &mbSnapshotStore.messages[i];
+			mbExpected = mbSnapshotStore.data + m->offset;
+			mbExpectedLength = m->length;
+
+			Netchan_Transmit( &chan, m->length, mbExpected );
+			while ( chan.unsentFragments ) {
+				Netchan_TransmitNextFragment( &chan );
+			}
+		}
+
+		if ( mbVerifyPackets ) {
+			if ( mbReceived != mbSnapshotStore.numMessages ) {
+				Com_Printf( "netchan: %i of %i messages came through\n", mbReceived, mbSnapshotStore.numMessages );
+				mbErrors++;
+			}
+		} else {
+			r->seconds += MB_Seconds() - start;
+		}
+	}
+	mbVerifyPackets = qfalse;
+
+	r->ops = (int64_t)mbSnapshotStore.numMessages * loops;
+	r->bytes = (int64_t)mbWireBytes * loops;
+}
+
+/*
+==============================================================================
+
+DIFFERENTIAL FUZZING
+
+==============================================================================
+*/
+
+static unsigned			mbFuzzSeed = 1;
+
+/*
+================
+MB_FuzzRand
+================
+*/
+static unsigned MB_FuzzRand( void ) {
+	mbFuzzSeed = mbFuzzSeed * 1103515245 + 12345;
+	return mbFuzzSeed >> 8;
+}
+
+/*
+================
+MB_RefCompress
+
+Huff_Compress as it was before the flattened tree, on huff_t and
+Huff_addRef.  The output buffer starts out clear, where the original
+left whatever was on the stack in the byte after the last bit.
+================
+*/
+static void MB_RefCompress( msg_t *mbuf ) {
+	static huffman_t	huff;
+	static byte			seq[MB_FUZZ_BUFFER];
+	int					i, size;
+
+	size = mbuf->cursize;
+	if ( size <= 0 ) {
+		return;
+	}
+
+	Huff_Init( &huff );
+	Com_Memset( seq, 0, sizeof( seq ) );
+
+	seq[0] = ( size >> 8 );
+	seq[1] = size & 0xff;
+
+	Huff_setBloc( 16 );
+	for ( i = 0 ; i < size ; i++ ) {
+		Huff_transmit( &huff.compressor, mbuf->data[i], seq );
+		Huff_addRef( &huff.compressor, mbuf->data[i] );
+	}
+
+	mbuf->cursize = ( Huff_getBloc() + 8 ) >> 3;
+	Com_Memcpy( mbuf->data, seq, mbuf->cursize );
+}
+
+/*
+================
+MB_RefDecompress
+
+Huff_Decompress as it was before the flattened tree, with the symbols
+after a truncated message cleared instead of left as stack garbage
+================
+*/
+static void MB_RefDecompress( msg_t *mbuf ) {
+	static huffman_t	huff;
+	static byte			seq[MB_FUZZ_BUFFER];
+	int					ch, cch, i, j, size, bit;
+
+	size = mbuf->cursize;
+	if ( size <= 0 ) {
+		return;
+	}
+
+	Huff_Init( &huff );
+	Com_Memset( seq, 0, sizeof( seq ) );
+
+	cch = mbuf->data[0] * 256 + mbuf->data[1];
+	if ( cch > mbuf->maxsize ) {
+		cch = mbuf->maxsize;
+	}
+
+	Huff_setBloc( 16 );
+	for ( j = 0 ; j < cch ; j++ ) {
+		if ( ( Huff_getBloc() >> 3 ) > size ) {
+			break;
+		}
+		ch = 0;
+		Huff_Receive( huff.decompressor.tree, &ch, mbuf->data );
+		if ( ch == NYT ) {
+			bit = Huff_getBloc();
+			ch = 0;
+			for ( i = 0 ; i < 8 ; i++ ) {
+				ch = ( ch << 1 ) + Huff_getBit( mbuf->data, &bit );
+			}
+			Huff_setBloc( bit );
+		}
+		seq[j] = ch;
+		Huff_addRef( &huff.decompressor, (byte)ch );
+	}
+
+	mbuf->cursize = cch;
+	Com_Memcpy( mbuf->data, seq, cch );
+}
+
+/*
+================
+MB_FuzzCompare
+
+Runs one buffer through both coders and returns the size of what they
+made, or -1 if they disagree.  The bytes past the end of the buffer are
+the same for both, so an overread decodes the same.
+================
+*/
+static int MB_FuzzCompare( const char *what, int num, qboolean decompress,
+	const byte *data, int length ) {
+	static byte	refData[MB_FUZZ_BUFFER], newData[MB_FUZZ_BUFFER];
+	static byte	packed[MB_FUZZ_BUFFER];
+	msg_t		ref, cur;
+	int			packedSize, size;
+
+	Com_Memset( refData, 0, sizeof( refData ) );
+	Com_Memset( newData, 0, sizeof( newData ) );
+	Com_Memcpy( refData, data, length );
+	Com_Memcpy( newData, data, length );
+
+	MSG_InitOOB( &ref, refData, sizeof( refData ) );
+	MSG_InitOOB( &cur, newData, sizeof( newData ) );
+	ref.cursize = cur.cursize = length;
+
+	if ( decompress ) {
+		MB_RefDecompress( &ref );
+		Huff_Decompress( &cur, 0 );
+	} else {
+		MB_RefCompress( &ref );
+		Huff_Compress( &cur, 0 );
+	}
+
+	if ( ref.cursize != cur.cursize || memcmp( refData, newData, ref.cursize ) ) {
+		Com_Printf( "fuzz: %s %i of %i bytes %s differently (%i and %i bytes)\n",
+			what, num, length, decompress ? "decompressed" : "compressed",
+			ref.cursize, cur.cursize );
+		mbErrors++;
+		return -1;
+	}
+
+	if ( decompress ) {
+		return ref.cursize;
+	}
+
+	// and it has to come back out of both decoders as it went in, the
+	// recursion reuses the buffers so the packed bytes are kept aside
+	packedSize = ref.cursize;
+	Com_Memcpy( packed, refData, packedSize );
+	size = MB_FuzzCompare( what, num, qtrue, packed, packedSize );
+	if ( size < 0 ) {
+		return -1;
+	}
+	if ( size != length || memcmp( refData, data, length ) ) {
+		Com_Printf( "fuzz: %s %i of %i bytes came back changed\n", what, num, length );
+		mbErrors++;
+		return -1;
+	}
+
+	return packedSize;
+}
+
+/*
+================
+MB_FuzzStore
+================
+*/
+static void MB_FuzzStore( const char *what, const mbStore_t *store ) {
+	const mbMessage_t	*m;
+	int					i;
+
+	for ( i = 0 ; i < store->numMessages ; i++ ) {
+		m = &store->messages[i];
+		MB_FuzzCompare( what, i, qfalse, store->data + m->offset, m->length );
+	}
+}
+
+/*
+================
+MB_Fuzz
+
+The real messages, then random buffers: uniform bytes, a few symbols
+with long runs that grow deep trees, and garbage handed straight to the
+decoders
+================
+*/
+static void MB_Fuzz( int count ) {
+	static byte	buffer[MAX_MSGLEN];
+	int			i, j, length, symbols, run;
+	byte		ch;
+
+	MB_FuzzStore( "snapshot", &mbSnapshotStore );
+	MB_FuzzStore( "playerstate", &mbPlayerStore );
+	MB_FuzzStore( "entities", &mbEntityStore );
+
+	for ( i = 0 ; i < count ; i++ ) {
+		length = 1 + MB_FuzzRand() % ( ( i & 3 ) ? 1400 : MAX_MSGLEN );
+
+		switch ( i % 3 ) {
+		case 0:
+			for ( j = 0 ; j < length ; j++ ) {
+				buffer[j] = MB_FuzzRand();
+			}
+			break;
+		case 1:
+			symbols = 1 + MB_FuzzRand() % 24;
+			for ( j = 0 ; j < length ; j += run ) {
+				ch = ( MB_FuzzRand() % symbols ) * 11;
+				run = 1 + MB_FuzzRand() % 64;
+				if ( run > length - j ) {
+					run = length - j;
+				}
+				Com_Memset( buffer + j, ch, run );
+			}
+			break;
+		default:
+			// small alphabets skewed towards zero, like delta coded fields
+			for ( j = 0 ; j < length ; j++ ) {
+				ch = MB_FuzzRand();
+				buffer[j] = ( ch & 0x80 ) ? 0 : ch & ( ( 1 << ( 1 + i % 8 ) ) - 1 );
+			}
+			break;
+		}
+
+		MB_FuzzCompare( "random", i, qfalse, buffer, length );
+		MB_FuzzCompare( "garbage", i, qtrue, buffer, 2 + length % 2048 );
+	}
+
+	Com_Printf( "fuzz: %i messages and %i random buffers, %i mismatches\n",
+		mbSnapshotStore.numMessages + mbPlayerStore.numMessages + mbEntityStore.numMessages,
+		count, mbErrors );
+}
+
+/*
+================
+MB_Report
+================
+*/
+static void MB_Report( const mbResult_t *r ) {
+	Com_Printf( "%-18s %10.0f %10.1f %10.1f\n", r->name, (double)r->ops,
+		r->ops ? r->seconds * 1e9 / r->ops : 0.0,
+		r->ops ? (double)r->bytes / r->ops : 0.0 );
+}
+
+/*
+================
+main
+================
+*/
+int main( int argc, char **argv ) {
+	mbResult_t	results[7];
+	const char	*expect;
+	int			i, loops, demos, fuzz;
+
+	loops = MB_LOOPS;
+	demos = 0;
+	fuzz = -1;
+	expect = NULL;
+
+	cl_shownet = Cvar_Get( "cl_shownet", "0", CVAR_TEMP );
+	cl_packetdelay = Cvar_Get( "cl_packetdelay", "0", CVAR_TEMP );
+	sv_packetdelay = Cvar_Get( "sv_packetdelay", "0", CVAR_TEMP );
+	com_timescale = Cvar_Get( "timescale", "1", CVAR_TEMP );
+	Netchan_Init( 0 );
+
+	for ( i = 1 ; i < argc ; i++ ) {
+		if ( !strcmp( argv[i], "-loops" ) && i + 1 < argc ) {
+			loops = atoi( argv[++i] );
+			if ( loops < 1 ) {
+				loops = 1;
+			}
+		} else if ( !strcmp( argv[i], "-expect" ) && i + 1 < argc ) {
+			expect = argv[++i];
+		} else if ( !strcmp( argv[i], "-fuzz" ) && i + 1 < argc ) {
+			fuzz = atoi( argv[++i] );
+			if ( fuzz < 0 ) {
+				fuzz = 0;
+			}
+		} else if ( argv[i][0] == '-' ) {
+			Com_Printf( "usage: q3msgbench [-loops <count>] [-expect <checksum>] [-fuzz <count>] [demo ...]\n" );
+			return 1;
+		} else {
+			MB_LoadDemo( argv[i] );
+			demos++;
+		}
+	}
+
+	if ( !mbNumSnapshots ) {
+		if ( demos ) {
+			Com_Printf( "no snapshots found\n" );
+			return 1;
+		}
+		MB_Synthesize( MB_SYNTH_FRAMES );
+		Com_Printf( "synthetic stream: %i snapshots\n", mbNumSnapshots );
+	}
+
+	MB_Encode();
+
+	if ( fuzz >= 0 ) {
+		MB_Fuzz( fuzz );
+		return mbErrors ? 1 : 0;
+	}
+
+	Com_Memset( results, 0, sizeof( results ) );
+	results[0].name = "entity write";
+	results[1].name = "entity read";
+	results[2].name = "playerstate write";
+	results[3].name = "playerstate read";
+	results[4].name = "huff compress";
+	results[5].name = "huff decompress";
+	results[6].name = "netchan transmit";
+
+	MB_WriteEntities( &results[0], loops );
+	MB_ReadEntities( &results[1], loops );
+	MB_WritePlayerstates( &results[2], loops );
+	MB_ReadPlayerstates( &results[3], loops );
+	MB_Huffman( &results[4], &results[5], loops );
+	MB_Netchan( &results[6], loops );
+
+	Com_Printf( "\n%-18s %10s %10s %10s\n", "", "ops", "ns/op", "bytes/op" );
+	for ( i = 0 ; i < ARRAY_LEN( results ) ; i++ ) {
+		MB_Report( &results[i] );
+	}
+
+	Com_Printf( "\nchecksum %08x\n", mbChecksum );
+
+	if ( mbErrors ) {
+		Com_Printf( "%i mismatches\n", mbErrors );
+		return 1;
+	}
+	if ( expect && strtoul( expect, NULL, 16 ) != mbChecksum ) {
+		Com_Printf( "checksum differs from %s\n", expect );
+		return 1;
+	}
+
+	return 0;
+}